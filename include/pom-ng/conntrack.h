@@ -26,6 +26,9 @@
 
 #define CONNTRACK_PKT_FIELD_NONE -1
 
+// Maximum size of the forward and reverse values to store them inline
+#define CONNTRACK_KEY_MAX 32
+
 struct proto_process_stack;
 
 struct conntrack_entry {
@@ -41,6 +44,8 @@ struct conntrack_entry {
 	pthread_mutex_t lock; ///< Lock of the conntrack entry
 	uint32_t hash; ///< Full hash prior to modulo
 	unsigned int refcount; ///< Reference count (mostly in how many proto_stack it's referenced)
+	unsigned char key[CONNTRACK_KEY_MAX]; ///< Inline copy of the forward and reverse values
+	uint8_t key_fwd_len, key_rev_len; ///< Size of the values in the key, 0 if not stored inline
 };
 
 struct conntrack_node_list {
@@ -52,6 +57,7 @@ struct conntrack_node_list {
 
 struct conntrack_list {
 	struct conntrack_entry *ce; ///< Corresponding conntrack
+	uint32_t hash; ///< Full hash of the conntrack
 	struct conntrack_list *prev, *next; ///< Next and previous connection in the list
 };
 
@@ -32,5 +32,15 @@
 
 int core_process_multi_packet(struct proto_process_stack *s, unsigned int stack_index, struct packet *p);
 int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity);
+void core_queue_thread_cleanup();
+
+// Symmetric hash of the flow of a packet, the same for both directions
+int core_flow_hash(struct packet *p, uint32_t *hash);
+
+unsigned int core_get_num_threads();
+int core_get_thread_id();
+
+unsigned int core_capture_filter_get_serial();
+char *core_capture_filter_get();
 
 #endif
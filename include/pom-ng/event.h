@@ -36,6 +36,15 @@
 
 struct event_reg;
 struct event;
+struct event_queue;
+
+// What to do when an event queue is full
+// Listeners with a process_begin handler are never dropped so that each begin gets its end
+enum event_queue_policy {
+	event_queue_policy_block = 0, // Wait for room in the queue
+	event_queue_policy_drop, // Drop the new events
+	event_queue_policy_sample, // Only queue some events past half the size, drop when full
+};
 
 struct event_reg_info {
 	char *source_name;
@@ -63,6 +72,10 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 int event_listener_unregister(struct event_reg *evt_reg, void *obj);
 int event_has_listener(struct event_reg *evt_reg);
 
+struct event_queue *event_queue_alloc(unsigned int size, enum event_queue_policy policy, unsigned int threads, struct registry_perf *perf_depth, struct registry_perf *perf_drops);
+int event_queue_cleanup(struct event_queue *q);
+struct event_queue *event_listener_queue_set(struct event_queue *q);
+
 int event_process(struct event *evt, struct proto_process_stack *stack, int stack_index, ptime ts);
 int event_process_begin(struct event *evt, struct proto_process_stack *stack, int stack_index, ptime ts);
 int event_process_end(struct event *evt);
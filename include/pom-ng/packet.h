@@ -42,6 +42,8 @@ struct packet {
 	struct packet_buffer *pkt_buff; // Structure pointing to the buffer information (if any)
 	struct packet_multipart *multipart; // Multipart details if the current packet is compose of multiple ones
 	unsigned int refcount; // Reference count
+	void (*buff_release) (void *priv); // Called on release when the buffer belongs to the input (no pkt_buff)
+	void *buff_release_priv;
 	struct packet *prev, *next; // Used internally
 };
 
@@ -69,10 +71,12 @@ struct packet_info {
 };
 
 int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset);
+int packet_buffer_wrap(struct packet *pkt, void *buff, size_t len, void (*release) (void *priv), void *priv);
 
 struct packet *packet_alloc();
 struct packet *packet_clone(struct packet *src, unsigned int flags);
 int packet_release(struct packet *p);
+int packet_pool_cleanup();
 
 struct packet_multipart *packet_multipart_alloc(struct proto *proto, unsigned int flags, unsigned int align_offset);
 int packet_multipart_cleanup(struct packet_multipart *m);
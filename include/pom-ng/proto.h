@@ -85,6 +85,7 @@ struct proto_packet_listener {
 	void *object;
 	int (*process) (void *object, struct packet *p, struct proto_process_stack *s, unsigned int stack_index);
 	struct filter_node *filter;
+	int filter_id; // Position of the filter in the filter set of the proto
 	struct proto_packet_listener *prev, *next;
 };
 
@@ -30,6 +30,7 @@
 #include <lualib.h>
 
 #include <pom-ng/dns.h>
+#include <pom-ng/core.h>
 
 
 static struct addon *addon_head = NULL;
@@ -292,6 +293,21 @@ int addon_pcall(lua_State *L, int nargs, int nresults) {
 	return POM_OK;
 }
 
+// Find the lua state to use from the current thread and its lock
+lua_State *addon_instance_get_state(struct addon_instance_priv *p, pthread_mutex_t **lock) {
+
+	int id = core_get_thread_id();
+
+	// Other threads share the main state
+	if (id < 0 || (unsigned int)id >= p->state_count) {
+		*lock = &p->lock;
+		return p->L;
+	}
+
+	*lock = &p->states[id].lock;
+	return p->states[id].L;
+}
+
 void addon_pomlib_register(lua_State *L, const char *sub, luaL_Reg *l) {
 
 	lua_getglobal(L, ADDON_POM_LIB); // Stack : pom (or nil)
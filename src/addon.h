@@ -53,6 +53,22 @@ struct addon_param {
 	struct addon_param *next;
 };
 
+// Additional lua state used by a single processing thread
+struct addon_instance_state {
+	lua_State *L;
+	pthread_mutex_t lock;
+};
+
+// Value shared between all the lua states of an instance
+struct addon_shared_value {
+	char *key;
+	int type; // LUA_TNUMBER or LUA_TSTRING
+	lua_Number num;
+	char *str;
+
+	struct addon_shared_value *next;
+};
+
 struct addon_instance_priv {
 
 	lua_State *L; // Main lua state for the output
@@ -60,6 +76,13 @@ struct addon_instance_priv {
 	void *instance;
 	struct addon_param *params;
 
+	// Per processing thread states for stateless handlers
+	struct addon_instance_state *states;
+	unsigned int state_count;
+
+	struct addon_shared_value *shared;
+	pthread_mutex_t shared_lock;
+
 };
 
 int addon_init();
@@ -71,6 +94,7 @@ void addon_lua_register(lua_State *L);
 struct addon *addon_get_from_registry(lua_State *L);
 
 int addon_pcall(lua_State *L, int nargs, int nresults);
+lua_State *addon_instance_get_state(struct addon_instance_priv *p, pthread_mutex_t **lock);
 
 void addon_pomlib_register(lua_State *L, const char *sub, luaL_Reg *l);
 int addon_log(lua_State *L);
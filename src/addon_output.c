@@ -28,6 +28,8 @@
 #include "addon_pload.h"
 #include "addon_plugin.h"
 
+#include <pom-ng/core.h>
+
 struct addon_output *addon_output_head = NULL;
 
 // Called from lua to create a new output class
@@ -37,11 +39,18 @@ static int addon_output_new(lua_State *L) {
 	// 1) name
 	// 2) output description
 	// 3) parameter table
-
-	// Stack : name, params
+	// 4) optional options table
 
 	luaL_checkstring(L, 1);
 
+	// Stateless outputs can run their handlers in one lua state per processing thread
+	int per_thread = 0;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "per_thread");
+		per_thread = lua_toboolean(L, -1);
+	}
+	lua_settop(L, 3); // Stack : name, descr, params
+
 	// Create a new addon class
 	lua_newtable(L); // Stack : name, descr, params, class
 
@@ -49,6 +58,9 @@ static int addon_output_new(lua_State *L) {
 	luaL_getmetatable(L, ADDON_OUTPUT_METATABLE); // Stack : name, descr, params, class, metatable
 	lua_setmetatable(L, -2); // Stack : name, descr, params, class
 
+	lua_pushboolean(L, per_thread); // Stack : name, descr, params, class, per_thread
+	lua_setfield(L, -2, "__per_thread"); // Stack : name, descr, params, class
+
 	// Save the parameter table
 	lua_pushvalue(L, -2); // Stack : name, descr, params, class, params
 	lua_setfield(L, -2, "__params"); // Stack : name, descr, params, class
@@ -80,9 +92,96 @@ static int addon_output_new(lua_State *L) {
 static struct addon_instance_priv *addon_output_get_priv(lua_State *L, int t) {
 
 	lua_getfield(L, t, "__priv");
+
+	// Per thread states only reference the priv of the main state
+	if (lua_islightuserdata(L, -1))
+		return lua_touserdata(L, -1);
+
 	return luaL_checkudata(L, -1, ADDON_OUTPUT_PRIV_METATABLE);
 }
 
+// Helper function to get the output priv from the main state only
+static struct addon_instance_priv *addon_output_get_main_priv(lua_State *L, int t) {
+
+	lua_getfield(L, t, "__priv");
+
+	if (lua_islightuserdata(L, -1))
+		luaL_error(L, "Listeners can only be changed from the main state of the output");
+
+	return luaL_checkudata(L, -1, ADDON_OUTPUT_PRIV_METATABLE);
+}
+
+// Find the name of the method of self matching the function at index func
+static const char *addon_output_method_find(lua_State *L, int self, int func) {
+
+	lua_pushnil(L); // Stack : nil
+	while (lua_next(L, self)) { // Stack : key, value
+		if (lua_type(L, -2) == LUA_TSTRING && lua_rawequal(L, -1, func)) {
+			// The key is still referenced by self
+			const char *name = lua_tostring(L, -2);
+			lua_pop(L, 2); // Stack : empty
+			return name;
+		}
+		lua_pop(L, 1); // Stack : key
+	}
+
+	luaL_error(L, "Handlers of per thread outputs must be methods of the output");
+	return NULL;
+}
+
+// Copy the handlers table at index idx of the main state to the per thread states
+// The handlers are removed from the per thread states if idx is 0
+static void addon_output_states_mirror(lua_State *L, struct addon_instance_priv *p, void *evt, int idx) {
+
+	if (!p->state_count)
+		return;
+
+	// Resolve the names first so nothing fails while holding the locks
+	if (idx) {
+		lua_newtable(L); // Stack : names
+		lua_pushnil(L); // Stack : names, nil
+		while (lua_next(L, idx)) { // Stack : names, handler, func
+			lua_pushvalue(L, -2); // Stack : names, handler, func, handler
+			lua_pushstring(L, addon_output_method_find(L, 1, lua_gettop(L) - 1)); // Stack : names, handler, func, handler, method
+			lua_settable(L, -5); // Stack : names, handler, func
+			lua_pop(L, 1); // Stack : names, handler
+		}
+	}
+
+	unsigned int i;
+	for (i = 0; i < p->state_count; i++) {
+		lua_State *S = p->states[i].L;
+
+		pom_mutex_lock(&p->states[i].lock);
+
+		lua_getfield(S, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+		if (evt)
+			lua_pushlightuserdata(S, evt); // Stack : self, evt_reg
+		else
+			lua_pushliteral(S, "__pload_listener"); // Stack : self, __pload_listener
+
+		if (idx) {
+			lua_newtable(S); // Stack : self, key, handlers
+			lua_pushnil(L);
+			while (lua_next(L, -2)) { // Main stack : names, handler, method
+				lua_getfield(S, -3, lua_tostring(L, -1)); // Stack : self, key, handlers, func
+				lua_setfield(S, -2, lua_tostring(L, -2)); // Stack : self, key, handlers
+				lua_pop(L, 1); // Main stack : names, handler
+			}
+		} else {
+			lua_pushnil(S); // Stack : self, key, nil
+		}
+
+		lua_settable(S, -3); // Stack : self
+		lua_pop(S, 1); // Stack : empty
+
+		pom_mutex_unlock(&p->states[i].lock);
+	}
+
+	if (idx)
+		lua_pop(L, 1); // Stack : empty
+}
+
 // Called from lua to listen to a new event from an instance
 static int addon_output_event_listen_start(lua_State *L) {
 	
@@ -109,10 +208,7 @@ static int addon_output_event_listen_start(lua_State *L) {
 		process_end = addon_event_process_end;
 
 	// Get the output
-	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
-
-	if (event_listener_register(evt, p, process_begin, process_end) != POM_OK)
-		luaL_error(L, "Error while listening to event %s", evt_name);
+	struct addon_instance_priv *p = addon_output_get_main_priv(L, 1);
 
 	// Add a table to self for the processing functions of this event
 	lua_newtable(L);
@@ -133,6 +229,12 @@ static int addon_output_event_listen_start(lua_State *L) {
 		lua_settable(L, -3);
 	}
 
+	// The per thread states must know the handlers before the first event
+	addon_output_states_mirror(L, p, evt, lua_gettop(L));
+
+	if (event_listener_register(evt, p, process_begin, process_end) != POM_OK)
+		luaL_error(L, "Error while listening to event %s", evt_name);
+
 	pomlog(POMLOG_DEBUG "Output listening to event %s", evt_name);
 
 	return 0;
@@ -152,7 +254,7 @@ static int addon_output_event_listen_stop(lua_State *L) {
 		luaL_error(L, "Event %s does not exists", evt_name);
 
 	// Get the output
-	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	struct addon_instance_priv *p = addon_output_get_main_priv(L, 1);
 	
 	if (event_listener_unregister(evt, p) != POM_OK)
 		luaL_error(L, "Error while unregistering event listener");
@@ -162,6 +264,8 @@ static int addon_output_event_listen_stop(lua_State *L) {
 	lua_pushnil(L);
 	lua_settable(L, 1);
 
+	addon_output_states_mirror(L, p, evt, 0);
+
 	return 0;
 }
 
@@ -170,74 +274,77 @@ static int addon_output_pload_open(void *obj, void **priv, struct pload *pload)
 
 	struct addon_instance_priv *p = obj;
 
-	// Lock the output
-	pom_mutex_lock(&p->lock);
-
-	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
-
 	struct addon_output_pload_priv *ppriv = malloc(sizeof(struct addon_output_pload_priv));
 	if (!ppriv) {
-		pom_mutex_unlock(&p->lock);
 		pom_oom(sizeof(struct addon_output_pload_priv));
 		return POM_ERR;
 	}
 	memset(ppriv, 0, sizeof(struct addon_output_pload_priv));
 
+	// The payload keeps using the state which opened it
+	ppriv->L = addon_instance_get_state(p, &ppriv->lock);
+	lua_State *L = ppriv->L;
+
 	*priv = ppriv;
 
+	// Lock the output
+	pom_mutex_lock(ppriv->lock);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+
 	// Get the __pload_listener table
-	lua_getfield(p->L, -1, "__pload_listener"); // Stack : self, __pload_listener
+	lua_getfield(L, -1, "__pload_listener"); // Stack : self, __pload_listener
 
 	// Get the open function
-	lua_getfield(p->L, -1, "open"); // Stack : self, __pload_listener, open_func
+	lua_getfield(L, -1, "open"); // Stack : self, __pload_listener, open_func
 
 	// Check if there is an open function
-	if (lua_isnil(p->L, -1)) {
-		pom_mutex_unlock(&p->lock);
-		lua_pop(p->L, 3); // Stack : empty
+	if (lua_isnil(L, -1)) {
+		pom_mutex_unlock(ppriv->lock);
+		lua_pop(L, 3); // Stack : empty
 		return POM_OK;
 	}
 
 	// Add self
-	lua_pushvalue(p->L, -3); // Stack : self, __pload_listener, open_func, self
+	lua_pushvalue(L, -3); // Stack : self, __pload_listener, open_func, self
 
 	// Create a new table for the pload priv and store it into __pload_listener
-	lua_newtable(p->L); // Stack : self, __pload_listener, open_func, self, pload_priv_table
+	lua_newtable(L); // Stack : self, __pload_listener, open_func, self, pload_priv_table
 
 	// Add output_pload_data to it
-	addon_pload_data_push(p->L); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_data
-	lua_setfield(p->L, -2, "__pload_data"); // Stack : self, __pload_listener, open_func, self, pload_priv_table
+	addon_pload_data_push(L); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_data
+	lua_setfield(L, -2, "__pload_data"); // Stack : self, __pload_listener, open_func, self, pload_priv_table
 
 	// Add the new priv to the __pload_listener table
-	lua_pushlightuserdata(p->L, ppriv); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_priv
-	lua_pushvalue(p->L, -2); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_priv, pload_priv_table
-	lua_settable(p->L, -6); // Stack : self, __pload_listener, open_func, self, pload_priv_table
+	lua_pushlightuserdata(L, ppriv); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_priv
+	lua_pushvalue(L, -2); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload_priv, pload_priv_table
+	lua_settable(L, -6); // Stack : self, __pload_listener, open_func, self, pload_priv_table
 
 	// Add the pload to the args
-	addon_pload_push(p->L, pload, ppriv); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload
+	addon_pload_push(L, pload, ppriv); // Stack : self, __pload_listener, open_func, self, pload_priv_table, pload
 
 
 	// Call the open function
-	addon_pcall(p->L, 3, 1); // Stack : self, __pload_listener, result
+	addon_pcall(L, 3, 1); // Stack : self, __pload_listener, result
 
 	int res = 0;
-	if (!lua_isboolean(p->L, -1)) {
+	if (!lua_isboolean(L, -1)) {
 		pomlog(POMLOG_WARN "LUA coding error: pload open function result must be a boolean");
 	} else {
-		res = lua_toboolean(p->L, -1);
+		res = lua_toboolean(L, -1);
 	}
 
 	if (!res) { // The payload doesn't need to be processed, remove the payload_priv_table and the __pload_data
-		lua_pushlightuserdata(p->L, ppriv); // Stack : self, __pload_listener, result, pload_priv
-		lua_pushnil(p->L); // Stack : self, __pload_listener, result, pload_priv, nil
-		lua_settable(p->L, -4); // Stack : self, __pload_listener, result
-		lua_pushnil(p->L); // Stack : self, __pload_listener, result, nil
-		lua_setfield(p->L, -3, "__pload_data"); // Stack : self, __pload_listener, result
+		lua_pushlightuserdata(L, ppriv); // Stack : self, __pload_listener, result, pload_priv
+		lua_pushnil(L); // Stack : self, __pload_listener, result, pload_priv, nil
+		lua_settable(L, -4); // Stack : self, __pload_listener, result
+		lua_pushnil(L); // Stack : self, __pload_listener, result, nil
+		lua_setfield(L, -3, "__pload_data"); // Stack : self, __pload_listener, result
 	}
 
 	// Remove leftovers
-	lua_pop(p->L, 3); // Stack : empty
-	pom_mutex_unlock(&p->lock);
+	lua_pop(L, 3); // Stack : empty
+	pom_mutex_unlock(ppriv->lock);
 
 	return POM_OK;
 }
@@ -246,9 +353,9 @@ static int addon_output_pload_open(void *obj, void **priv, struct pload *pload)
 static int addon_output_pload_write(void *output_priv, void *pload_instance_priv, void *data, size_t len) {
 
 	struct addon_output_pload_priv *ppriv = pload_instance_priv;
-	struct addon_instance_priv *p = output_priv;
+	lua_State *L = ppriv->L;
 
-	pom_mutex_lock(&p->lock);
+	pom_mutex_lock(ppriv->lock);
 
 	// First process all the plugins attached to this pload
 	struct addon_output_pload_plugin *tmp;
@@ -262,60 +369,59 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 		}
 	}
 
-	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
 
-	lua_getfield(p->L, -1, "__pload_listener"); // Stack : self, __pload_listener
+	lua_getfield(L, -1, "__pload_listener"); // Stack : self, __pload_listener
 
 	// Get the write function
-	lua_getfield(p->L, -1, "write"); // Stack : self, __pload_listener, write_func
+	lua_getfield(L, -1, "write"); // Stack : self, __pload_listener, write_func
 	
 	// Check if there is a write function
-	if (lua_isnil(p->L, -1)) {
-		lua_pop(p->L, 3); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 3); // Stack : empty
+		pom_mutex_unlock(ppriv->lock);
 		return POM_OK;
 	}
 
 	// Setup args
-	lua_pushvalue(p->L, -3); // Stack : self, __pload_listener, write_func, self
-	lua_pushlightuserdata(p->L, pload_instance_priv); // Stack : self, __pload_listener, write_func, self, pload_priv
-	lua_gettable(p->L, -4); // Stack : self, __pload_listener, write_func, self, pload_priv_table
+	lua_pushvalue(L, -3); // Stack : self, __pload_listener, write_func, self
+	lua_pushlightuserdata(L, pload_instance_priv); // Stack : self, __pload_listener, write_func, self, pload_priv
+	lua_gettable(L, -4); // Stack : self, __pload_listener, write_func, self, pload_priv_table
 
-	if (lua_isnil(p->L, -1)) {
+	if (lua_isnil(L, -1)) {
 		// There is no pload_priv_table, payload doesn't need to be processed
-		lua_pop(p->L, 5); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+		lua_pop(L, 5); // Stack : empty
+		pom_mutex_unlock(ppriv->lock);
 		return POM_OK;
 	}
 
-	lua_getfield(p->L, -1, "__pload_data"); // Stack : self, __pload_listener, write_func, self, pload_priv_table, pload_data
+	lua_getfield(L, -1, "__pload_data"); // Stack : self, __pload_listener, write_func, self, pload_priv_table, pload_data
 
 	// Update the pload_data
-	addon_pload_data_update(p->L, -1, data, len);
-	pom_mutex_unlock(&p->lock);
+	addon_pload_data_update(L, -1, data, len);
 
-	int res = addon_pcall(p->L, 3, 1); // Stack : self, __pload_listener, result
+	int res = addon_pcall(L, 3, 1); // Stack : self, __pload_listener, result
 
 	int write_res = 0;
 
 	if (res == POM_OK) {
-		if (!lua_isboolean(p->L, -1)) {
+		if (!lua_isboolean(L, -1)) {
 			pomlog(POMLOG_WARN "LUA coding error: pload write function result must be a boolean");
 		} else {
-			write_res = lua_toboolean(p->L, -1);
+			write_res = lua_toboolean(L, -1);
 		}
 	}
 
 	if (!write_res) {
 		// Remove the pload_priv_table since it failed
-		lua_pushlightuserdata(p->L, pload_instance_priv); // Stack : self, __pload_listener, result, pload_priv
-		lua_pushnil(p->L); // Stack : self, __pload_listener, result, pload_priv, nil
-		lua_settable(p->L, -4); // Stack : self, __pload_listener, result
+		lua_pushlightuserdata(L, pload_instance_priv); // Stack : self, __pload_listener, result, pload_priv
+		lua_pushnil(L); // Stack : self, __pload_listener, result, pload_priv, nil
+		lua_settable(L, -4); // Stack : self, __pload_listener, result
 	}
 
-	lua_pop(p->L, 3); // Stack : empty
+	lua_pop(L, 3); // Stack : empty
 
-	pom_mutex_unlock(&p->lock);
+	pom_mutex_unlock(ppriv->lock);
 
 	return POM_OK;
 }
@@ -324,11 +430,11 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 static int addon_output_pload_close(void *output_priv, void *pload_instance_priv) {
 
 	struct addon_output_pload_priv *ppriv = pload_instance_priv;
-	struct addon_instance_priv *p = output_priv;
+	lua_State *L = ppriv->L;
 	int res = POM_OK;
 
 
-	pom_mutex_lock(&p->lock);
+	pom_mutex_lock(ppriv->lock);
 
 	// Process all the plugins attached to this pload
 	struct addon_output_pload_plugin *tmp;
@@ -338,46 +444,45 @@ static int addon_output_pload_close(void *output_priv, void *pload_instance_priv
 		addon_plugin_pload_close(tmp->addon_reg, ppriv->plugin_priv, tmp->pload_priv);
 	}
 
-	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
-	lua_getfield(p->L, -1, "__pload_listener"); // Stack : self, __pload_listener
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+	lua_getfield(L, -1, "__pload_listener"); // Stack : self, __pload_listener
 
 	// Get the pload_priv_table
-	lua_pushlightuserdata(p->L, pload_instance_priv); // Stack : self, __pload_listener, pload_priv
-	lua_gettable(p->L, -2); // Stack : self, __pload_listener, pload_priv_table
+	lua_pushlightuserdata(L, pload_instance_priv); // Stack : self, __pload_listener, pload_priv
+	lua_gettable(L, -2); // Stack : self, __pload_listener, pload_priv_table
 
-	if (lua_isnil(p->L, -1)) {
+	if (lua_isnil(L, -1)) {
 		// There is no pload_priv_table, the payload doesn't need to be processed
-		lua_pop(p->L, 3);
-		pom_mutex_unlock(&p->lock);
+		lua_pop(L, 3);
 		goto cleanup;
 	}
 
 	// Remove the payload_priv_table from __pload_listener
-	lua_pushlightuserdata(p->L, pload_instance_priv); // Stack : self, __pload_listener, pload_priv_table, pload_priv
-	lua_pushnil(p->L); // Stack : self, __pload_listener, pload_priv_table, pload_priv, nil
-	lua_settable(p->L, -4); // Stack : self, __pload_listener, pload_priv_table
+	lua_pushlightuserdata(L, pload_instance_priv); // Stack : self, __pload_listener, pload_priv_table, pload_priv
+	lua_pushnil(L); // Stack : self, __pload_listener, pload_priv_table, pload_priv, nil
+	lua_settable(L, -4); // Stack : self, __pload_listener, pload_priv_table
 
 	// Get the close function
-	lua_getfield(p->L, -2,  "close"); // Stack : self, __pload_listener, pload_priv_table, close_func
+	lua_getfield(L, -2,  "close"); // Stack : self, __pload_listener, pload_priv_table, close_func
 
-	if (lua_isnil(p->L, -1)) {
+	if (lua_isnil(L, -1)) {
 		// There is no close function
-		lua_pop(p->L, 4); // Stack : empty
+		lua_pop(L, 4); // Stack : empty
 		goto cleanup;
 	}
 
 
 	// Setup args
-	lua_pushvalue(p->L, 1); // Stack : self, __pload_listener, pload_priv_table, close_func, self
-	lua_pushvalue(p->L, -3); // Stack : self, __pload_listener, pload_priv_table, close_func, self, pload_priv_table
+	lua_pushvalue(L, 1); // Stack : self, __pload_listener, pload_priv_table, close_func, self
+	lua_pushvalue(L, -3); // Stack : self, __pload_listener, pload_priv_table, close_func, self, pload_priv_table
 
-	res = addon_pcall(p->L, 2, 0); // Stack : self, __pload_listener, pload_priv_table
+	res = addon_pcall(L, 2, 0); // Stack : self, __pload_listener, pload_priv_table
 
-	lua_pop(p->L, 3); // Stack : empty
+	lua_pop(L, 3); // Stack : empty
 
 cleanup:
 
-	pom_mutex_unlock(&p->lock);
+	pom_mutex_unlock(ppriv->lock);
 
 	while (ppriv->plugins) {
 		tmp = ppriv->plugins;
@@ -407,7 +512,7 @@ static int addon_output_pload_listen_start(lua_State *L) {
 	// Stack : instance, read_func, write_func, close_func
 
 	// Get the output
-	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	struct addon_instance_priv *p = addon_output_get_main_priv(L, 1);
 
 	if (!lua_isfunction(L, 2) && !lua_isfunction(L, 3) && !lua_isfunction(L, 4))
 		luaL_error(L, "At least one function should be provided to pload_listen_start()");
@@ -417,10 +522,6 @@ static int addon_output_pload_listen_start(lua_State *L) {
 	if (!lua_isnil(L, -1))
 		luaL_error(L, "The output is already listening for payloads");
 
-	if (pload_listen_start(p, NULL, NULL, addon_output_pload_open, addon_output_pload_write, addon_output_pload_close) != POM_OK)
-		luaL_error(L, "Error while registering the payload listener");
-
-
 	// Create table to track pload listener functions
 	lua_pushliteral(L, "__pload_listener");
 	lua_newtable(L);
@@ -443,6 +544,14 @@ static int addon_output_pload_listen_start(lua_State *L) {
 		lua_settable(L, -3);
 	}
 
+	// The per thread states must know the handlers before the first payload
+	addon_output_states_mirror(L, p, NULL, lua_gettop(L));
+
+	if (pload_listen_start(p, NULL, NULL, addon_output_pload_open, addon_output_pload_write, addon_output_pload_close) != POM_OK) {
+		addon_output_states_mirror(L, p, NULL, 0);
+		luaL_error(L, "Error while registering the payload listener");
+	}
+
 	lua_settable(L, 1);
 	
 	return 0;
@@ -454,7 +563,7 @@ static int addon_output_pload_listen_stop(lua_State *L) {
 	// 1) self
 	
 	// Get the output
-	struct addon_instance_priv *p = addon_output_get_priv(L, 1); // Stack : instance
+	struct addon_instance_priv *p = addon_output_get_main_priv(L, 1); // Stack : instance
 
 	// Get the listening table
 	lua_getfield(L, 1, "__pload_listener"); // Stack : instance, __pload_listener
@@ -468,6 +577,8 @@ static int addon_output_pload_listen_stop(lua_State *L) {
 	lua_setfield(L, 1, "__pload_listener"); // Stack : instance
 	lua_pop(L, 1); // Stack : empty
 
+	addon_output_states_mirror(L, p, NULL, 0);
+
 	return 0;
 }
 
@@ -489,6 +600,157 @@ static int addon_output_param_get(lua_State *L) {
 	return 1;
 }
 
+// Find a shared value, the shared lock must be held
+static struct addon_shared_value *addon_output_shared_find(struct addon_instance_priv *p, const char *key) {
+
+	struct addon_shared_value *tmp;
+	for (tmp = p->shared; tmp && strcmp(tmp->key, key); tmp = tmp->next);
+
+	return tmp;
+}
+
+// Add a new shared value, the shared lock must be held
+static struct addon_shared_value *addon_output_shared_add(struct addon_instance_priv *p, const char *key) {
+
+	struct addon_shared_value *v = malloc(sizeof(struct addon_shared_value));
+	if (!v)
+		return NULL;
+	memset(v, 0, sizeof(struct addon_shared_value));
+
+	v->key = strdup(key);
+	if (!v->key) {
+		free(v);
+		return NULL;
+	}
+
+	v->next = p->shared;
+	p->shared = v;
+
+	return v;
+}
+
+// Called from lua to get a value shared between all the states of the output
+static int addon_output_shared_get(lua_State *L) {
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+
+	const char *key = luaL_checkstring(L, 2);
+
+	pom_mutex_lock(&p->shared_lock);
+
+	struct addon_shared_value *v = addon_output_shared_find(p, key);
+	if (!v)
+		lua_pushnil(L);
+	else if (v->type == LUA_TNUMBER)
+		lua_pushnumber(L, v->num);
+	else
+		lua_pushstring(L, v->str);
+
+	pom_mutex_unlock(&p->shared_lock);
+
+	return 1;
+}
+
+// Called from lua to set a value shared between all the states of the output
+static int addon_output_shared_set(lua_State *L) {
+
+	// Args should be :
+	// 1) self
+	// 2) key
+	// 3) number, string or nil to remove the value
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+
+	const char *key = luaL_checkstring(L, 2);
+	int type = lua_type(L, 3);
+
+	char *str = NULL;
+	if (type == LUA_TSTRING) {
+		const char *val = lua_tostring(L, 3);
+		str = strdup(val);
+		if (!str)
+			addon_oom(L, strlen(val) + 1);
+	} else if (type != LUA_TNUMBER && type != LUA_TNIL && type != LUA_TNONE) {
+		luaL_error(L, "Shared values must be numbers or strings");
+	}
+
+	pom_mutex_lock(&p->shared_lock);
+
+	struct addon_shared_value *v = addon_output_shared_find(p, key);
+
+	if (type == LUA_TNIL || type == LUA_TNONE) {
+		if (v) {
+			struct addon_shared_value **prev;
+			for (prev = &p->shared; *prev != v; prev = &(*prev)->next);
+			*prev = v->next;
+			free(v->key);
+			free(v->str);
+			free(v);
+		}
+		pom_mutex_unlock(&p->shared_lock);
+		return 0;
+	}
+
+	if (!v) {
+		v = addon_output_shared_add(p, key);
+		if (!v) {
+			pom_mutex_unlock(&p->shared_lock);
+			free(str);
+			addon_oom(L, sizeof(struct addon_shared_value));
+		}
+	}
+
+	free(v->str);
+	v->str = str;
+	v->type = type;
+	if (type == LUA_TNUMBER)
+		v->num = lua_tonumber(L, 3);
+
+	pom_mutex_unlock(&p->shared_lock);
+
+	return 0;
+}
+
+// Called from lua to atomically add to a shared number and get the result
+static int addon_output_shared_inc(lua_State *L) {
+
+	// Args should be :
+	// 1) self
+	// 2) key
+	// 3) optional increment, 1 by default
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+
+	const char *key = luaL_checkstring(L, 2);
+	lua_Number inc = luaL_optnumber(L, 3, 1);
+
+	pom_mutex_lock(&p->shared_lock);
+
+	struct addon_shared_value *v = addon_output_shared_find(p, key);
+	if (!v) {
+		v = addon_output_shared_add(p, key);
+		if (!v) {
+			pom_mutex_unlock(&p->shared_lock);
+			addon_oom(L, sizeof(struct addon_shared_value));
+		}
+		v->type = LUA_TNUMBER;
+	}
+
+	if (v->type != LUA_TNUMBER) {
+		pom_mutex_unlock(&p->shared_lock);
+		luaL_error(L, "Shared value %s is not a number", key);
+	}
+
+	v->num += inc;
+	lua_Number res = v->num;
+
+	pom_mutex_unlock(&p->shared_lock);
+
+	lua_pushnumber(L, res);
+
+	return 1;
+}
+
 // Garbage collector function for an output parameter
 static int addon_output_priv_gc(lua_State *L) {
 	struct addon_instance_priv *priv = luaL_checkudata(L, 1, ADDON_OUTPUT_PRIV_METATABLE);
@@ -501,7 +763,16 @@ static int addon_output_priv_gc(lua_State *L) {
 		free(tmp);
 	}
 
+	while (priv->shared) {
+		struct addon_shared_value *tmp = priv->shared;
+		priv->shared = tmp->next;
+		free(tmp->key);
+		free(tmp->str);
+		free(tmp);
+	}
+
 	pthread_mutex_destroy(&priv->lock);
+	pthread_mutex_destroy(&priv->shared_lock);
 
 	return 0;
 }
@@ -532,6 +803,9 @@ int addon_output_lua_register(lua_State *L) {
 		{ "pload_listen_start", addon_output_pload_listen_start },
 		{ "pload_listen_stop", addon_output_pload_listen_stop },
 		{ "param_get", addon_output_param_get },
+		{ "shared_get", addon_output_shared_get },
+		{ "shared_set", addon_output_shared_set },
+		{ "shared_inc", addon_output_shared_inc },
 
 		{ 0 }
 	};
@@ -657,6 +931,11 @@ int addon_output_init(struct output *o) {
 		abort();
 		return POM_ERR;
 	}
+	if (pthread_mutex_init(&p->shared_lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing mutex : %s", pom_strerror(errno));
+		abort();
+		return POM_ERR;
+	}
 
 	// Assign the output_priv metatable
 	luaL_getmetatable(L, ADDON_OUTPUT_PRIV_METATABLE); // Stack : output, priv, metatable
@@ -764,10 +1043,82 @@ err:
 	return POM_ERR;
 }
 
+// Create the lua state of a processing thread, it only knows the methods of the output
+static lua_State *addon_output_state_create(struct addon_instance_priv *p) {
+
+	struct output *o = p->instance;
+	struct addon *addon = o->info->reg_info->mod->priv;
+
+	lua_State *L = addon_create_state(addon->filename); // Stack : empty
+	if (!L)
+		return NULL;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUTS_TABLE); // Stack : outputs
+	lua_getfield(L, -1, o->info->reg_info->name); // Stack : outputs, output
+	lua_remove(L, -2); // Stack : output
+	lua_pushnil(L); // Stack : output, nil
+	lua_setfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUTS_TABLE); // Stack : output
+
+	// The priv belongs to the main state
+	lua_pushlightuserdata(L, p); // Stack : output, priv
+	lua_setfield(L, -2, "__priv"); // Stack : output
+
+	lua_setfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : empty
+
+	return L;
+}
+
+static void addon_output_states_cleanup(struct addon_instance_priv *p) {
+
+	unsigned int i;
+	for (i = 0; i < p->state_count; i++) {
+		lua_close(p->states[i].L);
+		pthread_mutex_destroy(&p->states[i].lock);
+	}
+
+	free(p->states);
+	p->states = NULL;
+	p->state_count = 0;
+}
+
+static int addon_output_states_init(struct addon_instance_priv *p) {
+
+	unsigned int count = core_get_num_threads();
+
+	p->states = malloc(sizeof(struct addon_instance_state) * count);
+	if (!p->states) {
+		pom_oom(sizeof(struct addon_instance_state) * count);
+		return POM_ERR;
+	}
+	memset(p->states, 0, sizeof(struct addon_instance_state) * count);
+
+	for (p->state_count = 0; p->state_count < count; p->state_count++) {
+		struct addon_instance_state *s = &p->states[p->state_count];
+		s->L = addon_output_state_create(p);
+		if (!s->L)
+			goto err;
+
+		if (pthread_mutex_init(&s->lock, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing mutex : %s", pom_strerror(errno));
+			lua_close(s->L);
+			goto err;
+		}
+	}
+
+	return POM_OK;
+
+err:
+	addon_output_states_cleanup(p);
+	return POM_ERR;
+}
+
 int addon_output_cleanup(void *output_priv) {
 	
 	struct addon_instance_priv *p = output_priv;
 
+	// The per thread states reference the priv of the main state
+	addon_output_states_cleanup(p);
+
 	if (p->L)
 		lua_close(p->L);
 
@@ -780,6 +1131,17 @@ int addon_output_open(void *output_priv) {
 
 	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
 
+	// The states are kept until cleanup as listeners may remain after close()
+	lua_getfield(p->L, -1, "__per_thread"); // Stack : self, per_thread
+	int per_thread = lua_toboolean(p->L, -1);
+	lua_pop(p->L, 1); // Stack : self
+
+	if (per_thread && !p->states && addon_output_states_init(p) != POM_OK) {
+		pomlog(POMLOG_ERR "Error while creating the per thread lua states");
+		lua_pop(p->L, 1); // Stack : empty
+		return POM_ERR;
+	}
+
 	lua_getfield(p->L, -1, "open"); // Stack : self, open_func
 
 	lua_pushvalue(p->L, -2); // Stack : self, open_func, self
@@ -51,6 +51,10 @@ struct addon_output_pload_priv {
 
 	void *plugin_priv;
 
+	// State which opened the payload
+	lua_State *L;
+	pthread_mutex_t *lock;
+
 	// Used by pload plugins for this output
 	struct addon_output_pload_plugin *plugins;
 
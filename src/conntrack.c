@@ -45,33 +45,51 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 	}
 	memset(ct, 0, sizeof(struct conntrack_tables));
 
+	if (!table_size)
+		table_size = 1;
 
-	size_t size = sizeof(struct conntrack_list) * table_size;
-	ct->table = malloc(size);
-	if (!ct->table) {
-		pom_oom(size);
-		goto err;
-	}
-	memset(ct->table, 0, size);
+	// Tables with a single bucket don't do any hashing, no need to grow them
+	ct->resizable = (table_size > 1);
+
+	unsigned int shard_count = 1;
+	while (shard_count < CONNTRACK_TABLE_SHARD_MAX && shard_count * 2 <= table_size)
+		shard_count <<= 1;
 
-	size = sizeof(pthread_mutex_t) *table_size;
-	ct->locks = malloc(size);
-	if (!ct->locks) {
+	size_t shard_size = 1;
+	while (shard_size * shard_count < table_size)
+		shard_size <<= 1;
+
+	size_t size = sizeof(struct conntrack_table_shard) * shard_count;
+	ct->shards = malloc(size);
+	if (!ct->shards) {
 		pom_oom(size);
 		goto err;
-
 	}
+	memset(ct->shards, 0, size);
 
 	unsigned int i;
+	for (i = 0; i < shard_count; i++) {
+		struct conntrack_table_shard *s = &ct->shards[i];
+
+		size = sizeof(struct conntrack_list *) * shard_size;
+		s->table = malloc(size);
+		if (!s->table) {
+			pom_oom(size);
+			goto err;
+		}
+		memset(s->table, 0, size);
+		s->table_size = shard_size;
 
-	for (i = 0; i < table_size; i++) {
-		int res = pthread_mutex_init(&ct->locks[i], NULL);
+		int res = pthread_mutex_init(&s->lock, NULL);
 		if (res) {
 			pomlog(POMLOG_ERR "Could not initialize conntrack hash lock : %s", pom_strerror(res));
+			free(s->table);
+			s->table = NULL;
 			goto err;
 		}
+		ct->shard_count++;
 	}
-	ct->table_size = table_size;
+	ct->shard_mask = shard_count - 1;
 
 	return ct;
 
@@ -80,17 +98,140 @@ err:
 	return NULL;
 }
 
+static void conntrack_table_chain_update(struct conntrack_table_shard *s, struct conntrack_list *lst) {
+
+	size_t len = 0;
+	for (; lst; lst = lst->next)
+		len++;
+
+	if (len > s->chain_max)
+		s->chain_max = len;
+}
+
+static void conntrack_table_rehash(struct conntrack_table_shard *s, size_t steps) {
+
+	// Move some buckets of the old table to the new one
+	while (s->old_table && steps--) {
+
+		struct conntrack_list *lst = s->old_table[s->rehash_pos];
+		while (lst) {
+			struct conntrack_list *next = lst->next;
+			struct conntrack_list **bucket = &s->table[(lst->hash >> CONNTRACK_TABLE_SHARD_BITS) & (s->table_size - 1)];
+			lst->prev = NULL;
+			lst->next = *bucket;
+			if (lst->next)
+				lst->next->prev = lst;
+			*bucket = lst;
+			conntrack_table_chain_update(s, lst);
+			lst = next;
+		}
+		s->old_table[s->rehash_pos] = NULL;
+		s->rehash_pos++;
+
+		if (s->rehash_pos >= s->old_table_size) {
+			free(s->old_table);
+			s->old_table = NULL;
+			s->old_table_size = 0;
+			s->rehash_pos = 0;
+		}
+	}
+}
+
+static struct conntrack_table_shard *conntrack_table_lock(struct conntrack_tables *ct, uint32_t hash) {
+
+	struct conntrack_table_shard *s = &ct->shards[hash & ct->shard_mask];
+	pom_mutex_lock(&s->lock);
+
+	// Each access to a shard being resized moves a few buckets
+	conntrack_table_rehash(s, CONNTRACK_TABLE_REHASH_STEP);
+
+	return s;
+}
+
+static struct conntrack_list **conntrack_table_bucket(struct conntrack_table_shard *s, uint32_t hash) {
+
+	hash >>= CONNTRACK_TABLE_SHARD_BITS;
+
+	// Buckets of the old table which weren't moved yet are still in use
+	if (s->old_table) {
+		size_t old_bucket = hash & (s->old_table_size - 1);
+		if (old_bucket >= s->rehash_pos)
+			return &s->old_table[old_bucket];
+	}
+
+	return &s->table[hash & (s->table_size - 1)];
+}
+
+static void conntrack_table_insert(struct conntrack_tables *ct, struct conntrack_table_shard *s, struct conntrack_list *lst, uint32_t hash) {
+
+	struct conntrack_list **bucket = conntrack_table_bucket(s, hash);
+
+	lst->hash = hash;
+	lst->prev = NULL;
+	lst->next = *bucket;
+	if (lst->next)
+		lst->next->prev = lst;
+	*bucket = lst;
+	s->count++;
+	conntrack_table_chain_update(s, lst);
+
+	if (!ct->resizable || s->old_table || s->count <= s->table_size * CONNTRACK_TABLE_LOAD_MAX || s->table_size >= CONNTRACK_TABLE_SHARD_SIZE_MAX)
+		return;
+
+	// Double the size of the shard, the conntracks will be moved over the next accesses
+	size_t size = sizeof(struct conntrack_list *) * s->table_size * 2;
+	struct conntrack_list **table = malloc(size);
+	if (!table) {
+		pom_oom(size);
+		return;
+	}
+	memset(table, 0, size);
+
+	s->old_table = s->table;
+	s->old_table_size = s->table_size;
+	s->rehash_pos = 0;
+	s->chain_max = 0; // Chains get shorter as they are moved over
+	s->table = table;
+	s->table_size *= 2;
+
+	debug_conntrack("Growing conntrack shard %p to %zu buckets", s, s->table_size);
+}
+
+static void conntrack_table_remove(struct conntrack_table_shard *s, struct conntrack_list **bucket, struct conntrack_list *lst) {
+
+	if (lst->prev)
+		lst->prev->next = lst->next;
+	else
+		*bucket = lst->next;
+
+	if (lst->next)
+		lst->next->prev = lst->prev;
+
+	s->count--;
+	if (!s->count)
+		s->chain_max = 0;
+}
 
 int conntrack_table_empty(struct conntrack_tables *ct) {
 
-	if (!ct || !ct->table)
+	if (!ct || !ct->shards)
 		return POM_ERR;
 
 	unsigned int i;
-	for (i = 0; i < ct->table_size; i++) {
-		while (ct->table[i]) {
-			struct conntrack_list *tmp = ct->table[i];
-			conntrack_cleanup(ct, tmp->ce->hash, tmp->ce);
+	for (i = 0; i < ct->shard_count; i++) {
+		struct conntrack_table_shard *s = &ct->shards[i];
+
+		// Finish any pending resize so that only one table remains
+		pom_mutex_lock(&s->lock);
+		conntrack_table_rehash(s, s->old_table_size);
+		pom_mutex_unlock(&s->lock);
+
+		size_t j;
+		for (j = 0; j < s->table_size; j++) {
+			while (s->table[j]) {
+				struct conntrack_list *tmp = s->table[j];
+				conntrack_cleanup(ct, tmp->ce->hash, tmp->ce);
+			}
 		}
 	}
 
@@ -103,20 +244,20 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 		return POM_OK;
 
 
-	if (ct->table) {
+	if (ct->shards) {
 		conntrack_table_empty(ct);
-		free(ct->table);
-	}
 
-	if (ct->locks) {
 		unsigned int i;
-		for (i = 0; i < ct->table_size; i++) {
-			int res = pthread_mutex_destroy(&ct->locks[i]);
+		for (i = 0; i < ct->shard_count; i++) {
+			struct conntrack_table_shard *s = &ct->shards[i];
+			int res = pthread_mutex_destroy(&s->lock);
 			if (res) {
 				pomlog(POMLOG_WARN "Error while destroying a hash lock : %s", pom_strerror(errno));
 			}
+			free(s->table);
+			free(s->old_table);
 		}
-		free(ct->locks);
+		free(ct->shards);
 	}
 
 
@@ -125,16 +266,48 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 	return POM_OK;
 }
 
+int conntrack_table_perf_load(uint64_t *value, void *priv) {
 
-uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+	struct conntrack_tables *ct = priv;
 
-	// Create a reversible hash for a and b
-	if (!a)
-		return POM_ERR;
+	uint64_t count = 0, size = 0;
+	unsigned int i;
+	for (i = 0; i < ct->shard_count; i++) {
+		struct conntrack_table_shard *s = &ct->shards[i];
+		pom_mutex_lock(&s->lock);
+		count += s->count;
+		size += s->table_size;
+		pom_mutex_unlock(&s->lock);
+	}
+
+	*value = (size ? (count * 100) / size : 0);
+
+	return POM_OK;
+}
+
+int conntrack_table_perf_chain_max(uint64_t *value, void *priv) {
+
+	struct conntrack_tables *ct = priv;
+
+	// Best effort sample, don't stall packet processing by locking the shards
+	uint64_t max = 0;
+	unsigned int i;
+	for (i = 0; i < ct->shard_count; i++) {
+		size_t chain_max = ct->shards[i].chain_max;
+		if (chain_max > max)
+			max = chain_max;
+	}
+
+	*value = max;
+
+	return POM_OK;
+}
+
+
+static uint32_t conntrack_hash_sized(struct ptype *a, size_t size_a, struct ptype *b, size_t size_b, void *parent) {
 
 	// Use the parent pointer as an init value
 	uint32_t parent_initval = (uint32_t) ((uint64_t)parent & 0xFFFFFFFF);
-	size_t size_a = ptype_get_value_size(a);
 
 	if (!b) {
 		// Only fwd direction
@@ -152,8 +325,6 @@ uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
 
 	}
 	 
-	size_t size_b = ptype_get_value_size(b);
-
 	// Try to use the best hash function
 	if (size_a == sizeof(uint16_t) && size_b == sizeof(uint16_t)) { // Multiply the two 16bit values
 		uint32_t value_a = *((uint16_t*)a->value);
@@ -169,19 +340,57 @@ uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
 }
 
 
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
+uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+
+	// Create a reversible hash for a and b
+	if (!a)
+		return POM_ERR;
+
+	return conntrack_hash_sized(a, ptype_get_value_size(a), b, (b ? ptype_get_value_size(b) : 0), parent);
+}
+
+static void conntrack_key_init(struct conntrack_key *key, struct ptype *a, size_t size_a, struct ptype *b, size_t size_b) {
+
+	if (size_a + size_b > CONNTRACK_KEY_MAX || !size_a) {
+		key->fwd_len = 0;
+		key->rev_len = 0;
+		return;
+	}
+
+	memcpy(key->buff, a->value, size_a);
+	if (b)
+		memcpy(key->buff + size_a, b->value, size_b);
+	key->fwd_len = size_a;
+	key->rev_len = size_b;
+}
+
+struct conntrack_entry *conntrack_find(struct conntrack_list *lst, uint32_t hash, struct conntrack_key *key, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
 
 	if (!fwd_value)
 		return NULL;
 
 
 	for (; lst; lst = lst->next) {
+
+		// Entries with a different hash can't match
+		if (lst->hash != hash)
+			continue;
+
 		struct conntrack_entry *ce = lst->ce;
 
 		// Check the parent conntrack
 		if (ce->parent && ce->parent->ce != parent)
 			continue;
 
+		if (ce->key_fwd_len) {
+			// Values are stored inline, no need to look at the ptypes
+			if (ce->key_fwd_len != key->fwd_len || ce->key_rev_len != key->rev_len || memcmp(ce->key, key->buff, key->fwd_len + key->rev_len))
+				continue;
+			return ce;
+		} else if (key->fwd_len) {
+			continue;
+		}
+
 		// Check the forward value
 		if (!ptype_compare_val(PTYPE_OP_EQ, ce->fwd_value, fwd_value))
 			continue;
@@ -229,23 +438,23 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 	}
 
 	struct conntrack_tables *ct = s->proto->ct;
-	pom_mutex_lock(&ct->locks[0]);
+	struct conntrack_table_shard *shard = conntrack_table_lock(ct, 0);
 
-	struct conntrack_list *lst = ct->table[0];
+	struct conntrack_list *lst = NULL;
 
-	for (lst = ct->table[0]; lst && lst->ce->parent; lst = lst->next);
+	for (lst = *conntrack_table_bucket(shard, 0); lst && lst->ce->parent; lst = lst->next);
 
 	if (lst) {
 		// Conntrack found
 		s->ce = lst->ce;
-		pom_mutex_unlock(&ct->locks[0]);
+		pom_mutex_unlock(&shard->lock);
 	} else {
 		// Alloc the conntrack
 		struct conntrack_entry *res = NULL;
 		res = malloc(sizeof(struct conntrack_entry));
 		if (!res) {
 			pom_oom(sizeof(struct conntrack_entry));
-			pom_mutex_unlock(&ct->locks[0]);
+			pom_mutex_unlock(&shard->lock);
 			return POM_ERR;
 		}
 
@@ -253,7 +462,7 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 		res->proto = s->proto;
 
 		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-			pom_mutex_unlock(&ct->locks[0]);
+			pom_mutex_unlock(&shard->lock);
 			return POM_ERR;
 		}
 
@@ -261,18 +470,15 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 		lst = malloc(sizeof(struct conntrack_list));
 		if (!lst) {
 			pom_oom(sizeof(struct conntrack_list));
-			pom_mutex_unlock(&ct->locks[0]);
+			pom_mutex_unlock(&shard->lock);
 			return POM_ERR;
 		}
 		memset(lst, 0, sizeof(struct conntrack_list));
 		lst->ce = res;
 
 		// Add the conntrack to the table
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
+		conntrack_table_insert(ct, shard, lst, 0);
+		pom_mutex_unlock(&shard->lock);
 		debug_conntrack("Allocated unique conntrack %p", res);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
@@ -386,12 +592,9 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 		parent->children = child;
 
 		// Add the conntrack to the table
-		pom_mutex_lock(&ct->locks[0]);
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
+		struct conntrack_table_shard *shard = conntrack_table_lock(ct, 0);
+		conntrack_table_insert(ct, shard, lst, 0);
+		pom_mutex_unlock(&shard->lock);
 		debug_conntrack("Allocated conntrack %p with parent %p (uniq child)", res, parent);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
@@ -449,36 +652,45 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_tables *ct = s->proto->ct;
 
-	uint32_t hash = conntrack_hash(fwd_value, rev_value, s_prev->ce) % ct->table_size;
+	size_t fwd_size = ptype_get_value_size(fwd_value);
+	size_t rev_size = (rev_value ? ptype_get_value_size(rev_value) : 0);
+	uint32_t hash = conntrack_hash_sized(fwd_value, fwd_size, rev_value, rev_size, s_prev->ce);
+
+	struct conntrack_key key;
+	conntrack_key_init(&key, fwd_value, fwd_size, rev_value, rev_size);
 
-	// Lock the specific hash while browsing for a conntrack
-	pom_mutex_lock(&ct->locks[hash]);
+	// Lock the shard of this hash while browsing for a conntrack
+	struct conntrack_table_shard *shard = conntrack_table_lock(ct, hash);
+	struct conntrack_list **bucket = conntrack_table_bucket(shard, hash);
 
 	// Try to find the conntrack in the forward table
 
 	// Check if we can find this entry in the forward way
-	if (ct->table[hash]) {
-		s->ce = conntrack_find(ct->table[hash], fwd_value, rev_value, s_prev->ce);
+	if (*bucket) {
+		s->ce = conntrack_find(*bucket, hash, &key, fwd_value, rev_value, s_prev->ce);
 		if (s->ce) {
 			s->direction = POM_DIR_FWD;
 			s_next->direction = POM_DIR_FWD;
 			pom_mutex_lock(&s->ce->lock);
 			s->ce->refcount++;
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(&shard->lock);
 			return POM_OK;;
 		}
 	}
 
 
 	// It wasn't found in the forward way, maybe in the reverse direction ?
-	if (rev_value) {
-		s->ce = conntrack_find(ct->table[hash], rev_value, fwd_value, s_prev->ce);
+	if (rev_value && *bucket) {
+		// The hash is the same in both directions
+		struct conntrack_key rev_key;
+		conntrack_key_init(&rev_key, rev_value, rev_size, fwd_value, fwd_size);
+		s->ce = conntrack_find(*bucket, hash, &rev_key, rev_value, fwd_value, s_prev->ce);
 		if (s->ce) {
 			s->direction = POM_DIR_REV;
 			s_next->direction = POM_DIR_REV;
 			pom_mutex_lock(&s->ce->lock);
 			s->ce->refcount++;
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(&shard->lock);
 			return POM_OK;
 		}
 
@@ -492,20 +704,24 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		struct ptype *tmp = rev_value;
 		rev_value = fwd_value;
 		fwd_value = tmp;
+		size_t tmp_size = rev_size;
+		rev_size = fwd_size;
+		fwd_size = tmp_size;
+		conntrack_key_init(&key, fwd_value, fwd_size, rev_value, rev_size);
 	}
 
 
 	// Alloc the conntrack entry
 	struct conntrack_entry *ce = malloc(sizeof(struct conntrack_entry));
 	if (!ce) {
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(&shard->lock);
 		pom_oom(sizeof(struct conntrack_entry));
 		return POM_ERR;
 	}
 	memset(ce, 0, sizeof(struct conntrack_entry));
 
 	if (pom_mutex_init_type(&ce->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(&shard->lock);
 		free(ce);
 		return POM_ERR;
 	}
@@ -521,7 +737,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		child = malloc(sizeof(struct conntrack_node_list));
 		if (!child) {
 			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(&shard->lock);
 			free(ce);
 			pom_oom(sizeof(struct conntrack_node_list));
 			return POM_ERR;
@@ -535,7 +751,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		ce->parent = malloc(sizeof(struct conntrack_node_list));
 		if (!ce->parent) {
 			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(&shard->lock);
 			free(child);
 			free(ce);
 			pom_oom(sizeof(struct conntrack_node_list));
@@ -551,6 +767,12 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	ce->hash = hash;
 
+	if (key.fwd_len) {
+		memcpy(ce->key, key.buff, key.fwd_len + key.rev_len);
+		ce->key_fwd_len = key.fwd_len;
+		ce->key_rev_len = key.rev_len;
+	}
+
 	struct conntrack_list *lst = NULL;
 
 	ce->fwd_value = ptype_alloc_from(fwd_value);
@@ -573,12 +795,9 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	lst->ce = ce;
 
 	// Insert in the conntrack table
-	lst->next = ct->table[hash];
-	if (lst->next) {
-		lst->next->prev = lst;
+	if (*bucket)
 		registry_perf_inc(s->proto->perf_conn_hash_col, 1);
-	}
-	ct->table[hash] = lst;
+	conntrack_table_insert(ct, shard, lst, hash);
 
 	// Add the child to the parent if any
 	if (child) {
@@ -600,7 +819,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	}
 	pom_mutex_lock(&ce->lock);
 	ce->refcount++;
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(&shard->lock);
 
 	s->ce = ce;
 	s->direction = s_prev->direction;
@@ -614,7 +833,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	return POM_OK;
 
 err:
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(&shard->lock);
 
 	pthread_mutex_destroy(&ce->lock);
 	if (child)
@@ -759,15 +978,16 @@ int conntrack_timed_cleanup(void *timer, ptime now) {
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
 
 	// Remove the conntrack from the conntrack table
-	pom_mutex_lock(&ct->locks[hash]);
+	struct conntrack_table_shard *shard = conntrack_table_lock(ct, hash);
+	struct conntrack_list **bucket = conntrack_table_bucket(shard, hash);
 
 	// Try to find the conntrack in the list
 	struct conntrack_list *lst = NULL;
 
-	for (lst = ct->table[hash]; lst && lst->ce != ce; lst = lst->next);
+	for (lst = *bucket; lst && lst->ce != ce; lst = lst->next);
 
 	if (!lst) {
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(&shard->lock);
 		pomlog(POMLOG_ERR "Trying to cleanup a non existing conntrack : %p", ce);
 		return POM_OK;
 	}
@@ -777,22 +997,16 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		debug_conntrack(POMLOG_ERR "Conntrack %p is still being referenced : %u !", ce, ce->refcount);
 		conntrack_delayed_cleanup(ce, 1, core_get_clock_last());
 		conntrack_unlock(ce);
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(&shard->lock);
 		return POM_OK;
 	}
 
 
-	if (lst->prev)
-		lst->prev->next = lst->next;
-	else
-		ct->table[hash] = lst->next;
-
-	if (lst->next)
-		lst->next->prev = lst->prev;
+	conntrack_table_remove(shard, bucket, lst);
 
 	free(lst);
 
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(&shard->lock);
 
 	if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1) {
 		conntrack_timer_cleanup(ce->cleanup_timer);
@@ -814,9 +1028,9 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		
 		// Make sure the parent still exists
 		uint32_t hash = ce->parent->hash;
-		pom_mutex_lock(&ce->parent->ct->locks[hash]);
+		struct conntrack_table_shard *parent_shard = conntrack_table_lock(ce->parent->ct, hash);
 		
-		for (lst = ce->parent->ct->table[hash]; lst && lst->ce != ce->parent->ce; lst = lst->next);
+		for (lst = *conntrack_table_bucket(parent_shard, hash); lst && lst->ce != ce->parent->ce; lst = lst->next);
 
 		if (lst) {
 
@@ -847,7 +1061,7 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 			debug_conntrack("Parent conntrack %p not found while cleaning child %p !", ce->parent->ce, ce);
 		}
 
-		pom_mutex_unlock(&ce->parent->ct->locks[hash]);
+		pom_mutex_unlock(&parent_shard->lock);
 
 		free(ce->parent);
 	}
@@ -965,16 +1179,16 @@ int conntrack_timer_process(void *priv, ptime now) {
 	struct conntrack_tables *ct = t->proto->ct;
 
 	// Lock the main table
-	pom_mutex_lock(&ct->locks[t->hash]);
+	struct conntrack_table_shard *shard = conntrack_table_lock(ct, t->hash);
 
 	// Check if the conntrack still exists
 
 	struct conntrack_list *lst = NULL;
-	for (lst = ct->table[t->hash]; lst && lst->ce != t->ce; lst = lst->next);
+	for (lst = *conntrack_table_bucket(shard, t->hash); lst && lst->ce != t->ce; lst = lst->next);
 
 	if (!lst) {
 		pomlog(POMLOG_DEBUG "Timer fired but conntrack doesn't exists anymore");
-		pom_mutex_unlock(&ct->locks[t->hash]);
+		pom_mutex_unlock(&shard->lock);
 		return POM_OK;
 	}
 
@@ -984,7 +1198,7 @@ int conntrack_timer_process(void *priv, ptime now) {
 
 	// The handler will unlock the conntrack
 	conntrack_lock(ce);
-	pom_mutex_unlock(&ct->locks[t->hash]);
+	pom_mutex_unlock(&shard->lock);
 	
 	int res = t->handler(ce, t->priv, now);
 	
@@ -27,10 +27,44 @@
 
 #define CONNTRACK_CHILDLESS_TIMEOUT	10
 
-struct conntrack_tables {
+// Maximum number of shards of a conntrack table, each with its own lock
+#define CONNTRACK_TABLE_SHARD_BITS	4
+#define CONNTRACK_TABLE_SHARD_MAX	(1 << CONNTRACK_TABLE_SHARD_BITS)
+
+// Grow a shard when it has more conntracks than this number of buckets times its size
+#define CONNTRACK_TABLE_LOAD_MAX	1
+
+// Maximum number of buckets of a shard
+#define CONNTRACK_TABLE_SHARD_SIZE_MAX	(1 << 24)
+
+// Number of buckets moved to the new table at each access while a shard is resized
+#define CONNTRACK_TABLE_REHASH_STEP	8
+
+// Forward and reverse values of a packet laid out like the inline key of a conntrack
+struct conntrack_key {
+	unsigned char buff[CONNTRACK_KEY_MAX];
+	size_t fwd_len, rev_len; // 0 if the values are too big to be inlined
+};
+
+struct conntrack_table_shard {
+	pthread_mutex_t lock;
 	struct conntrack_list **table;
-	pthread_mutex_t *locks;
-	size_t table_size;
+	size_t table_size; // Always a power of 2
+
+	// Previous table while it's incrementally moved to the new one
+	struct conntrack_list **old_table;
+	size_t old_table_size;
+	size_t rehash_pos; // Buckets of the old table before this one were moved
+
+	size_t count; // Number of conntracks in the shard
+	size_t chain_max; // Longest chain seen since the shard last grew or was emptied
+};
+
+struct conntrack_tables {
+	struct conntrack_table_shard *shards;
+	unsigned int shard_count; // Always a power of 2
+	unsigned int shard_mask;
+	int resizable;
 };
 
 struct conntrack_session {
@@ -64,10 +98,13 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev);
 int conntrack_table_empty(struct conntrack_tables *ct);
 int conntrack_table_cleanup(struct conntrack_tables *ct);
 uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent);
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
+struct conntrack_entry *conntrack_find(struct conntrack_list *lst, uint32_t hash, struct conntrack_key *key, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
 int conntrack_timed_cleanup(void *timer, ptime now);
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce);
 
+int conntrack_table_perf_load(uint64_t *value, void *priv);
+int conntrack_table_perf_chain_max(uint64_t *value, void *priv);
+
 
 int conntrack_timer_process(void *priv, ptime now);
 
@@ -31,9 +31,14 @@
 #include "analyzer.h"
 #include "dns.h"
 #include "pload.h"
+#include "event.h"
+#include "jhash.h"
 
 #include <pom-ng/ptype_bool.h>
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
+
+#include <arpa/inet.h>
 
 #if 0
 #define debug_core(x ...) pomlog(POMLOG_DEBUG x)
@@ -41,6 +46,12 @@
 #define debug_core(x ...)
 #endif
 
+#if defined(__i386__) || defined(__x86_64__)
+#define core_cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define core_cpu_relax() __sync_synchronize()
+#endif
+
 
 static volatile int core_run = 0; // Set to 1 while the processing thread should run
 static enum core_state core_cur_state = core_state_idle;
@@ -51,20 +62,101 @@ static ptime core_start_time;
 static struct core_processing_thread *core_processing_threads[CORE_PROCESS_THREAD_MAX];
 static unsigned int core_num_threads = 0;
 static pthread_rwlock_t core_processing_lock = PTHREAD_RWLOCK_INITIALIZER;
-static volatile unsigned int core_pkt_queue_count = 0;
+
+// Each thread queuing packets gets its own ring in every processing thread
+static volatile int core_producers[CORE_QUEUE_PRODUCER_MAX] = { 0 };
+static volatile unsigned int core_producer_count = 0; // Highest producer slot used + 1
+static __thread int core_producer_id = -1;
+static __thread unsigned int core_producer_next_thread = 0;
+static __thread int core_thread_id = -1;
 
 static pthread_mutex_t core_pkt_queue_wait_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t core_pkt_queue_wait_cond = PTHREAD_COND_INITIALIZER;
+static volatile unsigned int core_pkt_queue_waiting = 0; // Number of producers waiting for room in the queues
 
 static volatile ptime core_clock[CORE_PROCESS_THREAD_MAX] = { 0 };
 
+// Changes each time the packets needed by the listeners change
+static volatile unsigned int core_capture_filter_serial = 1;
+
 static struct registry_class *core_registry_class = NULL;
-static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL;
+static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL, *core_param_pkt_dispatch = NULL, *core_param_pkt_batch_size = NULL;
+
+static volatile enum core_pkt_dispatch core_pkt_dispatch_mode = core_pkt_dispatch_round_robin;
+
+// Datalinks that can be parsed to find out the flow of a packet
+static struct proto *core_proto_ethernet = NULL, *core_proto_ipv4 = NULL, *core_proto_ipv6 = NULL;
 
 // Perf objects
 struct registry_perf *perf_pkt_queue = NULL;
 struct registry_perf *perf_thread_active = NULL;
 struct registry_perf *perf_pkt_dropped = NULL;
+struct registry_perf *perf_thread_imbalance = NULL;
+
+static int core_param_pkt_dispatch_parse(void *priv, struct registry_param *p, char *value) {
+
+	if (!strcmp(value, "round_robin") || !strcmp(value, "flow"))
+		return POM_OK;
+
+	pomlog(POMLOG_ERR "Invalid packet dispatch mode \"%s\"", value);
+	return POM_ERR;
+}
+
+static int core_param_pkt_dispatch_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	char *mode = PTYPE_STRING_GETVAL(value);
+
+	if (!strcmp(mode, "flow"))
+		core_pkt_dispatch_mode = core_pkt_dispatch_flow;
+	else
+		core_pkt_dispatch_mode = core_pkt_dispatch_round_robin;
+
+	return POM_OK;
+}
+
+static int core_perf_thread_imbalance(uint64_t *value, void *priv) {
+
+	// Report how much more packets the busiest thread got compared to the average (in percent)
+	uint64_t max = 0, tot = 0;
+
+	unsigned int i;
+	for (i = 0; i < core_num_threads && core_processing_threads[i]; i++) {
+		uint64_t cur = 0;
+		unsigned int j;
+		for (j = 0; j < core_producer_count; j++)
+			cur += core_processing_threads[i]->rings[j].pkt_total;
+		tot += cur;
+		if (cur > max)
+			max = cur;
+	}
+
+	if (!tot) {
+		*value = 0;
+		return POM_OK;
+	}
+
+	uint64_t avg = tot / core_num_threads;
+	*value = ((max - avg) * 100) / (avg ? avg : 1);
+
+	return POM_OK;
+}
+
+static int core_perf_pkt_queue(uint64_t *value, void *priv) {
+
+	uint64_t tot = 0;
+
+	unsigned int i, j;
+	for (i = 0; i < core_num_threads && core_processing_threads[i]; i++) {
+		for (j = 0; j < core_producer_count; j++) {
+			struct core_pkt_ring *r = &core_processing_threads[i]->rings[j];
+			tot += r->tail - r->head;
+		}
+	}
+
+	*value = tot;
+
+	return POM_OK;
+}
 
 
 int core_init(unsigned int num_threads) {
@@ -78,10 +170,14 @@ int core_init(unsigned int num_threads) {
 	perf_pkt_queue = registry_class_add_perf(core_registry_class, "pkt_queue", registry_perf_type_gauge, "Number of packets in the queue waiting to be processed", "pkts");
 	perf_thread_active = registry_class_add_perf(core_registry_class, "active_thread", registry_perf_type_gauge, "Number of active threads", "threads");
 	perf_pkt_dropped = registry_class_add_perf(core_registry_class, "dropped_pkt", registry_perf_type_counter, "Number of packets dropped from the inputs", "pkts");
+	perf_thread_imbalance = registry_class_add_perf(core_registry_class, "thread_imbalance", registry_perf_type_gauge, "Packets queued to the busiest thread above the average", "%");
 
-	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped)
+	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped || !perf_thread_imbalance)
 		return POM_ERR;
 
+	registry_perf_set_update_hook(perf_pkt_queue, core_perf_pkt_queue, NULL);
+	registry_perf_set_update_hook(perf_thread_imbalance, core_perf_thread_imbalance, NULL);
+
 	core_param_dump_pkt = ptype_alloc("bool");
 	if (!core_param_dump_pkt)
 		goto err;
@@ -98,6 +194,14 @@ int core_init(unsigned int num_threads) {
 	if (!core_param_http_admin_password)
 		goto err;
 
+	core_param_pkt_dispatch = ptype_alloc("string");
+	if (!core_param_pkt_dispatch)
+		goto err;
+
+	core_param_pkt_batch_size = ptype_alloc_unit("uint32", "pkts");
+	if (!core_param_pkt_batch_size)
+		goto err;
+
 	param = registry_new_param("dump_pkt", "no", core_param_dump_pkt, "Dump packets to logs", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
@@ -113,6 +217,19 @@ int core_init(unsigned int num_threads) {
 	param = registry_new_param("http_admin_password", "", core_param_http_admin_password, "HTTP password for the user admin", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
+
+	param = registry_new_param("pkt_dispatch", "round_robin", core_param_pkt_dispatch, "How packets are dispatched to the processing threads", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_param_info_add_value(param, "round_robin") != POM_OK || registry_param_info_add_value(param, "flow") != POM_OK)
+		goto err;
+	registry_param_set_callbacks(param, NULL, core_param_pkt_dispatch_parse, core_param_pkt_dispatch_update);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("pkt_batch_size", CORE_THREAD_PKT_BATCH_DEFAULT, core_param_pkt_batch_size, "Maximum number of packets processed by a thread at once", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_param_info_set_min_max(param, 1, CORE_THREAD_PKT_BATCH_MAX) != POM_OK)
+		goto err;
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
 	
 	param = NULL;
 
@@ -145,8 +262,9 @@ int core_init(unsigned int num_threads) {
 	unsigned int i;
 
 	for (i = 0; i < core_num_threads; i++) {
-		struct core_processing_thread *tmp = malloc(sizeof(struct core_processing_thread));
-		if (!tmp) {
+		// Align the rings on a cache line
+		struct core_processing_thread *tmp = NULL;
+		if (posix_memalign((void **)&tmp, CORE_CACHE_LINE_SIZE, sizeof(struct core_processing_thread))) {
 			pom_oom(sizeof(struct core_processing_thread));
 			goto err;
 		}
@@ -218,26 +336,353 @@ int core_cleanup(int emergency_cleanup) {
 			pomlog(POMLOG_WARN "Error while destroying a processing thread condition : %s", pom_strerror(res));
 
 
-		struct core_packet_queue *tmp = NULL;
-		while (t->pkt_queue_head) {
-			tmp = t->pkt_queue_head;
-			t->pkt_queue_head = tmp->next;
+		unsigned int j;
+		for (j = 0; j < CORE_QUEUE_PRODUCER_MAX; j++) {
 			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
-			pomlog(POMLOG_WARN "A packet was still in a thread's queue");
+			if (t->rings[j].tail != t->rings[j].head)
+				pomlog(POMLOG_WARN "%u packet(s) were still in a thread's queue", t->rings[j].tail - t->rings[j].head);
 		}
 
-		while (t->pkt_queue_unused) {
-			tmp = t->pkt_queue_unused;
-			t->pkt_queue_unused = tmp->next;
-			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
+		free(t);
+	}
+
+	return POM_OK;
+}
+
+static uint32_t core_flow_hash_fold(const unsigned char *addr, size_t len) {
+
+	uint32_t res = 0, tmp;
+	size_t i;
+	for (i = 0; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		memcpy(&tmp, addr + i, sizeof(uint32_t));
+		res ^= tmp;
+	}
+
+	for (; i < len; i++)
+		res ^= addr[i] << ((i % sizeof(uint32_t)) * 8);
+
+	return res;
+}
+
+static uint32_t core_flow_hash_sym(uint32_t addr_a, uint32_t addr_b, uint16_t port_a, uint16_t port_b, uint32_t initval) {
+
+	// Order both ends of the flow so that both directions give the same result
+	if (addr_a > addr_b || (addr_a == addr_b && port_a > port_b)) {
+		uint32_t tmp_addr = addr_a;
+		addr_a = addr_b;
+		addr_b = tmp_addr;
+		uint16_t tmp_port = port_a;
+		port_a = port_b;
+		port_b = tmp_port;
+	}
+
+	return jhash_3words(addr_a, addr_b, ((uint32_t)port_a << 16) | port_b, initval);
+}
+
+static int core_flow_hash_l4(unsigned char *l4, size_t len, uint8_t ip_proto, uint16_t *sport, uint16_t *dport) {
+
+	*sport = 0;
+	*dport = 0;
+
+	// Only TCP, UDP and SCTP have ports at the same place
+	if (ip_proto != IPPROTO_TCP && ip_proto != IPPROTO_UDP && ip_proto != IPPROTO_SCTP)
+		return POM_OK;
+
+	if (len < 2 * sizeof(uint16_t))
+		return POM_OK;
+
+	*sport = (l4[0] << 8) | l4[1];
+	*dport = (l4[2] << 8) | l4[3];
+
+	return POM_OK;
+}
+
+static int core_flow_hash_ipv4(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 20 || (buff[0] >> 4) != 4)
+		return POM_ERR;
+
+	size_t hdr_len = (buff[0] & 0xf) * 4;
+	if (hdr_len < 20 || hdr_len > len)
+		return POM_ERR;
+
+	uint8_t ip_proto = buff[9];
+	uint32_t saddr, daddr;
+	memcpy(&saddr, buff + 12, sizeof(uint32_t));
+	memcpy(&daddr, buff + 16, sizeof(uint32_t));
+
+	uint16_t sport = 0, dport = 0;
+
+	// Fragments other than the first one don't have the ports, use only the addresses for all of them
+	uint16_t frag = (buff[6] << 8) | buff[7];
+	if (!(frag & 0x3fff))
+		core_flow_hash_l4(buff + hdr_len, len - hdr_len, ip_proto, &sport, &dport);
+	else
+		ip_proto = 0;
+
+	*hash = core_flow_hash_sym(saddr, daddr, sport, dport, ip_proto);
+
+	return POM_OK;
+}
+
+static int core_flow_hash_ipv6(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 40 || (buff[0] >> 4) != 6)
+		return POM_ERR;
+
+	uint8_t ip_proto = buff[6];
+	uint32_t saddr = core_flow_hash_fold(buff + 8, 16);
+	uint32_t daddr = core_flow_hash_fold(buff + 24, 16);
+
+	// Extension headers are not parsed, the packet will be hashed on the addresses only
+	uint16_t sport = 0, dport = 0;
+	core_flow_hash_l4(buff + 40, len - 40, ip_proto, &sport, &dport);
+
+	*hash = core_flow_hash_sym(saddr, daddr, sport, dport, ip_proto);
+
+	return POM_OK;
+}
+
+static int core_flow_hash_ethernet(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 14)
+		return POM_ERR;
+
+	size_t offset = 12;
+	uint16_t ether_type = (buff[offset] << 8) | buff[offset + 1];
+
+	// Skip up to two VLAN tags
+	int i;
+	for (i = 0; i < 2 && (ether_type == 0x8100 || ether_type == 0x88a8); i++) {
+		offset += 4;
+		if (offset + 2 > len)
+			return POM_ERR;
+		ether_type = (buff[offset] << 8) | buff[offset + 1];
+	}
+	offset += 2;
+
+	if (ether_type == 0x0800 && core_flow_hash_ipv4(buff + offset, len - offset, hash) == POM_OK)
+		return POM_OK;
+
+	if (ether_type == 0x86dd && core_flow_hash_ipv6(buff + offset, len - offset, hash) == POM_OK)
+		return POM_OK;
+
+	// Fallback to the MAC addresses
+	*hash = core_flow_hash_sym(core_flow_hash_fold(buff, 6), core_flow_hash_fold(buff + 6, 6), 0, 0, ether_type);
+
+	return POM_OK;
+}
+
+int core_flow_hash(struct packet *p, uint32_t *hash) {
+
+	// This is called from the input thread, keep it as cheap as possible
+
+	if (!p->datalink)
+		return POM_ERR;
+
+	if (p->datalink == core_proto_ethernet)
+		return core_flow_hash_ethernet(p->buff, p->len, hash);
+	else if (p->datalink == core_proto_ipv4)
+		return core_flow_hash_ipv4(p->buff, p->len, hash);
+	else if (p->datalink == core_proto_ipv6)
+		return core_flow_hash_ipv6(p->buff, p->len, hash);
+
+	return POM_ERR;
+}
+
+static int core_queue_producer_get() {
+
+	if (core_producer_id >= 0)
+		return core_producer_id;
+
+	int i;
+	for (i = 0; i < CORE_QUEUE_PRODUCER_MAX; i++) {
+		if (__sync_bool_compare_and_swap(&core_producers[i], 0, 1))
+			break;
+	}
+
+	if (i >= CORE_QUEUE_PRODUCER_MAX) {
+		pomlog(POMLOG_ERR "Too many threads are queuing packets, the maximum is %u", CORE_QUEUE_PRODUCER_MAX);
+		return POM_ERR;
+	}
+
+	// Make sure the processing threads will look at our rings
+	unsigned int count = core_producer_count;
+	while (count <= (unsigned int) i) {
+		if (__sync_bool_compare_and_swap(&core_producer_count, count, i + 1))
+			break;
+		count = core_producer_count;
+	}
+
+	core_producer_id = i;
+
+	return i;
+}
+
+static int core_pkt_ring_enqueue(struct core_pkt_ring *r, struct packet *p) {
+
+	unsigned int tail = r->tail;
+	if (tail - r->head >= CORE_THREAD_PKT_QUEUE_MAX)
+		return POM_ERR;
+
+	r->pkts[tail & CORE_THREAD_PKT_QUEUE_MASK] = p;
+	r->pkt_total++;
+
+	// The packet must be visible before it's published to the consumer
+	__sync_synchronize();
+	r->tail = tail + 1;
+
+	return POM_OK;
+}
+
+static unsigned int core_pkt_ring_dequeue(struct core_pkt_ring *r, struct packet **pkts, unsigned int max) {
+
+	unsigned int head = r->head;
+	unsigned int count = r->tail - head;
+	if (!count)
+		return 0;
+
+	if (count > max)
+		count = max;
+
+	// Read the tail before the packets
+	__sync_synchronize();
+
+	unsigned int i;
+	for (i = 0; i < count; i++)
+		pkts[i] = r->pkts[(head + i) & CORE_THREAD_PKT_QUEUE_MASK];
+
+	// Done reading the packets before giving back the slots
+	__sync_synchronize();
+	r->head = head + count;
+
+	return count;
+}
+
+static int core_queue_full(struct core_processing_thread *t, int producer) {
+
+	if (t)
+		return (t->rings[producer].tail - t->rings[producer].head >= CORE_THREAD_PKT_QUEUE_MAX);
+
+	unsigned int i;
+	for (i = 0; i < core_num_threads; i++) {
+		struct core_pkt_ring *r = &core_processing_threads[i]->rings[producer];
+		if (r->tail - r->head < CORE_THREAD_PKT_QUEUE_MAX)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void core_queue_wait(struct core_processing_thread *t, int producer) {
+
+	// Wait for some room in the queue of the given thread or in any thread if none
+	pom_mutex_lock(&core_pkt_queue_wait_lock);
+
+	__sync_fetch_and_add(&core_pkt_queue_waiting, 1);
+
+	// Recheck the queue after announcing that we're waiting
+	if (core_queue_full(t, producer)) {
+		int res = pthread_cond_wait(&core_pkt_queue_wait_cond, &core_pkt_queue_wait_lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while waiting for the core pkt_queue condition : %s", pom_strerror(res));
+			abort();
 		}
+	}
 
-		free(t);
+	__sync_fetch_and_sub(&core_pkt_queue_waiting, 1);
+
+	pom_mutex_unlock(&core_pkt_queue_wait_lock);
+}
+
+static void core_processing_thread_wakeup(struct core_processing_thread *t) {
+
+	// Either the thread sees our packet or we see that it's sleeping
+	__sync_synchronize();
+	if (!t->sleeping)
+		return;
+
+	pom_mutex_lock(&t->pkt_queue_lock);
+	int res = pthread_cond_signal(&t->pkt_queue_cond);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while signaling the thread pkt_queue restart condition : %s", pom_strerror(res));
+		abort();
 	}
+	pom_mutex_unlock(&t->pkt_queue_lock);
+}
+
+static int core_processing_thread_has_pkt(struct core_processing_thread *t) {
+
+	unsigned int i;
+	for (i = 0; i < core_producer_count; i++) {
+		if (t->rings[i].tail != t->rings[i].head)
+			return 1;
+	}
+
+	return 0;
+}
+
+static unsigned int core_processing_thread_dequeue(struct core_processing_thread *t, struct packet **pkts, unsigned int max) {
+
+	unsigned int producers = core_producer_count;
+	if (!producers)
+		return 0;
+
+	// Start with a different ring each time to be fair with all the producers
+	unsigned int i, count = 0;
+	for (i = 0; i < producers && count < max; i++) {
+		unsigned int ring = (t->next_ring + i) % producers;
+		count += core_pkt_ring_dequeue(&t->rings[ring], pkts + count, max - count);
+	}
+
+	t->next_ring = (t->next_ring + 1) % producers;
+
+	return count;
+}
+
+static int core_processing_thread_wait(struct core_processing_thread *t) {
+
+	// Poll the queues for a while before going to sleep
+	unsigned int i;
+	for (i = 0; i < CORE_THREAD_SPIN_MAX; i++) {
+		if (core_processing_thread_has_pkt(t))
+			return POM_OK;
+		core_cpu_relax();
+	}
+
+	pom_mutex_lock(&t->pkt_queue_lock);
+
+	t->sleeping = 1;
+	__sync_synchronize();
+
+	while (!core_processing_thread_has_pkt(t)) {
+		// We are not active while waiting for a packet
+		registry_perf_dec(perf_thread_active, 1);
+
+		debug_core("thread %u : waiting", t->thread_id);
+
+		if (registry_perf_getval(perf_thread_active) == 0) {
+			if (core_get_state() == core_state_finishing)
+				core_set_state(core_state_idle);
+		}
+
+		if (!core_run) {
+			t->sleeping = 0;
+			pom_mutex_unlock(&t->pkt_queue_lock);
+			return POM_ERR;
+		}
+
+		int res = pthread_cond_wait(&t->pkt_queue_cond, &t->pkt_queue_lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while waiting for restart condition : %s", pom_strerror(res));
+			abort();
+		}
+		registry_perf_inc(perf_thread_active, 1);
+	}
+
+	t->sleeping = 0;
+
+	pom_mutex_unlock(&t->pkt_queue_lock);
 
 	return POM_OK;
 }
@@ -254,185 +699,138 @@ int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_
 
 	debug_core("Queuing packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
 
+	// Pin the packet to a thread based on its flow if requested
+
+	if (!(flags & CORE_QUEUE_HAS_THREAD_AFFINITY) && core_pkt_dispatch_mode == core_pkt_dispatch_flow && core_num_threads > 1) {
+		uint32_t hash = 0;
+		if (core_flow_hash(p, &hash) == POM_OK) {
+			flags |= CORE_QUEUE_HAS_THREAD_AFFINITY;
+			thread_affinity = hash;
+		}
+	}
+
 	// Find the right thread to queue to
 
+	int producer = core_queue_producer_get();
+	if (producer < 0) {
+		packet_release(p);
+		return POM_ERR;
+	}
+
 	struct core_processing_thread *t = NULL;
 	if (flags & CORE_QUEUE_HAS_THREAD_AFFINITY) {
 		t = core_processing_threads[thread_affinity % core_num_threads];
-		pom_mutex_lock(&t->pkt_queue_lock);
+
+		while (core_pkt_ring_enqueue(&t->rings[producer], p) != POM_OK) {
+			// The queue of this thread is full
+			if (flags & CORE_QUEUE_DROP_IF_FULL) {
+				packet_release(p);
+				registry_perf_inc(perf_pkt_dropped, 1);
+				debug_core("Dropped packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), t->thread_id);
+				return POM_OK;
+			}
+
+			debug_core("Queue of thread %u full. Waiting ...", t->thread_id);
+			core_queue_wait(t, producer);
+		}
 	} else {
-		static volatile unsigned int start = 0;
-		unsigned int i;
 		while (1) {
-			unsigned int thread_id = start;
+			unsigned int i, thread_id = core_producer_next_thread;
 			for (i = 0; i < core_num_threads; i++) {
 				thread_id++;
 				if (thread_id >= core_num_threads)
 					thread_id -= core_num_threads;
 				t = core_processing_threads[thread_id];
-				int res = pthread_mutex_trylock(&t->pkt_queue_lock);
-				if (res == EBUSY) {
-					// Thread is busy, go to the next one
-					continue;
-				} else if (res) {
-					pomlog(POMLOG_ERR "Error while locking a processing thread pkt_queue mutex : %s", pom_strerror(res));
-					abort();
-					return POM_ERR;
-				}
 
-				// We've got the lock, check if it's ok to queue here
-				if (t->pkt_count < CORE_THREAD_PKT_QUEUE_MAX) {
-					// Use this thread
+				if (core_pkt_ring_enqueue(&t->rings[producer], p) == POM_OK)
 					break;
-				}
 
 				// Too many packets pending in this thread, go to the next one
-				pom_mutex_unlock(&t->pkt_queue_lock);
 			}
 
 			if (i < core_num_threads) {
-				// We locked on a thread
-				start = thread_id;
+				// We queued to a thread
+				core_producer_next_thread = thread_id;
 				break;
 			}
 
-			// No thread found
-			if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-				// Queue full
-				if (flags & CORE_QUEUE_DROP_IF_FULL) {
-					packet_release(p);
-					registry_perf_inc(perf_pkt_dropped, 1);
-					debug_core("Dropped packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
-					return POM_OK;
-				}
-
-				// We're not going to drop this. Wait then
-				debug_core("All queues full. Waiting ...");
-				pom_mutex_lock(&core_pkt_queue_wait_lock);
-
-				// Recheck the count after locking
-				if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-					int res = pthread_cond_wait(&core_pkt_queue_wait_cond, &core_pkt_queue_wait_lock);
-					if (res) {
-						pomlog(POMLOG_ERR "Error while waiting for the core pkt_queue condition : %s", pom_strerror(res));
-						abort();
-					}
-				}
-				pom_mutex_unlock(&core_pkt_queue_wait_lock);
-
+			// Queue full
+			if (flags & CORE_QUEUE_DROP_IF_FULL) {
+				packet_release(p);
+				registry_perf_inc(perf_pkt_dropped, 1);
+				debug_core("Dropped packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
+				return POM_OK;
 			}
-		}
-
-	}
 
-	// We've got the thread's lock, add it to the queue
-
-	struct core_packet_queue *tmp = NULL;
-	if (t->pkt_queue_unused) {
-		tmp = t->pkt_queue_unused;
-		t->pkt_queue_unused = tmp->next;
-	} else {
-		tmp = malloc(sizeof(struct core_packet_queue));
-		if (!tmp) {
-			pom_mutex_unlock(&t->pkt_queue_lock);
-			pom_oom(sizeof(struct core_packet_queue));
-			return POM_ERR;
-		}
-	}
-
-	tmp->pkt = p;
-	tmp->next = NULL;
-	if (t->pkt_queue_tail) {
-		t->pkt_queue_tail->next = tmp;
-	} else {
-		t->pkt_queue_head = tmp;
-
-		// The queue was empty, we need to signal it
-		int res = pthread_cond_signal(&t->pkt_queue_cond);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while signaling the thread pkt_queue restart condition : %s", pom_strerror(res));
-			abort();
-			return POM_ERR;
+			// We're not going to drop this. Wait then
+			debug_core("All queues full. Waiting ...");
+			core_queue_wait(NULL, producer);
 		}
 
 	}
-	t->pkt_queue_tail = tmp;
-
-	t->pkt_count++;
-	__sync_fetch_and_add(&core_pkt_queue_count, 1);
-
-	registry_perf_inc(perf_pkt_queue, 1);
 
 	debug_core("Queued packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), t->thread_id);
 
-	pom_mutex_unlock(&t->pkt_queue_lock);
+	core_processing_thread_wakeup(t);
 
 	return POM_OK;
 }
 
+void core_queue_thread_cleanup() {
+
+	// Give back our producer slot, packets still in the rings will be processed anyway
+	if (core_producer_id < 0)
+		return;
+
+	__sync_lock_release(&core_producers[core_producer_id]);
+	core_producer_id = -1;
+	core_producer_next_thread = 0;
+}
 
 void *core_processing_thread_func(void *priv) {
 
 	struct core_processing_thread *tpriv = priv;
 
+	core_thread_id = tpriv->thread_id;
+
 	if (packet_info_pool_init()) {
 		halt("Error while initializing the packet_info_pool", 1);
 		return NULL;
 	}
 
+	if (timers_thread_init(tpriv->thread_id) != POM_OK) {
+		halt("Error while initializing the timer wheel", 1);
+		return NULL;
+	}
+
 	registry_perf_inc(perf_thread_active, 1);
 
-	pom_mutex_lock(&tpriv->pkt_queue_lock);
+	struct packet *pkts[CORE_THREAD_PKT_BATCH_MAX];
+	uint32_t last_timers_sec = 0;
 
 	while (core_run) {
 		
-		while (!tpriv->pkt_queue_head) {
-			// We are not active while waiting for a packet
-			registry_perf_dec(perf_thread_active, 1);
-
-			debug_core("thread %u : waiting", tpriv->thread_id);
-
-			if (registry_perf_getval(perf_thread_active) == 0) {
-				if (core_get_state() == core_state_finishing)
-					core_set_state(core_state_idle);
-			}
-
-			if (!core_run) {
-				pom_mutex_unlock(&tpriv->pkt_queue_lock);
+		// Dequeue a batch of packets
+		uint32_t batch_size = *PTYPE_UINT32_GETVAL(core_param_pkt_batch_size);
+		if (batch_size < 1 || batch_size > CORE_THREAD_PKT_BATCH_MAX)
+			batch_size = CORE_THREAD_PKT_BATCH_MAX;
+
+		unsigned int count = core_processing_thread_dequeue(tpriv, pkts, batch_size);
+
+		if (!count) {
+			// Let the other threads process our timers while we wait
+			timers_thread_idle(1);
+			int res = core_processing_thread_wait(tpriv);
+			timers_thread_idle(0);
+			if (res != POM_OK)
 				goto end;
-			}
-
-			int res = pthread_cond_wait(&tpriv->pkt_queue_cond, &tpriv->pkt_queue_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while waiting for restart condition : %s", pom_strerror(res));
-				abort();
-				return NULL;
-			}
-			registry_perf_inc(perf_thread_active, 1);
+			continue;
 		}
 
-
-		// Dequeue a packet
-		struct core_packet_queue *tmp = tpriv->pkt_queue_head;
-		tpriv->pkt_queue_head = tmp->next;
-		if (!tpriv->pkt_queue_head)
-			tpriv->pkt_queue_tail = NULL;
-
-
-		// Add it to the unused list
-		tmp->next = tpriv->pkt_queue_unused;
-		tpriv->pkt_queue_unused = tmp;
-
-		tpriv->pkt_count--;
-
-		registry_perf_dec(perf_pkt_queue, 1);
-
-		__sync_fetch_and_sub(&core_pkt_queue_count, 1);
-
-		if (tpriv->pkt_count < CORE_THREAD_PKT_QUEUE_MIN) {
-
+		// Tell the input processes that they can continue queuing packets
+		__sync_synchronize();
+		if (core_pkt_queue_waiting) {
 			pom_mutex_lock(&core_pkt_queue_wait_lock);
-			// Tell the input processes that they can continue queuing packets
 			int res = pthread_cond_broadcast(&core_pkt_queue_wait_cond);
 			if (res) {
 				pomlog(POMLOG_ERR "Error while signaling the main pkt_queue condition : %s", pom_strerror(res));
@@ -441,49 +839,63 @@ void *core_processing_thread_func(void *priv) {
 			pom_mutex_unlock(&core_pkt_queue_wait_lock);
 		}
 
-		// Keep track of our packet
-		struct packet *pkt = tmp->pkt;
+		// Lock the processing lock once for the whole batch
+		pom_rwlock_rlock(&core_processing_lock);
 
-		debug_core("thread %u : Processing packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
-		pom_mutex_unlock(&tpriv->pkt_queue_lock);
+		unsigned int i;
+		for (i = 0; i < count; i++) {
 
-		// Lock the processing lock
-		pom_rwlock_rlock(&core_processing_lock);
+			struct packet *pkt = pkts[i];
 
-		// Update the current clock
-		if (core_clock[tpriv->thread_id] < pkt->ts) // Make sure we keep it monotonous
-			core_clock[tpriv->thread_id] = pkt->ts;
+			debug_core("thread %u : Processing packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
 
-		//pomlog(POMLOG_DEBUG "Thread %u processing ...", pthread_self());
-		if (core_process_packet(pkt) == POM_ERR) {
-			core_run = 0;
-			pom_rwlock_unlock(&core_processing_lock);
-			break;
+			// Update the current clock
+			if (core_clock[tpriv->thread_id] < pkt->ts) // Make sure we keep it monotonous
+				core_clock[tpriv->thread_id] = pkt->ts;
+
+			//pomlog(POMLOG_DEBUG "Thread %u processing ...", pthread_self());
+			if (core_process_packet(pkt) == POM_ERR) {
+				core_run = 0;
+				pom_rwlock_unlock(&core_processing_lock);
+				goto err;
+			}
+
+			debug_core("thread %u : Processed packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
+
+			// Timers have a granularity of one second, don't wait for the end of the batch when the clock moved to the next one
+			if (i < count - 1 && pom_ptime_sec(pkt->ts) != last_timers_sec) {
+				last_timers_sec = pom_ptime_sec(pkt->ts);
+				if (timers_process() != POM_OK) {
+					pom_rwlock_unlock(&core_processing_lock);
+					goto err;
+				}
+			}
 		}
 
 		// Process timers
+		last_timers_sec = pom_ptime_sec(pkts[count - 1]->ts);
 		if (timers_process() != POM_OK) {
 			pom_rwlock_unlock(&core_processing_lock);
-			break;
+			goto err;
 		}
 
 		pom_rwlock_unlock(&core_processing_lock);
 
-		debug_core("thread %u : Processed packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
-
-		if (packet_release(pkt) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while releasing the packet");
-			break;
+		for (i = 0; i < count; i++) {
+			if (packet_release(pkts[i]) != POM_OK) {
+				pomlog(POMLOG_ERR "Error while releasing the packet");
+				goto err;
+			}
 		}
-		
-		// Re-lock our queue for the next run
-		pom_mutex_lock(&tpriv->pkt_queue_lock);
 
 	}
 
+err:
 	halt("Processing thread encountered an error", 1);
 end:
+	timers_thread_cleanup();
 	packet_info_pool_cleanup();
+	packet_pool_cleanup();
 	pload_thread_cleanup();
 
 	return NULL;
@@ -730,6 +1142,17 @@ static int core_processing_start() {
 	if (*PTYPE_BOOL_GETVAL(core_param_reset_perf_on_restart))
 		registry_perf_reset_all();
 
+	// Find the datalinks for which the flow can be computed
+	core_proto_ethernet = proto_get("ethernet");
+	core_proto_ipv4 = proto_get("ipv4");
+	core_proto_ipv6 = proto_get("ipv6");
+
+	unsigned int i, j;
+	for (i = 0; i < core_num_threads; i++) {
+		for (j = 0; j < CORE_QUEUE_PRODUCER_MAX; j++)
+			core_processing_threads[i]->rings[j].pkt_total = 0;
+	}
+
 	return POM_OK;
 }
 
@@ -835,6 +1258,42 @@ unsigned int core_get_num_threads() {
 	return core_num_threads;
 }
 
+int core_get_thread_id() {
+	return core_thread_id;
+}
+
+void core_capture_filter_update() {
+	__sync_add_and_fetch(&core_capture_filter_serial, 1);
+}
+
+unsigned int core_capture_filter_get_serial() {
+	return core_capture_filter_serial;
+}
+
+char *core_capture_filter_get() {
+
+	// Every packet may be needed as soon as something is being analyzed
+	if (event_get_listener_count())
+		return NULL;
+
+	char *filter = proto_capture_filter_build();
+	if (!filter)
+		return NULL;
+
+	size_t len = strlen(filter) + strlen(CORE_CAPTURE_FILTER_ENCAP) + 8;
+	char *res = malloc(len);
+	if (!res) {
+		free(filter);
+		pom_oom(len);
+		return NULL;
+	}
+
+	snprintf(res, len, "(%s) or %s", filter, CORE_CAPTURE_FILTER_ENCAP);
+	free(filter);
+
+	return res;
+}
+
 char *core_get_http_admin_password() {
 	char *passwd = PTYPE_STRING_GETVAL(core_param_http_admin_password);
 	if (!strlen(passwd))
@@ -32,29 +32,57 @@
 #define CORE_PROCESS_THREAD_MAX		64
 #define CORE_PROCESS_THREAD_DEFAULT	1
 
-#define CORE_THREAD_PKT_QUEUE_MIN	5
+// Size of each packet ring, must be a power of 2
 #define CORE_THREAD_PKT_QUEUE_MAX	512
+#define CORE_THREAD_PKT_QUEUE_MASK	(CORE_THREAD_PKT_QUEUE_MAX - 1)
+
+// Maximum number of packets dequeued and processed at once by a processing thread
+#define CORE_THREAD_PKT_BATCH_MAX	256
+#define CORE_THREAD_PKT_BATCH_DEFAULT	"32"
+
+// Number of times a processing thread polls its queues before sleeping
+#define CORE_THREAD_SPIN_MAX		2000
+
+// Maximum number of threads queuing packets at the same time
+#define CORE_QUEUE_PRODUCER_MAX		16
+
+#define CORE_CACHE_LINE_SIZE		64
 
 #define CORE_REGISTRY "core"
+
+enum core_pkt_dispatch {
+	core_pkt_dispatch_round_robin = 0, // Queue packets to the first available thread
+	core_pkt_dispatch_flow, // Queue all the packets of a flow to the same thread
+};
+
 enum core_state {
 	core_state_idle = 0, // Core is idle
 	core_state_running, // Core is receiving packets from the input
 	core_state_finishing, // There are still packets in the input
 };
 
-struct core_packet_queue {
-	struct packet *pkt;
-	struct core_packet_queue *next;
+// Single producer, single consumer ring of packets
+struct core_pkt_ring {
+	// Written by the consumer only
+	volatile unsigned int head __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+
+	// Written by the producer only
+	volatile unsigned int tail __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+	uint64_t pkt_total; // Total number of packets queued in this ring
+
+	struct packet *pkts[CORE_THREAD_PKT_QUEUE_MAX] __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
 };
 
 struct core_processing_thread {
+	// One ring per thread queuing packets
+	struct core_pkt_ring rings[CORE_QUEUE_PRODUCER_MAX];
+
 	pthread_t thread;
 	unsigned int thread_id;
-	unsigned int pkt_count;
+	unsigned int next_ring; // Next ring to dequeue from
+	volatile int sleeping; // Set when the thread waits for packets
 	pthread_mutex_t pkt_queue_lock;
 	pthread_cond_t pkt_queue_cond;
-	struct core_packet_queue *pkt_queue_head, *pkt_queue_tail; // Thread's own queue
-	struct core_packet_queue *pkt_queue_unused;
 
 };
 
@@ -79,7 +107,14 @@ void core_resume_processing();
 
 struct registry_perf *core_add_perf(const char *name, enum registry_perf_type type, const char *description, const char *unit);
 
-unsigned int core_get_num_threads();
+
+// Packets that may hide the real protocols from a BPF filter and must always be captured
+#define CORE_CAPTURE_FILTER_ENCAP \
+	"(ip and (ip[6:2] & 0x3fff != 0 or ip proto 4 or ip proto 41 or ip proto 47)) or " \
+	"(ip6 and not (ip6 proto 6 or ip6 proto 17 or ip6 proto 58)) or " \
+	"ether proto 0x8847 or ether proto 0x8848 or ether proto 0x8863 or ether proto 0x8864 or vlan"
+
+void core_capture_filter_update();
 
 char *core_get_http_admin_password();
 
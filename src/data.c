@@ -78,6 +78,46 @@ void data_cleanup_table(struct data *d, struct data_reg *d_reg) {
 
 }
 
+// Reset a table to its state after data_alloc_table() while keeping the ptypes it owns
+int data_reset_table(struct data *d, struct data_reg *d_reg) {
+
+	int i;
+
+	for (i = 0; i < d_reg->data_count; i++) {
+
+		if (d_reg->items[i].flags & DATA_REG_FLAG_NO_ALLOC) {
+			if (!(d[i].flags & DATA_FLAG_NO_CLEAN))
+				ptype_cleanup(d[i].value);
+			d[i].value = NULL;
+			d[i].flags = DATA_FLAG_NO_CLEAN;
+		} else if (d_reg->items[i].flags & DATA_REG_FLAG_LIST) {
+			if (!(d[i].flags & DATA_FLAG_NO_CLEAN)) {
+				struct data_item *item = d[i].items;
+				while (item) {
+					struct data_item *tmp = item->next;
+					free(item->key);
+					ptype_cleanup(item->value);
+					free(item);
+					item = tmp;
+				}
+			}
+			d[i].items = NULL;
+			d[i].flags = 0;
+		} else if (d[i].flags & DATA_FLAG_NO_CLEAN) {
+			// The value was replaced by one we don't own
+			d[i].value = ptype_alloc_from_type(d_reg->items[i].value_type);
+			if (!d[i].value)
+				return POM_ERR; // Still flagged as not to be cleaned up
+			d[i].flags = 0;
+		} else {
+			// Only the flag needs to be reset, the value is overwritten when set again
+			d[i].flags = 0;
+		}
+	}
+
+	return POM_OK;
+}
+
 struct ptype *data_item_add(struct data *d, struct data_reg *d_reg, unsigned int data_id, const char *key) {
 
 	struct ptype *value = ptype_alloc_from_type(d_reg->items[data_id].value_type);
@@ -44,10 +44,22 @@
 
 static struct ptype_reg *ptype_string = NULL;
 
-static pthread_mutex_t dns_table_lock = PTHREAD_MUTEX_INITIALIZER;
+// Each lock protects the buckets whose index modulo DNS_TABLE_LOCK_COUNT is the lock index
+// and the entries in them. The table itself can only be resized while holding all of them.
+struct dns_table_lock {
+	pthread_rwlock_t lock;
+} __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+
+static struct dns_table_lock dns_table_locks[DNS_TABLE_LOCK_COUNT];
+
+// Protects the expiry queues as well as the expiry of the entries
+static pthread_mutex_t dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct event_reg *dns_record_evt = NULL;
-static struct dns_entry **dns_table;
+static struct dns_entry **dns_table = NULL;
+static unsigned int dns_table_size = 0;
+static unsigned int dns_table_resizing = 0;
+static unsigned int dns_entry_count = 0;
 
 static struct timer *dns_gc_run = NULL;
 
@@ -57,6 +69,9 @@ static int dns_enabled = 0;
 
 #define DNS_ADDITIONAL_TIMEOUT	300
 
+// The garbage collector doesn't run more often than this, no need to requeue entries for less
+#define DNS_EXPIRY_GRANULARITY	(DNS_GARBAGE_COLLECTOR_TIMEOUT * 1000000UL)
+
 static uint32_t dns_cache_queues_time[DNS_CACHE_QUEUE_COUNT] = {
 	// Based on distribution observed in real life
 	// See https://00f.net/2012/05/10/distribution-of-dns-ttls/
@@ -75,6 +90,10 @@ static uint32_t dns_cache_queues_time[DNS_CACHE_QUEUE_COUNT] = {
 static struct dns_entry *dns_cache_queues_head[DNS_CACHE_QUEUE_COUNT] = { 0 };
 static struct dns_entry *dns_cache_queues_tail[DNS_CACHE_QUEUE_COUNT] = { 0 };
 static struct registry_perf *dns_perf_cached_records = NULL;
+static struct registry_perf *dns_perf_cache_hits = NULL;
+static struct registry_perf *dns_perf_cache_misses = NULL;
+static struct registry_perf *dns_perf_cache_evictions = NULL;
+static struct registry_perf *dns_perf_table_size = NULL;
 
 
 #ifdef DEBUG_DNS
@@ -117,12 +136,67 @@ err:
 #endif
 
 int dns_init() {
+
 	dns_perf_cached_records = core_add_perf("dns_cached_records", registry_perf_type_gauge, "Number of cached DNS records", "records");
-	if (!dns_perf_cached_records)
+	dns_perf_cache_hits = core_add_perf("dns_cache_hits", registry_perf_type_counter, "Number of DNS lookups found in the cache", "lookups");
+	dns_perf_cache_misses = core_add_perf("dns_cache_misses", registry_perf_type_counter, "Number of DNS lookups not found in the cache", "lookups");
+	dns_perf_cache_evictions = core_add_perf("dns_cache_evictions", registry_perf_type_counter, "Number of expired DNS records removed from the cache", "records");
+	dns_perf_table_size = core_add_perf("dns_table_size", registry_perf_type_gauge, "Number of buckets in the DNS cache hash table", "buckets");
+	if (!dns_perf_cached_records || !dns_perf_cache_hits || !dns_perf_cache_misses || !dns_perf_cache_evictions || !dns_perf_table_size)
 		return POM_ERR;
+
+	unsigned int i;
+	for (i = 0; i < DNS_TABLE_LOCK_COUNT; i++) {
+		if (pthread_rwlock_init(&dns_table_locks[i].lock, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing the DNS table lock : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+	}
+
 	return POM_OK;
 }
 
+static void dns_table_lock_all() {
+
+	unsigned int i;
+	for (i = 0; i < DNS_TABLE_LOCK_COUNT; i++)
+		pom_rwlock_wlock(&dns_table_locks[i].lock);
+}
+
+static void dns_table_unlock_all() {
+
+	int i;
+	for (i = DNS_TABLE_LOCK_COUNT - 1; i >= 0; i--)
+		pom_rwlock_unlock(&dns_table_locks[i].lock);
+}
+
+static void dns_table_lock_pair(uint32_t hash_a, uint32_t hash_b) {
+
+	// Always lock in the same order to avoid deadlocks
+	unsigned int a = hash_a & (DNS_TABLE_LOCK_COUNT - 1);
+	unsigned int b = hash_b & (DNS_TABLE_LOCK_COUNT - 1);
+
+	if (a > b) {
+		unsigned int tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	pom_rwlock_wlock(&dns_table_locks[a].lock);
+	if (a != b)
+		pom_rwlock_wlock(&dns_table_locks[b].lock);
+}
+
+static void dns_table_unlock_pair(uint32_t hash_a, uint32_t hash_b) {
+
+	unsigned int a = hash_a & (DNS_TABLE_LOCK_COUNT - 1);
+	unsigned int b = hash_b & (DNS_TABLE_LOCK_COUNT - 1);
+
+	pom_rwlock_unlock(&dns_table_locks[a].lock);
+	if (a != b)
+		pom_rwlock_unlock(&dns_table_locks[b].lock);
+}
+
 int dns_core_init() {
 
 	if (!ptype_string)
@@ -131,14 +205,17 @@ int dns_core_init() {
 	if (!ptype_string)
 		return POM_ERR;
 
-	size_t dns_table_size = sizeof(struct dns_entry*) * DNS_TABLE_DEFAULT_SIZE;
+	size_t table_size = sizeof(struct dns_entry*) * DNS_TABLE_DEFAULT_SIZE;
 
-	dns_table = malloc(dns_table_size);
+	dns_table = malloc(table_size);
 	if (!dns_table) {
-		pom_oom(dns_table_size);
+		pom_oom(table_size);
 		return POM_ERR;
 	}
-	memset(dns_table, 0, dns_table_size);
+	memset(dns_table, 0, table_size);
+	dns_table_size = DNS_TABLE_DEFAULT_SIZE;
+	registry_perf_reset(dns_perf_table_size);
+	registry_perf_inc(dns_perf_table_size, dns_table_size);
 	
 	dns_gc_run = timer_alloc(NULL, dns_gc);
 	if (!dns_gc_run)
@@ -150,7 +227,8 @@ int dns_core_init() {
 		goto err;
 	}
 
-	if (event_listener_register(dns_record_evt, dns_table, NULL, dns_process_event) != POM_OK) {
+	// The table can be reallocated, use the address of its pointer to identify the listener
+	if (event_listener_register(dns_record_evt, &dns_table, NULL, dns_process_event) != POM_OK) {
 		pomlog(POMLOG_ERR "Unable to listen to event dns_record");
 		goto err;
 	}
@@ -163,6 +241,8 @@ int dns_core_init() {
 
 err:
 	free(dns_table);
+	dns_table = NULL;
+	dns_table_size = 0;
 
 	if (dns_gc_run)
 		timer_cleanup(dns_gc_run);
@@ -175,10 +255,10 @@ int dns_core_cleanup() {
 	if (!dns_record_evt)
 		return POM_OK;
 
-	event_listener_unregister(dns_record_evt, dns_table);
+	event_listener_unregister(dns_record_evt, &dns_table);
 
 	unsigned int i;
-	for (i = 0; i < DNS_TABLE_DEFAULT_SIZE; i++) {
+	for (i = 0; i < dns_table_size; i++) {
 		while (dns_table[i]) {
 			struct dns_entry *tmp = dns_table[i];
 
@@ -196,6 +276,7 @@ int dns_core_cleanup() {
 
 			dns_table[i] = tmp->next;
 			free(tmp->record);
+			free(tmp->origin);
 			free(tmp);
 			registry_perf_dec(dns_perf_cached_records, 1);
 		}
@@ -206,6 +287,9 @@ int dns_core_cleanup() {
 		dns_cache_queues_tail[i] = NULL;
 	}
 	free(dns_table);
+	dns_table = NULL;
+	dns_table_size = 0;
+	dns_entry_count = 0;
 
 	timer_cleanup(dns_gc_run);
 
@@ -215,13 +299,104 @@ int dns_core_cleanup() {
 }
 
 
-uint32_t dns_record_hash(const char *record) {
-	return jhash(record, strlen(record), INITVAL) % DNS_TABLE_DEFAULT_SIZE;
+static uint32_t dns_record_hash(const char *record) {
+	return jhash(record, strlen(record), INITVAL);
+}
+
+static const char *dns_record_str(struct ptype *record_pt, char *buff, size_t len) {
+
+	if (record_pt->type == ptype_string)
+		return PTYPE_STRING_GETVAL(record_pt);
+
+	ptype_print_val(record_pt, buff, len, NULL);
+	return buff;
+}
+
+// Must be called with all the table locks held
+static int dns_table_rehash(unsigned int new_size) {
+
+	size_t table_size = sizeof(struct dns_entry*) * new_size;
+	struct dns_entry **new_table = malloc(table_size);
+	if (!new_table) {
+		pom_oom(table_size);
+		return POM_ERR;
+	}
+	memset(new_table, 0, table_size);
+
+	unsigned int i;
+	for (i = 0; i < dns_table_size; i++) {
+		while (dns_table[i]) {
+			struct dns_entry *entry = dns_table[i];
+			dns_table[i] = entry->next;
+
+			uint32_t bucket = entry->hash & (new_size - 1);
+			entry->prev = NULL;
+			entry->next = new_table[bucket];
+			if (entry->next)
+				entry->next->prev = entry;
+			new_table[bucket] = entry;
+		}
+	}
+
+	debug_dns("DNS table resized from %u to %u buckets", dns_table_size, new_size);
+
+	free(dns_table);
+	dns_table = new_table;
+
+	if (new_size > dns_table_size)
+		registry_perf_inc(dns_perf_table_size, new_size - dns_table_size);
+	else
+		registry_perf_dec(dns_perf_table_size, dns_table_size - new_size);
+	dns_table_size = new_size;
+
+	return POM_OK;
+}
+
+static void dns_table_grow() {
+
+	// Only one thread needs to do it
+	if (!__sync_bool_compare_and_swap(&dns_table_resizing, 0, 1))
+		return;
+
+	dns_table_lock_all();
+
+	if (dns_entry_count > dns_table_size * DNS_TABLE_MAX_LOAD && dns_table_size < DNS_TABLE_MAX_SIZE)
+		dns_table_rehash(dns_table_size * 2);
+
+	dns_table_unlock_all();
+
+	__sync_lock_release(&dns_table_resizing);
+}
+
+// Must be called with the lock of the entry and the query held
+static int dns_entry_set_origin(struct dns_entry *entry, struct dns_entry *query) {
+
+	if (!query) {
+		free(entry->origin);
+		entry->origin = NULL;
+		return POM_OK;
+	}
+
+	char *origin = (query->origin ? query->origin : query->record);
+	if (entry->origin && !strcmp(entry->origin, origin))
+		return POM_OK;
+
+	char *tmp = strdup(origin);
+	if (!tmp) {
+		pom_oom(strlen(origin) + 1);
+		return POM_ERR;
+	}
+
+	free(entry->origin);
+	entry->origin = tmp;
+
+	return POM_OK;
 }
 
 int dns_gc(void *priv, ptime now) {
 
-	pom_mutex_lock(&dns_table_lock);
+	// Entries reference each other across buckets, lock the whole table
+	dns_table_lock_all();
 
 	int i;
 	for (i = 0; i < DNS_CACHE_QUEUE_COUNT; i++) {
@@ -247,7 +422,7 @@ int dns_gc(void *priv, ptime now) {
 				struct dns_entry_list *tmp_value;
 				for (tmp_value = query->values; tmp_value && tmp_value->entry != entry; tmp_value = tmp_value->next);
 				if (!tmp_value) {
-					pom_mutex_unlock(&dns_table_lock);
+					dns_table_unlock_all();
 					pomlog(POMLOG_ERR "Value of the query not found");
 					return POM_ERR;
 				}
@@ -276,7 +451,7 @@ int dns_gc(void *priv, ptime now) {
 				struct dns_entry_list *tmp_query;
 				for (tmp_query = value->query; tmp_query && tmp_query->entry != entry; tmp_query = tmp_query->next);
 				if (!tmp_query) {
-					pom_mutex_unlock(&dns_table_lock);
+					dns_table_unlock_all();
 					pomlog(POMLOG_ERR "Query of the value not found");
 					return POM_ERR;
 				}
@@ -291,6 +466,8 @@ int dns_gc(void *priv, ptime now) {
 
 				free(tmp_query);
 
+				// Resolve the value from the most recent query left
+				dns_entry_set_origin(value, (value->query ? value->query->entry : NULL));
 
 				struct dns_entry_list *tmp = entry->values;
 				entry->values = tmp->next;
@@ -304,22 +481,32 @@ int dns_gc(void *priv, ptime now) {
 			if (entry->prev) {
 				entry->prev->next = entry->next;
 			} else {
-				uint32_t hash = dns_record_hash(entry->record);
-				dns_table[hash] = entry->next;
+				dns_table[entry->hash & (dns_table_size - 1)] = entry->next;
 			}
 
 			// Now cleanup the entry itself
 			free(entry->record);
+			free(entry->origin);
 			free(entry);
 
+			__sync_fetch_and_sub(&dns_entry_count, 1);
 			registry_perf_dec(dns_perf_cached_records, 1);
+			registry_perf_inc(dns_perf_cache_evictions, 1);
 		}
 
 	}
 
 	dns_check_cache();
 
-	pom_mutex_unlock(&dns_table_lock);
+	// Shrink the table back if it's mostly empty
+	unsigned int new_size = dns_table_size;
+	while (new_size > DNS_TABLE_DEFAULT_SIZE && dns_entry_count < (new_size / 8))
+		new_size /= 2;
+
+	if (new_size != dns_table_size)
+		dns_table_rehash(new_size);
+
+	dns_table_unlock_all();
 
 	// Requeue the timer
 	timer_queue(dns_gc_run, DNS_GARBAGE_COLLECTOR_TIMEOUT);
@@ -327,26 +514,27 @@ int dns_gc(void *priv, ptime now) {
 	return POM_OK;
 }
 
-struct dns_entry *dns_find_or_add_entry(struct ptype *record_pt) {
-
-	char *record = NULL;
-	char buff[40] = { 0 };
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		// 40 is the max size of an ipv6 address
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
-	}
-	uint32_t hash = dns_record_hash(record);
+// Must be called with the lock of the hash held
+static struct dns_entry *dns_find_entry(const char *record, uint32_t hash) {
 
 	struct dns_entry *entry;
-
-	for (entry = dns_table[hash]; entry; entry = entry->next) {
-		if (!strcmp(entry->record, record))
+	
+	for (entry = dns_table[hash & (dns_table_size - 1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && !strcmp(entry->record, record))
 			break;
 	}
 
+	debug_dns("Entry for %s is %p", record, entry);
+
+	return entry;
+
+}
+
+// Must be called with the lock of the hash held
+static struct dns_entry *dns_find_or_add_entry(const char *record, uint32_t hash) {
+
+	struct dns_entry *entry = dns_find_entry(record, hash);
+
 	if (entry)
 		return entry;
 
@@ -363,27 +551,34 @@ struct dns_entry *dns_find_or_add_entry(struct ptype *record_pt) {
 		pom_oom(strlen(record) + 1);
 		return NULL;
 	}
-	entry->next = dns_table[hash];
+	entry->hash = hash;
+
+	uint32_t bucket = hash & (dns_table_size - 1);
+	entry->next = dns_table[bucket];
 	if (entry->next)
 		entry->next->prev = entry;
-	dns_table[hash] = entry;
+	dns_table[bucket] = entry;
 
+	__sync_fetch_and_add(&dns_entry_count, 1);
 	registry_perf_inc(dns_perf_cached_records, 1);
 
 	return entry;
 }
 
+// Must be called with the lock of both entries held
 static int dns_update_expiry(struct dns_entry *a, struct dns_entry *b, uint32_t ttl) {
 
 	ptime now = core_get_clock(&now);
 
 	ptime expiry = now + ((ttl + DNS_ADDITIONAL_TIMEOUT) * 1000000UL);
 
-	if (a->expiry >= expiry) {
+	// Most records are seen again well before they expire, leave them alone
+	// unless it moves their expiry further than the garbage collector can see
+	if (a->expiry + DNS_EXPIRY_GRANULARITY >= expiry) {
 		a = NULL;
 	}
 
-	if (b->expiry >= expiry) {
+	if (b->expiry + DNS_EXPIRY_GRANULARITY >= expiry) {
 		b = NULL;
 	} else if (!a) {
 		a = b;
@@ -394,6 +589,8 @@ static int dns_update_expiry(struct dns_entry *a, struct dns_entry *b, uint32_t
 	if (!a)
 		return POM_OK;
 
+	pom_mutex_lock(&dns_cache_lock);
+
 	// Remove a from the cache
 	if (a->expiry) {
 		if (a->cache_prev) {
@@ -472,6 +669,9 @@ static int dns_update_expiry(struct dns_entry *a, struct dns_entry *b, uint32_t
 		b->expiry = expiry;
 	}
 
+	dns_check_cache();
+
+	pom_mutex_unlock(&dns_cache_lock);
 
 	return POM_OK;
 }
@@ -504,36 +704,35 @@ int dns_process_event(struct event *evt, void *obj) {
 	if (ttl > DNS_TTL_MAX) // Restrict TTL to a maximum value
 		ttl = DNS_TTL_MAX;
 
-	pom_mutex_lock(&dns_table_lock);
+	// 40 is the max size of an ipv6 address
+	char query_buff[40] = { 0 }, response_buff[40] = { 0 };
+	const char *query_str = dns_record_str(evt_data[analyzer_dns_record_name].value, query_buff, sizeof(query_buff));
+	const char *response_str = dns_record_str(record, response_buff, sizeof(response_buff));
 
-	struct dns_entry *query = dns_find_or_add_entry(evt_data[analyzer_dns_record_name].value);
-	if (!query) {
-		pom_mutex_unlock(&dns_table_lock);
-		return POM_ERR;
-	}
+	uint32_t query_hash = dns_record_hash(query_str);
+	uint32_t response_hash = dns_record_hash(response_str);
 
-	struct dns_entry *response = dns_find_or_add_entry(record);
-	if (!response) {
-		pom_mutex_unlock(&dns_table_lock);
-		return POM_ERR;
-	}
+	dns_table_lock_pair(query_hash, response_hash);
+
+	struct dns_entry *query = dns_find_or_add_entry(query_str, query_hash);
+	if (!query)
+		goto err;
+
+	struct dns_entry *response = dns_find_or_add_entry(response_str, response_hash);
+	if (!response)
+		goto err;
 
 	// Update expiration queues with those entries
 	if (dns_update_expiry(query, response, ttl) != POM_OK)
-		return POM_ERR;
-		
-	dns_check_cache();
+		goto err;
 
 	// Check if the response already has this entry
 	
 	struct dns_entry_list *lst;
-	for (lst = response->query; lst; lst = lst->next) {
-		if (!strcmp(lst->entry->record, query->record))
-			break;
-	}
+	for (lst = response->query; lst && lst->entry != query; lst = lst->next);
 
 	if (lst) { // The response is already associated with the query
-		pom_mutex_unlock(&dns_table_lock);
+		dns_table_unlock_pair(query_hash, response_hash);
 		return POM_OK;
 	}
 	
@@ -543,18 +742,16 @@ int dns_process_event(struct event *evt, void *obj) {
 	struct dns_entry_list *fwd = NULL, *rev = NULL;
 	fwd = malloc(sizeof(struct dns_entry_list));
 	if (!fwd) {
-		pom_mutex_unlock(&dns_table_lock);
 		pom_oom(sizeof(struct dns_entry_list));
-		return POM_ERR;
+		goto err;
 	}
 	memset(fwd, 0, sizeof(struct dns_entry_list));
 
 	rev = malloc(sizeof(struct dns_entry_list));
 	if (!rev) {
-		pom_mutex_unlock(&dns_table_lock);
 		free(fwd);
 		pom_oom(sizeof(struct dns_entry_list));
-		return POM_ERR;
+		goto err;
 	}
 	memset(rev, 0, sizeof(struct dns_entry_list));
 
@@ -570,26 +767,19 @@ int dns_process_event(struct event *evt, void *obj) {
 		rev->next->prev = rev;
 	response->query = rev;
 
-	pom_mutex_unlock(&dns_table_lock);
-	
-	return POM_OK;
-}
+	// Keep where the response comes from so reverse lookups don't have to follow the chain
+	dns_entry_set_origin(response, query);
 
-static struct dns_entry *dns_find_entry(const char *record) {
+	dns_table_unlock_pair(query_hash, response_hash);
 
-	uint32_t hash = dns_record_hash(record);
-
-	struct dns_entry *entry = dns_table[hash];
+	if (dns_entry_count > dns_table_size * DNS_TABLE_MAX_LOAD && dns_table_size < DNS_TABLE_MAX_SIZE)
+		dns_table_grow();
 	
-	for (entry = dns_table[hash]; entry; entry = entry->next) {
-		if (!strcmp(entry->record, record))
-			break;
-	}
-
-	debug_dns("Entry for %s is %p", record, entry);
-
-	return entry;
+	return POM_OK;
 
+err:
+	dns_table_unlock_pair(query_hash, response_hash);
+	return POM_ERR;
 }
 
 char* dns_forward_lookup(const char *record) {
@@ -597,23 +787,47 @@ char* dns_forward_lookup(const char *record) {
 	if (!dns_enabled)
 		return NULL;
 
-	pom_mutex_lock(&dns_table_lock);
-	
-	struct dns_entry *entry = dns_find_entry(record);
+	// Entries in other buckets can only be accessed with their own lock
+	// Copy the name of the next value before moving to it
+	char name[NS_MAXDNAME] = { 0 };
+	strncpy(name, record, sizeof(name) - 1);
+
+	uint32_t hash = dns_record_hash(name);
+	pthread_rwlock_t *lock = &dns_table_locks[hash & (DNS_TABLE_LOCK_COUNT - 1)].lock;
+	pom_rwlock_rlock(lock);
+
+	struct dns_entry *entry = dns_find_entry(name, hash);
 	
 	if (!entry) {
-		pom_mutex_unlock(&dns_table_lock);
+		pom_rwlock_unlock(lock);
+		registry_perf_inc(dns_perf_cache_misses, 1);
 		return NULL;
 	}
 
 	int i;
-	for (i = 0; entry && entry->values && i < DNS_MAX_LOOKUP_DEPTH; i++, entry = entry->values->entry);
+	for (i = 0; entry->values && i < DNS_MAX_LOOKUP_DEPTH; i++) {
 
-	char *res = NULL;
-	if (entry)
-		res = strdup(entry->record);
+		struct dns_entry *value = entry->values->entry;
+		if (strlen(value->record) >= sizeof(name))
+			break;
+		strcpy(name, value->record);
+		hash = value->hash;
 
-	pom_mutex_unlock(&dns_table_lock);
+		pom_rwlock_unlock(lock);
+		lock = &dns_table_locks[hash & (DNS_TABLE_LOCK_COUNT - 1)].lock;
+		pom_rwlock_rlock(lock);
+
+		// The value may have expired in the mean time
+		entry = dns_find_entry(name, hash);
+		if (!entry)
+			break;
+	}
+
+	char *res = strdup(entry ? entry->record : name);
+
+	pom_rwlock_unlock(lock);
+
+	registry_perf_inc(dns_perf_cache_hits, 1);
 
 	return res;
 }
@@ -622,23 +836,45 @@ char* dns_reverse_lookup(const char *record) {
 	if (!dns_enabled)
 		return NULL;
 
-	pom_mutex_lock(&dns_table_lock);
+	char name[NS_MAXDNAME] = { 0 };
+	strncpy(name, record, sizeof(name) - 1);
 
-	struct dns_entry *entry = dns_find_entry(record);
+	uint32_t hash = dns_record_hash(name);
+	pthread_rwlock_t *lock = &dns_table_locks[hash & (DNS_TABLE_LOCK_COUNT - 1)].lock;
+	pom_rwlock_rlock(lock);
+
+	struct dns_entry *entry = dns_find_entry(name, hash);
 	
 	if (!entry) {
-		pom_mutex_unlock(&dns_table_lock);
+		pom_rwlock_unlock(lock);
+		registry_perf_inc(dns_perf_cache_misses, 1);
 		return NULL;
 	}
 
+	// The origin is usually the name that was queried. It only needs to be
+	// followed further when that name was itself resolved after its values
 	int i;
-	for (i = 0; entry && entry->query && i < DNS_MAX_LOOKUP_DEPTH; i++, entry = entry->query->entry);
+	for (i = 0; entry->origin && i < DNS_MAX_LOOKUP_DEPTH; i++) {
 
-	char *res = NULL;
-	if (entry)
-		res = strdup(entry->record);
+		if (strlen(entry->origin) >= sizeof(name))
+			break;
+		strcpy(name, entry->origin);
+		hash = dns_record_hash(name);
+
+		pom_rwlock_unlock(lock);
+		lock = &dns_table_locks[hash & (DNS_TABLE_LOCK_COUNT - 1)].lock;
+		pom_rwlock_rlock(lock);
 
-	pom_mutex_unlock(&dns_table_lock);
+		entry = dns_find_entry(name, hash);
+		if (!entry)
+			break;
+	}
+
+	char *res = strdup(entry ? entry->record : name);
+
+	pom_rwlock_unlock(lock);
+
+	registry_perf_inc(dns_perf_cache_hits, 1);
 
 	return res;
 }
@@ -650,14 +886,7 @@ char *dns_forward_lookup_ptype(struct ptype *record_pt) {
 
 	// 40 is the max size of an ipv6 address
 	char buff[40] = { 0 };
-	char *record = NULL;
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
-	}
-	return dns_forward_lookup(record);
+	return dns_forward_lookup(dns_record_str(record_pt, buff, sizeof(buff)));
 }
 
 char *dns_reverse_lookup_ptype(struct ptype *record_pt) {
@@ -667,12 +896,5 @@ char *dns_reverse_lookup_ptype(struct ptype *record_pt) {
 
 	// 40 is the max size of an ipv6 address
 	char buff[40] = { 0 };
-	char *record = NULL;
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
-	}
-	return dns_reverse_lookup(record);
+	return dns_reverse_lookup(dns_record_str(record_pt, buff, sizeof(buff)));
 }
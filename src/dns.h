@@ -22,8 +22,18 @@
 #ifndef __DNS_H__
 #define __DNS_H__
 
+// Initial size of the hash table, must be a power of 2
 #define DNS_TABLE_DEFAULT_SIZE 16384
 
+// Maximum size the hash table can grow to
+#define DNS_TABLE_MAX_SIZE (1 << 22)
+
+// Grow the table when the average chain length goes over this value
+#define DNS_TABLE_MAX_LOAD 2
+
+// Number of locks protecting the table, must be a power of 2 smaller than the table
+#define DNS_TABLE_LOCK_COUNT 64
+
 #define DNS_GARBAGE_COLLECTOR_TIMEOUT 60
 
 // Maximum lookup depth
@@ -45,8 +55,12 @@ struct dns_entry_list {
 struct dns_entry {
 
 	char *record;
+	uint32_t hash;
 	ptime expiry;
 
+	// Name from which this record was resolved, used for reverse lookups
+	char *origin;
+
 	// Query for which this record is a value
 	struct dns_entry_list *query;
 
@@ -23,6 +23,7 @@
 #include <pom-ng/event.h>
 #include "event.h"
 #include "registry.h"
+#include "core.h"
 
 #if 0
 #define debug_event(x ...) pomlog(POMLOG_DEBUG x)
@@ -34,8 +35,14 @@ static struct event_reg *event_reg_head = NULL;
 
 static unsigned int event_pload_listener_ref = 0;
 
+// Total number of event listeners, nothing is analyzed when there is none
+static unsigned int event_listener_count = 0;
+
 static struct registry_class *event_registry_class = NULL;
 
+// Queue given to the listeners registered by this thread
+static __thread struct event_queue *event_listener_queue = NULL;
+
 int event_init() {
 
 	event_registry_class = registry_add_class(EVENT_REGISTRY);
@@ -61,6 +68,88 @@ int event_finish() {
 }
 
 
+static void event_pool_free(struct event_reg *evt_reg, struct event *head) {
+
+	while (head) {
+		struct event *evt = head;
+		head = evt->pool_next;
+		data_cleanup_table(evt->data, evt_reg->info->data_reg);
+		free(evt);
+	}
+}
+
+// Get a free event from the pool of the current thread or from the shared one
+static struct event *event_pool_get(struct event_reg *evt_reg) {
+
+	int id = core_get_thread_id();
+	if (id < 0)
+		return NULL;
+
+	struct event_pool *pool = &evt_reg->pools[id];
+	struct event *evt = pool->head;
+
+	if (evt) {
+		pool->head = evt->pool_next;
+		pool->count--;
+	} else if (evt_reg->pool_shared_count) {
+		// Racy check above to avoid locking when the shared pool is empty
+		pom_mutex_lock(&evt_reg->pool_shared_lock);
+		evt = evt_reg->pool_shared;
+		if (evt) {
+			evt_reg->pool_shared = evt->pool_next;
+			evt_reg->pool_shared_count--;
+		}
+		pom_mutex_unlock(&evt_reg->pool_shared_lock);
+	}
+
+	if (!evt)
+		return NULL;
+
+	evt->pool_next = NULL;
+	registry_perf_dec(evt_reg->perf_pool_size, 1);
+
+	return evt;
+}
+
+// Give an event back to a pool, returns POM_ERR if the event must be freed instead
+static int event_pool_release(struct event *evt) {
+
+	struct event_reg *evt_reg = evt->reg;
+
+	if (data_reset_table(evt->data, evt_reg->info->data_reg) != POM_OK)
+		return POM_ERR;
+
+	// Only keep the fields that don't change
+	struct data *data = evt->data;
+	memset(evt, 0, sizeof(struct event));
+	evt->reg = evt_reg;
+	evt->data = data;
+
+	int id = core_get_thread_id();
+	if (id >= 0) {
+		struct event_pool *pool = &evt_reg->pools[id];
+		if (pool->count >= EVENT_POOL_THREAD_MAX)
+			return POM_ERR;
+		evt->pool_next = pool->head;
+		pool->head = evt;
+		pool->count++;
+	} else {
+		pom_mutex_lock(&evt_reg->pool_shared_lock);
+		if (evt_reg->pool_shared_count >= EVENT_POOL_SHARED_MAX) {
+			pom_mutex_unlock(&evt_reg->pool_shared_lock);
+			return POM_ERR;
+		}
+		evt->pool_next = evt_reg->pool_shared;
+		evt_reg->pool_shared = evt;
+		evt_reg->pool_shared_count++;
+		pom_mutex_unlock(&evt_reg->pool_shared_lock);
+	}
+
+	registry_perf_inc(evt_reg->perf_pool_size, 1);
+
+	return POM_OK;
+}
+
 struct event_reg *event_register(struct event_reg_info *reg_info) {
 
 	struct event_reg *evt;
@@ -96,7 +185,27 @@ struct event_reg *event_register(struct event_reg_info *reg_info) {
 	evt->perf_listeners = registry_instance_add_perf(evt->reg_instance, "listeners", registry_perf_type_gauge, "Number of event listeners", "listeners");
 	evt->perf_ongoing = registry_instance_add_perf(evt->reg_instance, "ongoing", registry_perf_type_gauge, "Number of ongoing events", "events");
 	evt->perf_processed = registry_instance_add_perf(evt->reg_instance, "processed", registry_perf_type_counter, "Number of events fully processed", "events");
-	if (!evt->perf_listeners || !evt->perf_ongoing || !evt->perf_processed) {
+	evt->perf_pool_size = registry_instance_add_perf(evt->reg_instance, "pool_size", registry_perf_type_gauge, "Number of free events kept for reuse", "events");
+	evt->perf_pool_hits = registry_instance_add_perf(evt->reg_instance, "pool_hits", registry_perf_type_counter, "Number of events reused from the pool", "events");
+	evt->perf_pool_misses = registry_instance_add_perf(evt->reg_instance, "pool_misses", registry_perf_type_counter, "Number of events allocated because the pool was empty", "events");
+	if (!evt->perf_listeners || !evt->perf_ongoing || !evt->perf_processed || !evt->perf_pool_size || !evt->perf_pool_hits || !evt->perf_pool_misses) {
+		registry_remove_instance(evt->reg_instance);
+		free(evt);
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&evt->pools, CORE_CACHE_LINE_SIZE, sizeof(struct event_pool) * CORE_PROCESS_THREAD_MAX)) {
+		pom_oom(sizeof(struct event_pool) * CORE_PROCESS_THREAD_MAX);
+		registry_remove_instance(evt->reg_instance);
+		free(evt);
+		return NULL;
+	}
+	memset(evt->pools, 0, sizeof(struct event_pool) * CORE_PROCESS_THREAD_MAX);
+
+	res = pthread_mutex_init(&evt->pool_shared_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the event pool lock : %s", pom_strerror(res));
+		free(evt->pools);
 		registry_remove_instance(evt->reg_instance);
 		free(evt);
 		return NULL;
@@ -130,6 +239,16 @@ int event_unregister(struct event_reg *evt) {
 	if (res)
 		pomlog(POMLOG_WARN "Error while destroying event listeners lock : %s", pom_strerror(res));
 
+	unsigned int i;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++)
+		event_pool_free(evt, evt->pools[i].head);
+	free(evt->pools);
+
+	event_pool_free(evt, evt->pool_shared);
+	res = pthread_mutex_destroy(&evt->pool_shared_lock);
+	if (res)
+		pomlog(POMLOG_WARN "Error while destroying event pool lock : %s", pom_strerror(res));
+
 	free(evt);
 
 	return POM_OK;
@@ -137,7 +256,15 @@ int event_unregister(struct event_reg *evt) {
 
 struct event *event_alloc(struct event_reg *evt_reg) {
 
-	struct event *evt = malloc(sizeof(struct event));
+	struct event *evt = event_pool_get(evt_reg);
+	if (evt) {
+		registry_perf_inc(evt_reg->perf_pool_hits, 1);
+		debug_event("Event %s reused", evt_reg->info->name);
+		return evt;
+	}
+	registry_perf_inc(evt_reg->perf_pool_misses, 1);
+
+	evt = malloc(sizeof(struct event));
 	if (!evt) {
 		pom_oom(sizeof(struct event));
 		return NULL;
@@ -182,8 +309,11 @@ int event_cleanup(struct event *evt) {
 		free(lst);
 	}
 
-	data_cleanup_table(evt->data, evt->reg->info->data_reg);
-	free(evt);
+	if (event_pool_release(evt) != POM_OK) {
+		data_cleanup_table(evt->data, evt->reg->info->data_reg);
+		free(evt);
+	}
+
 	return POM_OK;
 }
 
@@ -241,6 +371,268 @@ int event_payload_listen_stop() {
 	return POM_OK;
 }
 
+static void *event_queue_thread_func(void *priv) {
+
+	struct event_queue_thread *t = priv;
+	struct event_queue *q = t->q;
+
+	pom_mutex_lock(&q->lock);
+
+	while (1) {
+
+		while (!q->count && !q->stop)
+			pthread_cond_wait(&q->cond_pop, &q->lock);
+
+		if (!q->count)
+			break;
+
+		struct event_queue_item item = q->items[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		t->obj = item.obj;
+		pthread_cond_broadcast(&q->cond_push);
+		pom_mutex_unlock(&q->lock);
+
+		registry_perf_dec(q->perf_depth, 1);
+
+		if (item.process_end(item.evt, item.obj) != POM_OK)
+			pomlog(POMLOG_WARN "An error occured while processing event %s", item.evt->reg->info->name);
+
+		event_refcount_dec(item.evt);
+
+		pom_mutex_lock(&q->lock);
+		t->obj = NULL;
+		pthread_cond_broadcast(&q->cond_push);
+	}
+
+	pom_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+struct event_queue *event_queue_alloc(unsigned int size, enum event_queue_policy policy, unsigned int threads, struct registry_perf *perf_depth, struct registry_perf *perf_drops) {
+
+	if (!size) {
+		pomlog(POMLOG_ERR "Event queue size cannot be 0");
+		return NULL;
+	}
+
+	if (!threads)
+		threads = 1;
+	if (threads > EVENT_QUEUE_THREADS_MAX) {
+		pomlog(POMLOG_WARN "Too many threads for the event queue, using %u", EVENT_QUEUE_THREADS_MAX);
+		threads = EVENT_QUEUE_THREADS_MAX;
+	}
+
+	struct event_queue *q = malloc(sizeof(struct event_queue));
+	if (!q) {
+		pom_oom(sizeof(struct event_queue));
+		return NULL;
+	}
+	memset(q, 0, sizeof(struct event_queue));
+
+	q->items = malloc(sizeof(struct event_queue_item) * size);
+	if (!q->items) {
+		pom_oom(sizeof(struct event_queue_item) * size);
+		free(q);
+		return NULL;
+	}
+
+	q->size = size;
+	q->policy = policy;
+	q->perf_depth = perf_depth;
+	q->perf_drops = perf_drops;
+
+	if (pthread_mutex_init(&q->lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the event queue lock : %s", pom_strerror(errno));
+		goto err_items;
+	}
+
+	if (pthread_cond_init(&q->cond_push, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the event queue condition : %s", pom_strerror(errno));
+		goto err_lock;
+	}
+
+	if (pthread_cond_init(&q->cond_pop, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the event queue condition : %s", pom_strerror(errno));
+		goto err_cond;
+	}
+
+	for (q->thread_count = 0; q->thread_count < threads; q->thread_count++) {
+		struct event_queue_thread *t = &q->threads[q->thread_count];
+		t->q = q;
+		if (pthread_create(&t->thread, NULL, event_queue_thread_func, t)) {
+			pomlog(POMLOG_ERR "Error while creating the event queue thread : %s", pom_strerror(errno));
+			event_queue_cleanup(q);
+			return NULL;
+		}
+	}
+
+	return q;
+
+err_cond:
+	pthread_cond_destroy(&q->cond_push);
+err_lock:
+	pthread_mutex_destroy(&q->lock);
+err_items:
+	free(q->items);
+	free(q);
+	return NULL;
+}
+
+int event_queue_cleanup(struct event_queue *q) {
+
+	// Make sure no listener still uses this queue
+	struct event_reg *evt_reg;
+	for (evt_reg = event_reg_head; evt_reg; evt_reg = evt_reg->next) {
+		pom_rwlock_wlock(&evt_reg->listeners_lock);
+		struct event_listener *lst;
+		for (lst = evt_reg->listeners; lst; lst = lst->next) {
+			if (lst->queue == q)
+				lst->queue = NULL;
+		}
+		pom_rwlock_unlock(&evt_reg->listeners_lock);
+	}
+
+	// The threads process the remaining events before exiting
+	pom_mutex_lock(&q->lock);
+	while (q->pending)
+		pthread_cond_wait(&q->cond_push, &q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->cond_pop);
+	pom_mutex_unlock(&q->lock);
+
+	unsigned int i;
+	for (i = 0; i < q->thread_count; i++) {
+		if (pthread_join(q->threads[i].thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining the event queue thread");
+	}
+
+	pthread_cond_destroy(&q->cond_pop);
+	pthread_cond_destroy(&q->cond_push);
+	pthread_mutex_destroy(&q->lock);
+	free(q->items);
+	free(q);
+
+	return POM_OK;
+}
+
+static void event_queue_reserve(struct event_queue_pending *p, struct event_listener *lst) {
+
+	struct event_queue *q = lst->queue;
+
+	p->q = q;
+	p->obj = lst->obj;
+	p->process_end = lst->process_end;
+	// Listeners whose process_begin was called always get process_end, the queue blocks for them
+	p->can_drop = !lst->process_begin;
+	p->cancelled = 0;
+
+	pom_mutex_lock(&q->lock);
+	p->prev = NULL;
+	p->next = q->pending;
+	if (p->next)
+		p->next->prev = p;
+	q->pending = p;
+	pom_mutex_unlock(&q->lock);
+}
+
+static void event_queue_push(struct event_queue_pending *p, struct event *evt) {
+
+	struct event_queue *q = p->q;
+
+	pom_mutex_lock(&q->lock);
+
+	int drop = 0;
+	if (p->can_drop && q->policy == event_queue_policy_sample && q->count >= q->size / 2) {
+		// Past half the queue, only keep some events
+		if (q->sample++ % EVENT_QUEUE_SAMPLE_RATIO)
+			drop = 1;
+	}
+
+	if (!drop && q->count >= q->size) {
+		if (p->can_drop && q->policy != event_queue_policy_block) {
+			drop = 1;
+		} else {
+			while (q->count >= q->size && !p->cancelled)
+				pthread_cond_wait(&q->cond_push, &q->lock);
+		}
+	}
+
+	// The reservation is over, wake up whoever waits for it to go away
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		q->pending = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	pthread_cond_broadcast(&q->cond_push);
+
+	if (drop || p->cancelled) {
+		pom_mutex_unlock(&q->lock);
+		if (drop)
+			registry_perf_inc(q->perf_drops, 1);
+		return;
+	}
+
+	event_refcount_inc(evt);
+
+	struct event_queue_item *item = &q->items[(q->head + q->count) % q->size];
+	item->evt = evt;
+	item->obj = p->obj;
+	item->process_end = p->process_end;
+	q->count++;
+
+	pthread_cond_signal(&q->cond_pop);
+	pom_mutex_unlock(&q->lock);
+
+	registry_perf_inc(q->perf_depth, 1);
+}
+
+// Wait until all the events queued for this listener have been processed
+static void event_queue_drain(struct event_queue *q, void *obj) {
+
+	pom_mutex_lock(&q->lock);
+
+	// Events not pushed yet don't need to be for this listener anymore
+	struct event_queue_pending *p;
+	for (p = q->pending; p; p = p->next) {
+		if (p->obj == obj)
+			p->cancelled = 1;
+	}
+	pthread_cond_broadcast(&q->cond_push);
+
+	while (1) {
+		int pending = 0;
+		unsigned int i;
+		for (i = 0; i < q->thread_count && !pending; i++) {
+			if (q->threads[i].obj == obj)
+				pending = 1;
+		}
+		for (i = 0; i < q->count && !pending; i++) {
+			if (q->items[(q->head + i) % q->size].obj == obj)
+				pending = 1;
+		}
+		for (p = q->pending; p && !pending; p = p->next) {
+			if (p->obj == obj)
+				pending = 1;
+		}
+
+		if (!pending)
+			break;
+
+		pthread_cond_wait(&q->cond_push, &q->lock);
+	}
+	pom_mutex_unlock(&q->lock);
+}
+
+struct event_queue *event_listener_queue_set(struct event_queue *q) {
+
+	struct event_queue *prev = event_listener_queue;
+	event_listener_queue = q;
+	return prev;
+}
+
 int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj)) {
 
 	pom_rwlock_wlock(&evt_reg->listeners_lock);
@@ -267,6 +659,8 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 	lst->obj = obj;
 	lst->process_begin = process_begin;
 	lst->process_end = process_end;
+	if (process_end)
+		lst->queue = event_listener_queue;
 	
 	lst->next = evt_reg->listeners;
 	if (lst->next)
@@ -274,9 +668,16 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 
 	evt_reg->listeners = lst;
 
-	if (!lst->next) {
+	if (!lst->next && evt_reg->info->listeners_notify) {
 		// Got a listener now, notify
-		if (evt_reg->info->listeners_notify && evt_reg->info->listeners_notify(evt_reg->info->source_obj, evt_reg, 1) != POM_OK) {
+		// The listeners registered by the source object in turn must not
+		// end up in the queue of the output registering this one
+		struct event_queue *queue = event_listener_queue;
+		event_listener_queue = NULL;
+		int res = evt_reg->info->listeners_notify(evt_reg->info->source_obj, evt_reg, 1);
+		event_listener_queue = queue;
+
+		if (res != POM_OK) {
 			pom_rwlock_unlock(&evt_reg->listeners_lock);
 			pomlog(POMLOG_ERR "Error while notifying event object about new listener");
 			evt_reg->listeners = NULL;
@@ -287,6 +688,9 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 	pom_rwlock_unlock(&evt_reg->listeners_lock);
 
 	registry_perf_inc(evt_reg->perf_listeners, 1);
+
+	if (__sync_fetch_and_add(&event_listener_count, 1) == 0)
+		core_capture_filter_update();
 	
 
 	return POM_OK;
@@ -313,6 +717,7 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 	else
 		evt_reg->listeners = lst->next;
 
+	struct event_queue *q = lst->queue;
 	free(lst);
 
 	if (!evt_reg->listeners) {
@@ -323,8 +728,15 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 
 	pom_rwlock_unlock(&evt_reg->listeners_lock);
 
+	// The events already queued still reference the object
+	if (q)
+		event_queue_drain(q, obj);
+
 	registry_perf_dec(evt_reg->perf_listeners, 1);
 
+	if (__sync_sub_and_fetch(&event_listener_count, 1) == 0)
+		core_capture_filter_update();
+
 	return POM_OK;
 }
 
@@ -354,6 +766,11 @@ int event_add_listener(struct event *evt, void *obj, int (*process_begin) (struc
 
 }
 
+
+unsigned int event_get_listener_count() {
+	return event_listener_count;
+}
+
 int event_has_listener(struct event_reg *evt_reg) {
 	return (evt_reg->listeners ? 1 : 0);
 }
@@ -418,9 +835,33 @@ int event_process_end(struct event *evt) {
 	}
 
 
+	struct event_queue_pending pending_stack[EVENT_QUEUE_PENDING_STACK];
+	struct event_queue_pending *pending = pending_stack;
+	unsigned int pending_count = 0;
+
 	struct event_listener *lst;
 	pom_rwlock_rlock(&evt->reg->listeners_lock);
+
 	for (lst = evt->reg->listeners; lst; lst = lst->next) {
+		if (lst->queue)
+			pending_count++;
+	}
+
+	if (pending_count > EVENT_QUEUE_PENDING_STACK) {
+		pending = malloc(sizeof(struct event_queue_pending) * pending_count);
+		if (!pending) {
+			// Process all the listeners right away instead
+			pom_oom(sizeof(struct event_queue_pending) * pending_count);
+		}
+	}
+
+	pending_count = 0;
+	for (lst = evt->reg->listeners; lst; lst = lst->next) {
+		if (lst->queue && pending) {
+			// Pushing may wait for room in the queue, only do it once the listeners lock is released
+			event_queue_reserve(&pending[pending_count++], lst);
+			continue;
+		}
 		if (lst->process_end && lst->process_end(evt, lst->obj) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing event %s", evt->reg->info->name);
 		}
@@ -435,13 +876,23 @@ int event_process_end(struct event *evt) {
 		registry_perf_dec(evt->reg->perf_listeners, 1);
 	}
 	
-	evt->ce = NULL;
+	// The queued listeners still need the conntrack, it's cleared when the event is released
+	if (!pending_count)
+		evt->ce = NULL;
 
+	// Everything is written before the event is handed over to the queues
 	__sync_fetch_and_or(&evt->flags, EVENT_FLAG_PROCESS_DONE);
 
 	registry_perf_dec(evt->reg->perf_ongoing, 1);
 	registry_perf_inc(evt->reg->perf_processed, 1);
 
+	unsigned int i;
+	for (i = 0; i < pending_count; i++)
+		event_queue_push(&pending[i], evt);
+
+	if (pending && pending != pending_stack)
+		free(pending);
+
 	return event_refcount_dec(evt);
 }
 
@@ -24,6 +24,7 @@
 #define EVENT_REGISTRY "event"
 
 #include <pom-ng/event.h>
+#include "core.h"
 
 struct event {
 	struct event_reg *reg;
@@ -35,8 +36,20 @@ struct event {
 	ptime ts;
 
 	struct event_listener* tmp_listeners;
+
+	struct event *pool_next; // Next free event in the pool
 };
 
+// Maximum number of free events kept by each processing thread for each event type
+#define EVENT_POOL_THREAD_MAX		32
+// Maximum number of free events released by other threads for each event type
+#define EVENT_POOL_SHARED_MAX		128
+
+struct event_pool {
+	struct event *head;
+	unsigned int count;
+} __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+
 struct event_reg {
 
 	struct event_reg_info *info;
@@ -47,18 +60,81 @@ struct event_reg {
 	struct registry_perf *perf_ongoing;
 	struct registry_perf *perf_processed;
 	pthread_rwlock_t listeners_lock;
+
+	// Free events with their data table, one pool per processing thread
+	struct event_pool *pools;
+	// Events released by the other threads
+	struct event *pool_shared;
+	unsigned int pool_shared_count;
+	pthread_mutex_t pool_shared_lock;
+
+	struct registry_perf *perf_pool_size;
+	struct registry_perf *perf_pool_hits;
+	struct registry_perf *perf_pool_misses;
 };
 
 struct event_listener {
 	void *obj;
 	int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index);
 	int (*process_end) (struct event *evt, void *obj);
+	struct event_queue *queue; // Call process_end from the queue's threads if set
 
 	struct event_listener *prev, *next;
 };
 
+// Above half of the queue, only one event out of this number is queued with the sample policy
+#define EVENT_QUEUE_SAMPLE_RATIO	8
+
+#define EVENT_QUEUE_THREADS_MAX		16
+
+struct event_queue_item {
+	struct event *evt;
+	void *obj;
+	int (*process_end) (struct event *evt, void *obj);
+};
+
+// Push to a queue reserved while holding the listeners lock and done once it's released
+struct event_queue_pending {
+	struct event_queue *q;
+	void *obj;
+	int (*process_end) (struct event *evt, void *obj);
+	int can_drop;
+	int cancelled; // The listener was unregistered in the meantime
+	struct event_queue_pending *prev, *next;
+};
+
+// Number of queued listeners of an event handled without allocating
+#define EVENT_QUEUE_PENDING_STACK	8
+
+struct event_queue_thread {
+	pthread_t thread;
+	struct event_queue *q;
+	void *obj; // Object whose event is being processed
+};
+
+struct event_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond_push; // Signaled when there is room in the queue
+	pthread_cond_t cond_pop; // Signaled when an event is queued or the threads must stop
+
+	struct event_queue_item *items;
+	unsigned int size, head, count;
+	unsigned int sample;
+
+	enum event_queue_policy policy;
+	int stop;
+	struct event_queue_pending *pending;
+
+	struct event_queue_thread threads[EVENT_QUEUE_THREADS_MAX];
+	unsigned int thread_count;
+
+	struct registry_perf *perf_depth;
+	struct registry_perf *perf_drops;
+};
+
 int event_init();
 int event_finish();
 int event_add_listener(struct event *evt, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj));
+unsigned int event_get_listener_count();
 
 #endif
@@ -22,6 +22,14 @@
 #include "filter.h"
 #include "core.h"
 #include "proto.h"
+#include "ptype.h"
+
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_mac.h>
+#include <pom-ng/ptype_ipv6.h>
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
 
 int filter_raw_parse(char *expr, unsigned int len, struct filter_raw_node **n) {
 
@@ -707,8 +715,874 @@ int filter_node_data_match(struct filter_node *n, struct data *d) {
 	return res;
 }
 
+static struct filter_insn *filter_prog_insn_add(struct filter_prog *prog, enum filter_insn_type type) {
+
+	if (prog->insn_count >= prog->insn_size) {
+		unsigned int new_size = (prog->insn_size ? prog->insn_size * 2 : 16);
+		struct filter_insn *insns = realloc(prog->insns, sizeof(struct filter_insn) * new_size);
+		if (!insns) {
+			pom_oom(sizeof(struct filter_insn) * new_size);
+			return NULL;
+		}
+		prog->insns = insns;
+		prog->insn_size = new_size;
+	}
+
+	struct filter_insn *insn = &prog->insns[prog->insn_count++];
+	memset(insn, 0, sizeof(struct filter_insn));
+	insn->type = type;
+
+	return insn;
+}
+
+static int filter_prog_reg_get(struct filter_prog *prog, struct proto *proto) {
+
+	unsigned int i;
+	for (i = 0; i < prog->reg_count; i++) {
+		if (prog->regs[i] == proto)
+			return i;
+	}
+
+	if (prog->reg_count >= FILTER_PROG_REG_MAX)
+		return POM_ERR;
+
+	prog->regs[prog->reg_count] = proto;
+
+	return prog->reg_count++;
+}
+
+static int filter_prog_op_mirror(int op) {
+
+	switch (op) {
+		case FILTER_OP_GT:
+			return FILTER_OP_LT;
+		case FILTER_OP_GE:
+			return FILTER_OP_LE;
+		case FILTER_OP_LT:
+			return FILTER_OP_GT;
+		case FILTER_OP_LE:
+			return FILTER_OP_GE;
+	}
+
+	return op;
+}
+
+// Use a direct comparison when the ptype is one we know the layout of
+static void filter_prog_leaf_typed(struct filter_insn *insn, struct ptype *v) {
+
+	char *name = v->type->info->name;
+
+	if (!strcmp(name, "uint8")) {
+		insn->type = filter_insn_cmp_uint8;
+		insn->val.integer = *(uint8_t*)v->value;
+	} else if (!strcmp(name, "uint16")) {
+		insn->type = filter_insn_cmp_uint16;
+		insn->val.integer = *(uint16_t*)v->value;
+	} else if (!strcmp(name, "uint32")) {
+		insn->type = filter_insn_cmp_uint32;
+		insn->val.integer = *(uint32_t*)v->value;
+	} else if (!strcmp(name, "uint64")) {
+		insn->type = filter_insn_cmp_uint64;
+		insn->val.integer = *(uint64_t*)v->value;
+	} else if (!strcmp(name, "ipv4") && (insn->op == FILTER_OP_EQ || insn->op == FILTER_OP_NEQ)) {
+		struct ptype_ipv4_val *ipv4 = v->value;
+		insn->type = filter_insn_cmp_ipv4;
+		insn->val.ipv4.addr = ntohl(ipv4->addr.s_addr);
+		insn->val.ipv4.mask = ipv4->mask;
+	} else if (!strcmp(name, "mac") && (insn->op == FILTER_OP_EQ || insn->op == FILTER_OP_NEQ)) {
+		struct ptype_mac_val *mac = v->value;
+		insn->type = filter_insn_cmp_mac;
+		memcpy(insn->val.mac, mac->addr, sizeof(insn->val.mac));
+	} else {
+		return;
+	}
+
+	// The field is always the left operand of the typed comparisons
+	if (insn->swap) {
+		insn->op = filter_prog_op_mirror(insn->op);
+		insn->swap = 0;
+	}
+}
+
+static int filter_prog_emit_leaf(struct filter_prog *prog, struct filter_node *n) {
+
+	struct filter_insn *insn = NULL;
+
+	int field = -1;
+	if (n->type[0] == filter_value_type_proto)
+		field = 0;
+	else if (n->type[1] == filter_value_type_proto)
+		field = 1;
+
+	if (field == -1) {
+		// Nothing from the packet to look at, this can't match
+		insn = filter_prog_insn_add(prog, filter_insn_const);
+		if (!insn)
+			return POM_ERR;
+		insn->val.integer = FILTER_MATCH_NO;
+		return POM_OK;
+	}
+
+	int reg = filter_prog_reg_get(prog, n->value[field].proto.proto);
+	if (reg == POM_ERR)
+		return POM_ERR;
+
+	if (n->op == FILTER_OP_NOP) {
+		insn = filter_prog_insn_add(prog, filter_insn_proto);
+		if (!insn)
+			return POM_ERR;
+		insn->reg[0] = reg;
+		insn->field_id[0] = n->value[field].proto.field_id;
+		return POM_OK;
+	}
+
+	int other = !field;
+
+	if (n->type[other] == filter_value_type_proto) {
+		int reg_other = filter_prog_reg_get(prog, n->value[other].proto.proto);
+		if (reg_other == POM_ERR)
+			return POM_ERR;
+
+		insn = filter_prog_insn_add(prog, filter_insn_cmp_field);
+		if (!insn)
+			return POM_ERR;
+		insn->op = n->op;
+		insn->reg[0] = reg;
+		insn->field_id[0] = n->value[0].proto.field_id;
+		insn->reg[1] = reg_other;
+		insn->field_id[1] = n->value[1].proto.field_id;
+		return POM_OK;
+	}
+
+	if (n->type[other] != filter_value_type_ptype) {
+		insn = filter_prog_insn_add(prog, filter_insn_const);
+		if (!insn)
+			return POM_ERR;
+		insn->val.integer = FILTER_MATCH_NO;
+		return POM_OK;
+	}
+
+	insn = filter_prog_insn_add(prog, filter_insn_cmp);
+	if (!insn)
+		return POM_ERR;
+	insn->op = n->op;
+	insn->reg[0] = reg;
+	insn->field_id[0] = n->value[field].proto.field_id;
+	insn->swap = (field == 1);
+	insn->val.ptype = n->value[other].ptype;
+
+	filter_prog_leaf_typed(insn, n->value[other].ptype);
+
+	return POM_OK;
+}
+
+static int filter_prog_emit(struct filter_prog *prog, struct filter_node *n) {
+
+	if (n->type[0] == filter_value_type_node && n->type[1] == filter_value_type_node) {
+
+		if (n->op != FILTER_OP_AND && n->op != FILTER_OP_OR) {
+			pomlog(POMLOG_ERR "Invalid operation for nodes");
+			return POM_ERR;
+		}
+
+		if (filter_prog_emit(prog, n->value[0].node) != POM_OK)
+			return POM_ERR;
+
+		// Skip the second branch when the first one decides the result
+		unsigned int jmp = prog->insn_count;
+		if (!filter_prog_insn_add(prog, (n->op == FILTER_OP_AND ? filter_insn_jmp_false : filter_insn_jmp_true)))
+			return POM_ERR;
+
+		if (filter_prog_emit(prog, n->value[1].node) != POM_OK)
+			return POM_ERR;
+
+		prog->insns[jmp].jmp = prog->insn_count;
+
+	} else if (filter_prog_emit_leaf(prog, n) != POM_OK) {
+		return POM_ERR;
+	}
+
+	if (n->not && !filter_prog_insn_add(prog, filter_insn_not))
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+int filter_packet_prog_compile(struct filter_node *n) {
+
+	struct filter_prog *prog = malloc(sizeof(struct filter_prog));
+	if (!prog) {
+		pom_oom(sizeof(struct filter_prog));
+		return POM_ERR;
+	}
+	memset(prog, 0, sizeof(struct filter_prog));
+
+	if (filter_prog_emit(prog, n) != POM_OK) {
+		// The tree will be evaluated instead
+		pomlog(POMLOG_DEBUG "Unable to compile the filter, it will be interpreted");
+		filter_prog_cleanup(prog);
+		return POM_OK;
+	}
+
+	filter_prog_cleanup(n->prog);
+	n->prog = prog;
+
+	return POM_OK;
+}
+
+void filter_prog_cleanup(struct filter_prog *prog) {
+
+	if (!prog)
+		return;
+
+	if (prog->insns)
+		free(prog->insns);
+
+	free(prog);
+}
+
+static inline int filter_prog_cmp_int(int op, uint64_t a, uint64_t b) {
+
+	switch (op) {
+		case FILTER_OP_EQ:
+			return a == b;
+		case FILTER_OP_NEQ:
+			return a != b;
+		case FILTER_OP_GT:
+			return a > b;
+		case FILTER_OP_GE:
+			return a >= b;
+		case FILTER_OP_LT:
+			return a < b;
+		case FILTER_OP_LE:
+			return a <= b;
+	}
+
+	return 0;
+}
+
+// Evaluate a comparison instruction, regs holds the stack position of the protos or -1 if not resolved yet
+static int filter_insn_eval(struct filter_insn *insn, struct proto **reg_protos, int *regs, struct proto_process_stack *stack) {
+
+	// Fetch the operands
+	struct ptype *v[2] = { NULL, NULL };
+	int j, operands = (insn->type == filter_insn_cmp_field ? 2 : 1);
+	for (j = 0; j < operands; j++) {
+
+		int reg = insn->reg[j];
+		if (regs[reg] < 0) {
+			int k;
+			for (k = CORE_PROTO_STACK_START; k <= CORE_PROTO_STACK_MAX && stack[k].proto && stack[k].proto != reg_protos[reg]; k++);
+			regs[reg] = (k <= CORE_PROTO_STACK_MAX && stack[k].proto ? k : 0);
+		}
+
+		if (!regs[reg])
+			return FILTER_MATCH_NO;
+
+		if (insn->field_id[j] == -1)
+			continue;
+
+		v[j] = stack[regs[reg]].pkt_info->fields_value[insn->field_id[j]];
+		if (!v[j])
+			return FILTER_MATCH_NO;
+	}
+
+	int res = FILTER_MATCH_NO;
+
+	switch (insn->type) {
+		case filter_insn_proto:
+			res = FILTER_MATCH_YES;
+			break;
+		case filter_insn_cmp:
+			if (insn->swap)
+				res = ptype_compare_val(insn->op, insn->val.ptype, v[0]);
+			else
+				res = ptype_compare_val(insn->op, v[0], insn->val.ptype);
+			break;
+		case filter_insn_cmp_field:
+			res = ptype_compare_val(insn->op, v[0], v[1]);
+			break;
+		case filter_insn_cmp_uint8:
+			res = filter_prog_cmp_int(insn->op, *(uint8_t*)v[0]->value, insn->val.integer);
+			break;
+		case filter_insn_cmp_uint16:
+			res = filter_prog_cmp_int(insn->op, *(uint16_t*)v[0]->value, insn->val.integer);
+			break;
+		case filter_insn_cmp_uint32:
+			res = filter_prog_cmp_int(insn->op, *(uint32_t*)v[0]->value, insn->val.integer);
+			break;
+		case filter_insn_cmp_uint64:
+			res = filter_prog_cmp_int(insn->op, *(uint64_t*)v[0]->value, insn->val.integer);
+			break;
+		case filter_insn_cmp_ipv4: {
+			struct ptype_ipv4_val *ipv4 = v[0]->value;
+			unsigned char mask = insn->val.ipv4.mask;
+			if (ipv4->mask < mask)
+				mask = ipv4->mask;
+			uint32_t mask_bits = (mask ? 0xffffffff << (32 - mask) : 0);
+			res = !((ntohl(ipv4->addr.s_addr) ^ insn->val.ipv4.addr) & mask_bits);
+			if (insn->op == FILTER_OP_NEQ)
+				res = !res;
+			break;
+		}
+		case filter_insn_cmp_mac: {
+			struct ptype_mac_val *mac = v[0]->value;
+			res = !memcmp(mac->addr, insn->val.mac, sizeof(insn->val.mac));
+			if (insn->op == FILTER_OP_NEQ)
+				res = !res;
+			break;
+		}
+		default:
+			pomlog(POMLOG_ERR "Invalid filter instruction %u", insn->type);
+			return POM_ERR;
+	}
+
+	return res;
+}
+
+static int filter_prog_run(struct filter_prog *prog, struct proto_process_stack *stack) {
+
+	// Position of each proto in the stack, resolved the first time it's needed
+	int regs[FILTER_PROG_REG_MAX];
+	unsigned int i;
+	for (i = 0; i < prog->reg_count; i++)
+		regs[i] = -1;
+
+	int res = FILTER_MATCH_NO;
+	unsigned int pc = 0;
+
+	while (pc < prog->insn_count) {
+
+		struct filter_insn *insn = &prog->insns[pc++];
+
+		switch (insn->type) {
+			case filter_insn_const:
+				res = insn->val.integer;
+				break;
+			case filter_insn_not:
+				res = !res;
+				break;
+			case filter_insn_jmp_false:
+				if (!res)
+					pc = insn->jmp;
+				break;
+			case filter_insn_jmp_true:
+				if (res)
+					pc = insn->jmp;
+				break;
+			default:
+				res = filter_insn_eval(insn, prog->regs, regs, stack);
+				if (res == POM_ERR)
+					return POM_ERR;
+				break;
+		}
+	}
+
+	return res;
+}
+
+struct filter_set *filter_set_alloc() {
+
+	struct filter_set *set = malloc(sizeof(struct filter_set));
+	if (!set) {
+		pom_oom(sizeof(struct filter_set));
+		return NULL;
+	}
+	memset(set, 0, sizeof(struct filter_set));
+
+	set->leaves = malloc(sizeof(struct filter_insn) * FILTER_SET_LEAF_MAX);
+	if (!set->leaves) {
+		free(set);
+		pom_oom(sizeof(struct filter_insn) * FILTER_SET_LEAF_MAX);
+		return NULL;
+	}
+
+	return set;
+}
+
+static int filter_set_reg_get(struct filter_set *set, struct proto *proto) {
+
+	unsigned int i;
+	for (i = 0; i < set->reg_count; i++) {
+		if (set->regs[i] == proto)
+			return i;
+	}
+
+	if (set->reg_count >= FILTER_PROG_REG_MAX)
+		return POM_ERR;
+
+	set->regs[set->reg_count] = proto;
+
+	return set->reg_count++;
+}
+
+static int filter_insn_equals(struct filter_insn *a, struct filter_insn *b) {
+
+	if (a->type != b->type || a->op != b->op || a->swap != b->swap || a->reg[0] != b->reg[0] || a->field_id[0] != b->field_id[0])
+		return 0;
+
+	switch (a->type) {
+		case filter_insn_proto:
+			return 1;
+		case filter_insn_cmp_field:
+			return a->reg[1] == b->reg[1] && a->field_id[1] == b->field_id[1];
+		case filter_insn_cmp:
+			return ptype_compare_val(PTYPE_OP_EQ, a->val.ptype, b->val.ptype);
+		case filter_insn_cmp_ipv4:
+			return a->val.ipv4.addr == b->val.ipv4.addr && a->val.ipv4.mask == b->val.ipv4.mask;
+		case filter_insn_cmp_mac:
+			return !memcmp(a->val.mac, b->val.mac, sizeof(a->val.mac));
+		default:
+			break;
+	}
+
+	return a->val.integer == b->val.integer;
+}
+
+static int filter_set_leaf_get(struct filter_set *set, struct filter_insn *insn) {
+
+	unsigned int i;
+	for (i = 0; i < set->leaf_count; i++) {
+		if (filter_insn_equals(&set->leaves[i], insn))
+			return i;
+	}
+
+	if (set->leaf_count >= FILTER_SET_LEAF_MAX)
+		return POM_ERR;
+
+	struct filter_insn *leaf = &set->leaves[set->leaf_count];
+	memcpy(leaf, insn, sizeof(struct filter_insn));
+
+	// The set keeps its own copy of the value as the filter may go away first
+	if (leaf->type == filter_insn_cmp) {
+		leaf->val.ptype = ptype_alloc_from(insn->val.ptype);
+		if (!leaf->val.ptype)
+			return POM_ERR;
+	}
+
+	return set->leaf_count++;
+}
+
+int filter_set_add(struct filter_set *set, struct filter_node *n) {
+
+	if (set->count >= FILTER_SET_MAX)
+		return POM_ERR;
+
+	if (!n) {
+		set->progs[set->count] = NULL;
+		return set->count++;
+	}
+
+	// Only compiled filters can be shared
+	struct filter_prog *src = n->prog;
+	if (!src)
+		return POM_ERR;
+
+	struct filter_prog *prog = malloc(sizeof(struct filter_prog));
+	if (!prog) {
+		pom_oom(sizeof(struct filter_prog));
+		return POM_ERR;
+	}
+	memset(prog, 0, sizeof(struct filter_prog));
+
+	prog->insns = malloc(sizeof(struct filter_insn) * src->insn_count);
+	if (!prog->insns) {
+		free(prog);
+		pom_oom(sizeof(struct filter_insn) * src->insn_count);
+		return POM_ERR;
+	}
+	memcpy(prog->insns, src->insns, sizeof(struct filter_insn) * src->insn_count);
+	prog->insn_count = src->insn_count;
+	prog->insn_size = src->insn_count;
+
+	unsigned int i;
+	for (i = 0; i < prog->insn_count; i++) {
+
+		struct filter_insn *insn = &prog->insns[i];
+		if (insn->type < filter_insn_proto)
+			continue;
+
+		// Use the registers of the set
+		int j, operands = (insn->type == filter_insn_cmp_field ? 2 : 1);
+		for (j = 0; j < operands; j++) {
+			int reg = filter_set_reg_get(set, src->regs[insn->reg[j]]);
+			if (reg == POM_ERR)
+				goto err;
+			insn->reg[j] = reg;
+		}
+
+		int leaf = filter_set_leaf_get(set, insn);
+		if (leaf == POM_ERR)
+			goto err;
+
+		memset(insn, 0, sizeof(struct filter_insn));
+		insn->type = filter_insn_leaf;
+		insn->val.integer = leaf;
+	}
+
+	set->progs[set->count] = prog;
+
+	return set->count++;
+
+err:
+	filter_prog_cleanup(prog);
+	return POM_ERR;
+}
+
+uint64_t filter_set_match(struct filter_set *set, struct proto_process_stack *stack) {
+
+	int regs[FILTER_PROG_REG_MAX];
+	unsigned int i;
+	for (i = 0; i < set->reg_count; i++)
+		regs[i] = -1;
+
+	// Result of each comparison, evaluated the first time a filter needs it
+	signed char leaves[FILTER_SET_LEAF_MAX];
+	memset(leaves, -1, set->leaf_count);
+
+	uint64_t match = 0;
+
+	for (i = 0; i < set->count; i++) {
+
+		struct filter_prog *prog = set->progs[i];
+		if (!prog) {
+			match |= (1ULL << i);
+			continue;
+		}
+
+		int res = FILTER_MATCH_NO;
+		unsigned int pc = 0;
+
+		while (pc < prog->insn_count) {
+
+			struct filter_insn *insn = &prog->insns[pc++];
+
+			switch (insn->type) {
+				case filter_insn_const:
+					res = insn->val.integer;
+					break;
+				case filter_insn_not:
+					res = !res;
+					break;
+				case filter_insn_jmp_false:
+					if (!res)
+						pc = insn->jmp;
+					break;
+				case filter_insn_jmp_true:
+					if (res)
+						pc = insn->jmp;
+					break;
+				default: {
+					unsigned int leaf = insn->val.integer;
+					if (leaves[leaf] < 0) {
+						res = filter_insn_eval(&set->leaves[leaf], set->regs, regs, stack);
+						leaves[leaf] = (res == FILTER_MATCH_YES);
+					}
+					res = leaves[leaf];
+					break;
+				}
+			}
+		}
+
+		if (res)
+			match |= (1ULL << i);
+	}
+
+	return match;
+}
+
+void filter_set_cleanup(struct filter_set *set) {
+
+	if (!set)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < set->count; i++)
+		filter_prog_cleanup(set->progs[i]);
+
+	for (i = 0; i < set->leaf_count; i++) {
+		if (set->leaves[i].type == filter_insn_cmp)
+			ptype_cleanup(set->leaves[i].val.ptype);
+	}
+
+	free(set->leaves);
+	free(set);
+}
+
+static char *filter_bpf_printf(const char *fmt, ...) {
+
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return NULL;
+
+	char *res = malloc(len + 1);
+	if (!res) {
+		pom_oom(len + 1);
+		return NULL;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(res, len + 1, fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+static char *filter_bpf_join(char *a, char *op, char *b) {
+
+	char *res = filter_bpf_printf("(%s) %s (%s)", a, op, b);
+	free(a);
+	free(b);
+	return res;
+}
+
+// BPF primitive matching the presence of a proto
+static char *filter_bpf_proto(struct proto *proto) {
+
+	static char *protos[][2] = {
+		{ "ipv4", "ip" },
+		{ "ipv6", "ip6" },
+		{ "tcp", "tcp" },
+		{ "udp", "udp" },
+		{ "icmp", "icmp" },
+		{ "icmp6", "icmp6" },
+		{ "arp", "arp" },
+		{ NULL, NULL },
+	};
+
+	int i;
+	for (i = 0; protos[i][0]; i++) {
+		if (!strcmp(proto->info->name, protos[i][0]))
+			return protos[i][1];
+	}
+
+	return NULL;
+}
+
+static char *filter_bpf_leaf(struct filter_node *n, int *exact) {
+
+	*exact = 0;
+
+	int field = -1;
+	if (n->type[0] == filter_value_type_proto)
+		field = 0;
+	else if (n->type[1] == filter_value_type_proto)
+		field = 1;
+
+	if (field == -1)
+		return NULL;
+
+	struct proto *proto = n->value[field].proto.proto;
+	char *proto_bpf = filter_bpf_proto(proto);
+	if (!proto_bpf)
+		return NULL;
+
+	if (n->op == FILTER_OP_NOP) {
+		*exact = (n->value[field].proto.field_id == -1);
+		return strdup(proto_bpf);
+	}
+
+	int other = !field;
+	if (n->type[other] != filter_value_type_ptype)
+		return NULL;
+
+	char *proto_name = proto->info->name;
+	char *field_name = proto->info->pkt_fields[n->value[field].proto.field_id].name;
+	struct ptype *v = n->value[other].ptype;
+	char *type = v->type->info->name;
+
+	int op = n->op;
+	if (field == 1) {
+		// Make the field the left operand
+		if (op == FILTER_OP_GT)
+			op = FILTER_OP_LT;
+		else if (op == FILTER_OP_GE)
+			op = FILTER_OP_LE;
+		else if (op == FILTER_OP_LT)
+			op = FILTER_OP_GT;
+		else if (op == FILTER_OP_LE)
+			op = FILTER_OP_GE;
+	}
+
+	char *dir = NULL;
+	if (!strcmp(field_name, "src") || !strcmp(field_name, "sport"))
+		dir = "src";
+	else if (!strcmp(field_name, "dst") || !strcmp(field_name, "dport"))
+		dir = "dst";
+	else
+		return NULL;
+
+	char *res = NULL;
+
+	if ((!strcmp(proto_name, "tcp") || !strcmp(proto_name, "udp")) && !strcmp(type, "uint16")) {
+
+		unsigned int port = *(uint16_t*)v->value;
+		unsigned int start = 0, end = 65535;
+
+		switch (op) {
+			case FILTER_OP_EQ:
+			case FILTER_OP_NEQ:
+				start = end = port;
+				break;
+			case FILTER_OP_GT:
+				if (port == 65535)
+					return strdup("less 0"); // Never matches
+				start = port + 1;
+				break;
+			case FILTER_OP_GE:
+				start = port;
+				break;
+			case FILTER_OP_LT:
+				if (port == 0)
+					return strdup("less 0");
+				end = port - 1;
+				break;
+			case FILTER_OP_LE:
+				end = port;
+				break;
+			default:
+				return NULL;
+		}
+
+		if (start == end)
+			res = filter_bpf_printf("%s %s port %u", proto_bpf, dir, start);
+		else
+			res = filter_bpf_printf("%s %s portrange %u-%u", proto_bpf, dir, start, end);
+
+	} else if (op != FILTER_OP_EQ && op != FILTER_OP_NEQ) {
+		return NULL;
+	} else if (!strcmp(proto_name, "ipv4") && !strcmp(type, "ipv4")) {
+
+		struct ptype_ipv4_val *ipv4 = v->value;
+		if (!ipv4->mask)
+			return NULL;
+
+		// BPF refuses networks with host bits set
+		struct in_addr addr;
+		addr.s_addr = htonl(ntohl(ipv4->addr.s_addr) & (0xffffffff << (32 - ipv4->mask)));
+		char addr_str[INET_ADDRSTRLEN] = { 0 };
+		if (!inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str)))
+			return NULL;
+		res = filter_bpf_printf("ip %s net %s/%u", dir, addr_str, ipv4->mask);
+
+	} else if (!strcmp(proto_name, "ipv6") && !strcmp(type, "ipv6")) {
+
+		struct ptype_ipv6_val *ipv6 = v->value;
+		if (!ipv6->mask)
+			return NULL;
+
+		struct in6_addr addr;
+		memcpy(&addr, &ipv6->addr, sizeof(struct in6_addr));
+		int i;
+		for (i = 0; i < 16; i++) {
+			int bits = ipv6->mask - (i * 8);
+			if (bits >= 8)
+				continue;
+			addr.s6_addr[i] &= (bits > 0 ? (0xff << (8 - bits)) & 0xff : 0);
+		}
+		char addr_str[INET6_ADDRSTRLEN] = { 0 };
+		if (!inet_ntop(AF_INET6, &addr, addr_str, sizeof(addr_str)))
+			return NULL;
+		res = filter_bpf_printf("ip6 %s net %s/%u", dir, addr_str, ipv6->mask);
+
+	} else {
+		return NULL;
+	}
+
+	if (!res)
+		return NULL;
+
+	*exact = 1;
+
+	if (op == FILTER_OP_NEQ) {
+		char *tmp = filter_bpf_printf("%s and not (%s)", proto_bpf, res);
+		free(res);
+		res = tmp;
+	}
+
+	return res;
+}
+
+// Returns NULL when the expression can't be restricted, exact is set when it matches exactly the same packets
+static char *filter_bpf_node(struct filter_node *n, int *exact) {
+
+	char *res = NULL;
+
+	if (n->type[0] == filter_value_type_node && n->type[1] == filter_value_type_node) {
+
+		int exact_a = 0, exact_b = 0;
+		char *a = filter_bpf_node(n->value[0].node, &exact_a);
+		char *b = filter_bpf_node(n->value[1].node, &exact_b);
+		*exact = exact_a && exact_b;
+
+		if (n->op == FILTER_OP_AND) {
+			// Dropping one side of an AND makes the result broader, which is fine
+			if (!a)
+				res = b;
+			else if (!b)
+				res = a;
+			else
+				res = filter_bpf_join(a, "and", b);
+		} else if (n->op == FILTER_OP_OR && a && b) {
+			res = filter_bpf_join(a, "or", b);
+		} else {
+			free(a);
+			free(b);
+		}
+
+		if (!res)
+			*exact = 0;
+
+	} else {
+		res = filter_bpf_leaf(n, exact);
+	}
+
+	if (!n->not)
+		return res;
+
+	// The negation of a broader expression would be narrower
+	if (!*exact) {
+		free(res);
+		return NULL;
+	}
+
+	char *tmp = filter_bpf_printf("not (%s)", res);
+	free(res);
+
+	if (!tmp)
+		*exact = 0;
+
+	return tmp;
+}
+
+char *filter_packet_bpf(struct proto *proto, struct filter_node *n) {
+
+	char *proto_bpf = filter_bpf_proto(proto);
+
+	int exact = 0;
+	char *res = (n ? filter_bpf_node(n, &exact) : NULL);
+
+	if (!proto_bpf)
+		return res;
+
+	if (!res)
+		return strdup(proto_bpf);
+
+	char *tmp = filter_bpf_printf("%s and (%s)", proto_bpf, res);
+	free(res);
+
+	return tmp;
+}
+
 int filter_packet_match(struct filter_node *n, struct proto_process_stack *stack) {
 
+	if (n->prog)
+		return filter_prog_run(n->prog, stack);
+
 	int res = FILTER_MATCH_NO;
 
 	if (n->type[0] == filter_value_type_node && n->type[1] == filter_value_type_node) {
@@ -989,7 +1863,8 @@ int filter_packet(char *filter_expr, struct filter_node **filter) {
 	}
 
 	filter_raw_cleanup(fr);
-	return POM_OK;
+
+	return filter_packet_prog_compile(*filter);
 }
 
 int filter_event(char *filter_expr, struct event_reg *evt_reg, struct filter_node **filter) {
@@ -1070,6 +1945,8 @@ void filter_cleanup(struct filter_node *n) {
 				free(n->value[i].data_raw.key);
 		}
 	}
+
+	filter_prog_cleanup(n->prog);
 	
 	free(n);
 
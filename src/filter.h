@@ -98,6 +98,83 @@ struct filter_node {
 	enum filter_value_type type[2];
 	union filter_value value[2];
 
+	struct filter_prog *prog; // Compiled version of the filter, only set on the root node
+
+};
+
+// Maximum number of different protos a compiled packet filter can reference
+#define FILTER_PROG_REG_MAX	16
+
+enum filter_insn_type {
+	filter_insn_const = 0, // Load a constant result
+	filter_insn_not, // Invert the result
+	filter_insn_jmp_false, // Jump if the result is false
+	filter_insn_jmp_true, // Jump if the result is true
+	filter_insn_proto, // Proto or field is present
+	filter_insn_cmp, // Compare a field with a value through its ptype
+	filter_insn_cmp_field, // Compare two fields through their ptype
+	filter_insn_cmp_uint8,
+	filter_insn_cmp_uint16,
+	filter_insn_cmp_uint32,
+	filter_insn_cmp_uint64,
+	filter_insn_cmp_ipv4,
+	filter_insn_cmp_mac,
+	filter_insn_leaf, // Result of a comparison shared in a filter set
+};
+
+struct filter_insn {
+
+	enum filter_insn_type type;
+	int op;
+
+	// Proto register and field of the operands
+	unsigned int reg[2];
+	int field_id[2];
+
+	unsigned int jmp; // Target of the jumps
+	int swap; // The field is the right operand of a generic comparison
+
+	union {
+		uint64_t integer;
+		struct {
+			uint32_t addr;
+			unsigned char mask;
+		} ipv4;
+		char mac[6];
+		struct ptype *ptype;
+	} val;
+
+};
+
+struct filter_prog {
+
+	struct filter_insn *insns;
+	unsigned int insn_count, insn_size;
+
+	// Each proto referenced has a register holding its position in the stack
+	struct proto *regs[FILTER_PROG_REG_MAX];
+	unsigned int reg_count;
+
+};
+
+// Maximum number of filters in a set, each one gets a bit in the result
+#define FILTER_SET_MAX		64
+
+// Maximum number of different comparisons in a set
+#define FILTER_SET_LEAF_MAX	256
+
+// Set of packet filters evaluated together, comparisons found in several filters are only evaluated once
+struct filter_set {
+
+	struct filter_prog *progs[FILTER_SET_MAX]; // NULL when the filter always matches
+	unsigned int count;
+
+	struct filter_insn *leaves;
+	unsigned int leaf_count;
+
+	struct proto *regs[FILTER_PROG_REG_MAX];
+	unsigned int reg_count;
+
 };
 
 
@@ -141,7 +218,16 @@ int filter_pload_compile(struct filter_node **filter, struct filter_raw_node *fi
 
 int filter_node_data_match(struct filter_node *n, struct data *d);
 
+int filter_packet_prog_compile(struct filter_node *n);
+void filter_prog_cleanup(struct filter_prog *prog);
 int filter_packet_match(struct filter_node *n, struct proto_process_stack *stack);
+
+struct filter_set *filter_set_alloc();
+int filter_set_add(struct filter_set *set, struct filter_node *n);
+uint64_t filter_set_match(struct filter_set *set, struct proto_process_stack *stack);
+void filter_set_cleanup(struct filter_set *set);
+
+char *filter_packet_bpf(struct proto *proto, struct filter_node *n);
 int filter_event_match(struct filter_node *n, struct event *evt);
 int filter_pload_match(struct filter_node *n, struct pload *p);
 
@@ -420,6 +420,9 @@ void *input_process_thread(void *param) {
 
 	__sync_fetch_and_and(&i->running, ~INPUT_RUN_RUNNING);
 
+	core_queue_thread_cleanup();
+	packet_pool_cleanup();
+
 	registry_perf_timeticks_stop(i->perf_runtime);
 	pomlog("Input %s stopped", i->name);
 
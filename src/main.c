@@ -440,6 +440,7 @@ int main(int argc, char *argv[]) {
 	event_finish();
 	registry_cleanup();
 	timers_cleanup();
+	packet_cleanup();
 
 	mod_unload_all();
 
@@ -20,6 +20,15 @@
 
 #include "decoder_base64.h"
 
+#ifdef DECODER_BASE64_SIMD
+#include <immintrin.h>
+#endif
+
+// Decode as many blocks of valid characters as possible, returns the number of input bytes used
+static size_t (*decoder_base64_decode_blocks) (unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) = NULL;
+
+static unsigned char decoder_base64_table[256];
+
 struct mod_reg_info *decoder_base64_reg_info() {
 
 	static struct mod_reg_info reg_info;
@@ -35,6 +44,27 @@ struct mod_reg_info *decoder_base64_reg_info() {
 
 static int decoder_base64_mod_register(struct mod_reg *mod) {
 
+	// Characters outside of the alphabet such as line breaks are ignored as per RFC 2045
+	memset(decoder_base64_table, DECODER_BASE64_SKIP, sizeof(decoder_base64_table));
+	unsigned char i;
+	for (i = 0; i < 26; i++) {
+		decoder_base64_table['A' + i] = i;
+		decoder_base64_table['a' + i] = i + 26;
+	}
+	for (i = 0; i < 10; i++)
+		decoder_base64_table['0' + i] = i + 52;
+	decoder_base64_table['+'] = 62;
+	decoder_base64_table['/'] = 63;
+	decoder_base64_table['='] = DECODER_BASE64_PAD;
+
+#ifdef DECODER_BASE64_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		decoder_base64_decode_blocks = decoder_base64_decode_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		decoder_base64_decode_blocks = decoder_base64_decode_ssse3;
+#endif
+
 	static struct decoder_reg_info dec_base64 = { 0 };
 	dec_base64.mod = mod;
 	dec_base64.alloc = decoder_base64_alloc;
@@ -78,110 +108,174 @@ static size_t decoder_base64_estimate_size(size_t encoded_size) {
 	return (encoded_size / 4) * 3 + 1;
 }
 
-int decoder_base64_decode(struct decoder *dec) {
+#ifdef DECODER_BASE64_SIMD
 
+// The vectorized kernels map each character to its value with nibble lookups and stop at the
+// first block containing a character outside of the alphabet, the scalar code handles the rest
 
-	struct decoder_base64_priv *priv = dec->priv;
+__attribute__ ((target ("ssse3")))
+static size_t decoder_base64_decode_ssse3(unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) {
 
-	if (dec->priv && priv->buff_len) {
-		int i;
-		for (i = 0; i < (4 - priv->buff_len) && i < dec->avail_in; i++) {
-			priv->buff[priv->buff_len + i] = dec->next_in[i];
-		}
-		priv->buff_len += i;
-		dec->avail_in -= i;
-		dec->next_in += i;
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
 
-		if (priv->buff_len < 4)
-			return DEC_OK;
+	size_t done = 0;
 
-		// Setup a temporary struct decoder to decode these 3 bytes
-		struct decoder tmp_dec = { 0 };
-		tmp_dec.avail_in = 4;
-		tmp_dec.next_in = priv->buff;
-		tmp_dec.avail_out = dec->avail_out;
-		tmp_dec.next_out = dec->next_out;
+	// Each block of 16 characters gives 12 bytes but 16 are written
+	while (in_len - done >= 16 && out_len - (done / 4) * 3 >= 16) {
+		__m128i str = _mm_loadu_si128((__m128i *) (in + done));
 
-		int res = decoder_base64_decode(&tmp_dec);
-		dec->avail_out = tmp_dec.avail_out;
-		dec->next_out = tmp_dec.next_out;
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		__m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
 
-		if (res != DEC_OK)
-			return res;
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+			break;
 
+		__m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
 
-		// Discard our buffer
-		priv->buff_len = 0;
+		// Merge the 6 bits values into 24 bits groups and put them in network order
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, pack);
 
+		_mm_storeu_si128((__m128i *) (out + (done / 4) * 3), str);
+		done += 16;
 	}
 
-	char value[4];
-	int res = DEC_OK;
+	return done;
+}
 
-	while (dec->avail_in >= 4 && dec->avail_out >= 4) {
-		char *block = dec->next_in;
-		int i;
-		for (i = 0; i < 4; i++) {
-			if (block[i] >= 'A' && block[i] <= 'Z') {
-				value[i] = block[i] - 'A';
-			} else if (block[i] >= 'a' && block[i] <= 'z') {
-				value[i] = block[i] - 'a' + 26;
-			} else if (block[i] >= '0' && block[i] <= '9') {
-				value[i] = block[i] - '0' + 52;
-			} else if (block[i] == '+') {
-				value[i] = 62;
-			} else if (block[i] == '/') {
-				value[i] = 63;
-			} else if (block[i] == '=') {
-				value[i] = 0;
-			}
-		}
-		
-		char *output = dec->next_out;
-		if (block[1] == '=') {
-			res = DEC_END;
+__attribute__ ((target ("avx2")))
+static size_t decoder_base64_decode_avx2(unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) {
+
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+						0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+						0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+						0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+						2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+	size_t done = 0;
+
+	// Each block of 32 characters gives 24 bytes but 32 are written
+	while (in_len - done >= 32 && out_len - (done / 4) * 3 >= 32) {
+		__m256i str = _mm256_loadu_si256((__m256i *) (in + done));
+
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+		if (!_mm256_testz_si256(lo, hi))
 			break;
+
+		__m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		// Join the 12 bytes of each lane
+		str = _mm256_permutevar8x32_epi32(str, pack_lanes);
+
+		_mm256_storeu_si256((__m256i *) (out + (done / 4) * 3), str);
+		done += 32;
+	}
+
+	return done;
+}
+
+#endif
+
+int decoder_base64_decode(struct decoder *dec) {
+
+	struct decoder_base64_priv *priv = dec->priv;
+
+	unsigned char *in = (unsigned char *) dec->next_in;
+	unsigned char *out = (unsigned char *) dec->next_out;
+	size_t in_len = dec->avail_in, out_len = dec->avail_out;
+	int res = DEC_OK;
+
+	while (in_len) {
+
+		if (!priv->quad_len && decoder_base64_decode_blocks) {
+			size_t done = decoder_base64_decode_blocks(in, in_len, out, out_len);
+			in += done;
+			in_len -= done;
+			out += (done / 4) * 3;
+			out_len -= (done / 4) * 3;
+			if (!in_len)
+				break;
 		}
-		output[0] = ((value[0] << 2) | (0x3 & (value[1] >> 4)));
-		dec->avail_out--;
-		dec->next_out++;
 
-		if (block[2] == '=') {
-			res = DEC_END;
-			break;
+		unsigned char value = decoder_base64_table[*in];
+
+		if (value == DECODER_BASE64_SKIP) {
+			in++;
+			in_len--;
+			continue;
 		}
-		output[1] = ((value[1] << 4) | (0xf & (value[2] >> 2)));
-		dec->avail_out--;
-		dec->next_out++;
 
-		if (block[3] == '=') {
+		if (value == DECODER_BASE64_PAD) {
+			// Output what remains of the last group
+			if (priv->quad_len >= 2) {
+				if (out_len < priv->quad_len - 1) {
+					res = DEC_MORE;
+					break;
+				}
+				out[0] = (priv->quad[0] << 2) | (priv->quad[1] >> 4);
+				if (priv->quad_len == 3)
+					out[1] = (priv->quad[1] << 4) | (priv->quad[2] >> 2);
+				out += priv->quad_len - 1;
+				out_len -= priv->quad_len - 1;
+			}
+			priv->quad_len = 0;
+
+			// Nothing else is decoded after the padding
+			in += in_len;
+			in_len = 0;
 			res = DEC_END;
 			break;
 		}
-		output[2] = ((value[2] << 6) | value[3]);
-		dec->avail_out--;
-		dec->next_out++;
 
-		dec->next_in += 4;
-		dec->avail_in -= 4;
+		if (priv->quad_len == 3) {
+			if (out_len < 3) {
+				res = DEC_MORE;
+				break;
+			}
+			out[0] = (priv->quad[0] << 2) | (priv->quad[1] >> 4);
+			out[1] = (priv->quad[1] << 4) | (priv->quad[2] >> 2);
+			out[2] = (priv->quad[2] << 6) | value;
+			out += 3;
+			out_len -= 3;
+			priv->quad_len = 0;
+		} else {
+			priv->quad[priv->quad_len++] = value;
+		}
 
+		in++;
+		in_len--;
 	}
 
+	dec->next_in = (char *) in;
+	dec->avail_in = in_len;
+	dec->next_out = (char *) out;
+	dec->avail_out = out_len;
+
 	if (dec->avail_out > 0)
 		*dec->next_out = 0;
 
-	if (dec->avail_in > 0) {
-		memcpy(priv->buff, dec->next_in, dec->avail_in);
-		priv->buff[dec->avail_in] = 0;
-		priv->buff_len = dec->avail_in;
-		dec->next_in += dec->avail_in;
-		dec->avail_in = 0;
-	}
-
-	if (res == DEC_END) {
-		dec->next_in += 4;
-		dec->avail_in -= 4;
-	}
-
 	return res;
 }
@@ -24,9 +24,17 @@
 
 #include <pom-ng/decoder.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODER_BASE64_SIMD
+#endif
+
+// Values of the decoding table which are not part of the alphabet
+#define DECODER_BASE64_PAD	0x40
+#define DECODER_BASE64_SKIP	0x80
+
 struct decoder_base64_priv {
-	char buff[5];
-	int buff_len;
+	unsigned char quad[4]; // Values of the incomplete group of 4 characters
+	unsigned int quad_len;
 };
 
 struct mod_reg_info *decoder_base64_reg_info();
@@ -40,4 +48,9 @@ static int decoder_base64_cleanup(struct decoder *dec);
 static size_t decoder_base64_estimate_size(size_t encoded_size);
 static int decoder_base64_decode(struct decoder *dec);
 
+#ifdef DECODER_BASE64_SIMD
+static size_t decoder_base64_decode_ssse3(unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+static size_t decoder_base64_decode_avx2(unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+#endif
+
 #endif
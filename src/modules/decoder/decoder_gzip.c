@@ -22,6 +22,8 @@
 #include <zlib.h>
 
 #define DECODER_GZIP_DEFAULT_SIZE 4096
+// Expected compression ratio of the payloads, used to size the output buffers
+#define DECODER_GZIP_RATIO_ESTIMATE 4
 
 struct mod_reg_info *decoder_gzip_reg_info() {
 
@@ -105,12 +107,14 @@ static int decoder_gzip_cleanup(struct decoder *dec) {
 
 static size_t decoder_gzip_estimate_size(size_t encoded_size) {
 
+	size_t size = encoded_size * DECODER_GZIP_RATIO_ESTIMATE;
+
 	long pagesize = sysconf(_SC_PAGESIZE);
-	
-	if (pagesize)
-		return pagesize;
+	if (pagesize <= 0)
+		pagesize = DECODER_GZIP_DEFAULT_SIZE;
 
-	return DECODER_GZIP_DEFAULT_SIZE;
+	// Round up to a full page
+	return (size / pagesize + 1) * pagesize;
 }
 
 static int decoder_gzip_decode(struct decoder *dec) {
@@ -127,7 +131,8 @@ static int decoder_gzip_decode(struct decoder *dec) {
 
 	int res = DEC_OK;
 	int zres = inflate(zbuff, Z_SYNC_FLUSH);
-	if (zres != Z_OK && zres != Z_STREAM_END) {
+	// Z_BUF_ERROR only means that no progress was possible, like when called without input
+	if (zres != Z_OK && zres != Z_STREAM_END && zres != Z_BUF_ERROR) {
 		char *msg = zbuff->msg;
 		if (!msg)
 			msg = "Unknown error";
@@ -0,0 +1,606 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2014 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <pom-ng/input.h>
+#include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_bool.h>
+#include <pom-ng/ptype_uint32.h>
+
+#include <pom-ng/registry.h>
+
+#include <pom-ng/packet.h>
+#include <pom-ng/core.h>
+
+#include "input_afpacket.h"
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+static unsigned int input_afpacket_fanout_id = 0;
+
+struct mod_reg_info* input_afpacket_reg_info() {
+	static struct mod_reg_info reg_info;
+	memset(&reg_info, 0, sizeof(struct mod_reg_info));
+	reg_info.api_ver = MOD_API_VER;
+	reg_info.register_func = input_afpacket_mod_register;
+	reg_info.unregister_func = input_afpacket_mod_unregister;
+	reg_info.dependencies = "proto_ethernet, ptype_string, ptype_bool, ptype_uint32";
+
+	return &reg_info;
+}
+
+
+static int input_afpacket_mod_register(struct mod_reg *mod) {
+
+	static struct input_reg_info in_afpacket;
+	memset(&in_afpacket, 0, sizeof(struct input_reg_info));
+	in_afpacket.name = "afpacket";
+	in_afpacket.description = "Read packets from a live interface using multiple AF_PACKET mmap rings";
+	in_afpacket.flags = INPUT_REG_FLAG_LIVE;
+	in_afpacket.mod = mod;
+	in_afpacket.init = input_afpacket_init;
+	in_afpacket.open = input_afpacket_open;
+	in_afpacket.read = input_afpacket_read;
+	in_afpacket.close = input_afpacket_close;
+	in_afpacket.cleanup = input_afpacket_cleanup;
+	in_afpacket.interrupt = input_afpacket_interrupt;
+
+	return input_register(&in_afpacket);
+
+}
+
+static int input_afpacket_mod_unregister() {
+
+	return input_unregister("afpacket");
+}
+
+static int input_afpacket_perf_dropped(uint64_t *value, void *priv) {
+
+	struct input_afpacket_priv *p = priv;
+
+	// Reading the statistics resets them so accumulate them
+	unsigned int i;
+	for (i = 0; p->rings && i < p->ring_count; i++) {
+		struct tpacket_stats_v3 st = { 0 };
+		socklen_t len = sizeof(st);
+		if (!getsockopt(p->rings[i]->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len))
+			__sync_fetch_and_add(&p->dropped, st.tp_drops);
+	}
+
+	*value = p->dropped;
+
+	return POM_OK;
+}
+
+static int input_afpacket_init(struct input *i) {
+
+	struct input_afpacket_priv *priv;
+	priv = malloc(sizeof(struct input_afpacket_priv));
+	if (!priv) {
+		pom_oom(sizeof(struct input_afpacket_priv));
+		return POM_ERR;
+	}
+	memset(priv, 0, sizeof(struct input_afpacket_priv));
+
+	struct registry_param *p = NULL;
+
+	priv->p_interface = ptype_alloc("string");
+	priv->p_promisc = ptype_alloc("bool");
+	priv->p_threads = ptype_alloc("uint32");
+	priv->p_fanout_mode = ptype_alloc("string");
+	priv->p_block_size = ptype_alloc_unit("uint32", "bytes");
+	priv->p_block_count = ptype_alloc_unit("uint32", "blocks");
+	if (!priv->p_interface || !priv->p_promisc || !priv->p_threads || !priv->p_fanout_mode || !priv->p_block_size || !priv->p_block_count)
+		goto err;
+
+	priv->perf_dropped = registry_instance_add_perf(i->reg_instance, "dropped_pkt", registry_perf_type_counter, "Dropped packets", "pkts");
+	if (!priv->perf_dropped)
+		goto err;
+
+	registry_perf_set_update_hook(priv->perf_dropped, input_afpacket_perf_dropped, priv);
+
+	// Use the first interface which isn't loopback as default
+	char *dev = "<none>";
+	struct if_nameindex *ifs = if_nameindex(), *tmp;
+	if (!ifs) {
+		pomlog(POMLOG_WARN "Warning, could not list the interfaces : %s", pom_strerror(errno));
+	} else {
+		for (tmp = ifs; tmp->if_index; tmp++) {
+			if (strcmp(tmp->if_name, "lo")) {
+				dev = tmp->if_name;
+				break;
+			}
+		}
+	}
+
+	p = registry_new_param("interface", dev, priv->p_interface, "Interface to capture packets from", 0);
+
+	if (ifs) {
+		for (tmp = ifs; tmp->if_index; tmp++) {
+			if (registry_param_info_add_value(p, tmp->if_name) != POM_OK) {
+				if_freenameindex(ifs);
+				goto err;
+			}
+		}
+		if_freenameindex(ifs);
+	}
+
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("promisc", "no", priv->p_promisc, "Promiscious mode", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("threads", "2", priv->p_threads, "Number of capture threads, each with its own ring", 0);
+	if (registry_param_info_set_min_max(p, 1, INPUT_AFPACKET_THREADS_MAX) != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("fanout_mode", "hash", priv->p_fanout_mode, "How the kernel spreads the packets among the capture threads", 0);
+	if (registry_param_info_add_value(p, "hash") != POM_OK ||
+		registry_param_info_add_value(p, "lb") != POM_OK ||
+		registry_param_info_add_value(p, "cpu") != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("block_size", "1048576", priv->p_block_size, "Size of each block of the rings, must be a multiple of the page size", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("block_count", "64", priv->p_block_count, "Number of blocks in each ring", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	i->priv = priv;
+
+	return POM_OK;
+
+err:
+
+	if (priv->p_interface)
+		ptype_cleanup(priv->p_interface);
+
+	if (priv->p_promisc)
+		ptype_cleanup(priv->p_promisc);
+
+	if (priv->p_threads)
+		ptype_cleanup(priv->p_threads);
+
+	if (priv->p_fanout_mode)
+		ptype_cleanup(priv->p_fanout_mode);
+
+	if (priv->p_block_size)
+		ptype_cleanup(priv->p_block_size);
+
+	if (priv->p_block_count)
+		ptype_cleanup(priv->p_block_count);
+
+	if (p)
+		registry_cleanup_param(p);
+
+	free(priv);
+
+	return POM_ERR;
+
+}
+
+static int input_afpacket_open(struct input *i) {
+
+	struct input_afpacket_priv *priv = i->priv;
+
+	char *interface = PTYPE_STRING_GETVAL(priv->p_interface);
+	int ifindex = if_nametoindex(interface);
+	if (!ifindex) {
+		pomlog(POMLOG_ERR "Interface %s not found", interface);
+		return POM_ERR;
+	}
+
+	uint32_t block_size = *PTYPE_UINT32_GETVAL(priv->p_block_size);
+	if (!block_size || block_size % getpagesize() || block_size % INPUT_AFPACKET_FRAME_SIZE) {
+		pomlog(POMLOG_ERR "Invalid block size %u, it must be a multiple of the page size", block_size);
+		return POM_ERR;
+	}
+
+	priv->datalink_proto = proto_get("ethernet");
+	if (!priv->datalink_proto) {
+		pomlog(POMLOG_ERR "Cannot open input afpacket : protocol ethernet not registered");
+		return POM_ERR;
+	}
+
+	int fanout = -1;
+	unsigned int threads = *PTYPE_UINT32_GETVAL(priv->p_threads);
+	if (threads > 1) {
+		// All the rings join the same fanout group so that the kernel spreads the packets among them
+		char *mode_str = PTYPE_STRING_GETVAL(priv->p_fanout_mode);
+		int mode;
+		if (!strcmp(mode_str, "hash")) {
+			// Keep the fragments of a packet together
+			mode = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+		} else if (!strcmp(mode_str, "lb")) {
+			mode = PACKET_FANOUT_LB;
+		} else if (!strcmp(mode_str, "cpu")) {
+			mode = PACKET_FANOUT_CPU;
+		} else {
+			pomlog(POMLOG_ERR "Invalid fanout mode \"%s\"", mode_str);
+			return POM_ERR;
+		}
+
+		unsigned int group = (getpid() + __sync_fetch_and_add(&input_afpacket_fanout_id, 1)) & 0xFFFF;
+		fanout = group | (mode << 16);
+	}
+
+	priv->rings = malloc(sizeof(struct input_afpacket_ring *) * threads);
+	if (!priv->rings) {
+		pom_oom(sizeof(struct input_afpacket_ring *) * threads);
+		return POM_ERR;
+	}
+	memset(priv->rings, 0, sizeof(struct input_afpacket_ring *) * threads);
+
+	priv->stop = 0;
+	priv->error = 0;
+	priv->dropped = 0;
+
+	for (priv->ring_count = 0; priv->ring_count < threads; priv->ring_count++) {
+		struct input_afpacket_ring *r = input_afpacket_ring_open(i, ifindex, fanout);
+		if (!r)
+			goto err;
+		r->id = priv->ring_count;
+		priv->rings[priv->ring_count] = r;
+	}
+
+	// The first ring is read by the input thread, the others have their own thread
+	unsigned int j;
+	for (j = 1; j < priv->ring_count; j++) {
+		if (pthread_create(&priv->rings[j]->thread, NULL, input_afpacket_thread_func, priv->rings[j])) {
+			pomlog(POMLOG_ERR "Error while creating a capture thread : %s", pom_strerror(errno));
+			priv->stop = 1;
+			while (--j > 0)
+				pthread_join(priv->rings[j]->thread, NULL);
+			goto err;
+		}
+	}
+
+	pomlog(POMLOG_DEBUG "Capturing on interface %s with %u rings", interface, priv->ring_count);
+
+	return POM_OK;
+
+err:
+	for (j = 0; j < priv->ring_count; j++)
+		input_afpacket_ring_release(priv->rings[j]);
+	free(priv->rings);
+	priv->rings = NULL;
+	priv->ring_count = 0;
+
+	return POM_ERR;
+}
+
+static struct input_afpacket_ring *input_afpacket_ring_open(struct input *i, int ifindex, int fanout) {
+
+	struct input_afpacket_priv *priv = i->priv;
+
+	struct input_afpacket_ring *r = malloc(sizeof(struct input_afpacket_ring));
+	if (!r) {
+		pom_oom(sizeof(struct input_afpacket_ring));
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct input_afpacket_ring));
+	r->map = MAP_FAILED;
+	r->input = i;
+	r->priv = priv;
+	r->refcount = 1;
+
+	r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (r->fd == -1) {
+		pomlog(POMLOG_ERR "Error while creating the packet socket : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+		pomlog(POMLOG_ERR "Error while setting TPACKET_V3 : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	struct tpacket_req3 req = { 0 };
+	req.tp_block_size = *PTYPE_UINT32_GETVAL(priv->p_block_size);
+	req.tp_block_nr = *PTYPE_UINT32_GETVAL(priv->p_block_count);
+	req.tp_frame_size = INPUT_AFPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+	req.tp_retire_blk_tov = INPUT_AFPACKET_BLOCK_TIMEOUT;
+
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		pomlog(POMLOG_ERR "Error while creating the ring with %u blocks of %u bytes : %s", req.tp_block_nr, req.tp_block_size, pom_strerror(errno));
+		goto err;
+	}
+
+	r->map_size = (size_t) req.tp_block_size * req.tp_block_nr;
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		pomlog(POMLOG_ERR "Error while mapping the ring : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	r->block_count = req.tp_block_nr;
+	r->blocks = malloc(sizeof(struct input_afpacket_block) * r->block_count);
+	if (!r->blocks) {
+		pom_oom(sizeof(struct input_afpacket_block) * r->block_count);
+		goto err;
+	}
+	memset(r->blocks, 0, sizeof(struct input_afpacket_block) * r->block_count);
+
+	unsigned int j;
+	for (j = 0; j < r->block_count; j++) {
+		r->blocks[j].desc = r->map + ((size_t) j * req.tp_block_size);
+		r->blocks[j].ring = r;
+	}
+
+	struct sockaddr_ll sll = { 0 };
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *) &sll, sizeof(sll))) {
+		pomlog(POMLOG_ERR "Error while binding the packet socket : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	if (*PTYPE_BOOL_GETVAL(priv->p_promisc)) {
+		struct packet_mreq mr = { 0 };
+		mr.mr_ifindex = ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)))
+			pomlog(POMLOG_WARN "Error while setting promisc mode : %s", pom_strerror(errno));
+	}
+
+	if (fanout != -1 && setsockopt(r->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))) {
+		pomlog(POMLOG_ERR "Error while joining the fanout group : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	return r;
+
+err:
+	input_afpacket_ring_release(r);
+
+	return NULL;
+}
+
+static void input_afpacket_ring_release(struct input_afpacket_ring *r) {
+
+	// The ring goes away once the input and all the packets are done with it
+	if (__sync_sub_and_fetch(&r->refcount, 1))
+		return;
+
+	if (r->map != MAP_FAILED)
+		munmap(r->map, r->map_size);
+
+	if (r->fd != -1)
+		close(r->fd);
+
+	free(r->blocks);
+	free(r);
+}
+
+static void input_afpacket_block_release(void *priv) {
+
+	struct input_afpacket_block *b = priv;
+
+	if (__sync_sub_and_fetch(&b->refcount, 1))
+		return;
+
+	// Nobody uses the block anymore, give it back to the kernel
+	struct input_afpacket_ring *r = b->ring;
+	__sync_synchronize();
+	b->desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	__sync_synchronize();
+	b->held = 0;
+
+	input_afpacket_ring_release(r);
+}
+
+static int input_afpacket_ring_read(struct input_afpacket_ring *r) {
+
+	struct input_afpacket_block *b = &r->blocks[r->cur_block];
+
+	if (b->held) {
+		// Packets from the previous round are still being processed
+		usleep(INPUT_AFPACKET_BLOCK_WAIT);
+		return POM_OK;
+	}
+
+	if (!(b->desc->hdr.bh1.block_status & TP_STATUS_USER)) {
+		struct pollfd pfd = { 0 };
+		pfd.fd = r->fd;
+		pfd.events = POLLIN | POLLERR;
+		if (poll(&pfd, 1, INPUT_AFPACKET_POLL_TIMEOUT) == -1 && errno != EINTR) {
+			pomlog(POMLOG_ERR "Error while polling the packet socket : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+		return POM_OK;
+	}
+
+	__sync_synchronize();
+
+	// The block holds a reference on the ring and we hold one on the block while reading it
+	__sync_fetch_and_add(&r->refcount, 1);
+	b->refcount = 1;
+	b->held = 1;
+
+	int res = POM_OK;
+	unsigned int pkt_count = b->desc->hdr.bh1.num_pkts, j;
+	struct tpacket3_hdr *hdr = (void *) b->desc + b->desc->hdr.bh1.offset_to_first_pkt;
+	for (j = 0; j < pkt_count; j++) {
+		if (input_afpacket_queue_packet(r, b, hdr) != POM_OK) {
+			res = POM_ERR;
+			break;
+		}
+		hdr = (void *) hdr + hdr->tp_next_offset;
+	}
+
+	r->cur_block++;
+	if (r->cur_block >= r->block_count)
+		r->cur_block = 0;
+
+	input_afpacket_block_release(b);
+
+	return res;
+}
+
+static int input_afpacket_queue_packet(struct input_afpacket_ring *r, struct input_afpacket_block *b, struct tpacket3_hdr *hdr) {
+
+	struct input_afpacket_priv *priv = r->priv;
+
+	if (hdr->tp_len > hdr->tp_snaplen && !priv->warning) {
+		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", r->input->name);
+		priv->warning = 1;
+	}
+
+	struct packet *pkt = packet_alloc();
+	if (!pkt)
+		return POM_ERR;
+
+	unsigned char *data = (unsigned char *) hdr + hdr->tp_mac;
+
+	if ((hdr->tp_status & TP_STATUS_VLAN_VALID) && hdr->tp_snaplen >= 2 * ETH_ALEN) {
+		// The kernel stripped the VLAN tag, put it back in a copy of the packet
+		if (packet_buffer_alloc(pkt, hdr->tp_snaplen + 4, 2) != POM_OK) {
+			packet_release(pkt);
+			return POM_ERR;
+		}
+		uint16_t tpid = (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) ? hdr->hv1.tp_vlan_tpid : ETH_P_8021Q;
+		uint16_t tag[2] = { htons(tpid), htons(hdr->hv1.tp_vlan_tci) };
+		unsigned char *buff = pkt->buff;
+		memcpy(buff, data, 2 * ETH_ALEN);
+		memcpy(buff + 2 * ETH_ALEN, tag, sizeof(tag));
+		memcpy(buff + 2 * ETH_ALEN + sizeof(tag), data + 2 * ETH_ALEN, hdr->tp_snaplen - 2 * ETH_ALEN);
+	} else {
+		// Point directly to the ring, the block will be returned once the packet is released
+		__sync_fetch_and_add(&b->refcount, 1);
+		packet_buffer_wrap(pkt, data, hdr->tp_snaplen, input_afpacket_block_release, b);
+	}
+
+	pkt->input = r->input;
+	pkt->datalink = priv->datalink_proto;
+	pkt->ts = ((ptime) hdr->tp_sec * 1000000UL) + (hdr->tp_nsec / 1000);
+
+	// Keep both directions of a flow on the same processing thread
+	unsigned int flags = CORE_QUEUE_DROP_IF_FULL;
+	uint32_t hash = 0;
+	if (core_flow_hash(pkt, &hash) == POM_OK)
+		flags |= CORE_QUEUE_HAS_THREAD_AFFINITY;
+
+	return core_queue_packet(pkt, flags, hash);
+}
+
+static void *input_afpacket_thread_func(void *priv) {
+
+	struct input_afpacket_ring *r = priv;
+	struct input_afpacket_priv *p = r->priv;
+
+	while (!p->stop) {
+		if (input_afpacket_ring_read(r) != POM_OK) {
+			pomlog(POMLOG_ERR "Error while reading from ring %u of input %s", r->id, r->input->name);
+			p->error = 1;
+			break;
+		}
+	}
+
+	core_queue_thread_cleanup();
+	packet_pool_cleanup();
+
+	return NULL;
+}
+
+static int input_afpacket_read(struct input *i) {
+
+	struct input_afpacket_priv *priv = i->priv;
+
+	if (priv->error)
+		return POM_ERR;
+
+	return input_afpacket_ring_read(priv->rings[0]);
+}
+
+static int input_afpacket_close(struct input *i) {
+
+	struct input_afpacket_priv *priv = i->priv;
+
+	if (!priv->rings)
+		return POM_OK;
+
+	priv->stop = 1;
+
+	unsigned int j;
+	for (j = 1; j < priv->ring_count; j++) {
+		if (pthread_join(priv->rings[j]->thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining capture thread %u : %s", j, pom_strerror(errno));
+	}
+
+	uint64_t dropped = 0;
+	input_afpacket_perf_dropped(&dropped, priv);
+	pomlog(POMLOG_INFO "interface %s stats : %"PRIu64" pkts dropped by the kernel", PTYPE_STRING_GETVAL(priv->p_interface), dropped);
+
+	// Rings with blocks still in use will be released with the last packet
+	struct input_afpacket_ring **rings = priv->rings;
+	unsigned int ring_count = priv->ring_count;
+	priv->rings = NULL;
+	priv->ring_count = 0;
+	for (j = 0; j < ring_count; j++)
+		input_afpacket_ring_release(rings[j]);
+	free(rings);
+
+	priv->datalink_proto = NULL;
+	priv->warning = 0;
+
+	return POM_OK;
+}
+
+static int input_afpacket_cleanup(struct input *i) {
+
+	struct input_afpacket_priv *priv = i->priv;
+
+	ptype_cleanup(priv->p_interface);
+	ptype_cleanup(priv->p_promisc);
+	ptype_cleanup(priv->p_threads);
+	ptype_cleanup(priv->p_fanout_mode);
+	ptype_cleanup(priv->p_block_size);
+	ptype_cleanup(priv->p_block_count);
+	free(priv);
+
+	return POM_OK;
+}
+
+static int input_afpacket_interrupt(struct input *i) {
+
+	// Interrupt poll() in the input thread, the capture threads will stop at close time
+	pthread_kill(i->thread, SIGCHLD);
+	return POM_OK;
+}
@@ -0,0 +1,100 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2014 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __INPUT_AFPACKET_H__
+#define __INPUT_AFPACKET_H__
+
+#include <linux/if_packet.h>
+
+// Each capture thread uses a core queue producer slot
+#define INPUT_AFPACKET_THREADS_MAX	8
+
+#define INPUT_AFPACKET_FRAME_SIZE	2048
+
+// Time in ms after which the kernel hands over a partially filled block
+#define INPUT_AFPACKET_BLOCK_TIMEOUT	10
+
+// Time in ms to wait for a block before checking if we should stop
+#define INPUT_AFPACKET_POLL_TIMEOUT	100
+
+// Time in us to wait when the next block is still used by some packets
+#define INPUT_AFPACKET_BLOCK_WAIT	500
+
+struct input_afpacket_ring;
+
+struct input_afpacket_block {
+	struct tpacket_block_desc *desc;
+	unsigned int refcount; // Packets pointing to the block + 1 while it's being read
+	volatile int held; // The block is not yet returned to the kernel
+	struct input_afpacket_ring *ring;
+};
+
+struct input_afpacket_ring {
+	unsigned int id;
+	int fd;
+	void *map;
+	size_t map_size;
+	struct input_afpacket_block *blocks;
+	unsigned int block_count, cur_block;
+	unsigned int refcount; // 1 for the input + 1 per block held
+
+	struct input *input;
+	struct input_afpacket_priv *priv;
+	pthread_t thread;
+};
+
+struct input_afpacket_priv {
+	struct ptype *p_interface;
+	struct ptype *p_promisc;
+	struct ptype *p_threads;
+	struct ptype *p_fanout_mode;
+	struct ptype *p_block_size;
+	struct ptype *p_block_count;
+	struct registry_perf *perf_dropped;
+
+	struct proto *datalink_proto;
+	struct input_afpacket_ring **rings;
+	unsigned int ring_count;
+	uint64_t dropped;
+
+	int stop; // Tell the capture threads to stop
+	int error; // A capture thread encountered an error
+	int warning;
+};
+
+static int input_afpacket_mod_register(struct mod_reg *mod);
+static int input_afpacket_mod_unregister();
+
+static int input_afpacket_perf_dropped(uint64_t *value, void *priv);
+static int input_afpacket_init(struct input *i);
+static int input_afpacket_open(struct input *i);
+static struct input_afpacket_ring *input_afpacket_ring_open(struct input *i, int ifindex, int fanout);
+static void input_afpacket_ring_release(struct input_afpacket_ring *r);
+static void input_afpacket_block_release(void *priv);
+static int input_afpacket_ring_read(struct input_afpacket_ring *r);
+static int input_afpacket_queue_packet(struct input_afpacket_ring *r, struct input_afpacket_block *b, struct tpacket3_hdr *hdr);
+static void *input_afpacket_thread_func(void *priv);
+static int input_afpacket_read(struct input *i);
+static int input_afpacket_close(struct input *i);
+static int input_afpacket_cleanup(struct input *i);
+static int input_afpacket_interrupt(struct input *i);
+
+#endif
@@ -36,6 +36,10 @@
 #include <regex.h>
 #include <stddef.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 struct mod_reg_info* input_pcap_reg_info() {
 	static struct mod_reg_info reg_info;
@@ -61,7 +65,7 @@ static int input_pcap_mod_register(struct mod_reg *mod) {
 	in_pcap_interface.mod = mod;
 	in_pcap_interface.init = input_pcap_interface_init;
 	in_pcap_interface.open = input_pcap_interface_open;
-	in_pcap_interface.read = input_pcap_read;
+	in_pcap_interface.read = input_pcap_interface_read;
 	in_pcap_interface.close = input_pcap_close;
 	in_pcap_interface.cleanup = input_pcap_cleanup;
 	in_pcap_interface.interrupt = input_pcap_interrupt;
@@ -89,7 +93,7 @@ static int input_pcap_mod_register(struct mod_reg *mod) {
 	in_pcap_dir.init = input_pcap_dir_init;
 	// Do the open at read() time because scanning can take quite some time
 	//in_pcap_dir.open = input_pcap_dir_open;
-	in_pcap_dir.read = input_pcap_read;
+	in_pcap_dir.read = input_pcap_dir_read;
 	in_pcap_dir.close = input_pcap_close;
 	in_pcap_dir.cleanup = input_pcap_cleanup;
 	in_pcap_dir.interrupt = input_pcap_interrupt;
@@ -166,16 +170,11 @@ static int input_pcap_set_filter(pcap_t *p, char *filter) {
 	return POM_OK;
 }
 
-static int input_pcap_common_open(struct input *i) {
-
-	struct input_pcap_priv *priv = i->priv;
-
-	if (!priv || !priv->p)
-		return POM_ERR;
+static int input_pcap_datalink_setup(struct input_pcap_priv *priv, pcap_t *p) {
 
 	char *datalink = "undefined";
 
-	priv->datalink_type = pcap_datalink(priv->p);
+	priv->datalink_type = pcap_datalink(p);
 	switch (priv->datalink_type) {
 		case DLT_IEEE802_11:
 			datalink = "80211";
@@ -224,6 +223,20 @@ static int input_pcap_common_open(struct input *i) {
 
 	if (!priv->datalink_proto) {
 		pomlog(POMLOG_ERR "Cannot open input pcap : protocol %s not registered", datalink);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int input_pcap_common_open(struct input *i) {
+
+	struct input_pcap_priv *priv = i->priv;
+
+	if (!priv || !priv->p)
+		return POM_ERR;
+
+	if (input_pcap_datalink_setup(priv, priv->p) != POM_OK) {
 		input_pcap_close(i);
 		return POM_ERR;
 	}
@@ -258,6 +271,102 @@ static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv) {
 	return POM_OK;
 }
 
+static int input_pcap_interface_rx_packets(char *interface, uint64_t *rx_packets) {
+
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", interface);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return POM_ERR;
+
+	unsigned long long value = 0;
+	int res = fscanf(f, "%llu", &value);
+	fclose(f);
+
+	if (res != 1)
+		return POM_ERR;
+
+	*rx_packets = value;
+
+	return POM_OK;
+}
+
+static int input_pcap_interface_perf_avoided(uint64_t *value, void *priv) {
+
+	struct input_pcap_priv *p = priv;
+
+	*value = 0;
+
+	if (!p || !p->p || !*PTYPE_BOOL_GETVAL(p->tpriv.iface.p_auto_filter))
+		return POM_OK;
+
+	// Packets seen by the interface but never handed to us
+	uint64_t rx_packets = 0;
+	struct pcap_stat ps;
+	if (input_pcap_interface_rx_packets(PTYPE_STRING_GETVAL(p->tpriv.iface.p_interface), &rx_packets) != POM_OK || pcap_stats(p->p, &ps))
+		return POM_OK;
+
+	rx_packets -= p->tpriv.iface.rx_base;
+	if (rx_packets > ps.ps_recv)
+		*value = rx_packets - ps.ps_recv;
+
+	return POM_OK;
+}
+
+static int input_pcap_interface_auto_filter(struct input_pcap_priv *priv) {
+
+	char *user_filter = PTYPE_STRING_GETVAL(priv->p_filter);
+	char *auto_filter = core_capture_filter_get();
+
+	char *filter = user_filter;
+	if (auto_filter) {
+		size_t len = strlen(user_filter) + strlen(auto_filter) + 16;
+		filter = malloc(len);
+		if (!filter) {
+			free(auto_filter);
+			pom_oom(len);
+			return POM_ERR;
+		}
+		if (strlen(user_filter))
+			snprintf(filter, len, "(%s) and (%s)", user_filter, auto_filter);
+		else
+			snprintf(filter, len, "%s", auto_filter);
+		free(auto_filter);
+	}
+
+	// An empty filter matches everything
+	struct bpf_program fp;
+	if (pcap_compile(priv->p, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		pomlog(POMLOG_WARN "Unable to compile the capture filter \"%s\" : %s", filter, pcap_geterr(priv->p));
+		if (filter == user_filter)
+			return POM_ERR;
+
+		// Keep the filter of the user only
+		free(filter);
+		filter = user_filter;
+		if (pcap_compile(priv->p, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+			return POM_ERR;
+	}
+
+	if (pcap_setfilter(priv->p, &fp) == -1) {
+		pomlog(POMLOG_ERR "Unable to set the capture filter \"%s\" : %s", filter, pcap_geterr(priv->p));
+		pcap_freecode(&fp);
+		if (filter != user_filter)
+			free(filter);
+		return POM_ERR;
+	}
+
+	pcap_freecode(&fp);
+
+	pomlog(POMLOG_DEBUG "Capture filter set to \"%s\"", filter);
+
+	if (filter != user_filter)
+		free(filter);
+
+	return POM_OK;
+}
+
 static int input_pcap_interface_init(struct input *i) {
 
 	if (input_pcap_common_init(i) != POM_OK)
@@ -270,7 +379,8 @@ static int input_pcap_interface_init(struct input *i) {
 	priv->tpriv.iface.p_interface = ptype_alloc("string");
 	priv->tpriv.iface.p_promisc = ptype_alloc("bool");
 	priv->tpriv.iface.p_buff_size = ptype_alloc_unit("uint32", "bytes");
-	if (!priv->tpriv.iface.p_interface || !priv->tpriv.iface.p_promisc || !priv->tpriv.iface.p_buff_size)
+	priv->tpriv.iface.p_auto_filter = ptype_alloc("bool");
+	if (!priv->tpriv.iface.p_interface || !priv->tpriv.iface.p_promisc || !priv->tpriv.iface.p_buff_size || !priv->tpriv.iface.p_auto_filter)
 		goto err;
 
 	priv->tpriv.iface.perf_dropped = registry_instance_add_perf(i->reg_instance, "dropped_pkt", registry_perf_type_counter, "Dropped packets", "pkts");
@@ -279,6 +389,12 @@ static int input_pcap_interface_init(struct input *i) {
 
 	registry_perf_set_update_hook(priv->tpriv.iface.perf_dropped, input_pcap_interface_perf_dropped, priv);
 
+	priv->tpriv.iface.perf_avoided = registry_instance_add_perf(i->reg_instance, "avoided_pkt", registry_perf_type_counter, "Packets not captured thanks to the automatic filter", "pkts");
+	if (!priv->tpriv.iface.perf_avoided)
+		goto err;
+
+	registry_perf_set_update_hook(priv->tpriv.iface.perf_avoided, input_pcap_interface_perf_avoided, priv);
+
 	char err[PCAP_ERRBUF_SIZE] = { 0 };
 	char *dev = "<none>";
 	pcap_if_t *alldevsp = NULL;
@@ -313,6 +429,10 @@ static int input_pcap_interface_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("auto_filter", "no", priv->tpriv.iface.p_auto_filter, "Only capture the packets needed by the packet listeners when nothing else is analyzed", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
 	priv->type = input_pcap_type_interface;
 
 	return POM_OK;
@@ -328,6 +448,9 @@ err:
 	if (priv->tpriv.iface.p_buff_size)
 		ptype_cleanup(priv->tpriv.iface.p_buff_size);
 
+	if (priv->tpriv.iface.p_auto_filter)
+		ptype_cleanup(priv->tpriv.iface.p_auto_filter);
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -370,6 +493,11 @@ static int input_pcap_interface_open(struct input *i) {
 		pomlog(POMLOG_WARN "Warning while activating pcap : %s", pcap_statustostr(err));
 	}
 
+	// The automatic filter will be installed by the first read
+	p->tpriv.iface.filter_serial = 0;
+	p->tpriv.iface.rx_base = 0;
+	input_pcap_interface_rx_packets(interface, &p->tpriv.iface.rx_base);
+
 	return input_pcap_common_open(i);
 
 }
@@ -442,7 +570,9 @@ static int input_pcap_dir_init(struct input *i) {
 	struct registry_param *p = NULL;
 	priv->tpriv.dir.p_dir = ptype_alloc("string");
 	priv->tpriv.dir.p_match = ptype_alloc("string");
-	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match)
+	priv->tpriv.dir.p_parallel = ptype_alloc_unit("uint32", "files");
+	priv->tpriv.dir.p_index = ptype_alloc("string");
+	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match || !priv->tpriv.dir.p_parallel || !priv->tpriv.dir.p_index)
 		goto err;
 
 	p = registry_new_param("directory", "/tmp", priv->tpriv.dir.p_dir, "Directory containing pcap files", 0);
@@ -453,6 +583,16 @@ static int input_pcap_dir_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("parallel_files", "2", priv->tpriv.dir.p_parallel, "Number of files read ahead concurrently, their packets are merged by timestamp", 0);
+	if (registry_param_info_set_min_max(p, 1, INPUT_PCAP_DIR_PARALLEL_MAX) != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("index_file", INPUT_PCAP_DIR_INDEX_DEFAULT, priv->tpriv.dir.p_index, "File caching the timestamp of the first packet of each file, relative to the directory. Empty to disable", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
 	priv->type = input_pcap_type_dir;
 	
 	return POM_OK;
@@ -462,6 +602,15 @@ err:
 	if (priv->tpriv.dir.p_dir)
 		ptype_cleanup(priv->tpriv.dir.p_dir);
 
+	if (priv->tpriv.dir.p_match)
+		ptype_cleanup(priv->tpriv.dir.p_match);
+
+	if (priv->tpriv.dir.p_parallel)
+		ptype_cleanup(priv->tpriv.dir.p_parallel);
+
+	if (priv->tpriv.dir.p_index)
+		ptype_cleanup(priv->tpriv.dir.p_index);
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -481,7 +630,14 @@ static int input_pcap_dir_open(struct input *i) {
 
 	pomlog(POMLOG_INFO "Scanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
 
-	int found = input_pcap_dir_browse(p);
+	// The index is only needed for the initial scan, new files found later on won't be in it
+	struct input_pcap_dir_index *index = NULL;
+	if (input_pcap_dir_index_load(p, &index) != POM_OK)
+		return POM_ERR;
+
+	int found = input_pcap_dir_browse(p, index);
+
+	input_pcap_dir_index_cleanup(index);
 
 	if (dp->interrupt_scan)
 		return POM_ERR;
@@ -490,31 +646,155 @@ static int input_pcap_dir_open(struct input *i) {
 		return POM_ERR;
 
 	pomlog(POMLOG_INFO "Found %u files", found);
-	
-	dp->cur_file = dp->files;
 
-	// Skip files which were not read
-	while (dp->cur_file && !dp->cur_file->first_pkt)
-		dp->cur_file = dp->cur_file->next;
+	struct input_pcap_dir_file *tmp;
+	for (tmp = dp->files; tmp && !tmp->first_pkt; tmp = tmp->next);
 
-	if (!dp->cur_file) {
+	if (!tmp) {
 		pomlog(POMLOG_ERR "No useable file found");
 		return POM_ERR;
 	}
 
-	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
-	p->p = pcap_open_offline(dp->cur_file->full_path, errbuf);
-	if (!p->p) {
-		pomlog(POMLOG_ERR "Error opening %s for reading", dp->cur_file->full_path);
+	dp->cur_file = NULL;
+	dp->rescanned = 0;
+
+	return POM_OK;
+}
+
+static char *input_pcap_dir_index_path(struct input_pcap_priv *priv) {
+
+	char *index = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_index);
+	if (!strlen(index))
+		return NULL;
+
+	if (*index == '/')
+		return strdup(index);
+
+	char *dir = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_dir);
+	size_t len = strlen(dir) + strlen(index) + 2;
+	char *path = malloc(len);
+	if (!path) {
+		pom_oom(len);
+		return NULL;
+	}
+	strcpy(path, dir);
+	if (*path && path[strlen(path) - 1] != '/')
+		strcat(path, "/");
+	strcat(path, index);
+
+	return path;
+}
+
+static int input_pcap_dir_index_load(struct input_pcap_priv *priv, struct input_pcap_dir_index **index) {
+
+	char *path = input_pcap_dir_index_path(priv);
+	if (!path)
+		return POM_OK;
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			pomlog(POMLOG_WARN "Unable to open index file %s : %s", path, pom_strerror(errno));
+		free(path);
+		return POM_OK;
+	}
+
+	// Each line is "<first pkt> <mtime> <size> <filename>"
+	char line[INPUT_PCAP_DIR_INDEX_LINE_MAX];
+	unsigned int count = 0;
+	while (fgets(line, sizeof(line), f)) {
+
+		size_t len = strlen(line);
+		if (!len || line[len - 1] != '\n')
+			continue;
+		line[len - 1] = 0;
+
+		uint64_t first_pkt, mtime, size;
+		int name_pos = 0;
+		if (sscanf(line, "%"SCNu64" %"SCNu64" %"SCNu64" %n", &first_pkt, &mtime, &size, &name_pos) != 3 || !name_pos || !line[name_pos])
+			continue;
+
+		struct input_pcap_dir_index *idx = malloc(sizeof(struct input_pcap_dir_index));
+		if (!idx) {
+			pom_oom(sizeof(struct input_pcap_dir_index));
+			break;
+		}
+		memset(idx, 0, sizeof(struct input_pcap_dir_index));
+		idx->filename = strdup(line + name_pos);
+		if (!idx->filename) {
+			free(idx);
+			pom_oom(strlen(line + name_pos) + 1);
+			break;
+		}
+		idx->first_pkt = first_pkt;
+		idx->mtime = mtime;
+		idx->size = size;
+
+		HASH_ADD_KEYPTR(hh, *index, idx->filename, strlen(idx->filename), idx);
+		count++;
+	}
+
+	fclose(f);
+
+	pomlog(POMLOG_DEBUG "Loaded %u entries from index file %s", count, path);
+	free(path);
+
+	return POM_OK;
+}
+
+static int input_pcap_dir_index_save(struct input_pcap_priv *priv) {
+
+	char *path = input_pcap_dir_index_path(priv);
+	if (!path)
+		return POM_OK;
+
+	// Write a new file and rename it so that a partial index is never used
+	char *tmp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+	if (!tmp_path) {
+		pom_oom(strlen(path) + strlen(".tmp") + 1);
+		free(path);
 		return POM_ERR;
 	}
+	strcpy(tmp_path, path);
+	strcat(tmp_path, ".tmp");
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		pomlog(POMLOG_WARN "Unable to write index file %s : %s", tmp_path, pom_strerror(errno));
+		free(tmp_path);
+		free(path);
+		return POM_OK;
+	}
+
+	struct input_pcap_dir_file *tmp;
+	for (tmp = priv->tpriv.dir.files; tmp; tmp = tmp->next) {
+		if (!tmp->first_pkt || strchr(tmp->filename, '\n'))
+			continue;
+		fprintf(f, "%"PRIu64" %"PRIu64" %"PRIu64" %s\n", (uint64_t) tmp->first_pkt, (uint64_t) tmp->mtime, (uint64_t) tmp->size, tmp->filename);
+	}
 
-	pomlog("Reading file %s", dp->cur_file->filename);
+	if (fclose(f) || rename(tmp_path, path)) {
+		pomlog(POMLOG_WARN "Unable to write index file %s : %s", path, pom_strerror(errno));
+		unlink(tmp_path);
+	}
 
-	return input_pcap_common_open(i);
+	free(tmp_path);
+	free(path);
+
+	return POM_OK;
 }
 
-static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
+static void input_pcap_dir_index_cleanup(struct input_pcap_dir_index *index) {
+
+	struct input_pcap_dir_index *cur, *tmp;
+	HASH_ITER(hh, index, cur, tmp) {
+		HASH_DEL(index, cur);
+		free(cur->filename);
+		free(cur);
+	}
+}
+
+static int input_pcap_dir_browse(struct input_pcap_priv *priv, struct input_pcap_dir_index *index) {
 
 	// Open the directory
 	char *path = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_dir);
@@ -534,6 +814,7 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 		char errbuf[256] = { 0 };
 		regerror(errcode, &preg, errbuf, sizeof(errbuf) - 1);
 		pomlog(POMLOG_ERR "Error while compiling regex \"%s\" : %s", match, errbuf);
+		closedir(dir);
 		return POM_ERR;
 	}
 
@@ -542,8 +823,14 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 	struct dirent *buf, *de;
 	size_t len = offsetof(struct dirent, d_name) + pathconf(path, _PC_NAME_MAX) + 1;
 	buf = malloc(len);
+	if (!buf) {
+		pom_oom(len);
+		regfree(&preg);
+		closedir(dir);
+		return POM_ERR;
+	}
 
-	int tot_files = 0;
+	int tot_files = 0, index_updated = 0;
 
 	while (!priv->tpriv.dir.interrupt_scan) {
 
@@ -585,8 +872,9 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 		// Alloc the new file
 		struct input_pcap_dir_file *cur = malloc(sizeof(struct input_pcap_dir_file));
 		if (!cur) {
-			free(cur->full_path);
 			regfree(&preg);
+			free(buf);
+			closedir(dir);
 			pom_oom(sizeof(struct input_pcap_dir_file));
 			return POM_ERR;
 		}
@@ -594,7 +882,10 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 
 		cur->full_path = malloc(strlen(path) + strlen(buf->d_name) + 2);
 		if (!cur->full_path) {
+			free(cur);
 			regfree(&preg);
+			free(buf);
+			closedir(dir);
 			pom_oom(strlen(path) + strlen(buf->d_name) + 2);
 			return POM_ERR;
 		}
@@ -604,39 +895,50 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 		cur->filename = cur->full_path + strlen(cur->full_path);
 		strcat(cur->full_path, buf->d_name);
 
-		// Get the time of the first packet
-		pcap_t *p = pcap_open_offline(cur->full_path, errbuf);
-		if (!p) {
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Unable to open file %s : %s", cur->full_path, errbuf);
-			continue;
-		}
-	
-		if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+		struct stat st;
+		if (stat(cur->full_path, &st)) {
 			cur->next = priv->tpriv.dir.files;
 			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Could not set filter on file %s", cur->full_path);
+			pomlog(POMLOG_WARN "Unable to stat file %s : %s", cur->full_path, pom_strerror(errno));
 			continue;
 		}
+		cur->mtime = st.st_mtime;
+		cur->size = st.st_size;
+
+		// Use the index if the file didn't change
+		struct input_pcap_dir_index *idx = NULL;
+		HASH_FIND(hh, index, cur->filename, strlen(cur->filename), idx);
+		if (idx && idx->mtime == (uint64_t) cur->mtime && idx->size == (uint64_t) cur->size) {
+			cur->first_pkt = idx->first_pkt;
+		} else {
 
-		const u_char *next_pkt;
-		struct pcap_pkthdr *phdr;
+			// Get the time of the first packet
+			pcap_t *p = pcap_open_offline(cur->full_path, errbuf);
+			if (!p) {
+				cur->next = priv->tpriv.dir.files;
+				priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
+				pomlog(POMLOG_WARN "Unable to open file %s : %s", cur->full_path, errbuf);
+				continue;
+			}
 
-		int result = pcap_next_ex(p, &phdr, &next_pkt);
+			const u_char *next_pkt;
+			struct pcap_pkthdr *phdr;
 
-		if (result <= 0) {
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Could not read first packet from file %s", cur->full_path);
-			free(cur->full_path);
+			int result = pcap_next_ex(p, &phdr, &next_pkt);
+
+			if (result <= 0) {
+				cur->next = priv->tpriv.dir.files;
+				priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
+				pomlog(POMLOG_WARN "Could not read first packet from file %s", cur->full_path);
+				pcap_close(p);
+				continue;
+			}
+
+			cur->first_pkt = pom_timeval_to_ptime(phdr->ts);
 			pcap_close(p);
-			continue;
+			index_updated = 1;
 		}
 
-		cur->first_pkt = pom_timeval_to_ptime(phdr->ts);
-		pcap_close(p);
-
 		// Add the packet at the right position
 		tmp = priv->tpriv.dir.files;
 
@@ -676,132 +978,437 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 	if (priv->tpriv.dir.interrupt_scan)
 		return 0;
 
+	if (index_updated && input_pcap_dir_index_save(priv) != POM_OK)
+		return POM_ERR;
+
 	return tot_files;
 
 }
 
-static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
+static void *input_pcap_dir_reader_func(void *priv) {
 
-	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+	struct input_pcap_dir_reader *r = priv;
 
-	int rescanned = 0;
-	do {
-		if (!dp->cur_file->next) { // No more file
-			if (!rescanned) {
-				// Rescan the directory for possible new files
-				pomlog(POMLOG_INFO "Rescanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
-				int new_found = input_pcap_dir_browse(p);
-				if (dp->interrupt_scan)
-					return POM_OK;
-				if (new_found == POM_ERR)
-					return POM_ERR;
-				pomlog(POMLOG_INFO "Found %u new files", new_found);
-				rescanned = 1;
-				continue;
-			} else {
-				dp->cur_file = NULL;
-				return POM_OK;
+	while (1) {
+
+		struct pcap_pkthdr *phdr;
+		const u_char *data;
+		struct packet *pkt = NULL;
+
+		int result = pcap_next_ex(r->p, &phdr, &data);
+		int error = 0;
+		if (result == 1) {
+			pkt = input_pcap_packet_alloc(r->input, phdr, data);
+			if (!pkt) {
+				pomlog(POMLOG_ERR "Unable to allocate a packet while reading file %s", r->file->filename);
+				error = 1;
 			}
+		} else if (result == -1) {
+			pomlog(POMLOG_WARN "Error while reading packet from file %s : %s. Moving on the next file ...", r->file->filename, pcap_geterr(r->p));
 		}
 
-		dp->cur_file = dp->cur_file->next;
+		pom_mutex_lock(&r->lock);
 
+		while (pkt && !r->stop && r->count >= INPUT_PCAP_DIR_READAHEAD)
+			pthread_cond_wait(&r->cond, &r->lock);
 
-		char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
-		p->p = pcap_open_offline(dp->cur_file->full_path, errbuf);
-		if (!p->p || input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while opening next file %s in the directory : %s. Skipping", dp->cur_file->filename, errbuf);
-			continue;
+		if (!pkt || r->stop) {
+			r->error = error;
+			r->eof = 1;
+			pthread_cond_signal(&r->cond);
+			pom_mutex_unlock(&r->lock);
+			if (pkt)
+				packet_release(pkt);
+			break;
 		}
 
-		if (input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while setting filter on file %s", dp->cur_file->filename);
-			continue;
+		r->pkts[(r->head + r->count) % INPUT_PCAP_DIR_READAHEAD] = pkt;
+		r->count++;
+		pthread_cond_signal(&r->cond);
+
+		pom_mutex_unlock(&r->lock);
+	}
+
+	packet_pool_cleanup();
+
+	return NULL;
+}
+
+static struct input_pcap_dir_reader *input_pcap_dir_reader_open(struct input *i, struct input_pcap_dir_file *file) {
+
+	struct input_pcap_priv *p = i->priv;
+	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
+
+	FILE *f = fopen(file->full_path, "r");
+	if (!f) {
+		pomlog(POMLOG_WARN "Error while opening file %s : %s. Skipping", file->filename, pom_strerror(errno));
+		return NULL;
+	}
+
+	// Files are read from start to end, let the kernel read ahead more aggressively
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	pcap_t *pcap = pcap_fopen_offline(f, errbuf);
+	if (!pcap) {
+		fclose(f);
+		pomlog(POMLOG_WARN "Error while opening file %s : %s. Skipping", file->filename, errbuf);
+		return NULL;
+	}
+
+	if (!p->datalink_proto) {
+		// First file, the other ones need the same datalink
+		if (input_pcap_datalink_setup(p, pcap) != POM_OK) {
+			pcap_close(pcap);
+			p->datalink_proto = NULL;
+			return NULL;
 		}
+	} else if (pcap_datalink(pcap) != p->datalink_type) {
+		pcap_close(pcap);
+		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", file->filename);
+		return NULL;
+	}
 
-		// Make sure this file has the same datalink as the previous one
-		if (pcap_datalink(p->p) == p->datalink_type)
-			break;
+	if (input_pcap_set_filter(pcap, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
+		pcap_close(pcap);
+		pomlog(POMLOG_WARN "Error while setting filter on file %s. Skipping", file->filename);
+		return NULL;
+	}
 
-		pcap_close(p->p);
-		p->p = NULL;
-		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", dp->cur_file->filename);
+	struct input_pcap_dir_reader *r = malloc(sizeof(struct input_pcap_dir_reader));
+	if (!r) {
+		pcap_close(pcap);
+		pom_oom(sizeof(struct input_pcap_dir_reader));
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct input_pcap_dir_reader));
+	r->input = i;
+	r->file = file;
+	r->p = pcap;
+
+	if (pthread_mutex_init(&r->lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the reader lock : %s", pom_strerror(errno));
+		goto err_pcap;
+	}
+
+	if (pthread_cond_init(&r->cond, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the reader condition : %s", pom_strerror(errno));
+		goto err_lock;
+	}
+
+	if (pthread_create(&r->thread, NULL, input_pcap_dir_reader_func, r)) {
+		pomlog(POMLOG_ERR "Error while creating the reader thread : %s", pom_strerror(errno));
+		goto err_cond;
+	}
+
+	pomlog("Reading file %s", file->filename);
+
+	return r;
+
+err_cond:
+	pthread_cond_destroy(&r->cond);
+err_lock:
+	pthread_mutex_destroy(&r->lock);
+err_pcap:
+	pcap_close(pcap);
+	free(r);
+	return NULL;
+}
+
+static struct packet *input_pcap_dir_reader_peek(struct input_pcap_dir_reader *r) {
 
-	} while (1);
+	pom_mutex_lock(&r->lock);
+	while (!r->count && !r->eof)
+		pthread_cond_wait(&r->cond, &r->lock);
 
-	pomlog("Reading file %s", dp->cur_file->filename);
+	struct packet *pkt = NULL;
+	if (r->count)
+		pkt = r->pkts[r->head];
+	pom_mutex_unlock(&r->lock);
+
+	return pkt;
+}
+
+static struct packet *input_pcap_dir_reader_pop(struct input_pcap_dir_reader *r) {
+
+	pom_mutex_lock(&r->lock);
+	struct packet *pkt = r->pkts[r->head];
+	r->head = (r->head + 1) % INPUT_PCAP_DIR_READAHEAD;
+	r->count--;
+	pthread_cond_signal(&r->cond);
+	pom_mutex_unlock(&r->lock);
+
+	return pkt;
+}
+
+static void input_pcap_dir_reader_close(struct input_pcap_dir_reader *r) {
+
+	pom_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->cond);
+	pom_mutex_unlock(&r->lock);
+
+	if (pthread_join(r->thread, NULL))
+		pomlog(POMLOG_WARN "Error while joining the reader thread of file %s", r->file->filename);
+
+	while (r->count) {
+		packet_release(r->pkts[r->head]);
+		r->head = (r->head + 1) % INPUT_PCAP_DIR_READAHEAD;
+		r->count--;
+	}
+
+	pcap_close(r->p);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+static int input_pcap_dir_heap_push(struct input_pcap_dir_priv *dp, struct input_pcap_dir_reader *r) {
+
+	if (dp->heap_count >= dp->heap_size) {
+		unsigned int new_size = dp->heap_size ? dp->heap_size * 2 : INPUT_PCAP_DIR_PARALLEL_MAX;
+		struct input_pcap_dir_reader **heap = realloc(dp->heap, sizeof(struct input_pcap_dir_reader *) * new_size);
+		if (!heap) {
+			pom_oom(sizeof(struct input_pcap_dir_reader *) * new_size);
+			return POM_ERR;
+		}
+		dp->heap = heap;
+		dp->heap_size = new_size;
+	}
+
+	unsigned int pos = dp->heap_count++;
+	while (pos) {
+		unsigned int parent = (pos - 1) / 2;
+		if (dp->heap[parent]->next_ts <= r->next_ts)
+			break;
+		dp->heap[pos] = dp->heap[parent];
+		pos = parent;
+	}
+	dp->heap[pos] = r;
 
 	return POM_OK;
 }
 
-/*
- * common input pcap functions
- */
+static void input_pcap_dir_heap_sift_down(struct input_pcap_dir_priv *dp) {
 
-static int input_pcap_read(struct input *i) {
+	if (!dp->heap_count)
+		return;
+
+	struct input_pcap_dir_reader *r = dp->heap[0];
+	unsigned int pos = 0;
+	while (1) {
+		unsigned int child = pos * 2 + 1;
+		if (child >= dp->heap_count)
+			break;
+		if (child + 1 < dp->heap_count && dp->heap[child + 1]->next_ts < dp->heap[child]->next_ts)
+			child++;
+		if (r->next_ts <= dp->heap[child]->next_ts)
+			break;
+		dp->heap[pos] = dp->heap[child];
+		pos = child;
+	}
+	dp->heap[pos] = r;
+}
+
+static int input_pcap_dir_open_next(struct input *i) {
 
 	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	dp->cur_file = (dp->cur_file ? dp->cur_file->next : dp->files);
+
+	// Skip files which were not read
+	if (!dp->cur_file->first_pkt)
+		return POM_OK;
 
-	if (p->type == input_pcap_type_dir && !p->tpriv.dir.files) {
+	struct input_pcap_dir_reader *r = input_pcap_dir_reader_open(i, dp->cur_file);
+	if (!r)
+		return POM_OK;
+
+	struct packet *pkt = input_pcap_dir_reader_peek(r);
+	if (!pkt) {
+		// Nothing to read in this file
+		int error = r->error;
+		input_pcap_dir_reader_close(r);
+		return (error ? POM_ERR : POM_OK);
+	}
+	r->next_ts = pkt->ts;
+
+	if (input_pcap_dir_heap_push(dp, r) != POM_OK) {
+		input_pcap_dir_reader_close(r);
+		return POM_ERR;
+	}
+
+	dp->rescanned = 0;
+
+	return POM_OK;
+}
+
+static int input_pcap_dir_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	if (!dp->files) {
 		if (input_pcap_dir_open(i) != POM_OK) {
 			// Don't error out if the scan was interrupted
-			if (p->tpriv.dir.interrupt_scan)
+			if (dp->interrupt_scan)
 				return POM_OK;
 			return POM_ERR;
 		}
 	}
 
+	unsigned int parallel = *PTYPE_UINT32_GETVAL(dp->p_parallel);
+
+	while (1) {
+		struct input_pcap_dir_file *next = (dp->cur_file ? dp->cur_file->next : dp->files);
+
+		if (next) {
+			// Keep up to parallel files read ahead and always open the next file
+			// if it starts before the oldest packet we have
+			if (!dp->heap_count || dp->heap_count < parallel || next->first_pkt <= dp->heap[0]->next_ts) {
+				if (input_pcap_dir_open_next(i) != POM_OK)
+					return POM_ERR;
+				continue;
+			}
+		} else if (!dp->heap_count) {
+			// No more file
+			if (dp->rescanned)
+				return input_stop(i);
+
+			// Rescan the directory for possible new files
+			pomlog(POMLOG_INFO "Rescanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
+			int new_found = input_pcap_dir_browse(p, NULL);
+			if (dp->interrupt_scan)
+				return POM_OK;
+			if (new_found == POM_ERR)
+				return POM_ERR;
+			pomlog(POMLOG_INFO "Found %u new files", new_found);
+			dp->rescanned = 1;
+			continue;
+		}
+
+		break;
+	}
+
+	// Queue the oldest packet of all the files
+	struct input_pcap_dir_reader *r = dp->heap[0];
+	struct packet *pkt = input_pcap_dir_reader_pop(r);
+
+	int error = 0;
+	struct packet *next_pkt = input_pcap_dir_reader_peek(r);
+	if (next_pkt) {
+		r->next_ts = next_pkt->ts;
+	} else {
+		// Done with this file
+		error = r->error;
+		dp->heap[0] = dp->heap[--dp->heap_count];
+		input_pcap_dir_reader_close(r);
+	}
+	input_pcap_dir_heap_sift_down(dp);
+
+	if (input_pcap_packet_queue(i, pkt) != POM_OK)
+		return POM_ERR;
+
+	// Don't silently skip the rest of the file
+	return (error ? POM_ERR : POM_OK);
+}
+
+/*
+ * common input pcap functions
+ */
+
+static int input_pcap_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
 	struct pcap_pkthdr *phdr;
 	const u_char *data;
 	int result = pcap_next_ex(p->p, &phdr, &data);
-	if (phdr->len > phdr->caplen && !p->warning) {
-		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
-		p->warning = 1;
+
+	if (result == -2) // EOF
+		return input_stop(i);
+
+	if (result < 0) {
+		pomlog(POMLOG_ERR "Error while reading file : %s", pcap_geterr(p->p));
+		return POM_ERR;
 	}
 
-	if (result < 0) { // End of file or error 
+	if (result == 0) // Timeout
+		return POM_OK;
 
-		if (p->type == input_pcap_type_dir) {
+	return input_pcap_queue_packet(i, phdr, data);
+}
 
-			if (result != -2)
-				pomlog(POMLOG_WARN "Error while reading packet from file : %s. Moving on the next file ...", pcap_geterr(p->p), p->tpriv.dir.cur_file->filename);
-			
-			pcap_close(p->p);
-			p->p = NULL;
-			p->warning = 0;
+static void input_pcap_dispatch_handler(u_char *user, const struct pcap_pkthdr *phdr, const u_char *data) {
 
-			if (input_pcap_dir_open_next(p) != POM_OK)
-				return POM_ERR;
+	struct input *i = (struct input *) user;
+	struct input_pcap_priv *p = i->priv;
 
-			if (!p->tpriv.dir.cur_file) {
-				// No more file
-				return input_stop(i);
-			}
+	if (p->dispatch_res != POM_OK)
+		return;
 
-			result = pcap_next_ex(p->p, &phdr, &data);
-			if (result < 0) {
-				pomlog(POMLOG_ERR "Error while reading first packet of new file");
-				return POM_ERR;
-			}
-		} else {
-			if (result == -2) // EOF
-				return input_stop(i);
+	if (input_pcap_queue_packet(i, phdr, data) != POM_OK) {
+		p->dispatch_res = POM_ERR;
+		pcap_breakloop(p->p);
+	}
+}
 
-			pomlog(POMLOG_ERR "Error while reading file : %s", pcap_geterr(p->p));
-			return POM_ERR;
+static int input_pcap_interface_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	// Install a new capture filter when the packets we need changed
+	if (*PTYPE_BOOL_GETVAL(p->tpriv.iface.p_auto_filter)) {
+		unsigned int serial = core_capture_filter_get_serial();
+		if (serial != p->tpriv.iface.filter_serial) {
+			p->tpriv.iface.filter_serial = serial;
+			if (input_pcap_interface_auto_filter(p) != POM_OK)
+				return POM_ERR;
 		}
 	}
 
-	if (result == 0) // Timeout
-		return POM_OK;
+	// Unlike pcap_next_ex(), pcap_dispatch() gives us the packets straight
+	// from the capture ring without copying them in an intermediate buffer
+	p->dispatch_res = POM_OK;
+	int result = pcap_dispatch(p->p, INPUT_PCAP_DISPATCH_MAX, input_pcap_dispatch_handler, (u_char *) i);
 
-	struct packet *pkt = packet_alloc();
+	if (p->dispatch_res != POM_OK)
+		return POM_ERR;
+
+	if (result == -1) {
+		pomlog(POMLOG_ERR "Error while reading from interface : %s", pcap_geterr(p->p));
+		return POM_ERR;
+	}
+
+	// A result of -2 means that the read was interrupted
+	return POM_OK;
+}
+
+static int input_pcap_queue_packet(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data) {
+
+	struct packet *pkt = input_pcap_packet_alloc(i, phdr, data);
 	if (!pkt)
 		return POM_ERR;
 
+	return input_pcap_packet_queue(i, pkt);
+}
+
+static struct packet *input_pcap_packet_alloc(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	if (phdr->len > phdr->caplen && !p->warning) {
+		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
+		p->warning = 1;
+	}
+
+	struct packet *pkt = packet_alloc();
+	if (!pkt)
+		return NULL;
+
 	if (packet_buffer_alloc(pkt, phdr->caplen - p->skip_offset, p->align_offset) != POM_OK) {
 		packet_release(pkt);
-		return POM_ERR;
+		return NULL;
 	}
 
 	pkt->input = i;
@@ -809,6 +1416,13 @@ static int input_pcap_read(struct input *i) {
 	pkt->ts = pom_timeval_to_ptime(phdr->ts);
 	memcpy(pkt->buff, data + p->skip_offset, phdr->caplen - p->skip_offset);
 
+	return pkt;
+}
+
+static int input_pcap_packet_queue(struct input *i, struct packet *pkt) {
+
+	struct input_pcap_priv *p = i->priv;
+
 	unsigned int flags = 0, affinity = 0;
 
 	if (p->type == input_pcap_type_interface)
@@ -849,6 +1463,15 @@ static int input_pcap_close(struct input *i) {
 
 	if (priv->type == input_pcap_type_dir) {
 		struct input_pcap_dir_priv *dp = &priv->tpriv.dir;
+		unsigned int j;
+		for (j = 0; j < dp->heap_count; j++)
+			input_pcap_dir_reader_close(dp->heap[j]);
+		free(dp->heap);
+		dp->heap = NULL;
+		dp->heap_count = 0;
+		dp->heap_size = 0;
+		dp->cur_file = NULL;
+
 		while (dp->files) {
 			struct input_pcap_dir_file *tmp = dp->files;
 			dp->files = tmp->next;
@@ -871,6 +1494,7 @@ static int input_pcap_cleanup(struct input *i) {
 			ptype_cleanup(priv->tpriv.iface.p_interface);
 			ptype_cleanup(priv->tpriv.iface.p_promisc);
 			ptype_cleanup(priv->tpriv.iface.p_buff_size);
+			ptype_cleanup(priv->tpriv.iface.p_auto_filter);
 			break;
 		case input_pcap_type_file:
 			ptype_cleanup(priv->tpriv.file.p_file);
@@ -878,6 +1502,8 @@ static int input_pcap_cleanup(struct input *i) {
 		case input_pcap_type_dir:
 			ptype_cleanup(priv->tpriv.dir.p_dir);
 			ptype_cleanup(priv->tpriv.dir.p_match);
+			ptype_cleanup(priv->tpriv.dir.p_parallel);
+			ptype_cleanup(priv->tpriv.dir.p_index);
 			break;
 
 	}
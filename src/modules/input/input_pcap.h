@@ -22,9 +22,21 @@
 #define __INPUT_PCAP_H__
 
 #include <pcap.h>
+#include <uthash.h>
 
 #define INPUT_PCAP_SNAPLEN_MAX 65535
 
+// Maximum number of packets processed by each pcap_dispatch() call
+#define INPUT_PCAP_DISPATCH_MAX 64
+
+// Maximum number of packets read ahead for each file in dir mode
+#define INPUT_PCAP_DIR_READAHEAD 256
+
+#define INPUT_PCAP_DIR_PARALLEL_MAX 64
+
+#define INPUT_PCAP_DIR_INDEX_DEFAULT ".pom-ng-index"
+#define INPUT_PCAP_DIR_INDEX_LINE_MAX 4096
+
 enum input_pcap_type {
 	input_pcap_type_interface,
 	input_pcap_type_file,
@@ -36,7 +48,11 @@ struct input_pcap_interface_priv {
 	struct ptype *p_interface;
 	struct ptype *p_promisc;
 	struct ptype *p_buff_size;
+	struct ptype *p_auto_filter;
 	struct registry_perf *perf_dropped;
+	struct registry_perf *perf_avoided;
+	unsigned int filter_serial; // Serial of the capture filter currently installed
+	uint64_t rx_base; // Packets received by the interface when it was opened
 };
 
 struct input_pcap_file_priv {
@@ -47,15 +63,46 @@ struct input_pcap_file_priv {
 struct input_pcap_dir_file {
 	char *filename, *full_path;
 	ptime first_pkt;
+	time_t mtime;
+	off_t size;
 	struct input_pcap_dir_file *prev, *next;
 };
 
+struct input_pcap_dir_index {
+	char *filename;
+	ptime first_pkt;
+	uint64_t mtime, size;
+	UT_hash_handle hh;
+};
+
+struct input_pcap_dir_reader {
+	struct input *input;
+	struct input_pcap_dir_file *file;
+	pcap_t *p;
+	ptime next_ts; // Timestamp of the next packet, used to order the heap
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct packet *pkts[INPUT_PCAP_DIR_READAHEAD];
+	unsigned int head, count;
+	int eof, stop;
+	int error; // The reader stopped because a packet could not be allocated
+};
+
 struct input_pcap_dir_priv {
 	struct ptype *p_dir;
 	struct ptype *p_match;
+	struct ptype *p_parallel;
+	struct ptype *p_index;
 	struct input_pcap_dir_file *files;
-	struct input_pcap_dir_file *cur_file;
+	struct input_pcap_dir_file *cur_file; // Last file opened
+	int rescanned;
 	unsigned int interrupt_scan;
+
+	// Heap of the files being read, ordered by timestamp of their next packet
+	struct input_pcap_dir_reader **heap;
+	unsigned int heap_count, heap_size;
 };
 
 struct input_pcap_priv {
@@ -75,14 +122,19 @@ struct input_pcap_priv {
 	unsigned int align_offset;
 	unsigned int skip_offset;
 	int warning;
+	int dispatch_res; // Result of the last pcap_dispatch() callback
 };
 
 static int input_pcap_mod_register(struct mod_reg *mod);
 static int input_pcap_mod_unregister();
 
+static int input_pcap_datalink_setup(struct input_pcap_priv *priv, pcap_t *p);
 static int input_pcap_common_open(struct input *i);
 
 static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv);
+static int input_pcap_interface_perf_avoided(uint64_t *value, void *priv);
+static int input_pcap_interface_rx_packets(char *interface, uint64_t *rx_packets);
+static int input_pcap_interface_auto_filter(struct input_pcap_priv *priv);
 static int input_pcap_interface_init(struct input *i);
 static int input_pcap_interface_open(struct input *i);
 
@@ -91,10 +143,26 @@ static int input_pcap_file_open(struct input *i);
 
 static int input_pcap_dir_init(struct input *i);
 static int input_pcap_dir_open(struct input *i);
-static int input_pcap_dir_browse(struct input_pcap_priv *priv);
-static int input_pcap_dir_open_next(struct input_pcap_priv *p);
+static char *input_pcap_dir_index_path(struct input_pcap_priv *priv);
+static int input_pcap_dir_index_load(struct input_pcap_priv *priv, struct input_pcap_dir_index **index);
+static int input_pcap_dir_index_save(struct input_pcap_priv *priv);
+static void input_pcap_dir_index_cleanup(struct input_pcap_dir_index *index);
+static int input_pcap_dir_browse(struct input_pcap_priv *priv, struct input_pcap_dir_index *index);
+static void *input_pcap_dir_reader_func(void *priv);
+static struct input_pcap_dir_reader *input_pcap_dir_reader_open(struct input *i, struct input_pcap_dir_file *file);
+static struct packet *input_pcap_dir_reader_peek(struct input_pcap_dir_reader *r);
+static struct packet *input_pcap_dir_reader_pop(struct input_pcap_dir_reader *r);
+static void input_pcap_dir_reader_close(struct input_pcap_dir_reader *r);
+static int input_pcap_dir_heap_push(struct input_pcap_dir_priv *dp, struct input_pcap_dir_reader *r);
+static void input_pcap_dir_heap_sift_down(struct input_pcap_dir_priv *dp);
+static int input_pcap_dir_open_next(struct input *i);
+static int input_pcap_dir_read(struct input *i);
 
 static int input_pcap_read(struct input *i);
+static int input_pcap_interface_read(struct input *i);
+static int input_pcap_queue_packet(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data);
+static struct packet *input_pcap_packet_alloc(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data);
+static int input_pcap_packet_queue(struct input *i, struct packet *pkt);
 static int input_pcap_close(struct input *i);
 static int input_pcap_cleanup(struct input *i);
 
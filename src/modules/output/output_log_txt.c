@@ -22,12 +22,26 @@
 #include "output_log_txt.h"
 
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
 #include <pom-ng/resource.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
+
+// Files with buffered lines, checked by the flush thread
+static struct output_log_txt_file *output_log_txt_flush_files = NULL;
+static pthread_mutex_t output_log_txt_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_log_txt_flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t output_log_txt_flush_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t output_log_txt_flush_thread;
+static int output_log_txt_flush_running = 0, output_log_txt_flush_stop = 0;
+
+// Each thread formats its lines in its own buffer, kept for the lifetime of the thread
+static __thread char *output_log_txt_line = NULL;
+static __thread size_t output_log_txt_line_size = 0;
 
 
 static struct datavalue_template output_log_txt_templates_name[] = {
@@ -58,6 +72,232 @@ static struct resource_template output_log_txt_templates[] = {
 	{ 0 }
 };
 
+static uint64_t output_log_txt_now() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Must be called with the file lock held
+static int output_log_txt_file_flush(struct output_log_txt_file *file) {
+
+	if (!file->buff_len)
+		return POM_OK;
+
+	int res = pom_write(file->fd, file->buff, file->buff_len);
+	file->buff_len = 0;
+
+	return res;
+}
+
+static void *output_log_txt_flush_func(void *arg) {
+
+	pom_mutex_lock(&output_log_txt_flush_lock);
+
+	while (!output_log_txt_flush_stop) {
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += OUTPUT_LOG_TXT_FLUSH_TICK * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&output_log_txt_flush_cond, &output_log_txt_flush_lock, &ts);
+
+		uint64_t now = output_log_txt_now();
+
+		struct output_log_txt_file *file;
+		for (file = output_log_txt_flush_files; file; file = file->flush_next) {
+			pom_mutex_lock(&file->lock);
+			if (file->buff_len && now - file->buff_ts >= file->flush_delay) {
+				if (output_log_txt_file_flush(file) != POM_OK)
+					pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
+			}
+			pom_mutex_unlock(&file->lock);
+		}
+	}
+
+	pom_mutex_unlock(&output_log_txt_flush_lock);
+
+	return NULL;
+}
+
+static int output_log_txt_flush_register(struct output_log_txt_file *file) {
+
+	pom_mutex_lock(&output_log_txt_flush_thread_lock);
+	pom_mutex_lock(&output_log_txt_flush_lock);
+
+	file->flush_prev = NULL;
+	file->flush_next = output_log_txt_flush_files;
+	if (file->flush_next)
+		file->flush_next->flush_prev = file;
+	output_log_txt_flush_files = file;
+
+	int res = POM_OK;
+	if (!output_log_txt_flush_running) {
+		if (pthread_create(&output_log_txt_flush_thread, NULL, output_log_txt_flush_func, NULL)) {
+			pomlog(POMLOG_ERR "Error while creating the flush thread : %s", pom_strerror(errno));
+			res = POM_ERR;
+		} else {
+			output_log_txt_flush_running = 1;
+		}
+	}
+
+	pom_mutex_unlock(&output_log_txt_flush_lock);
+	pom_mutex_unlock(&output_log_txt_flush_thread_lock);
+
+	return res;
+}
+
+static void output_log_txt_flush_unregister(struct output_log_txt_file *file) {
+
+	pom_mutex_lock(&output_log_txt_flush_thread_lock);
+	pom_mutex_lock(&output_log_txt_flush_lock);
+
+	if (file->flush_prev || output_log_txt_flush_files == file) {
+		if (file->flush_next)
+			file->flush_next->flush_prev = file->flush_prev;
+
+		if (file->flush_prev)
+			file->flush_prev->flush_next = file->flush_next;
+		else
+			output_log_txt_flush_files = file->flush_next;
+
+		file->flush_prev = NULL;
+		file->flush_next = NULL;
+	}
+
+	int stop = (!output_log_txt_flush_files && output_log_txt_flush_running);
+	if (stop) {
+		output_log_txt_flush_stop = 1;
+		pthread_cond_signal(&output_log_txt_flush_cond);
+	}
+
+	pom_mutex_unlock(&output_log_txt_flush_lock);
+
+	if (stop) {
+		if (pthread_join(output_log_txt_flush_thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining the flush thread");
+		output_log_txt_flush_running = 0;
+		output_log_txt_flush_stop = 0;
+	}
+
+	pom_mutex_unlock(&output_log_txt_flush_thread_lock);
+
+	// Write what's left
+	pom_mutex_lock(&file->lock);
+	if (file->fd != -1 && output_log_txt_file_flush(file) != POM_OK)
+		pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
+	if (file->buff) {
+		free(file->buff);
+		file->buff = NULL;
+	}
+	pom_mutex_unlock(&file->lock);
+}
+
+static int output_log_txt_line_append(size_t *len, const char *data, size_t data_len) {
+
+	if (*len + data_len + 1 > output_log_txt_line_size) {
+		size_t size = output_log_txt_line_size ? output_log_txt_line_size : 1024;
+		while (*len + data_len + 1 > size)
+			size *= 2;
+
+		char *line = realloc(output_log_txt_line, size);
+		if (!line) {
+			pom_oom(size);
+			return POM_ERR;
+		}
+		output_log_txt_line = line;
+		output_log_txt_line_size = size;
+	}
+
+	memcpy(output_log_txt_line + *len, data, data_len);
+	*len += data_len;
+
+	return POM_OK;
+}
+
+// Append the value between quotes, escaping the quotes it contains
+static int output_log_txt_line_append_quoted(size_t *len, const char *value) {
+
+	if (output_log_txt_line_append(len, "\"", 1) != POM_OK)
+		return POM_ERR;
+
+	const char *quote = NULL, *tmp = value;
+	while ((quote = strchr(tmp, '"'))) {
+		if (output_log_txt_line_append(len, tmp, quote - tmp) != POM_OK || output_log_txt_line_append(len, "\\\"", 2) != POM_OK)
+			return POM_ERR;
+		tmp = quote + 1;
+	}
+
+	if (output_log_txt_line_append(len, tmp, strlen(tmp)) != POM_OK)
+		return POM_ERR;
+
+	return output_log_txt_line_append(len, "\"", 1);
+}
+
+static int output_log_txt_file_write(struct output_log_txt_event *log_evt, const char *line, size_t len) {
+
+	struct output_log_txt_file *file = log_evt->file;
+
+	pom_mutex_lock(&file->lock);
+	if (file->fd == -1) {
+		// File is not open, let's do it
+		char *filename = NULL;
+		char fname[FILENAME_MAX + 1] = {0};
+		if (log_evt->p_prefix) {
+			char *prefix = PTYPE_STRING_GETVAL(log_evt->p_prefix);
+			strcpy(fname, prefix);
+			strncat(fname, file->path, FILENAME_MAX - strlen(fname));
+			filename = fname;
+		} else {
+			filename = file->path;
+		}
+		file->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+
+		if (file->fd == -1) {
+			pomlog(POMLOG_ERR "Error while opening file \"%s\" : %s", filename, pom_strerror(errno));
+			pom_mutex_unlock(&file->lock);
+			return POM_ERR;
+		}
+	}
+
+	if (!file->buff) {
+		file->buff = malloc(OUTPUT_LOG_TXT_BUFF_SIZE);
+		if (!file->buff) {
+			pom_mutex_unlock(&file->lock);
+			pom_oom(OUTPUT_LOG_TXT_BUFF_SIZE);
+			return POM_ERR;
+		}
+		file->buff_len = 0;
+	}
+
+	if (file->buff_len + len > OUTPUT_LOG_TXT_BUFF_SIZE && output_log_txt_file_flush(file) != POM_OK)
+		goto err;
+
+	if (len > OUTPUT_LOG_TXT_BUFF_SIZE) {
+		// Too big to be buffered
+		if (pom_write(file->fd, line, len) != POM_OK)
+			goto err;
+	} else {
+		if (!file->buff_len)
+			file->buff_ts = output_log_txt_now();
+		memcpy(file->buff + file->buff_len, line, len);
+		file->buff_len += len;
+	}
+
+	pom_mutex_unlock(&file->lock);
+
+	return POM_OK;
+
+err:
+	pom_mutex_unlock(&file->lock);
+	pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
+	return POM_ERR;
+}
+
 int output_log_txt_init(struct output *o) {
 
 	struct output_log_txt_priv *priv = malloc(sizeof(struct output_log_txt_priv));
@@ -72,7 +312,8 @@ int output_log_txt_init(struct output *o) {
 
 	priv->p_prefix = ptype_alloc("string");
 	priv->p_template = ptype_alloc("string");
-	if (!priv->p_prefix || !priv->p_template)
+	priv->p_flush_interval = ptype_alloc_unit("uint32", "ms");
+	if (!priv->p_prefix || !priv->p_template || !priv->p_flush_interval)
 		goto err;
 
 	struct registry_instance *inst = output_get_reg_instance(o);
@@ -83,6 +324,10 @@ int output_log_txt_init(struct output *o) {
 	p = registry_new_param("prefix", "/tmp/", priv->p_prefix, "Log files prefix", 0);
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
+
+	p = registry_new_param("flush_interval", "1000", priv->p_flush_interval, "Maximum time lines stay buffered before being written", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
 	
 	p = registry_new_param("template", "", priv->p_template, "Log template to use", 0);
 
@@ -133,6 +378,8 @@ int output_log_txt_cleanup(void *output_priv) {
 			ptype_cleanup(priv->p_prefix);
 		if (priv->p_template)
 			ptype_cleanup(priv->p_template);
+		if (priv->p_flush_interval)
+			ptype_cleanup(priv->p_flush_interval);
 		free(priv);
 	}
 
@@ -363,6 +610,7 @@ int output_log_txt_open(void *output_priv) {
 		}
 		memset(file, 0, sizeof(struct output_log_txt_file));
 		file->fd = -1;
+		file->flush_delay = *PTYPE_UINT32_GETVAL(priv->p_flush_interval);
 
 		char *name = PTYPE_STRING_GETVAL(v[1].value);
 		file->name = strdup(name);
@@ -480,6 +728,14 @@ int output_log_txt_open(void *output_priv) {
 
 	resource_close(r);
 
+	struct output_log_txt_file *file;
+	for (file = priv->files; file; file = file->next) {
+		if (output_log_txt_flush_register(file) != POM_OK) {
+			output_log_txt_close(priv);
+			return POM_ERR;
+		}
+	}
+
 	return POM_OK;
 
 err:
@@ -535,6 +791,8 @@ int output_log_txt_close(void *output_priv) {
 		struct output_log_txt_file *file = priv->files;
 		priv->files = file->next;
 
+		output_log_txt_flush_unregister(file);
+
 		if (file->fd != -1) {
 			if (close(file->fd) < 0) 
 				pomlog(POMLOG_WARN "Error while closing file : %s", pom_strerror(errno));
@@ -560,67 +818,38 @@ int output_log_txt_process(struct event *evt, void *obj) {
 
 	struct output_log_txt_event *log_evt = obj;
 
-	// Open the log file
-	struct output_log_txt_file *file = log_evt->file;
-
-	pom_mutex_lock(&file->lock);
-	if (file->fd == -1) {
-		// File is not open, let's do it
-		char *filename = NULL;
-		if (log_evt->p_prefix) {
-			char fname[FILENAME_MAX + 1] = {0};
-			char *prefix = PTYPE_STRING_GETVAL(log_evt->p_prefix);
-			strcpy(fname, prefix);
-			strncat(fname, file->path, FILENAME_MAX - strlen(fname));
-			filename = fname;
-		} else {
-			filename = file->path;
-		}
-		file->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
-
-		if (file->fd == -1) {
-			pomlog(POMLOG_ERR "Error while opening file \"%s\" : %s", pom_strerror(errno));
-			pom_mutex_unlock(&file->lock);
-			return POM_ERR;
-		}
-	}
-
 	char *format = log_evt->format;
 
 	int i;
 	unsigned int format_pos = 0;
+	size_t len = 0;
 
-	// Write to the log file
+	// Format the line in the buffer of this thread
 	for (i = 0; log_evt->fields[i].id != -1; i++) {
 	
 		struct output_log_txt_field *field = &log_evt->fields[i];
 		if (format_pos < field->start_off) {
-			unsigned int len = field->start_off - format_pos;
-			if (pom_write(file->fd, format + format_pos, len) != POM_OK)
-				goto write_err;
+			if (output_log_txt_line_append(&len, format + format_pos, field->start_off - format_pos) != POM_OK)
+				return POM_ERR;
 		}
 
 		format_pos = field->end_off;
 	
 		char *value = NULL;
 		int allocated = 1;
+		char ts_buff[20] = { 0 };
 
 		if (field->type == output_log_txt_event_property) {
 			// Fetch the property value
 			struct event_reg_info *evt_reg = event_reg_get_info(event_get_reg(evt));
 			switch (field->id) {
 				case output_log_txt_event_property_ts: {
-					value = malloc(20);
-					if (!value) {
-						pom_oom(20);
-						return POM_ERR;
-					}
-					memset(value, 0, 20);
-					char *format = "%Y-%m-%d %H:%M:%S";
 					struct tm tmp;
 					time_t sec = pom_ptime_sec(event_get_timestamp(evt));
 					localtime_r(&sec, &tmp);
-					strftime(value, 20, format, &tmp);
+					strftime(ts_buff, sizeof(ts_buff), "%Y-%m-%d %H:%M:%S", &tmp);
+					value = ts_buff;
+					allocated = 0;
 					break;
 				}
 				case output_log_txt_event_property_name:
@@ -636,7 +865,6 @@ int output_log_txt_process(struct event *evt, void *obj) {
 					allocated = 0;
 					break;
 				default:
-					pom_mutex_unlock(&file->lock);
 					return POM_ERR;
 			}
 		} else {
@@ -649,27 +877,14 @@ int output_log_txt_process(struct event *evt, void *obj) {
 					struct data_item *item;
 					for (item = evt_data[field->id].items; item; item = item->next) {
 						value = ptype_print_val_alloc(item->value, field->ptype_format);
-						if (!value) {
-							pom_mutex_unlock(&file->lock);
+						if (!value)
 							return POM_ERR;
-						}
 
-						if ((pom_write(file->fd, item->key, strlen(item->key)) != POM_OK) || (pom_write(file->fd, ": \"", strlen(": \"")) != POM_OK)) {
-							free(value);
-							goto write_err;
-						}
-						char *quote = NULL;
-						char *tmp = value;
-						while ((quote = strchr(tmp, '"'))) {
-							if ((pom_write(file->fd, tmp, quote - tmp) != POM_OK) || (pom_write(file->fd, "\\\"", strlen("\\\"")) != POM_OK)) {
-								free(value);
-								goto write_err;
-							}
-							tmp = quote + 1;
-						}
-						if (pom_write(file->fd, tmp, strlen(tmp)) != POM_OK || (pom_write(file->fd, "\"", 1) != POM_OK)) {
+						if (output_log_txt_line_append(&len, item->key, strlen(item->key)) != POM_OK ||
+							output_log_txt_line_append(&len, ": ", 2) != POM_OK ||
+							output_log_txt_line_append_quoted(&len, value) != POM_OK) {
 							free(value);
-							goto write_err;
+							return POM_ERR;
 						}
 
 						free(value);
@@ -683,59 +898,49 @@ int output_log_txt_process(struct event *evt, void *obj) {
 				for (item = evt_data[field->id].items; item; item = item->next) {
 					if (!strcasecmp(item->key, field->key)) {
 						value = ptype_print_val_alloc(item->value, field->ptype_format);
-						if (!value) {
-							pom_mutex_unlock(&file->lock);
+						if (!value)
 							return POM_ERR;
-						}
 						break;
 					}
 				}
 			} else if (data_is_set(evt_data[field->id]) && evt_data[field->id].value) {
 				// Find the value of the field
 				value = ptype_print_val_alloc(evt_data[field->id].value, field->ptype_format);
-				if (!value) {
-					pom_mutex_unlock(&file->lock);
+				if (!value)
 					return POM_ERR;
-				}
 			}
 		}
 
 		if (value) {
-			if (pom_write(file->fd, value, strlen(value)) != POM_OK) {
-				if (allocated)
-					free(value);
-				goto write_err;
-			}
+			int res = output_log_txt_line_append(&len, value, strlen(value));
 			if (allocated)
 				free(value);
+			if (res != POM_OK)
+				return POM_ERR;
 		} else {
-			if (pom_write(file->fd, "-", 1) != POM_OK)
-				goto write_err;
+			if (output_log_txt_line_append(&len, "-", 1) != POM_OK)
+				return POM_ERR;
 		}
 	}
 
-	// Write the last part after the last field
-	if (format_pos < strlen(format)) {
-		unsigned int len = strlen(format) - format_pos;
-		if (pom_write(file->fd, format + format_pos, len) != POM_OK)
-			goto write_err;
+	// Add the last part after the last field
+	size_t format_len = strlen(format);
+	if (format_pos < format_len) {
+		if (output_log_txt_line_append(&len, format + format_pos, format_len - format_pos) != POM_OK)
+			return POM_ERR;
 	}
 
-	if (pom_write(file->fd, "\n", 1) != POM_OK)
-		goto write_err;
+	if (output_log_txt_line_append(&len, "\n", 1) != POM_OK)
+		return POM_ERR;
 
-	pom_mutex_unlock(&file->lock);
+	if (output_log_txt_file_write(log_evt, output_log_txt_line, len) != POM_OK)
+		return POM_ERR;
 
 	if (log_evt->priv && log_evt->priv->perf_events)
 		registry_perf_inc(log_evt->priv->perf_events, 1);
 
 	return POM_OK;
 
-write_err:
-	pom_mutex_unlock(&file->lock);
-	pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
-	return POM_ERR;
-
 }
 
 int addon_log_txt_init(struct addon_plugin *a) {
@@ -831,10 +1036,11 @@ int addon_log_txt_open(void *addon_priv) {
 	// Only the path field need to be filled
 	txt_file->path = PTYPE_STRING_GETVAL(priv->p_filename);
 	txt_file->fd = -1;
+	txt_file->flush_delay = OUTPUT_LOG_TXT_FLUSH_DELAY;
 
 	txt_evt->file = txt_file;
 
-	return POM_OK;
+	return output_log_txt_flush_register(txt_file);
 }
 
 int addon_log_txt_close(void *addon_priv) {
@@ -845,13 +1051,16 @@ int addon_log_txt_close(void *addon_priv) {
 
 	int i;
 	for (i = 0; txt_evt->fields[i].id != -1; i++) {
-		if (txt_evt->fields[i].key)
+		if (txt_evt->fields[i].key && txt_evt->fields[i].key != OUTPUT_LOG_TXT_FIELD_KEY_WILDCARD)
 			free(txt_evt->fields[i].key);
+		if (txt_evt->fields[i].ptype_format)
+			free(txt_evt->fields[i].ptype_format);
 	}
 
 	free(txt_evt->fields);
 
 	struct output_log_txt_file *txt_file = &priv->txt_file;
+	output_log_txt_flush_unregister(txt_file);
 	if (txt_file->fd != -1) {
 		close(txt_file->fd);
 		txt_file->fd = -1;
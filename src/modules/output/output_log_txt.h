@@ -26,6 +26,15 @@
 #define OUTPUT_LOG_TXT_RESOURCE "output_log_txt"
 #define OUTPUT_LOG_TXT_FIELD_KEY_WILDCARD	(void*)-1
 
+// Size of the write buffer of each file
+#define OUTPUT_LOG_TXT_BUFF_SIZE	65536
+
+// Interval at which the flush thread checks the buffers, in ms
+#define OUTPUT_LOG_TXT_FLUSH_TICK	100
+
+// Maximum time a line stays in the buffer when not configurable, in ms
+#define OUTPUT_LOG_TXT_FLUSH_DELAY	1000
+
 enum output_log_txt_field_type {
 	output_log_txt_event_field,
 	output_log_txt_event_property
@@ -51,7 +60,15 @@ struct output_log_txt_file {
 	char *path;
 	int fd;
 	pthread_mutex_t lock;
+
+	// Lines waiting to be written
+	char *buff;
+	size_t buff_len;
+	uint64_t buff_ts; // Time at which the oldest line was buffered, in ms
+	unsigned int flush_delay;
+
 	struct output_log_txt_file *prev, *next;
+	struct output_log_txt_file *flush_prev, *flush_next;
 };
 
 struct output_log_txt_event {
@@ -70,6 +87,7 @@ struct output_log_txt_event {
 struct output_log_txt_priv {
 	struct ptype *p_prefix;
 	struct ptype *p_template;
+	struct ptype *p_flush_interval;
 
 	struct output_log_txt_file *files;
 	struct output_log_txt_event *events;
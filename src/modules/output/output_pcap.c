@@ -22,28 +22,36 @@
 
 #include "output_pcap.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <pom-ng/core.h>
 #include <pom-ng/ptype_string.h>
 #include <pom-ng/ptype_bool.h>
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_ipv6.h>
 #include <pom-ng/ptype_uint16.h>
+#include <pom-ng/ptype_uint32.h>
 #include <pom-ng/ptype_uint64.h>
 
 
 static struct event_reg *output_pcap_flow_evt_file_reg = NULL;
 
 static struct output_pcap_link_type output_pcap_link_types[] = {
-	{ "ethernet", DLT_EN10MB },
-	{ "ipv4", DLT_RAW },
-	{ "80211", DLT_IEEE802_11 },
-	{ "radiotap", DLT_IEEE802_11_RADIO },
-	{ "ppi", DLT_PPI },
+	{ "ethernet", DLT_EN10MB, 1 },
+	{ "ipv4", DLT_RAW, 101 },
+	{ "80211", DLT_IEEE802_11, 105 },
+	{ "radiotap", DLT_IEEE802_11_RADIO, 127 },
+	{ "ppi", DLT_PPI, 192 },
 #ifdef DLT_DOCSIS
-	{ "docsis", DLT_DOCSIS },
+	{ "docsis", DLT_DOCSIS, 143 },
 #endif
 #ifdef DLT_MPEG_2_TS
-	{ "mpeg_ts", DLT_MPEG_2_TS },
+	{ "mpeg_ts", DLT_MPEG_2_TS, 243 },
 #endif
-	{ NULL, 0 }
+	{ NULL, 0, 0 }
 
 };
 
@@ -55,7 +63,7 @@ struct mod_reg_info *output_pcap_reg_info() {
 	reg_info.api_ver = MOD_API_VER;
 	reg_info.register_func = output_pcap_mod_register;
 	reg_info.unregister_func = output_pcap_mod_unregister;
-	reg_info.dependencies = "ptype_string, ptype_bool, ptype_uint16, ptype_uint64";
+	reg_info.dependencies = "ptype_string, ptype_bool, ptype_uint16, ptype_uint32, ptype_uint64";
 
 	return &reg_info;
 }
@@ -89,7 +97,21 @@ static int output_pcap_mod_register(struct mod_reg *mod) {
 	output_pcap_flow.open = output_pcap_flow_open;
 	output_pcap_flow.close = output_pcap_flow_close;
 
-	return output_register(&output_pcap_flow);
+	if (output_register(&output_pcap_flow) != POM_OK)
+		return POM_ERR;
+
+
+	static struct output_reg_info output_pcap_store = { 0 };
+	output_pcap_store.name = "pcap_store";
+	output_pcap_store.description = "Save packets of all the flows in large segment files with a per flow index";
+	output_pcap_store.mod = mod;
+
+	output_pcap_store.init = output_pcap_store_init;
+	output_pcap_store.cleanup = output_pcap_store_cleanup;
+	output_pcap_store.open = output_pcap_store_open;
+	output_pcap_store.close = output_pcap_store_close;
+
+	return output_register(&output_pcap_store);
 }
 
 
@@ -97,23 +119,32 @@ static int output_pcap_mod_unregister() {
 
 	output_unregister("pcap_file");
 	output_unregister("pcap_flow");
+	output_unregister("pcap_store");
 
 	return POM_OK;
 }
 
 
-static int output_pcap_linktype_to_dlt(char *link_type) {
-
+static struct output_pcap_link_type *output_pcap_linktype_get(char *link_type) {
 
 	int i;
 	for (i = 0; output_pcap_link_types[i].name; i++) {
 
 		if (!strcasecmp(link_type, output_pcap_link_types[i].name))
-			return output_pcap_link_types[i].dlt;
+			return &output_pcap_link_types[i];
 	}
 
 	pomlog(POMLOG_ERR "Protocol %s is not supported", link_type);
-	return POM_ERR;
+	return NULL;
+}
+
+static int output_pcap_linktype_to_dlt(char *link_type) {
+
+	struct output_pcap_link_type *lt = output_pcap_linktype_get(link_type);
+	if (!lt)
+		return POM_ERR;
+
+	return lt->dlt;
 }
 
 static int output_pcap_file_init(struct output *o) {
@@ -125,6 +156,7 @@ static int output_pcap_file_init(struct output *o) {
 		return POM_ERR;
 	}
 	memset(priv, 0, sizeof(struct output_pcap_file_priv));
+	priv->fd = -1;
 
 	int res = pthread_mutex_init(&priv->lock, NULL);
 	if (res) {
@@ -133,6 +165,23 @@ static int output_pcap_file_init(struct output *o) {
 		return POM_ERR;
 	}
 
+	res = pthread_mutex_init(&priv->writer_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the writer mutex : %s", pom_strerror(res));
+		pthread_mutex_destroy(&priv->lock);
+		free(priv);
+		return POM_ERR;
+	}
+
+	res = pthread_cond_init(&priv->writer_cond, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the writer condition : %s", pom_strerror(res));
+		pthread_mutex_destroy(&priv->writer_lock);
+		pthread_mutex_destroy(&priv->lock);
+		free(priv);
+		return POM_ERR;
+	}
+
 	output_set_priv(o, priv);
 
 	priv->p_filename = ptype_alloc("string");
@@ -140,15 +189,19 @@ static int output_pcap_file_init(struct output *o) {
 	priv->p_link_type = ptype_alloc("string");
 	priv->p_unbuffered = ptype_alloc("bool");
 	priv->p_filter = ptype_alloc("string");
+	priv->p_flush_interval = ptype_alloc_unit("uint32", "ms");
+	priv->p_buffer_size = ptype_alloc_unit("uint32", "bytes");
+	priv->p_direct_io = ptype_alloc("bool");
 
-	if (!priv->p_filename || !priv->p_snaplen || !priv->p_link_type || !priv->p_unbuffered || !priv->p_filter)
+	if (!priv->p_filename || !priv->p_snaplen || !priv->p_link_type || !priv->p_unbuffered || !priv->p_filter || !priv->p_flush_interval || !priv->p_buffer_size || !priv->p_direct_io)
 		goto err;
 
 	struct registry_instance *inst = output_get_reg_instance(o);
 	priv->perf_pkts_out = registry_instance_add_perf(inst, "pkts_out", registry_perf_type_counter, "Number of packets written", "pkts");
 	priv->perf_bytes_out = registry_instance_add_perf(inst, "bytes_out", registry_perf_type_counter, "Number of packet bytes written", "bytes");
+	priv->perf_writes = registry_instance_add_perf(inst, "writes", registry_perf_type_counter, "Number of write calls to the file", "writes");
 
-	if (!priv->perf_pkts_out || !priv->perf_bytes_out)
+	if (!priv->perf_pkts_out || !priv->perf_bytes_out || !priv->perf_writes)
 		goto err;
 
 	struct registry_param *p = registry_new_param("filename", "out.pcap", priv->p_filename, "Output PCAP file", 0);
@@ -175,6 +228,18 @@ static int output_pcap_file_init(struct output *o) {
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("flush_interval", "1000", priv->p_flush_interval, "Maximum time packets stay buffered, 0 to write only when a buffer is half full", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("buffer_size", "1048576", priv->p_buffer_size, "Size of the buffer of each processing thread", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("direct_io", "no", priv->p_direct_io, "Bypass the page cache using O_DIRECT", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
 	p = registry_new_param("filter", "", priv->p_filter, "Filter", REGISTRY_PARAM_FLAG_NOT_LOCKED_WHILE_RUNNING);
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
@@ -197,6 +262,8 @@ static int output_pcap_file_cleanup(void *output_priv) {
 		return POM_OK;
 
 	pthread_mutex_destroy(&priv->lock);
+	pthread_mutex_destroy(&priv->writer_lock);
+	pthread_cond_destroy(&priv->writer_cond);
 
 	if (priv->p_filename)
 		ptype_cleanup(priv->p_filename);
@@ -208,6 +275,12 @@ static int output_pcap_file_cleanup(void *output_priv) {
 		ptype_cleanup(priv->p_unbuffered);
 	if (priv->p_filter)
 		ptype_cleanup(priv->p_filter);
+	if (priv->p_flush_interval)
+		ptype_cleanup(priv->p_flush_interval);
+	if (priv->p_buffer_size)
+		ptype_cleanup(priv->p_buffer_size);
+	if (priv->p_direct_io)
+		ptype_cleanup(priv->p_direct_io);
 	
 	free(priv);
 
@@ -223,27 +296,121 @@ static int output_pcap_file_open(void *output_priv) {
 
 	char *link_type_str = PTYPE_STRING_GETVAL(priv->p_link_type);
 
-	int link_type = output_pcap_linktype_to_dlt(link_type_str);
+	struct output_pcap_link_type *link_type = output_pcap_linktype_get(link_type_str);
+	if (!link_type)
+		return POM_ERR;
 
 	struct proto *proto = proto_get(link_type_str);
 	if (!proto) {
 		pomlog(POMLOG_ERR "Protocol %s not yet implemented", link_type_str);
-		goto err;
+		return POM_ERR;
 	}
 
-	priv->p = pcap_open_dead(link_type, *snaplen);
-	if (!priv->p) {
-		pomlog(POMLOG_ERR "Unable to open pcap");
-		goto err;
+	char unbuffered = *PTYPE_BOOL_GETVAL(priv->p_unbuffered);
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	priv->direct = 0;
+	if (*PTYPE_BOOL_GETVAL(priv->p_direct_io)) {
+#ifdef O_DIRECT
+		if (unbuffered) {
+			pomlog(POMLOG_WARN "Direct IO cannot be used in unbuffered mode, ignoring");
+		} else {
+			flags |= O_DIRECT;
+			priv->direct = 1;
+		}
+#else
+		pomlog(POMLOG_WARN "Direct IO is not supported on this system, ignoring");
+#endif
 	}
 
 	char *filename = PTYPE_STRING_GETVAL(priv->p_filename);
-	priv->pdump = pcap_dump_open(priv->p, filename);
-	if (!priv->pdump) {
-		pomlog(POMLOG_ERR "Unable to open pcap file %s for writing !", filename);
-		goto err;
+	priv->fd = open(filename, flags, 0666);
+	if (priv->fd == -1) {
+		pomlog(POMLOG_ERR "Unable to open pcap file %s for writing : %s", filename, pom_strerror(errno));
+		return POM_ERR;
 	}
 
+	struct pcap_file_header fhdr = { 0 };
+	fhdr.magic = 0xa1b2c3d4;
+	fhdr.version_major = PCAP_VERSION_MAJOR;
+	fhdr.version_minor = PCAP_VERSION_MINOR;
+	fhdr.snaplen = *snaplen;
+	fhdr.linktype = link_type->linktype;
+
+	if (unbuffered) {
+		struct iovec iov = { &fhdr, sizeof(fhdr) };
+		if (output_pcap_file_write(priv, &iov, 1) != POM_OK)
+			goto err;
+	} else {
+
+		// Each buffer must at least hold a full packet
+		priv->buff_size = *PTYPE_UINT32_GETVAL(priv->p_buffer_size);
+		if (priv->buff_size < *snaplen + sizeof(struct output_pcap_rec_hdr))
+			priv->buff_size = *snaplen + sizeof(struct output_pcap_rec_hdr);
+
+		if (priv->direct) {
+			priv->buff_size = (priv->buff_size + OUTPUT_PCAP_DIRECT_ALIGN - 1) & ~(OUTPUT_PCAP_DIRECT_ALIGN - 1);
+			int res = posix_memalign((void **)&priv->direct_buff, OUTPUT_PCAP_DIRECT_ALIGN, priv->buff_size);
+			if (res) {
+				pomlog(POMLOG_ERR "Error while allocating the direct IO buffer : %s", pom_strerror(res));
+				goto err;
+			}
+			priv->direct_len = 0;
+		}
+
+		unsigned int stage_count = core_get_num_threads() + 1;
+
+		priv->stages = malloc(sizeof(struct output_pcap_file_stage) * stage_count);
+		priv->writer_buffs = malloc(sizeof(unsigned char *) * stage_count);
+		priv->writer_lens = malloc(sizeof(size_t) * stage_count);
+		priv->writer_pos = malloc(sizeof(size_t) * stage_count);
+		priv->iov = malloc(sizeof(struct iovec) * OUTPUT_PCAP_IOV_MAX);
+		if (!priv->stages || !priv->writer_buffs || !priv->writer_lens || !priv->writer_pos || !priv->iov) {
+			pom_oom(sizeof(struct output_pcap_file_stage) * stage_count);
+			goto err;
+		}
+		memset(priv->stages, 0, sizeof(struct output_pcap_file_stage) * stage_count);
+		memset(priv->writer_buffs, 0, sizeof(unsigned char *) * stage_count);
+
+		unsigned int i;
+		for (i = 0; i < stage_count; i++) {
+			struct output_pcap_file_stage *stage = &priv->stages[i];
+			if (pthread_mutex_init(&stage->lock, NULL)) {
+				pomlog(POMLOG_ERR "Error while initializing the stage mutex : %s", pom_strerror(errno));
+				goto err;
+			}
+			if (pthread_cond_init(&stage->cond, NULL)) {
+				pthread_mutex_destroy(&stage->lock);
+				pomlog(POMLOG_ERR "Error while initializing the stage condition : %s", pom_strerror(errno));
+				goto err;
+			}
+			priv->stage_count = i + 1;
+
+			stage->buff = malloc(priv->buff_size);
+			priv->writer_buffs[i] = malloc(priv->buff_size);
+			if (!stage->buff || !priv->writer_buffs[i]) {
+				pom_oom(priv->buff_size);
+				goto err;
+			}
+		}
+
+		if (priv->direct) {
+			if (output_pcap_file_direct_write(priv, &fhdr, sizeof(fhdr)) != POM_OK)
+				goto err;
+		} else {
+			struct iovec iov = { &fhdr, sizeof(fhdr) };
+			if (output_pcap_file_write(priv, &iov, 1) != POM_OK)
+				goto err;
+		}
+
+		priv->writer_pending = 0;
+		priv->writer_stop = 0;
+		if (pthread_create(&priv->writer_thread, NULL, output_pcap_file_writer_func, priv)) {
+			pomlog(POMLOG_ERR "Error while creating the writer thread : %s", pom_strerror(errno));
+			goto err;
+		}
+		priv->writer_running = 1;
+	}
 
 	priv->listener = proto_packet_listener_register(proto, 0, priv, output_pcap_file_process, priv->filter);
 	if (!priv->listener) 
@@ -253,20 +420,66 @@ static int output_pcap_file_open(void *output_priv) {
 
 err:
 
-	if (priv->pdump) {
-		pcap_dump_close(priv->pdump);
-		priv->pdump = NULL;
+	if (priv->writer_running) {
+		pom_mutex_lock(&priv->writer_lock);
+		priv->writer_stop = 1;
+		pthread_cond_signal(&priv->writer_cond);
+		pom_mutex_unlock(&priv->writer_lock);
+		pthread_join(priv->writer_thread, NULL);
+		priv->writer_running = 0;
 	}
 
-	if (priv->p) {
-		pcap_close(priv->p);
-		priv->p = NULL;
+	output_pcap_file_stages_cleanup(priv);
+
+	if (priv->fd != -1) {
+		close(priv->fd);
+		priv->fd = -1;
 	}
 
 	return POM_ERR;
 
 }
 
+static void output_pcap_file_stages_cleanup(struct output_pcap_file_priv *priv) {
+
+	unsigned int i;
+	for (i = 0; i < priv->stage_count; i++) {
+		struct output_pcap_file_stage *stage = &priv->stages[i];
+		pthread_mutex_destroy(&stage->lock);
+		pthread_cond_destroy(&stage->cond);
+		if (stage->buff)
+			free(stage->buff);
+		if (priv->writer_buffs[i])
+			free(priv->writer_buffs[i]);
+	}
+	priv->stage_count = 0;
+
+	if (priv->stages) {
+		free(priv->stages);
+		priv->stages = NULL;
+	}
+	if (priv->writer_buffs) {
+		free(priv->writer_buffs);
+		priv->writer_buffs = NULL;
+	}
+	if (priv->writer_lens) {
+		free(priv->writer_lens);
+		priv->writer_lens = NULL;
+	}
+	if (priv->writer_pos) {
+		free(priv->writer_pos);
+		priv->writer_pos = NULL;
+	}
+	if (priv->iov) {
+		free(priv->iov);
+		priv->iov = NULL;
+	}
+	if (priv->direct_buff) {
+		free(priv->direct_buff);
+		priv->direct_buff = NULL;
+	}
+}
+
 static int output_pcap_file_close(void *output_priv) {
 
 	struct output_pcap_file_priv *priv = output_priv;
@@ -279,53 +492,313 @@ static int output_pcap_file_close(void *output_priv) {
 
 	priv->listener = NULL;
 
-	if (priv->pdump) {
-		pcap_dump_close(priv->pdump);
-		priv->pdump = NULL;
+	int res = POM_OK;
+
+	if (priv->writer_running) {
+		// The writer empties all the buffers before exiting
+		pom_mutex_lock(&priv->writer_lock);
+		priv->writer_stop = 1;
+		pthread_cond_signal(&priv->writer_cond);
+		pom_mutex_unlock(&priv->writer_lock);
+
+		if (pthread_join(priv->writer_thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining the writer thread");
+		priv->writer_running = 0;
+
+		if (priv->direct)
+			res = output_pcap_file_direct_flush(priv, 1);
 	}
 
-	if (priv->p) {
-		pcap_close(priv->p);
-		priv->p = NULL;
+	output_pcap_file_stages_cleanup(priv);
+
+	if (priv->fd != -1) {
+		close(priv->fd);
+		priv->fd = -1;
 	}
 
+	return res;
 
-	return POM_OK;
+}
+
+static void output_pcap_file_writer_wakeup(struct output_pcap_file_priv *priv) {
 
+	pom_mutex_lock(&priv->writer_lock);
+	priv->writer_pending = 1;
+	pthread_cond_signal(&priv->writer_cond);
+	pom_mutex_unlock(&priv->writer_lock);
 }
 
 static int output_pcap_file_process(void *obj, struct packet *p, struct proto_process_stack *s, unsigned int stack_index) {
 
 	struct output_pcap_file_priv *priv = obj;
 
-	struct pcap_pkthdr phdr = { { 0 } };
-
-	memcpy(&phdr.ts, &p->ts, sizeof(struct timeval));
+	struct output_pcap_rec_hdr hdr;
+	hdr.ts_sec = pom_ptime_sec(p->ts);
+	hdr.ts_usec = pom_ptime_usec(p->ts);
 
 	struct proto_process_stack *stack = &s[stack_index];
 
-	phdr.len = stack->plen;
+	hdr.len = stack->plen;
 
 	uint16_t *snaplen = PTYPE_UINT16_GETVAL(priv->p_snaplen);
 
 	if (*snaplen > stack->plen)
-		phdr.caplen = stack->plen;
+		hdr.caplen = stack->plen;
 	else
-		phdr.caplen = *snaplen;
+		hdr.caplen = *snaplen;
 
 	registry_perf_inc(priv->perf_pkts_out, 1);
-	registry_perf_inc(priv->perf_bytes_out, phdr.caplen);
-	
-	pom_mutex_lock(&priv->lock);
-	pcap_dump((u_char*)priv->pdump, &phdr, stack->pload);
-	if (PTYPE_BOOL_GETVAL(priv->p_unbuffered))
-		pcap_dump_flush(priv->pdump);
-	pom_mutex_unlock(&priv->lock);
+	registry_perf_inc(priv->perf_bytes_out, hdr.caplen);
+
+	if (!priv->stages) {
+		// Unbuffered mode
+		struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { stack->pload, hdr.caplen } };
+		pom_mutex_lock(&priv->lock);
+		int res = output_pcap_file_write(priv, iov, 2);
+		pom_mutex_unlock(&priv->lock);
+		return res;
+	}
+
+	unsigned int id = core_get_thread_id() + 1;
+	if (id >= priv->stage_count)
+		id = 0;
+
+	struct output_pcap_file_stage *stage = &priv->stages[id];
+	size_t rec_len = sizeof(hdr) + hdr.caplen;
+	size_t half = priv->buff_size / 2;
+
+	pom_mutex_lock(&stage->lock);
+
+	while (stage->len + rec_len > priv->buff_size) {
+		// Wait for the writer to empty our buffer
+		stage->waiting = 1;
+		output_pcap_file_writer_wakeup(priv);
+		pthread_cond_wait(&stage->cond, &stage->lock);
+	}
+
+	size_t prev_len = stage->len;
+	memcpy(stage->buff + stage->len, &hdr, sizeof(hdr));
+	memcpy(stage->buff + stage->len + sizeof(hdr), stack->pload, hdr.caplen);
+	stage->len += rec_len;
+
+	pom_mutex_unlock(&stage->lock);
+
+	if (prev_len < half && prev_len + rec_len >= half)
+		output_pcap_file_writer_wakeup(priv);
 
 	return POM_OK;
 
 }
 
+static int output_pcap_file_write(struct output_pcap_file_priv *priv, struct iovec *iov, int iovcnt) {
+
+	while (iovcnt) {
+		ssize_t res = writev(priv->fd, iov, iovcnt);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			pomlog(POMLOG_ERR "Error while writing to the pcap file : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+		registry_perf_inc(priv->perf_writes, 1);
+
+		// Skip what was written in case of partial write
+		while (iovcnt && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	return POM_OK;
+}
+
+static int output_pcap_file_direct_write(struct output_pcap_file_priv *priv, void *data, size_t len) {
+
+	unsigned char *d = data;
+
+	while (len) {
+		size_t avail = priv->buff_size - priv->direct_len;
+		size_t l = (len < avail ? len : avail);
+		memcpy(priv->direct_buff + priv->direct_len, d, l);
+		priv->direct_len += l;
+		d += l;
+		len -= l;
+
+		if (priv->direct_len == priv->buff_size && output_pcap_file_direct_flush(priv, 0) != POM_OK)
+			return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int output_pcap_file_direct_flush(struct output_pcap_file_priv *priv, int final) {
+
+	// Only complete blocks can be written with O_DIRECT
+	size_t len = priv->direct_len & ~(OUTPUT_PCAP_DIRECT_ALIGN - 1);
+
+	if (final && len < priv->direct_len) {
+		// Disable O_DIRECT to write the last partial block
+#ifdef O_DIRECT
+		int flags = fcntl(priv->fd, F_GETFL);
+		if (flags == -1 || fcntl(priv->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+			pomlog(POMLOG_ERR "Error while disabling direct IO : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+#endif
+		len = priv->direct_len;
+	}
+
+	if (!len)
+		return POM_OK;
+
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t res = write(priv->fd, priv->direct_buff + pos, len - pos);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			pomlog(POMLOG_ERR "Error while writing to the pcap file : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+		pos += res;
+	}
+	registry_perf_inc(priv->perf_writes, 1);
+
+	memmove(priv->direct_buff, priv->direct_buff + len, priv->direct_len - len);
+	priv->direct_len -= len;
+
+	return POM_OK;
+}
+
+static int output_pcap_file_merge(struct output_pcap_file_priv *priv) {
+
+	// Take the content of all the stages
+	unsigned int i, used = 0;
+	for (i = 0; i < priv->stage_count; i++) {
+		struct output_pcap_file_stage *stage = &priv->stages[i];
+		pom_mutex_lock(&stage->lock);
+		unsigned char *tmp = stage->buff;
+		stage->buff = priv->writer_buffs[i];
+		priv->writer_buffs[i] = tmp;
+		priv->writer_lens[i] = stage->len;
+		stage->len = 0;
+		if (stage->waiting) {
+			stage->waiting = 0;
+			pthread_cond_broadcast(&stage->cond);
+		}
+		pom_mutex_unlock(&stage->lock);
+
+		priv->writer_pos[i] = 0;
+		if (priv->writer_lens[i])
+			used++;
+	}
+
+	if (!used)
+		return POM_OK;
+
+	// Each buffer is already sorted, merge them by timestamp
+	int iovcnt = 0;
+	while (1) {
+
+		int best = -1;
+		uint64_t best_ts = 0;
+		struct output_pcap_rec_hdr hdr;
+		for (i = 0; i < priv->stage_count; i++) {
+			if (priv->writer_pos[i] >= priv->writer_lens[i])
+				continue;
+			memcpy(&hdr, priv->writer_buffs[i] + priv->writer_pos[i], sizeof(hdr));
+			uint64_t ts = ((uint64_t)hdr.ts_sec << 32) | hdr.ts_usec;
+			if (best == -1 || ts < best_ts) {
+				best = i;
+				best_ts = ts;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		unsigned char *rec = priv->writer_buffs[best] + priv->writer_pos[best];
+		memcpy(&hdr, rec, sizeof(hdr));
+		size_t rec_len = sizeof(hdr) + hdr.caplen;
+		priv->writer_pos[best] += rec_len;
+
+		if (priv->direct) {
+			if (output_pcap_file_direct_write(priv, rec, rec_len) != POM_OK)
+				return POM_ERR;
+			continue;
+		}
+
+		// Packets following each other in the same buffer are written at once
+		if (iovcnt && (unsigned char *)priv->iov[iovcnt - 1].iov_base + priv->iov[iovcnt - 1].iov_len == rec) {
+			priv->iov[iovcnt - 1].iov_len += rec_len;
+			continue;
+		}
+
+		if (iovcnt == OUTPUT_PCAP_IOV_MAX) {
+			if (output_pcap_file_write(priv, priv->iov, iovcnt) != POM_OK)
+				return POM_ERR;
+			iovcnt = 0;
+		}
+
+		priv->iov[iovcnt].iov_base = rec;
+		priv->iov[iovcnt].iov_len = rec_len;
+		iovcnt++;
+	}
+
+	if (priv->direct)
+		return output_pcap_file_direct_flush(priv, 0);
+
+	if (iovcnt)
+		return output_pcap_file_write(priv, priv->iov, iovcnt);
+
+	return POM_OK;
+}
+
+static void *output_pcap_file_writer_func(void *p) {
+
+	struct output_pcap_file_priv *priv = p;
+
+	pom_mutex_lock(&priv->writer_lock);
+
+	while (1) {
+
+		if (!priv->writer_pending && !priv->writer_stop) {
+			uint32_t interval = *PTYPE_UINT32_GETVAL(priv->p_flush_interval);
+			if (interval) {
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += interval / 1000;
+				ts.tv_nsec += (interval % 1000) * 1000000;
+				if (ts.tv_nsec >= 1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&priv->writer_cond, &priv->writer_lock, &ts);
+			} else {
+				pthread_cond_wait(&priv->writer_cond, &priv->writer_lock);
+			}
+		}
+
+		int stop = priv->writer_stop;
+		priv->writer_pending = 0;
+		pom_mutex_unlock(&priv->writer_lock);
+
+		output_pcap_file_merge(priv);
+
+		if (stop)
+			break;
+
+		pom_mutex_lock(&priv->writer_lock);
+	}
+
+	return NULL;
+}
+
 static int output_pcap_filter_parse(void *priv, struct registry_param *param, char *value) {
 
 	struct output_pcap_file_priv *p = priv;
@@ -616,7 +1089,8 @@ static int output_pcap_flow_process(void *obj, struct packet *p, struct proto_pr
 
 	struct pcap_pkthdr phdr = { { 0 } };
 
-	memcpy(&phdr.ts, &p->ts, sizeof(struct timeval));
+	phdr.ts.tv_sec = pom_ptime_sec(p->ts);
+	phdr.ts.tv_usec = pom_ptime_usec(p->ts);
 
 	struct proto_process_stack *stack = &s[stack_index];
 
@@ -641,7 +1115,7 @@ static int output_pcap_flow_process(void *obj, struct packet *p, struct proto_pr
 	pom_mutex_lock(&cpriv->lock);
 
 	pcap_dump((u_char*)cpriv->pdump, &phdr, stack->pload);
-	if (PTYPE_BOOL_GETVAL(priv->p_unbuffered))
+	if (*PTYPE_BOOL_GETVAL(priv->p_unbuffered))
 		pcap_dump_flush(cpriv->pdump);
 
 	pom_mutex_unlock(&cpriv->lock);
@@ -833,3 +1307,546 @@ static int output_pcap_flow_parse_filename(struct proto_process_stack *s, struct
 
 	return POM_OK;
 }
+
+static int output_pcap_store_init(struct output *o) {
+
+	struct output_pcap_store_priv *priv = malloc(sizeof(struct output_pcap_store_priv));
+	if (!priv) {
+		pom_oom(sizeof(struct output_pcap_store_priv));
+		return POM_ERR;
+	}
+	memset(priv, 0, sizeof(struct output_pcap_store_priv));
+	priv->seg_fd = -1;
+
+	int res = pthread_mutex_init(&priv->lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the store mutex : %s", pom_strerror(res));
+		free(priv);
+		return POM_ERR;
+	}
+
+	output_set_priv(o, priv);
+
+	priv->p_prefix = ptype_alloc("string");
+	priv->p_link_type = ptype_alloc("string");
+	priv->p_flow_proto = ptype_alloc("string");
+	priv->p_snaplen = ptype_alloc_unit("uint16", "bytes");
+	priv->p_segment_size = ptype_alloc_unit("uint64", "bytes");
+	priv->p_buffer_size = ptype_alloc_unit("uint32", "bytes");
+
+	if (!priv->p_prefix || !priv->p_link_type || !priv->p_flow_proto || !priv->p_snaplen || !priv->p_segment_size || !priv->p_buffer_size)
+		goto err;
+
+	struct registry_instance *inst = output_get_reg_instance(o);
+	priv->perf_pkts_out = registry_instance_add_perf(inst, "pkts_out", registry_perf_type_counter, "Number of packets written", "pkts");
+	priv->perf_bytes_out = registry_instance_add_perf(inst, "bytes_out", registry_perf_type_counter, "Number of packet bytes written", "bytes");
+	priv->perf_flows_cur = registry_instance_add_perf(inst, "flows_cur", registry_perf_type_gauge, "Number of flows being processed", "flows");
+	priv->perf_flows_tot = registry_instance_add_perf(inst, "flows_tot", registry_perf_type_counter, "Total number of flows processed", "flows");
+	priv->perf_segments = registry_instance_add_perf(inst, "segments", registry_perf_type_counter, "Number of segment files created", "segments");
+
+	if (!priv->perf_pkts_out || !priv->perf_bytes_out || !priv->perf_flows_cur || !priv->perf_flows_tot || !priv->perf_segments)
+		goto err;
+
+	struct registry_param *p = registry_new_param("prefix", "/tmp/pom-ng-flows-", priv->p_prefix, "Prefix of the segment and index files", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("flow_proto", "tcp", priv->p_flow_proto, "Protocol to use for flows", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("snaplen", "1550", priv->p_snaplen, "Snaplen", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("link_type", "ethernet", priv->p_link_type, "Link type of the stored packets", 0);
+	int i;
+	for (i = 0; output_pcap_link_types[i].name; i++) {
+		if (registry_param_info_add_value(p, output_pcap_link_types[i].name) != POM_OK) {
+			goto err;
+		}
+	}
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("segment_size", "1073741824", priv->p_segment_size, "Size after which a new segment is started", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("buffer_size", "1048576", priv->p_buffer_size, "Size of the write buffer", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	return POM_OK;
+
+err:
+	output_pcap_store_cleanup(priv);
+	return POM_ERR;
+}
+
+static int output_pcap_store_cleanup(void *output_priv) {
+
+	struct output_pcap_store_priv *priv = output_priv;
+
+	if (!priv)
+		return POM_OK;
+
+	pthread_mutex_destroy(&priv->lock);
+
+	if (priv->p_prefix)
+		ptype_cleanup(priv->p_prefix);
+	if (priv->p_link_type)
+		ptype_cleanup(priv->p_link_type);
+	if (priv->p_flow_proto)
+		ptype_cleanup(priv->p_flow_proto);
+	if (priv->p_snaplen)
+		ptype_cleanup(priv->p_snaplen);
+	if (priv->p_segment_size)
+		ptype_cleanup(priv->p_segment_size);
+	if (priv->p_buffer_size)
+		ptype_cleanup(priv->p_buffer_size);
+
+	free(priv);
+
+	return POM_OK;
+}
+
+static int output_pcap_store_open(void *output_priv) {
+
+	struct output_pcap_store_priv *priv = output_priv;
+
+	char *link_type_str = PTYPE_STRING_GETVAL(priv->p_link_type);
+	struct output_pcap_link_type *link_type = output_pcap_linktype_get(link_type_str);
+	if (!link_type)
+		return POM_ERR;
+
+	struct proto *proto = proto_get(link_type_str);
+	if (!proto) {
+		pomlog(POMLOG_ERR "Protocol %s not yet implemented", link_type_str);
+		return POM_ERR;
+	}
+
+	priv->proto = proto_get(PTYPE_STRING_GETVAL(priv->p_flow_proto));
+	if (!priv->proto) {
+		pomlog(POMLOG_ERR "Flow protocol %s not found", PTYPE_STRING_GETVAL(priv->p_flow_proto));
+		return POM_ERR;
+	}
+
+	priv->proto_ipv4 = proto_get("ipv4");
+	priv->proto_ipv6 = proto_get("ipv6");
+	priv->proto_tcp = proto_get("tcp");
+	priv->proto_udp = proto_get("udp");
+
+	uint16_t *snaplen = PTYPE_UINT16_GETVAL(priv->p_snaplen);
+
+	memset(&priv->file_hdr, 0, sizeof(struct output_pcap_store_file_hdr));
+	priv->file_hdr.version = OUTPUT_PCAP_STORE_VERSION;
+	priv->file_hdr.linktype = link_type->linktype;
+	priv->file_hdr.snaplen = *snaplen;
+
+	// Each buffer must at least hold a full packet
+	priv->buff_size = *PTYPE_UINT32_GETVAL(priv->p_buffer_size);
+	if (priv->buff_size < *snaplen + sizeof(struct output_pcap_store_pkt_hdr))
+		priv->buff_size = *snaplen + sizeof(struct output_pcap_store_pkt_hdr);
+
+	priv->buff = malloc(priv->buff_size);
+	if (!priv->buff) {
+		pom_oom(priv->buff_size);
+		return POM_ERR;
+	}
+	priv->buff_len = 0;
+
+	// Do not overwrite the files of a previous run
+	char *prefix = PTYPE_STRING_GETVAL(priv->p_prefix);
+	size_t len = strlen(prefix) + 32;
+	priv->filename_base = malloc(len);
+	if (!priv->filename_base) {
+		pom_oom(len);
+		goto err;
+	}
+	snprintf(priv->filename_base, len, "%s%u-", prefix, pom_ptime_sec(pom_gettimeofday()));
+
+	priv->seg_id = 0;
+	if (output_pcap_store_segment_open(priv) != POM_OK)
+		goto err;
+
+	priv->listener = proto_packet_listener_register(proto, 0, priv, output_pcap_store_process, NULL);
+	if (!priv->listener) {
+		output_pcap_store_segment_close(priv);
+		goto err;
+	}
+
+	return POM_OK;
+
+err:
+	if (priv->filename_base) {
+		free(priv->filename_base);
+		priv->filename_base = NULL;
+	}
+	free(priv->buff);
+	priv->buff = NULL;
+	return POM_ERR;
+}
+
+static int output_pcap_store_close(void *output_priv) {
+
+	struct output_pcap_store_priv *priv = output_priv;
+
+	if (proto_packet_listener_unregister(priv->listener) != POM_OK)
+		return POM_ERR;
+
+	priv->listener = NULL;
+
+	// Write the index entries of the remaining flows
+	while (priv->flows) {
+		conntrack_lock(priv->flows->ce);
+		conntrack_remove_priv(priv->flows->ce, priv);
+		conntrack_unlock(priv->flows->ce);
+		output_pcap_store_ce_cleanup(priv, priv->flows);
+	}
+
+	int res = output_pcap_store_segment_close(priv);
+
+	free(priv->idx_entries);
+	priv->idx_entries = NULL;
+	priv->idx_size = 0;
+
+	free(priv->buff);
+	priv->buff = NULL;
+	free(priv->filename_base);
+	priv->filename_base = NULL;
+
+	return res;
+}
+
+static int output_pcap_store_segment_open(struct output_pcap_store_priv *priv) {
+
+	size_t len = strlen(priv->filename_base) + 16;
+	char *filename = malloc(len);
+	if (!filename) {
+		pom_oom(len);
+		return POM_ERR;
+	}
+
+	snprintf(filename, len, "%s%06u" OUTPUT_PCAP_STORE_SEG_EXT, priv->filename_base, priv->seg_id);
+	priv->seg_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (priv->seg_fd == -1) {
+		pomlog(POMLOG_ERR "Unable to open segment file %s : %s", filename, pom_strerror(errno));
+		free(filename);
+		return POM_ERR;
+	}
+
+	snprintf(filename, len, "%s%06u" OUTPUT_PCAP_STORE_IDX_EXT, priv->filename_base, priv->seg_id);
+	priv->idx = fopen(filename, "w");
+	if (!priv->idx) {
+		pomlog(POMLOG_ERR "Unable to open index file %s : %s", filename, pom_strerror(errno));
+		close(priv->seg_fd);
+		priv->seg_fd = -1;
+		free(filename);
+		return POM_ERR;
+	}
+	free(filename);
+
+	priv->idx_count = 0;
+
+	struct output_pcap_store_file_hdr hdr = priv->file_hdr;
+	hdr.magic = OUTPUT_PCAP_STORE_SEG_MAGIC;
+	memcpy(priv->buff, &hdr, sizeof(hdr));
+	priv->buff_len = sizeof(hdr);
+	priv->seg_off = 0;
+
+	registry_perf_inc(priv->perf_segments, 1);
+
+	return POM_OK;
+}
+
+static int output_pcap_store_idx_cmp(const void *a, const void *b) {
+
+	const struct output_pcap_store_idx *ia = a, *ib = b;
+
+	if (ia->flow_id != ib->flow_id)
+		return (ia->flow_id < ib->flow_id ? -1 : 1);
+
+	if (ia->first_ts != ib->first_ts)
+		return (ia->first_ts < ib->first_ts ? -1 : 1);
+
+	return 0;
+}
+
+static int output_pcap_store_idx_flush(struct output_pcap_store_priv *priv) {
+
+	// Sort the entries so that the exporter can search flows without reading the whole index
+	qsort(priv->idx_entries, priv->idx_count, sizeof(struct output_pcap_store_idx), output_pcap_store_idx_cmp);
+
+	struct output_pcap_store_idx_hdr idx_hdr = { 0 };
+	idx_hdr.count = priv->idx_count;
+
+	size_t i;
+	for (i = 0; i < priv->idx_count; i++) {
+		struct output_pcap_store_idx *idx = &priv->idx_entries[i];
+		if (!idx_hdr.first_ts || idx->first_ts < idx_hdr.first_ts)
+			idx_hdr.first_ts = idx->first_ts;
+		if (idx->last_ts > idx_hdr.last_ts)
+			idx_hdr.last_ts = idx->last_ts;
+	}
+
+	struct output_pcap_store_file_hdr hdr = priv->file_hdr;
+	hdr.magic = OUTPUT_PCAP_STORE_IDX_MAGIC;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, priv->idx) != 1 || fwrite(&idx_hdr, sizeof(idx_hdr), 1, priv->idx) != 1 ||
+		(priv->idx_count && fwrite(priv->idx_entries, sizeof(struct output_pcap_store_idx), priv->idx_count, priv->idx) != priv->idx_count)) {
+		pomlog(POMLOG_ERR "Error while writing to the index file : %s", pom_strerror(errno));
+		return POM_ERR;
+	}
+
+	priv->idx_count = 0;
+
+	return POM_OK;
+}
+
+static int output_pcap_store_segment_close(struct output_pcap_store_priv *priv) {
+
+	int res = output_pcap_store_flush(priv);
+
+	if (priv->idx) {
+		if (output_pcap_store_idx_flush(priv) != POM_OK)
+			res = POM_ERR;
+		if (fclose(priv->idx)) {
+			pomlog(POMLOG_ERR "Error while closing the index file : %s", pom_strerror(errno));
+			res = POM_ERR;
+		}
+		priv->idx = NULL;
+	}
+
+	if (priv->seg_fd != -1) {
+		close(priv->seg_fd);
+		priv->seg_fd = -1;
+	}
+
+	return res;
+}
+
+static int output_pcap_store_flush(struct output_pcap_store_priv *priv) {
+
+	size_t pos = 0;
+	while (pos < priv->buff_len) {
+		ssize_t res = write(priv->seg_fd, priv->buff + pos, priv->buff_len - pos);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			pomlog(POMLOG_ERR "Error while writing to the segment file : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+		pos += res;
+	}
+
+	priv->seg_off += priv->buff_len;
+	priv->buff_len = 0;
+
+	return POM_OK;
+}
+
+static int output_pcap_store_idx_write(struct output_pcap_store_priv *priv, struct output_pcap_store_ce_priv *cpriv) {
+
+	if (!cpriv->idx.pkts || !priv->idx)
+		return POM_OK;
+
+	if (priv->idx_count >= priv->idx_size) {
+		size_t size = (priv->idx_size ? priv->idx_size * 2 : OUTPUT_PCAP_STORE_IDX_ALLOC);
+		struct output_pcap_store_idx *entries = realloc(priv->idx_entries, sizeof(struct output_pcap_store_idx) * size);
+		if (!entries) {
+			pom_oom(sizeof(struct output_pcap_store_idx) * size);
+			return POM_ERR;
+		}
+		priv->idx_entries = entries;
+		priv->idx_size = size;
+	}
+
+	memcpy(&priv->idx_entries[priv->idx_count++], &cpriv->idx, sizeof(struct output_pcap_store_idx));
+
+	// The next packet will start a new chain
+	cpriv->idx.pkts = 0;
+	cpriv->idx.bytes = 0;
+
+	return POM_OK;
+}
+
+static void output_pcap_store_flow_key(struct output_pcap_store_priv *priv, struct output_pcap_store_idx *idx, struct proto_process_stack *s) {
+
+	int i;
+	for (i = CORE_PROTO_STACK_START; i < CORE_PROTO_STACK_MAX && s[i].proto; i++) {
+		if (!s[i].pkt_info)
+			continue;
+
+		struct ptype **fields = s[i].pkt_info->fields_value;
+
+		if (s[i].proto == priv->proto_ipv4) {
+			idx->ip_ver = 4;
+			memcpy(idx->src, &PTYPE_IPV4_GETADDR(fields[0]), sizeof(struct in_addr));
+			memcpy(idx->dst, &PTYPE_IPV4_GETADDR(fields[1]), sizeof(struct in_addr));
+		} else if (s[i].proto == priv->proto_ipv6) {
+			idx->ip_ver = 6;
+			memcpy(idx->src, &PTYPE_IPV6_GETADDR(fields[0]), sizeof(struct in6_addr));
+			memcpy(idx->dst, &PTYPE_IPV6_GETADDR(fields[1]), sizeof(struct in6_addr));
+		} else if (s[i].proto == priv->proto_tcp || s[i].proto == priv->proto_udp) {
+			idx->ip_proto = (s[i].proto == priv->proto_tcp ? IPPROTO_TCP : IPPROTO_UDP);
+			idx->sport = *PTYPE_UINT16_GETVAL(fields[0]);
+			idx->dport = *PTYPE_UINT16_GETVAL(fields[1]);
+		}
+	}
+}
+
+static int output_pcap_store_process(void *obj, struct packet *p, struct proto_process_stack *s, unsigned int stack_index) {
+
+	struct output_pcap_store_priv *priv = obj;
+
+	int i;
+	for (i = CORE_PROTO_STACK_START; i < CORE_PROTO_STACK_MAX && s[i].proto && s[i].proto != priv->proto; i++);
+
+	if (!s[i].proto) // No protocol for our flow has been found
+		return POM_OK;
+
+	struct conntrack_entry *ce = s[i].ce;
+
+	if (!ce) // No conntrack for this packet
+		return POM_OK;
+
+	conntrack_lock(ce);
+
+	struct output_pcap_store_ce_priv *cpriv = conntrack_get_priv(ce, priv);
+	if (!cpriv) {
+		cpriv = malloc(sizeof(struct output_pcap_store_ce_priv));
+		if (!cpriv) {
+			pom_oom(sizeof(struct output_pcap_store_ce_priv));
+			conntrack_unlock(ce);
+			return POM_ERR;
+		}
+		memset(cpriv, 0, sizeof(struct output_pcap_store_ce_priv));
+		cpriv->ce = ce;
+
+		output_pcap_store_flow_key(priv, &cpriv->idx, s);
+		cpriv->idx.flow_id = __sync_fetch_and_add(&priv->next_flow_id, 1);
+
+		if (conntrack_add_priv(ce, priv, cpriv, output_pcap_store_ce_cleanup) != POM_OK) {
+			conntrack_unlock(ce);
+			free(cpriv);
+			return POM_ERR;
+		}
+
+		registry_perf_inc(priv->perf_flows_cur, 1);
+		registry_perf_inc(priv->perf_flows_tot, 1);
+
+		pom_mutex_lock(&priv->lock);
+		cpriv->next = priv->flows;
+		if (cpriv->next)
+			cpriv->next->prev = cpriv;
+		priv->flows = cpriv;
+		pom_mutex_unlock(&priv->lock);
+	}
+
+	conntrack_unlock(ce);
+
+	struct proto_process_stack *stack = &s[stack_index];
+
+	struct output_pcap_store_pkt_hdr hdr = { 0 };
+	hdr.flow_id = cpriv->idx.flow_id;
+	hdr.ts_sec = pom_ptime_sec(p->ts);
+	hdr.ts_usec = pom_ptime_usec(p->ts);
+	hdr.len = stack->plen;
+
+	uint16_t *snaplen = PTYPE_UINT16_GETVAL(priv->p_snaplen);
+	if (*snaplen > stack->plen)
+		hdr.caplen = stack->plen;
+	else
+		hdr.caplen = *snaplen;
+
+	registry_perf_inc(priv->perf_pkts_out, 1);
+	registry_perf_inc(priv->perf_bytes_out, hdr.caplen);
+
+	size_t rec_len = sizeof(hdr) + hdr.caplen;
+
+	pom_mutex_lock(&priv->lock);
+
+	// No segment is open if the last rotation failed
+	if (!priv->idx) {
+		pom_mutex_unlock(&priv->lock);
+		return POM_ERR;
+	}
+
+	if (priv->buff_len + rec_len > priv->buff_size && output_pcap_store_flush(priv) != POM_OK) {
+		pom_mutex_unlock(&priv->lock);
+		return POM_ERR;
+	}
+
+	uint64_t off = priv->seg_off + priv->buff_len;
+
+	struct output_pcap_store_idx *idx = &cpriv->idx;
+	if (idx->pkts) {
+		hdr.prev = idx->last_off;
+	} else {
+		hdr.prev = OUTPUT_PCAP_STORE_NO_PREV;
+		idx->first_off = off;
+		idx->first_ts = p->ts;
+	}
+	idx->last_off = off;
+	idx->last_ts = p->ts;
+	idx->pkts++;
+	idx->bytes += hdr.caplen;
+
+	memcpy(priv->buff + priv->buff_len, &hdr, sizeof(hdr));
+	memcpy(priv->buff + priv->buff_len + sizeof(hdr), stack->pload, hdr.caplen);
+	priv->buff_len += rec_len;
+
+	int res = POM_OK;
+
+	uint64_t *segment_size = PTYPE_UINT64_GETVAL(priv->p_segment_size);
+	if (priv->seg_off + priv->buff_len >= *segment_size) {
+		// Close the index entries of all the flows in this segment and start a new one
+		struct output_pcap_store_ce_priv *tmp;
+		for (tmp = priv->flows; tmp; tmp = tmp->next) {
+			if (output_pcap_store_idx_write(priv, tmp) != POM_OK)
+				res = POM_ERR;
+		}
+
+		if (output_pcap_store_segment_close(priv) != POM_OK)
+			res = POM_ERR;
+
+		priv->seg_id++;
+		if (output_pcap_store_segment_open(priv) != POM_OK)
+			res = POM_ERR;
+	}
+
+	pom_mutex_unlock(&priv->lock);
+
+	return res;
+}
+
+static int output_pcap_store_ce_cleanup(void *obj, void *priv) {
+
+	struct output_pcap_store_priv *opriv = obj;
+	struct output_pcap_store_ce_priv *cpriv = priv;
+
+	if (!cpriv)
+		return POM_OK;
+
+	pom_mutex_lock(&opriv->lock);
+
+	if (opriv->idx)
+		output_pcap_store_idx_write(opriv, cpriv);
+
+	if (cpriv->next)
+		cpriv->next->prev = cpriv->prev;
+
+	if (cpriv->prev)
+		cpriv->prev->next = cpriv->next;
+	else
+		opriv->flows = cpriv->next;
+
+	pom_mutex_unlock(&opriv->lock);
+
+	registry_perf_dec(opriv->perf_flows_cur, 1);
+
+	free(cpriv);
+
+	return POM_OK;
+}
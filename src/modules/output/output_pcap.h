@@ -26,15 +26,47 @@
 #include <pom-ng/proto.h>
 #include <pom-ng/filter.h>
 #include <pom-ng/event.h>
+#include <pom-ng/conntrack.h>
 
 #include <pcap.h>
 
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "output_pcap_store_fmt.h"
+
 #define OUTPUT_PCAP_FLOW_FILE_DATA_COUNT 5
 
+// Alignment of the buffer and of the writes when using O_DIRECT
+#define OUTPUT_PCAP_DIRECT_ALIGN 4096
+
+// Maximum number of iovec passed to a single writev() call
+#define OUTPUT_PCAP_IOV_MAX 1024
+
+// Initial number of index entries kept for a segment of the flow store
+#define OUTPUT_PCAP_STORE_IDX_ALLOC 256
+
+// On disk header of each packet
+struct output_pcap_rec_hdr {
+	uint32_t ts_sec, ts_usec;
+	uint32_t caplen, len;
+};
+
+// Staging buffer of a processing thread
+struct output_pcap_file_stage {
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signaled by the writer when the buffer has been emptied
+	unsigned char *buff;
+	size_t len;
+	int waiting;
+
+};
+
 struct output_pcap_file_priv {
 
-	pcap_dumper_t *pdump;
-	pcap_t *p;
+	int fd;
+	int direct;
 	struct filter_node *filter;
 
 	struct proto_packet_listener *listener;
@@ -44,11 +76,37 @@ struct output_pcap_file_priv {
 	struct ptype *p_link_type;
 	struct ptype *p_unbuffered;
 	struct ptype *p_filter;
+	struct ptype *p_flush_interval;
+	struct ptype *p_buffer_size;
+	struct ptype *p_direct_io;
 
+	// Used when writing each packet directly
 	pthread_mutex_t lock;
 
+	// Stage 0 is used by threads which are not processing threads
+	struct output_pcap_file_stage *stages;
+	unsigned int stage_count;
+	size_t buff_size;
+
+	// Buffers owned by the writer, swapped with the ones of the stages
+	unsigned char **writer_buffs;
+	size_t *writer_lens;
+	size_t *writer_pos;
+	struct iovec *iov;
+
+	// Aligned buffer for O_DIRECT writes
+	unsigned char *direct_buff;
+	size_t direct_len;
+
+	pthread_t writer_thread;
+	int writer_running;
+	pthread_mutex_t writer_lock;
+	pthread_cond_t writer_cond;
+	int writer_pending, writer_stop;
+
 	struct registry_perf *perf_pkts_out;
 	struct registry_perf *perf_bytes_out;
+	struct registry_perf *perf_writes;
 
 };
 
@@ -92,6 +150,58 @@ struct output_pcap_flow_ce_priv {
 
 };
 
+struct output_pcap_store_priv {
+
+	struct ptype *p_prefix;
+	struct ptype *p_link_type;
+	struct ptype *p_flow_proto;
+	struct ptype *p_snaplen;
+	struct ptype *p_segment_size;
+	struct ptype *p_buffer_size;
+
+	struct proto *proto;
+	struct proto *proto_ipv4, *proto_ipv6, *proto_tcp, *proto_udp;
+	struct proto_packet_listener *listener;
+
+	struct output_pcap_store_file_hdr file_hdr;
+	char *filename_base;
+
+	pthread_mutex_t lock;
+
+	// Current segment and its index, the entries are sorted and written when the segment is closed
+	int seg_fd;
+	FILE *idx;
+	struct output_pcap_store_idx *idx_entries;
+	size_t idx_count, idx_size;
+	uint32_t seg_id;
+	uint64_t seg_off; // Offset in the segment of the start of the buffer
+
+	unsigned char *buff;
+	size_t buff_len, buff_size;
+
+	uint64_t next_flow_id;
+
+	struct output_pcap_store_ce_priv *flows;
+
+	struct registry_perf *perf_pkts_out;
+	struct registry_perf *perf_bytes_out;
+	struct registry_perf *perf_flows_cur;
+	struct registry_perf *perf_flows_tot;
+	struct registry_perf *perf_segments;
+
+};
+
+struct output_pcap_store_ce_priv {
+
+	struct conntrack_entry *ce;
+
+	// Entry for the current segment, written when the flow ends or the segment changes
+	struct output_pcap_store_idx idx;
+
+	struct output_pcap_store_ce_priv *prev, *next;
+
+};
+
 enum {
 	output_pcap_flow_file_output = 0,
 	output_pcap_flow_file_filename,
@@ -103,12 +213,14 @@ enum {
 struct output_pcap_link_type {
 	char *name;
 	int dlt;
+	int linktype; // Value stored in the file header, may differ from the DLT
 };
 
 struct mod_reg_info *output_pcap_reg_info();
 static int output_pcap_mod_register(struct mod_reg *mod);
 static int output_pcap_mod_unregister();
 
+static struct output_pcap_link_type *output_pcap_linktype_get(char *link_type);
 static int output_pcap_linktype_to_dlt(char *link_type);
 
 static int output_pcap_file_init(struct output *o);
@@ -116,6 +228,13 @@ static int output_pcap_file_cleanup(void *output_priv);
 static int output_pcap_file_open(void *output_priv);
 static int output_pcap_file_close(void *output_priv);
 static int output_pcap_file_process(void *obj, struct packet *p, struct proto_process_stack *s, unsigned int stack_index);
+static int output_pcap_file_write(struct output_pcap_file_priv *priv, struct iovec *iov, int iovcnt);
+static int output_pcap_file_direct_write(struct output_pcap_file_priv *priv, void *data, size_t len);
+static int output_pcap_file_direct_flush(struct output_pcap_file_priv *priv, int final);
+static int output_pcap_file_merge(struct output_pcap_file_priv *priv);
+static void output_pcap_file_writer_wakeup(struct output_pcap_file_priv *priv);
+static void *output_pcap_file_writer_func(void *priv);
+static void output_pcap_file_stages_cleanup(struct output_pcap_file_priv *priv);
 static int output_pcap_filter_parse(void *priv, struct registry_param *param, char *value);
 static int output_pcap_filter_update(void *priv, struct registry_param *param, struct ptype *value);
 
@@ -129,4 +248,16 @@ static int output_pcap_flow_open(void *output_priv);
 static int output_pcap_flow_close(void *output_priv);
 static int output_pcap_flow_parse_filename(struct proto_process_stack *s, struct packet *p, char *format, char *filename, size_t filename_len);
 
+static int output_pcap_store_init(struct output *o);
+static int output_pcap_store_cleanup(void *output_priv);
+static int output_pcap_store_open(void *output_priv);
+static int output_pcap_store_close(void *output_priv);
+static int output_pcap_store_process(void *obj, struct packet *p, struct proto_process_stack *s, unsigned int stack_index);
+static int output_pcap_store_ce_cleanup(void *obj, void *priv);
+static int output_pcap_store_segment_open(struct output_pcap_store_priv *priv);
+static int output_pcap_store_segment_close(struct output_pcap_store_priv *priv);
+static int output_pcap_store_flush(struct output_pcap_store_priv *priv);
+static int output_pcap_store_idx_write(struct output_pcap_store_priv *priv, struct output_pcap_store_ce_priv *cpriv);
+static void output_pcap_store_flow_key(struct output_pcap_store_priv *priv, struct output_pcap_store_idx *idx, struct proto_process_stack *s);
+
 #endif
@@ -0,0 +1,77 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2014 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef __OUTPUT_PCAP_STORE_FMT_H__
+#define __OUTPUT_PCAP_STORE_FMT_H__
+
+#include <stdint.h>
+
+// On disk format of the flow store
+// All the values are stored in host byte order, the magic tells if it matches
+
+// Each segment file contains the packets of all the flows, one after the other
+// Each index file lists the flows having packets in the segment of the same number, sorted by flow id
+
+#define OUTPUT_PCAP_STORE_SEG_MAGIC	0x504f4d53
+#define OUTPUT_PCAP_STORE_IDX_MAGIC	0x504f4d49
+#define OUTPUT_PCAP_STORE_VERSION	2
+
+#define OUTPUT_PCAP_STORE_SEG_EXT	".seg"
+#define OUTPUT_PCAP_STORE_IDX_EXT	".idx"
+
+// Marks the first packet of a flow in a segment
+#define OUTPUT_PCAP_STORE_NO_PREV	UINT64_MAX
+
+struct output_pcap_store_file_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t linktype;
+	uint32_t snaplen;
+};
+
+// Header of each packet in a segment, followed by caplen bytes of data
+struct output_pcap_store_pkt_hdr {
+	uint64_t flow_id;
+	uint64_t prev; // Offset of the previous packet of the same flow in this segment
+	uint32_t ts_sec, ts_usec;
+	uint32_t caplen, len;
+};
+
+// Follows the file header in index files so they can be skipped or searched without reading them
+struct output_pcap_store_idx_hdr {
+	uint64_t count; // Number of entries
+	uint64_t first_ts, last_ts; // Time range covered by the entries, in microseconds
+};
+
+// Index entry of a flow in a segment, sorted by flow_id then first_ts
+struct output_pcap_store_idx {
+	uint64_t flow_id;
+	uint64_t first_off, last_off;
+	uint64_t first_ts, last_ts; // In microseconds
+	uint64_t bytes;
+	uint32_t pkts;
+	uint16_t sport, dport;
+	uint8_t ip_ver, ip_proto;
+	uint8_t reserved[6];
+	uint8_t src[16], dst[16];
+};
+
+#endif
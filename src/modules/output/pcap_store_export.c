@@ -0,0 +1,502 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2014 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Standalone tool listing the flows of a pcap_store output and exporting them as pcap files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <pcap.h>
+
+#include "output_pcap_store_fmt.h"
+
+static FILE *export_out = NULL;
+static struct output_pcap_store_file_hdr export_hdr = { 0 };
+
+// Which flows and packets to list or export
+struct export_filter {
+	int has_flow_id;
+	uint64_t flow_id;
+
+	// The addresses and ports match either direction of the flow
+	uint8_t ip_ver;
+	int has_src, has_dst;
+	uint8_t src[16], dst[16];
+	int has_sport, has_dport;
+	uint16_t sport, dport;
+	int has_proto;
+	uint8_t proto;
+
+	uint64_t begin, end; // In microseconds
+};
+
+
+static void usage(char *name) {
+
+	fprintf(stderr, "Usage : %s [-l] [-f flow_id] [-s src] [-S sport] [-d dst] [-D dport] [-p proto] [-b begin] [-e end] [-o output.pcap] file.idx [file.idx ...]\n"
+		"\n"
+		"  -l            list the matching flows found in the index files\n"
+		"  -f flow_id    only the flow with this id\n"
+		"  -s src        only the flows with this address on one side\n"
+		"  -S sport      only the flows with this port on the same side as src\n"
+		"  -d dst        only the flows with this address on the other side\n"
+		"  -D dport      only the flows with this port on the same side as dst\n"
+		"  -p proto      only the flows with this IP protocol number\n"
+		"  -b begin      only the packets captured at or after this time (seconds since epoch)\n"
+		"  -e end        only the packets captured at or before this time (seconds since epoch)\n"
+		"  -o filename   pcap file to write the matching flows to, one flow after the other\n", name);
+}
+
+static int export_parse_ts(char *str, uint64_t *ts) {
+
+	char *end = NULL;
+	double val = strtod(str, &end);
+	if (*end || val < 0) {
+		fprintf(stderr, "Invalid time : %s\n", str);
+		return -1;
+	}
+
+	*ts = (uint64_t) (val * 1000000.0);
+	return 0;
+}
+
+static int export_parse_port(char *str, uint16_t *port) {
+
+	char *end = NULL;
+	unsigned long val = strtoul(str, &end, 10);
+	if (*end || val > 65535) {
+		fprintf(stderr, "Invalid port : %s\n", str);
+		return -1;
+	}
+
+	*port = val;
+	return 0;
+}
+
+static int export_parse_addr(char *str, struct export_filter *f, uint8_t *addr) {
+
+	uint8_t ip_ver = 4;
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, str, addr) != 1) {
+		ip_ver = 6;
+		if (inet_pton(AF_INET6, str, addr) != 1) {
+			fprintf(stderr, "Invalid address : %s\n", str);
+			return -1;
+		}
+	}
+
+	if (f->ip_ver && f->ip_ver != ip_ver) {
+		fprintf(stderr, "Source and destination addresses must be of the same family\n");
+		return -1;
+	}
+	f->ip_ver = ip_ver;
+
+	return 0;
+}
+
+static int export_match_side(struct export_filter *f, uint8_t *src, uint16_t sport, uint8_t *dst, uint16_t dport) {
+
+	size_t len = (f->ip_ver == 6 ? 16 : 4);
+
+	if (f->has_src && memcmp(f->src, src, len))
+		return 0;
+	if (f->has_sport && f->sport != sport)
+		return 0;
+	if (f->has_dst && memcmp(f->dst, dst, len))
+		return 0;
+	if (f->has_dport && f->dport != dport)
+		return 0;
+
+	return 1;
+}
+
+static int export_match(struct export_filter *f, struct output_pcap_store_idx *idx) {
+
+	if (f->has_flow_id && idx->flow_id != f->flow_id)
+		return 0;
+
+	if (idx->last_ts < f->begin || idx->first_ts > f->end)
+		return 0;
+
+	if (f->has_proto && idx->ip_proto != f->proto)
+		return 0;
+
+	if (f->ip_ver && (f->has_src || f->has_dst) && idx->ip_ver != f->ip_ver)
+		return 0;
+
+	return export_match_side(f, idx->src, idx->sport, idx->dst, idx->dport) ||
+		export_match_side(f, idx->dst, idx->dport, idx->src, idx->sport);
+}
+
+static int export_read_hdr(int fd, char *filename, uint32_t magic, struct output_pcap_store_file_hdr *hdr) {
+
+	if (pread(fd, hdr, sizeof(struct output_pcap_store_file_hdr), 0) != sizeof(struct output_pcap_store_file_hdr)) {
+		fprintf(stderr, "Unable to read the header of %s\n", filename);
+		return -1;
+	}
+
+	if (hdr->magic != magic) {
+		fprintf(stderr, "File %s is not a flow store file or has a different byte order\n", filename);
+		return -1;
+	}
+
+	if (hdr->version != OUTPUT_PCAP_STORE_VERSION) {
+		fprintf(stderr, "Unsupported version %u for file %s\n", hdr->version, filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void export_list(struct output_pcap_store_idx *idx) {
+
+	char src[INET6_ADDRSTRLEN] = { 0 }, dst[INET6_ADDRSTRLEN] = { 0 };
+	int af = (idx->ip_ver == 6 ? AF_INET6 : AF_INET);
+
+	if (idx->ip_ver) {
+		inet_ntop(af, idx->src, src, sizeof(src));
+		inet_ntop(af, idx->dst, dst, sizeof(dst));
+	} else {
+		strcpy(src, "?");
+		strcpy(dst, "?");
+	}
+
+	printf("%"PRIu64" %s:%u -> %s:%u proto %u first %"PRIu64".%06"PRIu64" last %"PRIu64".%06"PRIu64" pkts %u bytes %"PRIu64"\n",
+		idx->flow_id, src, idx->sport, dst, idx->dport, idx->ip_proto,
+		idx->first_ts / 1000000, idx->first_ts % 1000000, idx->last_ts / 1000000, idx->last_ts % 1000000,
+		idx->pkts, idx->bytes);
+}
+
+static int export_flow(int seg_fd, char *seg_name, struct output_pcap_store_idx *idx, struct export_filter *f) {
+
+	// Follow the chain backward from the last packet
+	uint64_t *offs = malloc(sizeof(uint64_t) * idx->pkts);
+	if (!offs) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	struct output_pcap_store_pkt_hdr hdr;
+	uint64_t off = idx->last_off;
+	uint32_t count = 0;
+
+	while (count < idx->pkts && off != OUTPUT_PCAP_STORE_NO_PREV) {
+		if (pread(seg_fd, &hdr, sizeof(hdr), off) != sizeof(hdr) || hdr.flow_id != idx->flow_id) {
+			fprintf(stderr, "Corrupted segment %s at offset %"PRIu64"\n", seg_name, off);
+			free(offs);
+			return -1;
+		}
+		offs[idx->pkts - ++count] = off;
+		off = hdr.prev;
+	}
+
+	unsigned char *data = malloc(export_hdr.snaplen);
+	if (!data) {
+		fprintf(stderr, "Not enough memory\n");
+		free(offs);
+		return -1;
+	}
+
+	uint32_t i;
+	for (i = idx->pkts - count; i < idx->pkts; i++) {
+		if (pread(seg_fd, &hdr, sizeof(hdr), offs[i]) != sizeof(hdr) || hdr.caplen > export_hdr.snaplen) {
+			fprintf(stderr, "Error while reading packet at offset %"PRIu64" in %s\n", offs[i], seg_name);
+			break;
+		}
+
+		uint64_t ts = ((uint64_t) hdr.ts_sec * 1000000) + hdr.ts_usec;
+		if (ts < f->begin || ts > f->end)
+			continue;
+
+		if (pread(seg_fd, data, hdr.caplen, offs[i] + sizeof(hdr)) != hdr.caplen) {
+			fprintf(stderr, "Error while reading packet at offset %"PRIu64" in %s\n", offs[i], seg_name);
+			break;
+		}
+
+		uint32_t rec[4] = { hdr.ts_sec, hdr.ts_usec, hdr.caplen, hdr.len };
+		if (fwrite(rec, sizeof(rec), 1, export_out) != 1 || fwrite(data, hdr.caplen, 1, export_out) != 1) {
+			fprintf(stderr, "Error while writing the output : %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	free(data);
+	free(offs);
+
+	return (i == idx->pkts ? 0 : -1);
+}
+
+static int export_segment_open(char *seg_name, char *out_name) {
+
+	int seg_fd = open(seg_name, O_RDONLY);
+	if (seg_fd == -1) {
+		fprintf(stderr, "Unable to open %s : %s\n", seg_name, strerror(errno));
+		return -1;
+	}
+
+	struct output_pcap_store_file_hdr seg_hdr;
+	if (export_read_hdr(seg_fd, seg_name, OUTPUT_PCAP_STORE_SEG_MAGIC, &seg_hdr) < 0)
+		goto err;
+
+	if (export_out) {
+		if (seg_hdr.linktype != export_hdr.linktype || seg_hdr.snaplen > export_hdr.snaplen) {
+			fprintf(stderr, "Segment %s does not have the same link type or snaplen as the previous ones\n", seg_name);
+			goto err;
+		}
+		return seg_fd;
+	}
+
+	export_out = fopen(out_name, "w");
+	if (!export_out) {
+		fprintf(stderr, "Unable to open %s : %s\n", out_name, strerror(errno));
+		goto err;
+	}
+
+	export_hdr = seg_hdr;
+
+	struct pcap_file_header fhdr = { 0 };
+	fhdr.magic = 0xa1b2c3d4;
+	fhdr.version_major = PCAP_VERSION_MAJOR;
+	fhdr.version_minor = PCAP_VERSION_MINOR;
+	fhdr.snaplen = seg_hdr.snaplen;
+	fhdr.linktype = seg_hdr.linktype;
+	if (fwrite(&fhdr, sizeof(fhdr), 1, export_out) != 1) {
+		fprintf(stderr, "Error while writing the output : %s\n", strerror(errno));
+		goto err;
+	}
+
+	return seg_fd;
+
+err:
+	close(seg_fd);
+	return -1;
+}
+
+static int export_idx_file(char *idx_name, int list, struct export_filter *f, char *out_name, unsigned int *matched) {
+
+	int res = -1;
+
+	int idx_fd = open(idx_name, O_RDONLY);
+	if (idx_fd == -1) {
+		fprintf(stderr, "Unable to open %s : %s\n", idx_name, strerror(errno));
+		return -1;
+	}
+
+	struct output_pcap_store_file_hdr hdr;
+	if (export_read_hdr(idx_fd, idx_name, OUTPUT_PCAP_STORE_IDX_MAGIC, &hdr) < 0)
+		goto err;
+
+	struct output_pcap_store_idx_hdr idx_hdr;
+	off_t base = sizeof(struct output_pcap_store_file_hdr);
+	if (pread(idx_fd, &idx_hdr, sizeof(idx_hdr), base) != sizeof(idx_hdr)) {
+		fprintf(stderr, "Unable to read the index header of %s\n", idx_name);
+		goto err;
+	}
+	base += sizeof(idx_hdr);
+
+	// Nothing in the requested time range
+	if (!idx_hdr.count || idx_hdr.last_ts < f->begin || idx_hdr.first_ts > f->end) {
+		res = 0;
+		goto err;
+	}
+
+	size_t len = strlen(idx_name);
+	size_t ext_len = strlen(OUTPUT_PCAP_STORE_IDX_EXT);
+	if (len < ext_len || strcmp(idx_name + len - ext_len, OUTPUT_PCAP_STORE_IDX_EXT)) {
+		fprintf(stderr, "Index file name %s does not end with " OUTPUT_PCAP_STORE_IDX_EXT "\n", idx_name);
+		goto err;
+	}
+
+	char *seg_name = malloc(len - ext_len + strlen(OUTPUT_PCAP_STORE_SEG_EXT) + 1);
+	if (!seg_name) {
+		fprintf(stderr, "Not enough memory\n");
+		goto err;
+	}
+	memcpy(seg_name, idx_name, len - ext_len);
+	strcpy(seg_name + len - ext_len, OUTPUT_PCAP_STORE_SEG_EXT);
+
+	struct output_pcap_store_idx idx;
+	uint64_t pos = 0;
+
+	if (f->has_flow_id) {
+		// Entries are sorted by flow id, seek to the first one of the flow
+		uint64_t lo = 0, hi = idx_hdr.count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (pread(idx_fd, &idx, sizeof(idx), base + mid * sizeof(idx)) != sizeof(idx)) {
+				fprintf(stderr, "Error while reading %s\n", idx_name);
+				free(seg_name);
+				goto err;
+			}
+			if (idx.flow_id < f->flow_id)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		pos = lo;
+	}
+
+	int seg_fd = -1;
+	res = 0;
+
+	for (; pos < idx_hdr.count; pos++) {
+
+		if (pread(idx_fd, &idx, sizeof(idx), base + pos * sizeof(idx)) != sizeof(idx)) {
+			fprintf(stderr, "Error while reading %s\n", idx_name);
+			res = -1;
+			break;
+		}
+
+		// Past the requested flow
+		if (f->has_flow_id && idx.flow_id != f->flow_id)
+			break;
+
+		if (!export_match(f, &idx))
+			continue;
+
+		(*matched)++;
+
+		if (list) {
+			export_list(&idx);
+			continue;
+		}
+
+		if (seg_fd == -1) {
+			seg_fd = export_segment_open(seg_name, out_name);
+			if (seg_fd == -1) {
+				res = -1;
+				break;
+			}
+		}
+
+		if (export_flow(seg_fd, seg_name, &idx, f) < 0) {
+			res = -1;
+			break;
+		}
+	}
+
+	if (seg_fd != -1)
+		close(seg_fd);
+	free(seg_name);
+
+err:
+	close(idx_fd);
+	return res;
+}
+
+int main(int argc, char *argv[]) {
+
+	int list = 0;
+	char *out_name = NULL;
+
+	struct export_filter f = { 0 };
+	f.end = UINT64_MAX;
+
+	int c;
+	while ((c = getopt(argc, argv, "lf:s:S:d:D:p:b:e:o:h")) != -1) {
+		char *end = NULL;
+		switch (c) {
+			case 'l':
+				list = 1;
+				break;
+			case 'f':
+				f.flow_id = strtoull(optarg, &end, 10);
+				if (*end) {
+					fprintf(stderr, "Invalid flow id : %s\n", optarg);
+					return 1;
+				}
+				f.has_flow_id = 1;
+				break;
+			case 's':
+				if (export_parse_addr(optarg, &f, f.src) < 0)
+					return 1;
+				f.has_src = 1;
+				break;
+			case 'S':
+				if (export_parse_port(optarg, &f.sport) < 0)
+					return 1;
+				f.has_sport = 1;
+				break;
+			case 'd':
+				if (export_parse_addr(optarg, &f, f.dst) < 0)
+					return 1;
+				f.has_dst = 1;
+				break;
+			case 'D':
+				if (export_parse_port(optarg, &f.dport) < 0)
+					return 1;
+				f.has_dport = 1;
+				break;
+			case 'p': {
+				unsigned long proto = strtoul(optarg, &end, 10);
+				if (*end || proto > 255) {
+					fprintf(stderr, "Invalid protocol : %s\n", optarg);
+					return 1;
+				}
+				f.proto = proto;
+				f.has_proto = 1;
+				break;
+			}
+			case 'b':
+				if (export_parse_ts(optarg, &f.begin) < 0)
+					return 1;
+				break;
+			case 'e':
+				if (export_parse_ts(optarg, &f.end) < 0)
+					return 1;
+				break;
+			case 'o':
+				out_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc || (!list && !out_name)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	unsigned int matched = 0;
+	int res = 0, i;
+	for (i = optind; i < argc; i++) {
+		if (export_idx_file(argv[i], list, &f, out_name, &matched) < 0)
+			res = 1;
+	}
+
+	if (export_out && fclose(export_out)) {
+		fprintf(stderr, "Error while closing %s : %s\n", out_name, strerror(errno));
+		res = 1;
+	}
+
+	if (!matched) {
+		fprintf(stderr, "No matching flow found\n");
+		res = 1;
+	}
+
+	return res;
+}
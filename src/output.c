@@ -21,7 +21,10 @@
 #include "output.h"
 #include "registry.h"
 #include "mod.h"
+#include "event.h"
 #include <pom-ng/ptype_bool.h>
+#include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
 
 static struct output_reg *output_reg_head = NULL;
 static struct output *output_head = NULL;
@@ -29,6 +32,97 @@ static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct registry_class *output_registry_class = NULL;
 
+static int output_event_queue_params_add(struct output *o) {
+
+	o->perf_event_queue_depth = registry_instance_add_perf(o->reg_instance, "event_queue_depth", registry_perf_type_gauge, "Number of events waiting in the queue", "events");
+	o->perf_event_queue_drops = registry_instance_add_perf(o->reg_instance, "event_queue_drops", registry_perf_type_counter, "Number of events dropped because the queue was full", "events");
+	if (!o->perf_event_queue_depth || !o->perf_event_queue_drops)
+		return POM_ERR;
+
+	o->p_event_queue_size = ptype_alloc_unit("uint32", "events");
+	if (!o->p_event_queue_size)
+		return POM_ERR;
+
+	struct registry_param *p = registry_new_param("event_queue_size", "0", o->p_event_queue_size, "Size of the queue of events to process in separate threads, 0 to process them synchronously", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!p) {
+		ptype_cleanup(o->p_event_queue_size);
+		return POM_ERR;
+	}
+	if (output_add_param(o, p) != POM_OK) {
+		registry_cleanup_param(p);
+		ptype_cleanup(o->p_event_queue_size);
+		return POM_ERR;
+	}
+
+	o->p_event_queue_policy = ptype_alloc("string");
+	if (!o->p_event_queue_policy)
+		return POM_ERR;
+
+	p = registry_new_param("event_queue_policy", "block", o->p_event_queue_policy, "What to do when the event queue is full", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!p) {
+		ptype_cleanup(o->p_event_queue_policy);
+		return POM_ERR;
+	}
+	if (registry_param_info_add_value(p, "block") != POM_OK ||
+		registry_param_info_add_value(p, "drop") != POM_OK ||
+		registry_param_info_add_value(p, "sample") != POM_OK ||
+		output_add_param(o, p) != POM_OK) {
+		registry_cleanup_param(p);
+		ptype_cleanup(o->p_event_queue_policy);
+		return POM_ERR;
+	}
+
+	o->p_event_queue_threads = ptype_alloc_unit("uint32", "threads");
+	if (!o->p_event_queue_threads)
+		return POM_ERR;
+
+	p = registry_new_param("event_queue_threads", "1", o->p_event_queue_threads, "Number of threads processing the event queue", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!p) {
+		ptype_cleanup(o->p_event_queue_threads);
+		return POM_ERR;
+	}
+	if (output_add_param(o, p) != POM_OK) {
+		registry_cleanup_param(p);
+		ptype_cleanup(o->p_event_queue_threads);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int output_event_queue_open(struct output *o) {
+
+	uint32_t *size = PTYPE_UINT32_GETVAL(o->p_event_queue_size);
+	if (!*size)
+		return POM_OK;
+
+	enum event_queue_policy policy = event_queue_policy_block;
+	char *policy_str = PTYPE_STRING_GETVAL(o->p_event_queue_policy);
+	if (!strcmp(policy_str, "drop")) {
+		policy = event_queue_policy_drop;
+	} else if (!strcmp(policy_str, "sample")) {
+		policy = event_queue_policy_sample;
+	} else if (strcmp(policy_str, "block")) {
+		pomlog(POMLOG_ERR "Invalid event queue policy %s", policy_str);
+		return POM_ERR;
+	}
+
+	o->event_queue = event_queue_alloc(*size, policy, *PTYPE_UINT32_GETVAL(o->p_event_queue_threads), o->perf_event_queue_depth, o->perf_event_queue_drops);
+	if (!o->event_queue)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+static void output_event_queue_close(struct output *o) {
+
+	if (!o->event_queue)
+		return;
+
+	event_queue_cleanup(o->event_queue);
+	o->event_queue = NULL;
+}
+
 int output_init() {
 	
 	output_registry_class = registry_add_class(OUTPUT_REGISTRY);
@@ -180,6 +274,9 @@ int output_instance_add(char *type, char *name) {
 		goto err;
 	}
 
+	if (output_event_queue_params_add(res) != POM_OK)
+		goto err;
+
 	if (registry_uid_create(res->reg_instance) != POM_OK)
 		goto err;
 
@@ -220,6 +317,9 @@ int output_instance_remove(struct registry_instance *ri) {
 		}
 	}
 
+	if (o->running)
+		output_event_queue_close(o);
+
 	if (o->info->reg_info->cleanup) {
 		if (o->info->reg_info->cleanup(o->priv) != POM_OK) {
 			pomlog(POMLOG_ERR "Error while cleaning up output");
@@ -269,8 +369,17 @@ int output_instance_start_stop_handler(void *priv, struct registry_param *p, str
 	}
 
 	if (*new_state) {
+		if (output_event_queue_open(o) != POM_OK)
+			return POM_ERR;
+
 		if (o->info->reg_info->open) {
-			if (o->info->reg_info->open(o->priv) != POM_OK) {
+			// Listeners registered while opening use the output's queue
+			struct event_queue *prev = event_listener_queue_set(o->event_queue);
+			int res = o->info->reg_info->open(o->priv);
+			event_listener_queue_set(prev);
+
+			if (res != POM_OK) {
+				output_event_queue_close(o);
 				pomlog(POMLOG_ERR "Error while starting the output");
 				return POM_ERR;
 			}
@@ -284,6 +393,7 @@ int output_instance_start_stop_handler(void *priv, struct registry_param *p, str
 				return POM_ERR;
 			}
 		}
+		output_event_queue_close(o);
 		registry_perf_timeticks_stop(o->perf_runtime);
 		pomlog("Output %s stopped", o->info->reg_info->name);
 	}
@@ -35,6 +35,14 @@ struct output {
 
 	struct registry_perf *perf_runtime;
 
+	// Deliver the events to the output from separate threads
+	struct ptype *p_event_queue_size;
+	struct ptype *p_event_queue_policy;
+	struct ptype *p_event_queue_threads;
+	struct event_queue *event_queue;
+	struct registry_perf *perf_event_queue_depth;
+	struct registry_perf *perf_event_queue_drops;
+
 	void *priv;
 
 	struct output *prev, *next;
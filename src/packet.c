@@ -46,19 +46,216 @@
 
 static struct registry_perf *perf_pkt_buff = NULL;
 static struct registry_perf *perf_pkt_in_use = NULL;
+static struct registry_perf *perf_pkt_pool_hit = NULL;
+static struct registry_perf *perf_pkt_pool_miss = NULL;
+
+// Size of the objects in each pool class and maximum number of magazines kept in its depot
+static struct packet_pool_class {
+	size_t size;
+	unsigned int depot_max;
+} packet_pool_classes[PACKET_POOL_CLASS_COUNT] = {
+	{ sizeof(struct packet), 64 },
+	{ 128, 64 },
+	{ 2048, 64 },
+	{ 9216, 16 },
+	{ 65536, 4 },
+};
+
+static struct packet_pool_depot packet_pool_depots[PACKET_POOL_CLASS_COUNT];
+static __thread struct packet_pool_magazine *packet_pool_mags[PACKET_POOL_CLASS_COUNT] = { 0 };
+
+// Give back the magazines of the threads which exit without calling packet_pool_cleanup()
+static pthread_key_t packet_pool_key;
+static __thread int packet_pool_key_set = 0;
+
+static void packet_pool_thread_exit(void *arg) {
+	packet_pool_cleanup();
+}
+
+static void packet_pool_thread_register() {
+
+	if (packet_pool_key_set)
+		return;
+
+	int res = pthread_setspecific(packet_pool_key, packet_pool_mags);
+	if (res) {
+		pomlog(POMLOG_WARN "Error while setting the packet pool thread key : %s", pom_strerror(res));
+		return;
+	}
+	packet_pool_key_set = 1;
+}
 
 int packet_init() {
 	perf_pkt_buff = core_add_perf("pkt_buff", registry_perf_type_gauge, "Number of bytes used by packets", "bytes");
 	perf_pkt_in_use = core_add_perf("pkt_in_use", registry_perf_type_gauge, "Number of packets in use", "pkts");
+	perf_pkt_pool_hit = core_add_perf("pkt_pool_hit", registry_perf_type_counter, "Number of packets and buffers reused from the pool", "objs");
+	perf_pkt_pool_miss = core_add_perf("pkt_pool_miss", registry_perf_type_counter, "Number of packets and buffers which had to be allocated", "objs");
+
+	if (!perf_pkt_buff || !perf_pkt_in_use || !perf_pkt_pool_hit || !perf_pkt_pool_miss)
+		return POM_ERR;
 
-	if (!perf_pkt_buff || !perf_pkt_in_use)
+	memset(packet_pool_depots, 0, sizeof(packet_pool_depots));
+
+	int res = pthread_key_create(&packet_pool_key, packet_pool_thread_exit);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while creating the packet pool thread key : %s", pom_strerror(res));
 		return POM_ERR;
+	}
+
+	int i;
+	for (i = 0; i < PACKET_POOL_CLASS_COUNT; i++) {
+		res = pthread_mutex_init(&packet_pool_depots[i].lock, NULL);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while initializing the packet pool lock : %s", pom_strerror(res));
+			return POM_ERR;
+		}
+	}
+
+	return POM_OK;
+}
+
+int packet_cleanup() {
+
+	packet_pool_cleanup();
+	pthread_key_delete(packet_pool_key);
+
+	int i;
+	for (i = 0; i < PACKET_POOL_CLASS_COUNT; i++) {
+		struct packet_pool_depot *d = &packet_pool_depots[i];
+
+		while (d->full) {
+			struct packet_pool_magazine *m = d->full;
+			d->full = m->next;
+			while (m->count)
+				free(m->objs[--m->count]);
+			free(m);
+		}
+		d->full_count = 0;
+
+		while (d->empty) {
+			struct packet_pool_magazine *m = d->empty;
+			d->empty = m->next;
+			free(m);
+		}
+
+		pthread_mutex_destroy(&d->lock);
+	}
+
 	return POM_OK;
 }
 
 // Packet info pool stuff
 static __thread struct packet_info **packet_info_pool;
 
+static void *packet_pool_get(unsigned int cls) {
+
+	struct packet_pool_magazine *m = packet_pool_mags[cls];
+	if (m && m->count) {
+		registry_perf_inc(perf_pkt_pool_hit, 1);
+		return m->objs[--m->count];
+	}
+
+	// Our magazine is empty, exchange it for a full one from the depot
+	struct packet_pool_depot *d = &packet_pool_depots[cls];
+	pom_mutex_lock(&d->lock);
+	struct packet_pool_magazine *full = d->full;
+	if (!full) {
+		pom_mutex_unlock(&d->lock);
+		registry_perf_inc(perf_pkt_pool_miss, 1);
+		return NULL;
+	}
+	d->full = full->next;
+	d->full_count--;
+
+	if (m) {
+		m->next = d->empty;
+		d->empty = m;
+	}
+	pom_mutex_unlock(&d->lock);
+
+	full->next = NULL;
+	packet_pool_mags[cls] = full;
+	packet_pool_thread_register();
+
+	registry_perf_inc(perf_pkt_pool_hit, 1);
+	return full->objs[--full->count];
+}
+
+static void packet_pool_put(unsigned int cls, void *obj) {
+
+	struct packet_pool_magazine *m = packet_pool_mags[cls];
+	if (m && m->count < PACKET_POOL_MAGAZINE_SIZE) {
+		m->objs[m->count++] = obj;
+		return;
+	}
+
+	// Our magazine is full, give it to the depot and get an empty one
+	struct packet_pool_depot *d = &packet_pool_depots[cls];
+	pom_mutex_lock(&d->lock);
+	if (m) {
+		if (d->full_count >= packet_pool_classes[cls].depot_max) {
+			// The depot has enough objects already
+			pom_mutex_unlock(&d->lock);
+			free(obj);
+			return;
+		}
+		m->next = d->full;
+		d->full = m;
+		d->full_count++;
+	}
+
+	m = d->empty;
+	if (m)
+		d->empty = m->next;
+	pom_mutex_unlock(&d->lock);
+
+	if (!m) {
+		m = malloc(sizeof(struct packet_pool_magazine));
+		if (!m) {
+			packet_pool_mags[cls] = NULL;
+			pom_oom(sizeof(struct packet_pool_magazine));
+			free(obj);
+			return;
+		}
+	}
+
+	m->count = 0;
+	m->next = NULL;
+	m->objs[m->count++] = obj;
+	packet_pool_mags[cls] = m;
+	packet_pool_thread_register();
+}
+
+int packet_pool_cleanup() {
+
+	// Give back the magazines of the current thread to the depots
+	int i;
+	for (i = 0; i < PACKET_POOL_CLASS_COUNT; i++) {
+		struct packet_pool_magazine *m = packet_pool_mags[i];
+		if (!m)
+			continue;
+		packet_pool_mags[i] = NULL;
+
+		struct packet_pool_depot *d = &packet_pool_depots[i];
+		pom_mutex_lock(&d->lock);
+		if (m->count && d->full_count < packet_pool_classes[i].depot_max) {
+			m->next = d->full;
+			d->full = m;
+			d->full_count++;
+			m = NULL;
+		}
+		pom_mutex_unlock(&d->lock);
+
+		if (m) {
+			while (m->count)
+				free(m->objs[--m->count]);
+			free(m);
+		}
+	}
+
+	return POM_OK;
+}
+
 int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 
 	if (align_offset >= PACKET_BUFFER_ALIGNMENT) {
@@ -66,18 +263,37 @@ int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 		return POM_ERR;
 	}
 
-	size_t tot_size = size + align_offset + PACKET_BUFFER_ALIGNMENT + sizeof(struct packet_buffer);
+	// Find the smallest class that fits
+	int cls;
+	for (cls = PACKET_POOL_CLASS_BUFF_FIRST; cls < PACKET_POOL_CLASS_COUNT && packet_pool_classes[cls].size < size; cls++);
+
+	size_t tot_size;
+	struct packet_buffer *pb = NULL;
+
+	if (cls < PACKET_POOL_CLASS_COUNT) {
+		// Leave room for the biggest alignment offset so the buffer can be reused for any
+		tot_size = packet_pool_classes[cls].size + (PACKET_BUFFER_ALIGNMENT * 2) + sizeof(struct packet_buffer);
+		pb = packet_pool_get(cls);
+	} else {
+		cls = PACKET_POOL_CLASS_NONE;
+		tot_size = size + align_offset + PACKET_BUFFER_ALIGNMENT + sizeof(struct packet_buffer);
+	}
 
-	struct packet_buffer *pb = malloc(tot_size);
 	if (!pb) {
-		pom_oom(tot_size);
-		return POM_ERR;
+		pb = malloc(tot_size);
+		if (!pb) {
+			pom_oom(tot_size);
+			return POM_ERR;
+		}
 	}
-	memset(pb, 0, tot_size);
+
+	// The payload area is not zeroed, whoever allocates the buffer fills it
+	memset(pb, 0, sizeof(struct packet_buffer));
 
 	pb->base_buff = (void*)pb + sizeof(struct packet_buffer);
 	pb->aligned_buff = (void*) (((long)pb->base_buff & ~(PACKET_BUFFER_ALIGNMENT - 1)) + PACKET_BUFFER_ALIGNMENT + align_offset);
 	pb->buff_size = tot_size;
+	pb->pool_class = cls;
 
 	pkt->pkt_buff = pb;
 	pkt->len = size;
@@ -89,16 +305,45 @@ int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 	return POM_OK;
 }
 
+int packet_buffer_wrap(struct packet *pkt, void *buff, size_t len, void (*release) (void *priv), void *priv) {
+
+	// The packet will point to a buffer owned by someone else, usually a ring buffer
+	// It will be copied by packet_clone() if it needs to be kept after processing
+
+	if (pkt->pkt_buff) {
+		pomlog(POMLOG_ERR "Packet already has a buffer");
+		return POM_ERR;
+	}
+
+	pkt->buff = buff;
+	pkt->len = len;
+	pkt->buff_release = release;
+	pkt->buff_release_priv = priv;
+
+	return POM_OK;
+}
+
 void packet_buffer_release(struct packet_buffer *pb) {
 
 	registry_perf_dec(perf_pkt_buff, pb->buff_size);
-	free(pb);
+
+	if (pb->pool_class == PACKET_POOL_CLASS_NONE)
+		free(pb);
+	else
+		packet_pool_put(pb->pool_class, pb);
 }
 
 
 struct packet *packet_alloc() {
 
-	struct packet *tmp = malloc(sizeof(struct packet));
+	struct packet *tmp = packet_pool_get(PACKET_POOL_CLASS_PACKET);
+	if (!tmp) {
+		tmp = malloc(sizeof(struct packet));
+		if (!tmp) {
+			pom_oom(sizeof(struct packet));
+			return NULL;
+		}
+	}
 	memset(tmp, 0, sizeof(struct packet));
 
 	// Init the refcount
@@ -119,8 +364,8 @@ struct packet *packet_clone(struct packet *src, unsigned int flags) {
 		dst = packet_alloc();
 		if (!dst)
 			return NULL;
-		// FIXME get the alignment offset from the input
-		if (packet_buffer_alloc(dst, src->len, 0) != POM_OK) {
+		// Keep the same alignment as the original buffer
+		if (packet_buffer_alloc(dst, src->len, (unsigned long)src->buff & (PACKET_BUFFER_ALIGNMENT - 1)) != POM_OK) {
 			packet_release(dst);
 			return NULL;
 		}
@@ -156,9 +401,11 @@ int packet_release(struct packet *p) {
 	
 	if (p->pkt_buff)
 		packet_buffer_release(p->pkt_buff);
+	else if (p->buff_release)
+		p->buff_release(p->buff_release_priv);
 
 	registry_perf_dec(perf_pkt_in_use, 1);
-	free(p);
+	packet_pool_put(PACKET_POOL_CLASS_PACKET, p);
 
 	return POM_OK;
 }
@@ -444,6 +691,10 @@ int packet_multipart_process(struct packet_multipart *multipart, struct proto_pr
 		return PROTO_ERR;
 	}
 
+	// Buffers are not zeroed, make sure we don't leak old data in the gaps
+	if (multipart->gaps)
+		memset(p->buff, 0, multipart->cur);
+
 	struct packet_multipart_pkt *tmp = multipart->head;
 	for (; tmp; tmp = tmp->next) {
 		if (tmp->offset + tmp->len > multipart->cur) {
@@ -491,26 +742,60 @@ struct packet_stream_parser *packet_stream_parser_alloc(size_t max_line_size, un
 }
 
 
+// Keep a copy of the remaining payload as it is only valid while processing the current packet
+static int packet_stream_parser_buffer(struct packet_stream_parser *sp) {
+
+	if (sp->buff || !sp->plen) // Already buffered or nothing to keep
+		return POM_OK;
+
+	size_t size = sp->plen;
+	if (size < PACKET_STREAM_PARSER_BUFF_MIN)
+		size = PACKET_STREAM_PARSER_BUFF_MIN;
+
+	sp->buff = malloc(size);
+	if (!sp->buff) {
+		pom_oom(size);
+		return POM_ERR;
+	}
+	memcpy(sp->buff, sp->pload, sp->plen);
+	sp->buff_len = size;
+	sp->buff_pos = sp->plen;
+	sp->pload = sp->buff;
+
+	return POM_OK;
+}
+
 int packet_stream_parser_add_payload(struct packet_stream_parser *sp, void *pload, size_t len) {
 
-	if (!sp->pload && sp->buff) {
+	if (!sp->plen && sp->buff) {
 		// Payload was fully used, we can discard the buffer
 		free(sp->buff);
 		sp->buff = NULL;
 		sp->buff_len = 0;
 		sp->buff_pos = 0;
-
+		sp->scan_pos = 0;
 	}
 
 	if (sp->buff) {
-		// There is some leftovers, append the new payload
+		// There is some leftovers, move them at the begining of the buffer only if some data was consumed
+		if (sp->pload != sp->buff) {
+			memmove(sp->buff, sp->pload, sp->plen);
+			sp->pload = sp->buff;
+			sp->buff_pos = sp->plen;
+		}
+
+		// Grow the buffer exponentially so long lines are not copied over and over
 		if (sp->buff_len - sp->buff_pos < len) {
-			sp->buff = realloc(sp->buff, sp->buff_pos + len);
-			if (!sp->buff) {
-				pom_oom(sp->buff_pos + len);
+			size_t new_len = sp->buff_len * 2;
+			if (new_len < sp->buff_pos + len)
+				new_len = sp->buff_pos + len;
+			char *buff = realloc(sp->buff, new_len);
+			if (!buff) {
+				pom_oom(new_len);
 				return POM_ERR;
 			}
-			sp->buff_len = sp->buff_pos + len;
+			sp->buff = buff;
+			sp->buff_len = new_len;
 		}
 		memcpy(sp->buff + sp->buff_pos, pload, len);
 		sp->buff_pos += len;
@@ -520,6 +805,7 @@ int packet_stream_parser_add_payload(struct packet_stream_parser *sp, void *ploa
 		// No need to buffer anything, let's just process it
 		sp->pload = pload;
 		sp->plen = len;
+		sp->scan_pos = 0;
 	}
 
 	debug_stream_parser("entry %p, added pload %p with len %u", sp, pload, len);
@@ -535,6 +821,11 @@ int packet_stream_parser_skip_bytes(struct packet_stream_parser *sp, size_t len)
 	sp->pload += len;
 	sp->plen -= len;
 
+	if (sp->scan_pos > len)
+		sp->scan_pos -= len;
+	else
+		sp->scan_pos = 0;
+
 	return POM_OK;
 }
 
@@ -551,6 +842,7 @@ int packet_stream_parser_empty(struct packet_stream_parser *sp) {
 
 	sp->pload = NULL;
 	sp->plen = 0;
+	sp->scan_pos = 0;
 
 	return POM_OK;
 };
@@ -561,27 +853,22 @@ int packet_stream_parser_get_line(struct packet_stream_parser *sp, char **line,
 		return POM_ERR;
 
 	// Find the next line return in the current payload
+	// Only look at the bytes that were not scanned yet, memchr() is already vectorized by the libc
 	
 	char *pload = sp->pload;
 	
 	size_t str_len = sp->plen, tmp_len = 0;
 	
-	char *lf = memchr(pload, '\n', sp->plen);
+	char *lf = NULL;
+	if (sp->plen > sp->scan_pos)
+		lf = memchr(pload + sp->scan_pos, '\n', sp->plen - sp->scan_pos);
+
 	if (!lf) {
 
-		if (sp->buff) {
-			memmove(sp->buff, sp->pload, sp->plen);
-			sp->buff_pos = sp->plen;
-		} else {
-			sp->buff = malloc(sp->plen);
-			if (!sp->buff) {
-				pom_oom(sp->plen);
-				return POM_ERR;
-			}
-			memcpy(sp->buff, sp->pload, sp->plen);
-			sp->buff_len = sp->plen;
-			sp->buff_pos = sp->plen;
-		}
+		sp->scan_pos = sp->plen;
+
+		if (packet_stream_parser_buffer(sp) != POM_OK)
+			return POM_ERR;
 
 		// \n not found
 		*line = NULL;
@@ -598,6 +885,7 @@ int packet_stream_parser_get_line(struct packet_stream_parser *sp, char **line,
 
 	
 	sp->plen -= str_len;
+	sp->scan_pos = 0;
 	if (!sp->plen)
 		sp->pload = NULL;
 	else
@@ -631,28 +919,17 @@ int packet_stream_parser_get_bytes(struct packet_stream_parser *sp, size_t len,
 		*pload = NULL;
 
 		// Buffer remaining if needed
-		if (!sp->buff) {
-			sp->buff = malloc(sp->plen);
-			if (!sp->buff) {
-				pom_oom(sp->plen);
-				return POM_ERR;
-			}
-			memcpy(sp->buff, sp->pload, sp->plen);
-			sp->buff_len = sp->plen;
-			sp->buff_pos = sp->plen;
-
-		}
-
-		return POM_OK;
+		return packet_stream_parser_buffer(sp);
 	}
 
 	*pload = sp->pload;
 	sp->plen -= len;
+	sp->pload += len;
 
-	if (sp->plen) {
-		sp->pload += len;
-		sp->buff_pos += len;
-	}
+	if (sp->scan_pos > len)
+		sp->scan_pos -= len;
+	else
+		sp->scan_pos = 0;
 
 	return POM_OK;
 }
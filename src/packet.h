@@ -28,33 +28,60 @@
 
 #define PACKET_BUFFER_ALIGNMENT 4
 
+// Number of objects in each magazine of the packet pool
+#define PACKET_POOL_MAGAZINE_SIZE 64
+
+// Pool classes, the first one is for struct packet, the others for buffers
+#define PACKET_POOL_CLASS_PACKET	0
+#define PACKET_POOL_CLASS_BUFF_FIRST	1
+#define PACKET_POOL_CLASS_COUNT		5
+#define PACKET_POOL_CLASS_NONE		-1 // Not allocated from the pool
+
 struct packet_buffer {
 
 	void *base_buff;
 	void *aligned_buff;
 	size_t buff_size;
+	int pool_class;
 
 	// The actual data will be after this
 	
 };
 
+struct packet_pool_magazine {
+	unsigned int count;
+	struct packet_pool_magazine *next;
+	void *objs[PACKET_POOL_MAGAZINE_SIZE];
+};
+
+struct packet_pool_depot {
+	pthread_mutex_t lock;
+	struct packet_pool_magazine *full; // Magazines with objects
+	unsigned int full_count;
+	struct packet_pool_magazine *empty; // Spare empty magazines
+};
+
+// Minimum size of the buffer holding an incomplete line
+#define PACKET_STREAM_PARSER_BUFF_MIN	2048
+
 struct packet_stream_parser {
 	size_t max_line_size;
-	char *buff;
-	size_t buff_len;
-	size_t buff_pos;
+	char *buff; // Copy of the remaining payload when it must outlive the packet
+	size_t buff_len; // Allocated size of buff
+	size_t buff_pos; // End of the data in buff
 	char *pload;
 	size_t plen;
+	size_t scan_pos; // Bytes at the start of pload known not to contain a line return
 	unsigned int flags;
 };
 
 int packet_init();
+int packet_cleanup();
 
 void packet_buffer_release(struct packet_buffer *pb);
 
 struct packet_info *packet_info_pool_get(struct proto *p);
 struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *info);
-int packet_pool_cleanup();
 int packet_info_pool_init();
 int packet_info_pool_release(struct packet_info *info, unsigned int protocol_id);
 int packet_info_pool_cleanup();
@@ -44,6 +44,7 @@ static __thread magic_t magic_cookie = NULL;
 
 
 static struct registry_class *pload_registry_class = NULL;
+static struct registry_perf *pload_perf_decoded_in = NULL, *pload_perf_decoded_out = NULL, *pload_perf_decode_time = NULL;
 static struct ptype *pload_store_path = NULL;
 static struct ptype *pload_store_mmap_block_size = NULL;
 static size_t pload_page_size = 0;
@@ -51,6 +52,9 @@ static size_t pload_page_size = 0;
 static struct pload_listener_reg *pload_listeners = NULL;
 static pthread_rwlock_t pload_listeners_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+// Decoded data is handed to the listeners from this buffer when there is no store
+static __thread char *pload_decode_chunk = NULL;
+
 static struct pload_type *pload_types = NULL;
 static struct pload_mime_type *pload_mime_types_hash = NULL, *pload_mime_types_head = NULL;
 
@@ -120,6 +124,12 @@ int pload_init() {
 
 	p = NULL;
 
+	pload_perf_decoded_in = registry_class_add_perf(pload_registry_class, "decoded_in", registry_perf_type_counter, "Number of encoded bytes decoded", "bytes");
+	pload_perf_decoded_out = registry_class_add_perf(pload_registry_class, "decoded_out", registry_perf_type_counter, "Number of bytes produced by the decoders", "bytes");
+	pload_perf_decode_time = registry_class_add_perf(pload_registry_class, "decode_time", registry_perf_type_counter, "Time spent decoding payloads", "us");
+	if (!pload_perf_decoded_in || !pload_perf_decoded_out || !pload_perf_decode_time)
+		goto err;
+
 
 	r = resource_open("payload_types", pload_types_resource_template);
 	if (!r)
@@ -292,6 +302,9 @@ void pload_thread_cleanup() {
 		magic_close(magic_cookie);
 #endif
 
+	free(pload_decode_chunk);
+	pload_decode_chunk = NULL;
+
 }
 
 void pload_cleanup() {
@@ -527,6 +540,22 @@ int pload_buffer_grow(struct pload *p, size_t min_size) {
 	return POM_OK;
 }
 
+// Decode what's possible and account it in the perfs
+static int pload_decode(struct decoder *d) {
+
+	size_t avail_in = d->avail_in, avail_out = d->avail_out;
+	ptime start = pom_gettimeofday();
+
+	// Call the decoder even without input as it may still have some output pending
+	int res = d->reg->decode(d);
+
+	registry_perf_inc(pload_perf_decode_time, pom_gettimeofday() - start);
+	registry_perf_inc(pload_perf_decoded_in, avail_in - d->avail_in);
+	registry_perf_inc(pload_perf_decoded_out, avail_out - d->avail_out);
+
+	return res;
+}
+
 int pload_buffer_append(struct pload *p, void *data, size_t len) {
 
 	if (p->decoder) {
@@ -548,7 +577,7 @@ int pload_buffer_append(struct pload *p, void *data, size_t len) {
 		while (1) {
 			d->next_out = p->buf.data + p->buf.data_len;
 
-			int res = decoder_decode(d);
+			int res = pload_decode(d);
 
 			if (res == DEC_END) {
 				break;
@@ -652,7 +681,7 @@ int pload_store_append(struct pload *p, void *data, size_t len) {
 		while (1) {
 			d->next_out = write_map->map + write_map->off_cur;
 
-			int res = decoder_decode(d);
+			int res = pload_decode(d);
 
 			if (res == DEC_END) {
 				break;
@@ -693,6 +722,74 @@ int pload_store_append(struct pload *p, void *data, size_t len) {
 
 	return POM_OK;
 }
+static void pload_listeners_write(struct pload *p, void *data, size_t len) {
+
+	struct pload_listener *tmp = p->listeners;
+	while (tmp) {
+		
+		if (tmp->reg->write(tmp->reg->obj, tmp->priv, data, len) != POM_OK) {
+			pomlog(POMLOG_WARN "Error while writing to a pload listener");
+			tmp->reg->close(tmp->reg->obj, tmp->priv);
+
+			struct pload_listener *todel = tmp;
+			tmp = tmp->next;
+
+			if (todel->prev)
+				todel->prev->next = todel->next;
+			else
+				p->listeners = todel->next;
+
+			if (todel->next)
+				todel->next->prev = todel->prev;
+
+			free(todel);
+
+			continue;
+		}
+		tmp = tmp->next;
+	}
+}
+
+// Decode the payload by fixed size chunks and give each of them to the listeners
+// Nothing is kept once the listeners have been called so the decoded data is never buffered
+static int pload_decode_chunks(struct pload *p, void *data, size_t len) {
+
+	if (!pload_decode_chunk) {
+		pload_decode_chunk = malloc(PLOAD_DECODE_CHUNK_SIZE);
+		if (!pload_decode_chunk) {
+			pom_oom(PLOAD_DECODE_CHUNK_SIZE);
+			p->flags |= PLOAD_FLAG_IS_ERR;
+			return POM_ERR;
+		}
+	}
+
+	struct decoder *d = p->decoder;
+	d->next_in = data;
+	d->avail_in = len;
+
+	int res;
+	size_t avail_in;
+	do {
+		avail_in = d->avail_in;
+		d->next_out = pload_decode_chunk;
+		d->avail_out = PLOAD_DECODE_CHUNK_SIZE;
+
+		res = pload_decode(d);
+		if (res == DEC_ERR) {
+			p->flags |= PLOAD_FLAG_IS_ERR;
+			return POM_ERR;
+		}
+
+		size_t out_len = PLOAD_DECODE_CHUNK_SIZE - d->avail_out;
+		if (out_len)
+			pload_listeners_write(p, pload_decode_chunk, out_len);
+
+		// Stop when the decoder is done or when it needs more input
+	} while (p->listeners && (res == DEC_MORE || (res == DEC_OK && d->avail_in && d->avail_in != avail_in)));
+
+	return POM_OK;
+}
+
 int pload_append(struct pload *p, void *data, size_t len) {
 
 	if (p->flags & PLOAD_FLAG_IS_ERR)
@@ -737,11 +834,9 @@ int pload_append(struct pload *p, void *data, size_t len) {
 			len = p->buf.data_len;
 		}
 	} else if (!p->store && p->decoder) {
-		// There is no store being used but we still need some space to decode the payload
-		if (pload_buffer_append(p, data, len) != POM_OK)
-			return POM_OK;
-		data = p->buf.data;
-		len = p->buf.data_len;
+		// There is no store being used, no need to keep the decoded payload
+		pload_decode_chunks(p, data, len);
+		return POM_OK;
 	}
 
 
@@ -940,29 +1035,7 @@ int pload_append(struct pload *p, void *data, size_t len) {
 
 	}
 
-	struct pload_listener *tmp = p->listeners;
-	while (tmp) {
-		
-		if (tmp->reg->write(tmp->reg->obj, tmp->priv, data, len) != POM_OK) {
-			pomlog(POMLOG_WARN "Error while writing to a pload listener");
-			tmp->reg->close(tmp->reg->obj, tmp->priv);
-
-			struct pload_listener *todel = tmp;
-			tmp = tmp->next;
-
-			if (todel->prev)
-				todel->prev->next = todel->next;
-			else
-				p->listeners = todel->next;
-
-			if (todel->next)
-				todel->next->prev = todel->prev;
-
-			free(todel);
-
-		}
-		tmp = tmp->next;
-	}
+	pload_listeners_write(p, data, len);
 
 
 	if (p->buf.data) {
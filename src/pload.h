@@ -31,6 +31,9 @@
 #define PLOAD_STORE_FLAG_OPENED		0x1
 #define PLOAD_STORE_FLAG_COMPLETE	0x2
 
+// Size of the per thread buffer used to decode payloads which are not stored
+#define PLOAD_DECODE_CHUNK_SIZE		(256 * 1024)
+
 struct pload_mime_type {
 	char *name;
 	struct pload_type *type;
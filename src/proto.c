@@ -25,6 +25,10 @@
 #include "main.h"
 #include "mod.h"
 #include "filter.h"
+#include "core.h"
+#include "timer.h"
+#include "ptype.h"
+#include "jhash.h"
 
 
 #if 0
@@ -113,17 +117,25 @@ int proto_register(struct proto_reg_info *reg_info) {
 		proto->perf_conn_tot = registry_instance_add_perf(proto->reg_instance, "conn_tot", registry_perf_type_counter, "Total number of connections", "connections");
 		proto->perf_conn_hash_col = registry_instance_add_perf(proto->reg_instance, "conn_hash_col", registry_perf_type_counter, "Total number of conntrack hash collisions", "collisions");
 
-		if (!proto->perf_conn_cur || !proto->perf_conn_tot || !proto->perf_conn_hash_col)
+		proto->perf_conn_load = registry_instance_add_perf(proto->reg_instance, "conn_load", registry_perf_type_gauge, "Load factor of the conntrack tables", "%");
+		proto->perf_conn_chain_max = registry_instance_add_perf(proto->reg_instance, "conn_chain_max", registry_perf_type_gauge, "Longest conntrack chain seen since the last resize", "connections");
+
+		if (!proto->perf_conn_cur || !proto->perf_conn_tot || !proto->perf_conn_hash_col || !proto->perf_conn_load || !proto->perf_conn_chain_max)
 			goto err_conntrack;
 
+		registry_perf_set_update_hook(proto->perf_conn_load, conntrack_table_perf_load, proto->ct);
+		registry_perf_set_update_hook(proto->perf_conn_chain_max, conntrack_table_perf_chain_max, proto->ct);
+
 	}
 
 	proto->perf_pkts = registry_instance_add_perf(proto->reg_instance, "pkts", registry_perf_type_counter, "Number of packets processed", "pkts");
 	proto->perf_bytes = registry_instance_add_perf(proto->reg_instance, "bytes", registry_perf_type_counter, "Number of bytes processed", "bytes");
 	proto->perf_expt_pending = registry_instance_add_perf(proto->reg_instance, "expectations_pending", registry_perf_type_gauge, "Number of expectations pending", "expectations");
 	proto->perf_expt_matched = registry_instance_add_perf(proto->reg_instance, "expectations_matched", registry_perf_type_counter, "Number of expectations matched", "expectations");
+	proto->perf_expt_lookups = registry_instance_add_perf(proto->reg_instance, "expectations_lookups", registry_perf_type_counter, "Number of packets looked up in the expectation table", "lookups");
+	proto->perf_expt_cmps = registry_instance_add_perf(proto->reg_instance, "expectations_cmps", registry_perf_type_counter, "Number of expectations compared during lookups", "comparisons");
 
-	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_expt_pending || !proto->perf_expt_matched)
+	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_expt_pending || !proto->perf_expt_matched || !proto->perf_expt_lookups || !proto->perf_expt_cmps)
 		goto err_conntrack;
 
 	if (reg_info->init) {
@@ -161,6 +173,271 @@ err_proto:
 
 }
 
+static uint32_t proto_expectation_hash(struct ptype *value) {
+
+	return jhash((char*)value->value, ptype_get_value_size(value), 0);
+}
+
+static int proto_expectation_field_match(struct ptype *expt, struct ptype *value) {
+
+	if (!expt)
+		return 1;
+
+	if (!value)
+		return 0;
+
+	return ptype_compare_val(PTYPE_OP_EQ, expt, value);
+}
+
+static struct proto_expectation **proto_expectation_table_bucket(struct proto_expectation_table *tbl, struct proto_expectation *e) {
+
+	struct proto_expectation_stack *es = e->tail;
+
+	if (es->fields[POM_DIR_FWD] && es->fields[POM_DIR_REV])
+		return &tbl->pairs[e->hash & (tbl->size - 1)];
+	else if (es->fields[POM_DIR_FWD] || es->fields[POM_DIR_REV])
+		return &tbl->singles[e->hash & (tbl->size - 1)];
+
+	return &tbl->wildcards;
+}
+
+static void proto_expectation_table_link(struct proto_expectation_table *tbl, struct proto_expectation *e) {
+
+	struct proto_expectation **bucket = proto_expectation_table_bucket(tbl, e);
+
+	e->prev = NULL;
+	e->next = *bucket;
+	if (e->next)
+		e->next->prev = e;
+	*bucket = e;
+}
+
+static void proto_expectation_table_remove(struct proto_expectation_table *tbl, struct proto_expectation *e) {
+
+	if (e->next)
+		e->next->prev = e->prev;
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		*proto_expectation_table_bucket(tbl, e) = e->next;
+
+	e->prev = NULL;
+	e->next = NULL;
+	tbl->count--;
+}
+
+static int proto_expectation_table_grow(struct proto_expectation_table *tbl) {
+
+	unsigned int new_size = (tbl->size ? tbl->size << 1 : PROTO_EXPECTATION_TABLE_SIZE);
+
+	size_t buckets_size = sizeof(struct proto_expectation *) * new_size;
+	struct proto_expectation **pairs = malloc(buckets_size);
+	if (!pairs) {
+		pom_oom(buckets_size);
+		return POM_ERR;
+	}
+	struct proto_expectation **singles = malloc(buckets_size);
+	if (!singles) {
+		free(pairs);
+		pom_oom(buckets_size);
+		return POM_ERR;
+	}
+	memset(pairs, 0, buckets_size);
+	memset(singles, 0, buckets_size);
+
+	struct proto_expectation **old_pairs = tbl->pairs, **old_singles = tbl->singles;
+	unsigned int old_size = tbl->size;
+
+	tbl->pairs = pairs;
+	tbl->singles = singles;
+	tbl->size = new_size;
+
+	unsigned int i;
+	for (i = 0; i < old_size; i++) {
+		while (old_pairs[i]) {
+			struct proto_expectation *e = old_pairs[i];
+			old_pairs[i] = e->next;
+			proto_expectation_table_link(tbl, e);
+		}
+		while (old_singles[i]) {
+			struct proto_expectation *e = old_singles[i];
+			old_singles[i] = e->next;
+			proto_expectation_table_link(tbl, e);
+		}
+	}
+
+	free(old_pairs);
+	free(old_singles);
+
+	return POM_OK;
+}
+
+static int proto_expectation_table_add(struct proto_expectation_table *tbl, struct proto_expectation *e) {
+
+	if (!tbl->size || (tbl->count >= tbl->size && tbl->size < PROTO_EXPECTATION_TABLE_SIZE_MAX)) {
+		if (proto_expectation_table_grow(tbl) != POM_OK)
+			return POM_ERR;
+	}
+
+	struct proto_expectation_stack *es = e->tail;
+	if (es->fields[POM_DIR_FWD] && es->fields[POM_DIR_REV]) {
+		// Combine the hashes so that both directions end up in the same bucket
+		e->hash = proto_expectation_hash(es->fields[POM_DIR_FWD]) ^ proto_expectation_hash(es->fields[POM_DIR_REV]);
+	} else if (es->fields[POM_DIR_FWD]) {
+		e->hash = proto_expectation_hash(es->fields[POM_DIR_FWD]);
+	} else if (es->fields[POM_DIR_REV]) {
+		e->hash = proto_expectation_hash(es->fields[POM_DIR_REV]);
+	} else {
+		e->hash = 0;
+	}
+
+	proto_expectation_table_link(tbl, e);
+	tbl->count++;
+
+	return POM_OK;
+}
+
+static void proto_expectation_table_cleanup(struct proto_expectation_table *tbl) {
+
+	unsigned int i;
+	for (i = 0; i < tbl->size; i++) {
+		while (tbl->pairs[i]) {
+			struct proto_expectation *e = tbl->pairs[i];
+			tbl->pairs[i] = e->next;
+			proto_expectation_cleanup(e);
+		}
+		while (tbl->singles[i]) {
+			struct proto_expectation *e = tbl->singles[i];
+			tbl->singles[i] = e->next;
+			proto_expectation_cleanup(e);
+		}
+	}
+
+	while (tbl->wildcards) {
+		struct proto_expectation *e = tbl->wildcards;
+		tbl->wildcards = e->next;
+		proto_expectation_cleanup(e);
+	}
+
+	free(tbl->pairs);
+	free(tbl->singles);
+	memset(tbl, 0, sizeof(struct proto_expectation_table));
+}
+
+// Check the expected values of the last stack against the packet, return the direction
+static int proto_expectation_match_dir(struct proto_expectation_stack *es, struct ptype *fwd_value, struct ptype *rev_value) {
+
+	if (proto_expectation_field_match(es->fields[POM_DIR_FWD], fwd_value) && proto_expectation_field_match(es->fields[POM_DIR_REV], rev_value))
+		return POM_DIR_FWD;
+
+	if (proto_expectation_field_match(es->fields[POM_DIR_FWD], rev_value) && proto_expectation_field_match(es->fields[POM_DIR_REV], fwd_value))
+		return POM_DIR_REV;
+
+	return POM_DIR_UNK;
+}
+
+// Check the previous stacks of the expectation against the ones of the packet
+static int proto_expectation_match_stack(struct proto_expectation *e, int expt_dir, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	struct proto_expectation_stack *es = e->tail->prev;
+	int stack_index_tmp = stack_index - 1;
+
+	for (; es; es = es->prev, stack_index_tmp--) {
+
+		if (stack_index_tmp < 0)
+			return 0;
+
+		struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+
+		if (s_tmp->proto != es->proto || !s_tmp->proto->info->ct_info)
+			return 0;
+
+		struct conntrack_info *ct_info = s_tmp->proto->info->ct_info;
+		struct ptype *fwd_value = s_tmp->pkt_info->fields_value[ct_info->fwd_pkt_field_id];
+		struct ptype *rev_value = (ct_info->rev_pkt_field_id == -1 ? NULL : s_tmp->pkt_info->fields_value[ct_info->rev_pkt_field_id]);
+
+		if (expt_dir == POM_DIR_REV) {
+			struct ptype *tmp = fwd_value;
+			fwd_value = rev_value;
+			rev_value = tmp;
+		}
+
+		if (!proto_expectation_field_match(es->fields[POM_DIR_FWD], fwd_value) || !proto_expectation_field_match(es->fields[POM_DIR_REV], rev_value))
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct proto_expectation *proto_expectation_find_bucket(struct proto_expectation *e, int check_hash, uint32_t hash_a, uint32_t hash_b, struct ptype *fwd_value, struct ptype *rev_value, struct proto_process_stack *stack, unsigned int stack_index, int *expt_dir, unsigned int *cmps) {
+
+	for (; e; e = e->next) {
+
+		// Entries with a different hash can't match
+		if (check_hash && e->hash != hash_a && e->hash != hash_b)
+			continue;
+
+		(*cmps)++;
+
+		int dir = proto_expectation_match_dir(e->tail, fwd_value, rev_value);
+		if (dir == POM_DIR_UNK)
+			continue;
+
+		if (!proto_expectation_match_stack(e, dir, stack, stack_index))
+			continue;
+
+		*expt_dir = dir;
+		return e;
+	}
+
+	return NULL;
+}
+
+// Must be called with the expectation lock held
+static struct proto_expectation *proto_expectation_find(struct proto *proto, struct proto_process_stack *stack, unsigned int stack_index, int *expt_dir) {
+
+	struct proto_expectation_table *tbl = &proto->expectations;
+	if (!tbl->count)
+		return NULL;
+
+	struct proto_process_stack *s = &stack[stack_index];
+	struct conntrack_info *ct_info = proto->info->ct_info;
+
+	struct ptype *fwd_value = s->pkt_info->fields_value[ct_info->fwd_pkt_field_id];
+	struct ptype *rev_value = (ct_info->rev_pkt_field_id == -1 ? NULL : s->pkt_info->fields_value[ct_info->rev_pkt_field_id]);
+
+	if (!fwd_value)
+		return NULL;
+
+	uint32_t hash_fwd = proto_expectation_hash(fwd_value);
+	uint32_t hash_rev = (rev_value ? proto_expectation_hash(rev_value) : hash_fwd);
+	unsigned int mask = tbl->size - 1;
+
+	unsigned int cmps = 0;
+	struct proto_expectation *e = NULL;
+
+	// Expectations knowing both values
+	if (rev_value)
+		e = proto_expectation_find_bucket(tbl->pairs[(hash_fwd ^ hash_rev) & mask], 1, hash_fwd ^ hash_rev, hash_fwd ^ hash_rev, fwd_value, rev_value, stack, stack_index, expt_dir, &cmps);
+
+	// Expectations knowing one of the values
+	if (!e)
+		e = proto_expectation_find_bucket(tbl->singles[hash_fwd & mask], 1, hash_fwd, hash_rev, fwd_value, rev_value, stack, stack_index, expt_dir, &cmps);
+
+	if (!e && (hash_fwd & mask) != (hash_rev & mask))
+		e = proto_expectation_find_bucket(tbl->singles[hash_rev & mask], 1, hash_fwd, hash_rev, fwd_value, rev_value, stack, stack_index, expt_dir, &cmps);
+
+	// Expectations matching any value
+	if (!e)
+		e = proto_expectation_find_bucket(tbl->wildcards, 0, 0, 0, fwd_value, rev_value, stack, stack_index, expt_dir, &cmps);
+
+	registry_perf_inc(proto->perf_expt_lookups, 1);
+	registry_perf_inc(proto->perf_expt_cmps, cmps);
+
+	return e;
+}
+
 int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct proto_process_stack *s = &stack[stack_index];
@@ -177,110 +454,63 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	if (res != PROTO_OK)
 		return res;
+
+	// Most protocols don't have any expectation pending
+	if (!proto->expectations.count || !proto->info->ct_info)
+		return res;
 		
 	// Process the expectations !
+	int expt_dir = POM_DIR_UNK;
 	pom_rwlock_rlock(&proto->expectation_lock);
-	struct proto_expectation *e = proto->expectations;
-	while (e) {
-		
-		int expt_dir = POM_DIR_UNK;
-
-		struct proto_expectation_stack *es = e->tail;
-		struct ptype *fwd_value = s->pkt_info->fields_value[s->proto->info->ct_info->fwd_pkt_field_id];
-		struct ptype *rev_value = s->pkt_info->fields_value[s->proto->info->ct_info->rev_pkt_field_id];
-
-		if ((!es->fields[POM_DIR_FWD] || ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) &&
-			(!es->fields[POM_DIR_REV] || ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
-			// Expectation matched the forward direction
-			expt_dir = POM_DIR_FWD;
-		} else if ((!es->fields[POM_DIR_FWD] || ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) &&
-			(!es->fields[POM_DIR_REV] || ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
-			// Expectation matched the reverse direction
-			expt_dir = POM_DIR_REV;
-		}
-
-		if (expt_dir == POM_DIR_UNK) {
-			// Expectation not matched
-			e = e->next;
-			continue;
-		}
-		
-		es = es->prev;
-		int stack_index_tmp = stack_index - 1;
-		while (es) {
-
-			struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
-
-			if (s_tmp->proto != es->proto) {
-				 e = e->next;
-				 continue;
-			}
-
-			fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
-			rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
-
-			if (expt_dir == POM_DIR_FWD) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
-					e = e->next;
-					continue;
-				}
-			} else {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
-					e = e->next;
-					continue;
-				}
-
-			}
-
-			es = es->prev;
-			stack_index_tmp--;
-		}
-
-		// Expectation matched !
-		// Relock with write access
+	struct proto_expectation *e = proto_expectation_find(proto, stack, stack_index, &expt_dir);
+	if (!e) {
 		pom_rwlock_unlock(&proto->expectation_lock);
-		pom_rwlock_wlock(&proto->expectation_lock);
+		return res;
+	}
 
-		debug_expectation("Expectation %p matched !", e);
+	// Relock with write access and make sure the expectation is still there
+	pom_rwlock_unlock(&proto->expectation_lock);
+	pom_rwlock_wlock(&proto->expectation_lock);
 
-		// Remove it from the list
-		
-		if (e->next)
-			e->next->prev = e->prev;
+	e = proto_expectation_find(proto, stack, stack_index, &expt_dir);
+	if (!e) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return res;
+	}
 
-		if (e->prev)
-			e->prev->next = e->next;
-		else
-			proto->expectations = e->next;
+	// The expiry timer may be running on another thread, it owns the expectation then
+	if (timer_dequeue_pending(e->expiry) != POM_OK) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return res;
+	}
 
-		struct proto_process_stack *s_next = &stack[stack_index + 1];
-		s_next->proto = e->proto;
+	debug_expectation("Expectation %p matched !", e);
 
-		
-		if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
-			proto_expectation_cleanup(e);
-			return PROTO_ERR;
-		}
+	// Remove it from the table
+	proto_expectation_table_remove(&proto->expectations, e);
+	pom_rwlock_unlock(&proto->expectation_lock);
 
-		s_next->ce->priv = e->priv;
+	struct proto_process_stack *s_next = &stack[stack_index + 1];
+	s_next->proto = e->proto;
 
-		if (conntrack_session_bind(s_next->ce, e->session)) {
-			proto_expectation_cleanup(e);
-			return PROTO_ERR;
-		}
+	
+	if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
+		proto_expectation_cleanup(e);
+		return PROTO_ERR;
+	}
 
-		registry_perf_dec(e->proto->perf_expt_pending, 1);
-		registry_perf_inc(e->proto->perf_expt_matched, 1);
+	s_next->ce->priv = e->priv;
 
+	if (conntrack_session_bind(s_next->ce, e->session)) {
 		proto_expectation_cleanup(e);
-		conntrack_unlock(s_next->ce);
+		return PROTO_ERR;
+	}
 
-		break;
+	registry_perf_dec(e->proto->perf_expt_pending, 1);
+	registry_perf_inc(e->proto->perf_expt_matched, 1);
 
-	}
-	pom_rwlock_unlock(&proto->expectation_lock);
+	proto_expectation_cleanup(e);
+	conntrack_unlock(s_next->ce);
 
 	return res;
 }
@@ -297,9 +527,17 @@ int proto_process_pload_listeners(struct packet *p, struct proto_process_stack *
 		
 		struct proto_packet_listener *l;
 		pom_rwlock_rlock(&proto->listeners_lock);
+
+		// Evaluate the filters of all the listeners at once
+		uint64_t match = (proto->payload_filters ? filter_set_match(proto->payload_filters, stack) : 0);
+
 		for (l = proto->payload_listeners; l; l = l->next) {
-			if (l->filter && !filter_packet_match(l->filter, stack))
+			if (l->filter_id >= 0) {
+				if (!(match & (1ULL << l->filter_id)))
+					continue;
+			} else if (l->filter && !filter_packet_match(l->filter, stack)) {
 				continue;
+			}
 			if (l->process(l->object, p, stack, stack_index + 1) != POM_OK) {
 				pomlog(POMLOG_WARN "Warning payload listener failed");
 				// FIXME remove listener from the list ?
@@ -324,9 +562,17 @@ int proto_post_process(struct packet *p, struct proto_process_stack *s, unsigned
 	// Process the listeners after the whole stack has been processed
 	struct proto_packet_listener *l;
 	pom_rwlock_rlock(&proto->listeners_lock);
+
+	// Evaluate the filters of all the listeners at once
+	uint64_t match = (proto->packet_filters ? filter_set_match(proto->packet_filters, s) : 0);
+
 	for (l = proto->packet_listeners; l; l = l->next) {
-		if (l->filter && !filter_packet_match(l->filter, s))
+		if (l->filter_id >= 0) {
+			if (!(match & (1ULL << l->filter_id)))
+				continue;
+		} else if (l->filter && !filter_packet_match(l->filter, s)) {
 			continue;
+		}
 		if (l->process(l->object, p, s, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "Warning packet listener failed");
 			// FIXME remove listener from the list ?
@@ -359,6 +605,8 @@ int proto_unregister(char *name) {
 
 		conntrack_table_cleanup(proto->ct);
 
+	proto_expectation_table_cleanup(&proto->expectations);
+
 	if (proto->next)
 		proto->next->prev = proto->prev;
 	if (proto->prev)
@@ -368,6 +616,9 @@ int proto_unregister(char *name) {
 
 	mod_refcount_dec(proto->info->mod);
 
+	filter_set_cleanup(proto->packet_filters);
+	filter_set_cleanup(proto->payload_filters);
+
 	free(proto);
 
 	return POM_OK;
@@ -386,13 +637,8 @@ int proto_finish() {
 	struct proto *proto;
 
 	// Cleanup the expectations first
-	for (proto = proto_head; proto; proto = proto->next) {
-		while (proto->expectations) {
-			struct proto_expectation *e = proto->expectations;
-			proto->expectations = e->next;
-			proto_expectation_cleanup(e);
-		}
-	}
+	for (proto = proto_head; proto; proto = proto->next)
+		proto_expectation_table_cleanup(&proto->expectations);
 
 	// Cleanup the conntracks
 	for (proto = proto_head; proto; proto = proto->next) {
@@ -425,6 +671,8 @@ int proto_cleanup() {
 		if (res)
 			pomlog(POMLOG_ERR "Error while destroying the listners lock : %s", pom_strerror(res));
 
+		filter_set_cleanup(proto->packet_filters);
+		filter_set_cleanup(proto->payload_filters);
 
 		free(proto);
 	}
@@ -448,6 +696,76 @@ int proto_cleanup() {
 	return POM_OK;
 }
 
+// Must be called with the listeners lock held for writing
+static void proto_packet_listener_filters_update(struct proto *proto, int pload) {
+
+	struct filter_set **set = (pload ? &proto->payload_filters : &proto->packet_filters);
+	struct proto_packet_listener *l = (pload ? proto->payload_listeners : proto->packet_listeners);
+
+	filter_set_cleanup(*set);
+	*set = NULL;
+
+	if (l)
+		*set = filter_set_alloc();
+
+	// Listeners which can't be part of the set have their filter evaluated on its own
+	for (; l; l = l->next)
+		l->filter_id = (*set ? filter_set_add(*set, l->filter) : -1);
+
+	// The packets needed by the listeners changed
+	core_capture_filter_update();
+}
+
+char *proto_capture_filter_build() {
+
+	char *res = NULL;
+
+	struct proto *proto;
+	for (proto = proto_head; proto; proto = proto->next) {
+
+		pom_rwlock_rlock(&proto->listeners_lock);
+
+		struct proto_packet_listener *lists[2] = { proto->packet_listeners, proto->payload_listeners };
+		int i;
+		for (i = 0; i < 2; i++) {
+			struct proto_packet_listener *l;
+			for (l = lists[i]; l; l = l->next) {
+
+				char *filter = filter_packet_bpf(proto, l->filter);
+				if (!filter) {
+					// This listener may need any packet
+					pom_rwlock_unlock(&proto->listeners_lock);
+					free(res);
+					return NULL;
+				}
+
+				if (!res) {
+					res = filter;
+					continue;
+				}
+
+				size_t len = strlen(res) + strlen(filter) + 12;
+				char *tmp = malloc(len);
+				if (!tmp) {
+					pom_rwlock_unlock(&proto->listeners_lock);
+					pom_oom(len);
+					free(res);
+					free(filter);
+					return NULL;
+				}
+				snprintf(tmp, len, "(%s) or (%s)", res, filter);
+				free(res);
+				free(filter);
+				res = tmp;
+			}
+		}
+
+		pom_rwlock_unlock(&proto->listeners_lock);
+	}
+
+	return res;
+}
+
 struct proto_packet_listener *proto_packet_listener_register(struct proto *proto, unsigned int flags, void *object, int (*process) (void *object, struct packet *p, struct proto_process_stack *s, unsigned int stack_index), struct filter_node *f) {
 
 	struct proto_packet_listener *l = malloc(sizeof(struct proto_packet_listener));
@@ -478,6 +796,8 @@ struct proto_packet_listener *proto_packet_listener_register(struct proto *proto
 	else
 		proto->packet_listeners = l;
 
+	proto_packet_listener_filters_update(proto, l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY);
+
 	pom_rwlock_unlock(&l->proto->listeners_lock);
 
 	return l;
@@ -502,6 +822,8 @@ int proto_packet_listener_unregister(struct proto_packet_listener *l) {
 			l->proto->packet_listeners = l->next;
 	}
 
+	proto_packet_listener_filters_update(l->proto, l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY);
+
 	pom_rwlock_unlock(&l->proto->listeners_lock);
 
 	free(l);
@@ -512,6 +834,7 @@ int proto_packet_listener_unregister(struct proto_packet_listener *l) {
 void proto_packet_listener_set_filter(struct proto_packet_listener *l, struct filter_node *f) {
 	pom_rwlock_wlock(&l->proto->listeners_lock);
 	l->filter = f;
+	proto_packet_listener_filters_update(l->proto, l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY);
 	pom_rwlock_unlock(&l->proto->listeners_lock);
 }
 
@@ -652,7 +975,8 @@ void proto_expectation_cleanup(struct proto_expectation *e) {
 	if (e->session)
 		conntrack_session_refcount_dec(e->session);
 
-	timer_cleanup(e->expiry);
+	if (e->expiry)
+		timer_cleanup(e->expiry);
 
 	free(e);
 }
@@ -712,11 +1036,10 @@ int proto_expectation_add(struct proto_expectation *e, struct conntrack_session
 	struct proto *proto = e->tail->proto;
 	pom_rwlock_wlock(&proto->expectation_lock);
 
-	e->next = proto->expectations;
-	if (e->next)
-		e->next->prev = e;
-
-	proto->expectations = e;
+	if (proto_expectation_table_add(&proto->expectations, e) != POM_OK) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return POM_ERR;
+	}
 
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -731,16 +1054,9 @@ int proto_expectation_expiry(void *priv, ptime now) {
 	struct proto *proto = e->tail->proto;
 
 	timer_cleanup(e->expiry);
+	e->expiry = NULL;
 	pom_rwlock_wlock(&proto->expectation_lock);
-
-	if (e->next)
-		e->next->prev = e->prev;
-
-	if (e->prev)
-		e->prev->next = e->next;
-	else
-		proto->expectations = e->next;
-
+	proto_expectation_table_remove(&proto->expectations, e);
 	pom_rwlock_unlock(&proto->expectation_lock);
 
 	if (e->priv && proto->info->ct_info->cleanup_handler) {
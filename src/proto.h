@@ -29,6 +29,21 @@
 
 #define PROTO_REGISTRY "proto"
 
+// Initial and maximum number of buckets of the expectation tables
+#define PROTO_EXPECTATION_TABLE_SIZE		64
+#define PROTO_EXPECTATION_TABLE_SIZE_MAX	(1 << 20)
+
+// Expectations are indexed on the values they expect in the last proto of their stack
+struct proto_expectation_table {
+
+	struct proto_expectation **pairs; // Both values known, indexed on their combined hash
+	struct proto_expectation **singles; // Only one value known, indexed on its hash
+	struct proto_expectation *wildcards; // No value known
+	unsigned int size;
+	volatile unsigned int count;
+
+};
+
 struct proto {
 
 	struct proto_reg_info *info;
@@ -45,9 +60,11 @@ struct proto {
 	pthread_rwlock_t listeners_lock;
 	struct proto_packet_listener *packet_listeners;
 	struct proto_packet_listener *payload_listeners;
+	struct filter_set *packet_filters;
+	struct filter_set *payload_filters;
 
 	pthread_rwlock_t expectation_lock;
-	struct proto_expectation *expectations;
+	struct proto_expectation_table expectations;
 
 	struct proto_number_class *number_class;
 
@@ -56,8 +73,12 @@ struct proto {
 	struct registry_perf *perf_conn_cur;
 	struct registry_perf *perf_conn_tot;
 	struct registry_perf *perf_conn_hash_col;
+	struct registry_perf *perf_conn_load;
+	struct registry_perf *perf_conn_chain_max;
 	struct registry_perf *perf_expt_pending;
 	struct registry_perf *perf_expt_matched;
+	struct registry_perf *perf_expt_lookups;
+	struct registry_perf *perf_expt_cmps;
 
 	struct proto *next, *prev;
 
@@ -83,6 +104,7 @@ struct proto_expectation {
 	void *priv;
 	struct timer *expiry;
 	struct conntrack_session *session;
+	uint32_t hash; // Hash of the values of the last stack
 	struct proto_expectation *prev, *next;
 };
 
@@ -108,6 +130,8 @@ int proto_cleanup();
 
 int proto_expectation_expiry(void *priv, ptime now);
 
+char *proto_capture_filter_build();
+
 unsigned int proto_get_count();
 struct proto_number_class *proto_number_class_get(char *name);
 int proto_number_unregister(struct proto *p);
@@ -58,6 +58,14 @@ static size_t registry_uid_table_size = 0;
 static unsigned int registry_uid_seedp = 0;
 static uint32_t registry_serial = 0, registry_classes_serial = 0, registry_config_serial = 0;
 
+// Each thread updates its own slot of the perfs to avoid sharing cache lines
+struct registry_perf_shard {
+	volatile uint64_t value;
+} __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+
+static unsigned int registry_perf_shard_next = 0;
+static __thread int registry_perf_shard_id = -1;
+
 int registry_init() {
 
 	if (pom_mutex_init_type(&registry_global_lock, PTHREAD_MUTEX_RECURSIVE) != POM_OK)
@@ -201,6 +209,7 @@ int registry_remove_class(struct registry_class *c) {
 		free(p->name);
 		free(p->description);
 		free(p->unit);
+		free(p->shards);
 		free(p);
 	}
 
@@ -368,6 +377,7 @@ int registry_remove_instance(struct registry_instance *i) {
 		free(p->name);
 		free(p->description);
 		free(p->unit);
+		free(p->shards);
 		free(p);
 	}
 
@@ -1493,9 +1503,39 @@ struct registry_perf *registry_perf_alloc(const char *name, enum registry_perf_t
 
 	perf->type = type;
 
+	if (type != registry_perf_type_timeticks) {
+		if (posix_memalign((void **)&perf->shards, CORE_CACHE_LINE_SIZE, sizeof(struct registry_perf_shard) * REGISTRY_PERF_SHARDS)) {
+			free(perf->name);
+			free(perf->description);
+			free(perf->unit);
+			free(perf);
+			pom_oom(sizeof(struct registry_perf_shard) * REGISTRY_PERF_SHARDS);
+			return NULL;
+		}
+		memset(perf->shards, 0, sizeof(struct registry_perf_shard) * REGISTRY_PERF_SHARDS);
+	}
+
 	return perf;
 }
 
+static inline volatile uint64_t *registry_perf_shard_get(struct registry_perf *p) {
+
+	if (registry_perf_shard_id < 0)
+		registry_perf_shard_id = __sync_fetch_and_add(&registry_perf_shard_next, 1) & (REGISTRY_PERF_SHARDS - 1);
+
+	return &p->shards[registry_perf_shard_id].value;
+}
+
+static uint64_t registry_perf_shard_sum(struct registry_perf *p) {
+
+	uint64_t sum = 0;
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_SHARDS; i++)
+		sum += p->shards[i].value;
+
+	return sum;
+}
+
 struct registry_perf *registry_class_add_perf(struct registry_class *c, const char *name, enum registry_perf_type type, const char *description, const char *unit) {
 	
 	struct registry_perf *p = registry_perf_alloc(name, type, description, unit);
@@ -1567,7 +1607,8 @@ void registry_perf_inc(struct registry_perf *p, uint64_t val) {
 		return;
 	}
 
-	__sync_fetch_and_add(&p->value, val);
+	// Slots are shared when there are more threads than slots
+	__sync_fetch_and_add(registry_perf_shard_get(p), val);
 }
 
 void registry_perf_dec(struct registry_perf *p, uint64_t val) {
@@ -1580,7 +1621,8 @@ void registry_perf_dec(struct registry_perf *p, uint64_t val) {
 		return;
 	}
 
-	__sync_fetch_and_sub(&p->value, val);
+	// The slot may wrap, the sum of all the slots is still right
+	__sync_fetch_and_sub(registry_perf_shard_get(p), val);
 }
 
 void registry_perf_timeticks_stop(struct registry_perf *p) {
@@ -1633,9 +1675,10 @@ uint64_t registry_perf_getval(struct registry_perf *p) {
 			if (p->update_hook((uint64_t*)&p->value, p->hook_priv) != POM_OK)
 				pomlog(POMLOG_WARN "Warning: update of performance %s value failed.", p->name);
 			pom_mutex_unlock(&p->hook_lock);
+			return p->value;
 		}
 
-		return p->value;
+		return p->value + registry_perf_shard_sum(p);
 
 	}
 
@@ -1666,7 +1709,8 @@ void registry_perf_reset(struct registry_perf *p) {
 		}
 
 	}else {
-		p->value = 0;
+		// Offset the slots instead of writing to the ones of the other threads
+		p->value = 0 - registry_perf_shard_sum(p);
 	}
 }
 
@@ -32,6 +32,9 @@
 // Use the msb for started/stopped flag
 #define REGISTRY_PERF_TIMETICKS_STARTED (1LLU << 63)
 
+// Number of per thread slots of counters and gauges, must be a power of 2
+#define REGISTRY_PERF_SHARDS		16
+
 struct registry_perf {
 
 	char *name;
@@ -39,6 +42,7 @@ struct registry_perf {
 	char *unit;
 	enum registry_perf_type type;
 	volatile uint64_t value;
+	struct registry_perf_shard *shards; // Added to value when reading counters and gauges
 	struct registry_perf *next;
 
 	int (*update_hook) (uint64_t *cur_val, void *priv);
@@ -34,91 +34,294 @@ static struct timer_sys *timer_sys_head = NULL, *timer_sys_tail = NULL;
 static pthread_mutex_t timer_sys_lock;
 
 
-static pthread_mutex_t timer_main_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct timer_queue *timer_queues = NULL;
+static pthread_mutex_t timer_wheels_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t timer_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_wheel *timer_wheels[TIMER_WHEEL_MAX] = { 0 };
+static __thread struct timer_wheel *timer_wheel_local = NULL;
 
 static struct registry_perf *perf_timer_processed = NULL;
 static struct registry_perf *perf_timer_queued = NULL;
 static struct registry_perf *perf_timer_allocated = NULL;
 static struct registry_perf *perf_timer_queues = NULL;
 
+static struct timer_wheel *timer_wheel_get(unsigned int id) {
+
+	pom_mutex_lock(&timer_wheels_lock);
+
+	struct timer_wheel *w = timer_wheels[id];
+	if (w) {
+		pom_mutex_unlock(&timer_wheels_lock);
+		return w;
+	}
+
+	w = malloc(sizeof(struct timer_wheel));
+	if (!w) {
+		pom_mutex_unlock(&timer_wheels_lock);
+		pom_oom(sizeof(struct timer_wheel));
+		return NULL;
+	}
+	memset(w, 0, sizeof(struct timer_wheel));
+
+	if (pthread_mutex_init(&w->lock, NULL)) {
+		pom_mutex_unlock(&timer_wheels_lock);
+		pomlog(POMLOG_ERR "Error while initializing the timer wheel lock : %s", pom_strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	timer_wheels[id] = w;
+	pom_mutex_unlock(&timer_wheels_lock);
+
+	registry_perf_inc(perf_timer_queues, 1);
+
+	return w;
+}
+
 int timers_init() {
 
 	perf_timer_processed = core_add_perf("timer_processed", registry_perf_type_counter, "Number of timers processeds", "timers");
 	perf_timer_queued = core_add_perf("timer_queued", registry_perf_type_gauge, "Number of timers queued", "timers");
 	perf_timer_allocated = core_add_perf("timer_allocated", registry_perf_type_gauge, "Number of timers allocated", "timers");
-	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer queues", "queues");
+	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer wheels", "wheels");
 
 	if (!perf_timer_processed || !perf_timer_queued || !perf_timer_allocated || !perf_timer_queues)
 		return POM_ERR;
 
+	// The shared wheel is used by threads which don't process packets
+	if (!timer_wheel_get(0))
+		return POM_ERR;
+
 	return POM_OK;
 }
 
-int timers_process() {
+int timers_thread_init(unsigned int thread_id) {
 
+	// Wheels are kept when the thread exits as they may still hold timers
+	struct timer_wheel *w = timer_wheel_get(thread_id + 1);
+	if (!w)
+		return POM_ERR;
 
-	static int processing = 0;
+	timer_wheel_local = w;
+	w->owner_busy = 1;
 
-	int res = pthread_mutex_trylock(&timer_main_lock);
-	if (res == EBUSY) {
-		// Already locked, give up
-		return POM_OK;
-	} else if (res) {
-		// Something went wrong
-		pomlog(POMLOG_ERR "Error while trying to lock the main timer lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
+	return POM_OK;
+}
+
+void timers_thread_cleanup() {
+
+	// Let the other threads take care of the remaining timers
+	if (timer_wheel_local)
+		timer_wheel_local->owner_busy = 0;
+
+	timer_wheel_local = NULL;
+}
+
+void timers_thread_idle(int idle) {
+
+	if (timer_wheel_local)
+		timer_wheel_local->owner_busy = !idle;
+}
+
+static void timer_slot_remove(struct timer *t) {
+
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		t->slot->head = t->next;
+
+	if (t->next)
+		t->next->prev = t->prev;
+
+	t->prev = NULL;
+	t->next = NULL;
+	t->slot = NULL;
+}
+
+static void timer_wheel_add(struct timer_wheel *w, struct timer *t) {
+
+	uint32_t tick = pom_ptime_sec(t->expires);
+	if (tick < w->cur)
+		tick = w->cur;
+
+	uint32_t delta = tick - w->cur;
+
+	unsigned int level;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1UL << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	// Too far in the future, park it in the last slot, it will be requeued when cascading
+	if (delta >= (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+		tick = w->cur + (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	struct timer_slot *s = &w->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+	t->prev = NULL;
+	t->next = s->head;
+	if (t->next)
+		t->next->prev = t;
+	s->head = t;
+	t->slot = s;
+	t->wheel = w;
+}
+
+static void timer_wheel_cascade(struct timer_wheel *w, uint32_t tick) {
+
+	// Move the timers of the higher levels down when their slot comes up
+	unsigned int level;
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+
+		if (tick & ((1UL << (TIMER_WHEEL_BITS * level)) - 1))
+			break;
+
+		struct timer_slot *s = &w->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+		struct timer *t = s->head;
+		s->head = NULL;
+
+		while (t) {
+			struct timer *next = t->next;
+			timer_wheel_add(w, t);
+			t = next;
+		}
 	}
+}
+
+// Lock the wheel in which the timer is queued, returns NULL if it isn't queued
+static struct timer_wheel *timer_wheel_lock(struct timer *t) {
+
+	while (1) {
+		struct timer_wheel *w = t->wheel;
+		if (!w)
+			return NULL;
+
+		pom_mutex_lock(&w->lock);
+		if (t->wheel == w)
+			return w;
+
+		// The timer moved to another wheel in the meantime
+		pom_mutex_unlock(&w->lock);
+	}
+}
 
-	// Another thread is already processing the timers, drop out
-	if (processing) {
-		pom_mutex_unlock(&timer_main_lock);
+static int timer_wheel_process(struct timer_wheel *w, ptime now, int try) {
+
+	if (try) {
+		int res = pthread_mutex_trylock(&w->lock);
+		if (res == EBUSY) {
+			// Already locked, give up
+			return POM_OK;
+		} else if (res) {
+			pomlog(POMLOG_ERR "Error while trying to lock the timer wheel lock : %s", pom_strerror(res));
+			abort();
+			return POM_ERR;
+		}
+	} else {
+		pom_mutex_lock(&w->lock);
+	}
+
+	// Another thread is already processing this wheel, drop out
+	if (w->processing) {
+		pom_mutex_unlock(&w->lock);
 		return POM_OK;
 	}
 
-	processing = 1;
+	w->processing = 1;
 
-	ptime now = core_get_clock();
+	uint32_t now_sec = pom_ptime_sec(now);
+
+	while (w->cur < now_sec) {
+
+		// Nothing queued, skip right to the current time
+		if (!w->count) {
+			w->cur = now_sec;
+			break;
+		}
+
+		uint32_t tick = w->cur;
+		timer_wheel_cascade(w, tick);
+		w->cur++;
 
-	struct timer_queue *tq;
-	tq = timer_queues;
-
-	while (tq) {
-		while (tq->head && (tq->head->expires < now)) {
-				
-			// Dequeue the timer
-			struct timer *tmp = tq->head;
-			tq->head = tq->head->next;
-			if (tq->head)
-				tq->head->prev = NULL;
-			else
-				tq->tail = NULL;
-
-			tmp->next = NULL;
-			tmp->prev = NULL;
-			tmp->queue = NULL;
-			pom_mutex_unlock(&timer_main_lock);
+		// Timers of this second are moved out of the wheel so the ones requeued by the handlers don't end up in the same slot
+		struct timer_slot *s = &w->slots[0][tick & TIMER_WHEEL_MASK];
+		if (!s->head)
+			continue;
+
+		w->expired.head = s->head;
+		s->head = NULL;
+
+		struct timer *t;
+		for (t = w->expired.head; t; t = t->next)
+			t->slot = &w->expired;
+
+		while (w->expired.head) {
+
+			t = w->expired.head;
+			timer_slot_remove(t);
+			t->wheel = NULL;
+			w->count--;
+
+			pom_mutex_unlock(&w->lock);
 			registry_perf_dec(perf_timer_queued, 1);
 
 			// Process it
-			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) tmp);
-			if ((*tmp->handler) (tmp->priv, now) != POM_OK) {
+			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) t);
+			if ((*t->handler) (t->priv, now) != POM_OK) {
+				pom_mutex_lock(&w->lock);
+				w->processing = 0;
+				pom_mutex_unlock(&w->lock);
 				return POM_ERR;
 			}
 
 			registry_perf_inc(perf_timer_processed, 1);
 
-			pom_mutex_lock(&timer_main_lock);
-
+			pom_mutex_lock(&w->lock);
 		}
-		tq = tq->next;
+	}
+
+	w->processing = 0;
 
+	pom_mutex_unlock(&w->lock);
+
+	return POM_OK;
+}
+
+int timers_process() {
+
+	// Only one thread runs timer handlers at a time, they were written with that assumption
+	int res = pthread_mutex_trylock(&timer_handlers_lock);
+	if (res == EBUSY) {
+		// Another thread is processing timers, ours will be processed next time
+		return POM_OK;
+	} else if (res) {
+		pomlog(POMLOG_ERR "Error while trying to lock the timer handlers lock : %s", pom_strerror(res));
+		abort();
+		return POM_ERR;
+	}
+
+	ptime now = core_get_clock();
+	uint32_t now_sec = pom_ptime_sec(now);
+
+	struct timer_wheel *local = timer_wheel_local;
+	if (local && timer_wheel_process(local, now, 0) != POM_OK) {
+		pom_mutex_unlock(&timer_handlers_lock);
+		return POM_ERR;
 	}
 
-	processing = 0;
+	// Process the wheels of the threads that are idle or gone as well as the shared one
+	unsigned int i;
+	for (i = 0; i < TIMER_WHEEL_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w || w == local || w->owner_busy || !w->count || w->cur >= now_sec)
+			continue;
 
-	pom_mutex_unlock(&timer_main_lock);
+		if (timer_wheel_process(w, now, 1) != POM_OK) {
+			pom_mutex_unlock(&timer_handlers_lock);
+			return POM_ERR;
+		}
+	}
+
+	pom_mutex_unlock(&timer_handlers_lock);
 
 	return POM_OK;
 }
@@ -129,25 +332,29 @@ int timers_cleanup() {
 
 	// Free the timers
 
-	while (timer_queues) {
-		struct timer_queue *tmpq;
-		tmpq = timer_queues;
-
-		while (tmpq->head) {
-			
-			struct timer *tmp;
-			tmp = tmpq->head;
-
-			tmpq->head = tmpq->head->next;
+	unsigned int i;
+	for (i = 0; i < TIMER_WHEEL_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w)
+			continue;
 
-			free(tmp);
+		unsigned int level, slot;
+		for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+			for (slot = 0; slot < TIMER_WHEEL_SIZE; slot++) {
+				while (w->slots[level][slot].head) {
+					struct timer *tmp = w->slots[level][slot].head;
+					w->slots[level][slot].head = tmp->next;
 
-			pomlog(POMLOG_WARN "Timer not dequeued");
+					free(tmp);
 
+					pomlog(POMLOG_WARN "Timer not dequeued");
+				}
+			}
 		}
-		timer_queues = timer_queues->next;
 
-		free(tmpq);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		timer_wheels[i] = NULL;
 	}
 
 	return POM_OK;
@@ -174,7 +381,7 @@ struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
 
 int timer_cleanup(struct timer *t) {
 
-	if (t->queue)
+	if (t->wheel)
 		timer_dequeue(t);
 
 	free(t);
@@ -191,182 +398,74 @@ int timer_queue(struct timer *t, unsigned int expiry) {
 
 int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
 
-
-	pom_mutex_lock(&timer_main_lock);
-
-	struct timer_queue *tq = timer_queues;
+	// Timers are owned by the thread arming them
+	struct timer_wheel *w = timer_wheel_local;
+	if (!w)
+		w = timer_wheels[0];
 
 	// Timer is still queued, dequeue it
-	if (t->queue) {
-
-		// Start further in the list of queues if possible
-		if (expiry >= t->queue->expiry)
-			tq = t->queue;
-
-		if (t->prev) {
-			t->prev->next = t->next;
-		} else {
-			t->queue->head = t->next;
-			if (t->queue->head)
-				t->queue->head->prev = NULL;
+	struct timer_wheel *old = timer_wheel_lock(t);
+	if (old) {
+		timer_slot_remove(t);
+		old->count--;
+		if (old != w) {
+			t->wheel = NULL;
+			pom_mutex_unlock(&old->lock);
+			pom_mutex_lock(&w->lock);
 		}
-
-		if (t->next) {
-			t->next->prev = t->prev;
-		} else {
-			t->queue->tail = t->prev;
-			if (t->queue->tail)
-				t->queue->tail->next = NULL;
-			
-		}
-		t->queue = NULL;
-		t->prev = NULL;
-		t->next = NULL;
 	} else {
+		pom_mutex_lock(&w->lock);
 		registry_perf_inc(perf_timer_queued, 1);
 	}
 
-	// First find the right queue or create it
-	
-	if (!tq) {
-
-		// There is no queue yet
-		tq = malloc(sizeof(struct timer_queue));
-		if (!tq) {
-			pom_mutex_unlock(&timer_main_lock);
-			pom_oom(sizeof(struct timer_queue));
-			return POM_ERR;
-		}
-		memset(tq, 0, sizeof(struct timer_queue));
-		timer_queues = tq;
-
-		tq->expiry = expiry;
-
-		registry_perf_inc(perf_timer_queues, 1);
-
-	} else {
-
-		while (tq) {
-			
-			if (tq->expiry == expiry) { // The right queue already exists
-				
-				break;
+	// Empty wheels start at the time the first timer is queued
+	if (!w->count && !w->processing)
+		w->cur = pom_ptime_sec(now);
 
-			} else if (tq->expiry > expiry) { // The right queue doesn't exists and we are too far in the list
-
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
-
-				tmp->prev = tq->prev;
-				tmp->next = tq;
-				tq->prev = tmp;
-
-				if (tmp->prev)
-					tmp->prev->next = tmp;
-				else
-					timer_queues = tmp;
-
-
-				tq = tmp;
-				tq->expiry = expiry;
-
-				registry_perf_inc(perf_timer_queues, 1);
-
-				break;
-			
-			} else if (!tq->next) { // Looks like we are at the end of our list
-
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
-
-				tmp->prev = tq;
-				
-				tq->next = tmp;
+	// Update the expiry time
+	t->expires = now + (expiry * 1000000UL);
 
-				tq = tmp;
+	timer_wheel_add(w, t);
+	w->count++;
 
-				tq->expiry = expiry;
+	pom_mutex_unlock(&w->lock);
 
-				registry_perf_inc(perf_timer_queues, 1);
-				
-				break;
-			}
+	return POM_OK;
+}
 
-			tq = tq->next;
-		}
 
-	}
+// Dequeue the timer unless it already fired, returns POM_ERR if its handler is running or about to
+int timer_dequeue_pending(struct timer *t) {
 
-	// Now we can queue the timer
-	
-	if (tq->head == NULL) {
-		tq->head = t;
-		tq->tail = t;
-	} else {
-		t->prev = tq->tail;
-		tq->tail = t;
-		t->prev->next = t;
-	}
+	struct timer_wheel *w = timer_wheel_lock(t);
+	if (!w)
+		return POM_ERR;
 
-	// Update the expiry time
-	
-	t->expires = now + (expiry * 1000000UL);
-	t->queue = tq;
-	pom_mutex_unlock(&timer_main_lock);
+	timer_slot_remove(t);
+	w->count--;
+	t->wheel = NULL;
+	pom_mutex_unlock(&w->lock);
 
+	registry_perf_dec(perf_timer_queued, 1);
 
 	return POM_OK;
 }
 
-
 int timer_dequeue(struct timer *t) {
 
-	// First let's check if it's the one at the begining of the queue
-
-	pom_mutex_lock(&timer_main_lock);
+	struct timer_wheel *w = timer_wheel_lock(t);
 
-	if (!t->queue) {
+	if (!w) {
 		pomlog(POMLOG_WARN "Warning, timer %p was already dequeued", t);
-		pom_mutex_unlock(&timer_main_lock);
 		return POM_OK;
 	}
 
-	if (t->prev) {
-		t->prev->next = t->next;
-	} else {
-		t->queue->head = t->next;
-		if (t->queue->head)
-			t->queue->head->prev = NULL;
-	}
-
-	if (t->next) {
-		t->next->prev = t->prev;
-	} else {
-		t->queue->tail = t->prev;
-		if (t->queue->tail)
-			t->queue->tail->next = NULL;
-		
-	}
-
+	timer_slot_remove(t);
+	w->count--;
 
 	// Make sure this timer will not reference anything
-
-	t->prev = NULL;
-	t->next = NULL;
-	t->queue = NULL;
-	pom_mutex_unlock(&timer_main_lock);
+	t->wheel = NULL;
+	pom_mutex_unlock(&w->lock);
 
 	registry_perf_dec(perf_timer_queued, 1);
 
@@ -23,6 +23,7 @@
 #define __TIMER_H__
 
 #include <pom-ng/timer.h>
+#include "core.h"
 
 struct timer_sys {
 	time_t expiry;
@@ -31,33 +32,54 @@ struct timer_sys {
 	struct timer_sys *prev, *next;
 };
 
+// Timers have a granularity of one second, each level of the wheel covers 64 times more than the previous one
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	4
+
+// One wheel per processing thread and one shared by the other threads
+#define TIMER_WHEEL_MAX		(CORE_PROCESS_THREAD_MAX + 1)
+
+struct timer_slot {
+	struct timer *head;
+};
+
 struct timer {
 
 	ptime expires;
 	void *priv;
 	int (*handler) (void *, ptime);
-	struct timer_queue *queue;
+	struct timer_wheel * volatile wheel; // Wheel in which the timer is queued
+	struct timer_slot *slot;
 	struct timer *next;
 	struct timer *prev;
 
 };
 
-struct timer_queue {
+// A processing thread handles its own wheel and, only when their owner is idle or gone, the wheels of the
+// other threads as well as the shared one. Timer handlers never run concurrently with each other, whatever
+// wheel they are in, but they can run while other threads process packets.
+struct timer_wheel {
 
-	unsigned int expiry;
-	struct timer_queue *next;
-	struct timer_queue *prev;
-	struct timer *head;
-	struct timer *tail;
+	pthread_mutex_t lock;
+	uint32_t cur; // Next second to process
+	unsigned int count; // Number of timers queued
+	int processing;
+	volatile int owner_busy; // The owner thread is processing packets and takes care of the wheel
+	struct timer_slot expired; // Timers being processed
+	struct timer_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
 
 };
 
 int timers_init();
+int timers_thread_init(unsigned int thread_id);
+void timers_thread_cleanup();
+void timers_thread_idle(int idle);
 int timers_process();
 int timers_cleanup();
 
-void timer_queue_lock(struct timer_queue *q, int write);
-void timer_queue_unlock(struct timer_queue *q);
+int timer_dequeue_pending(struct timer *t);
 
 int timer_sys_process();
 